@@ -46,7 +46,9 @@ void main() {
 
     if ((materialParams.hasTexture & NORMAL_TEXTURE_BIT) != 0) {
         mat3 TBN = mat3(normalize(inTangent), normalize(inBinormal), normalize(inNormal));
-        vec3 normal = texture(normalTexture, inTexCoord).rgb * 2.0 - 1.0;
+        // z is rebuilt from x and y, as BC5-compressed normal maps only keep those two
+        vec2 xy = texture(normalTexture, inTexCoord).rg * 2.0 - 1.0;
+        vec3 normal = vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
         normal.y *= -1.0; // Normal map for Sponza is in DirectX convention, flip it
         outNormal.xyz = normalize(inNormalMatrix * TBN * normal);
     } else {
@@ -2,4 +2,5 @@ struct RayPayload {
     vec3 color;
     vec3 normal;
     vec3 hitPoint;
+    float hitDistance; // Negative where the ray missed
 };
@@ -7,6 +7,14 @@ class RayTracer : public App
 public:
     struct PushConstants {
         int renderMode;
+        uint32_t accumulate;
+        uint32_t seed;
+    };
+
+    struct ResolvePushConstants {
+        uint32_t showSampleCount;
+        uint32_t frameCount;
+        uint32_t showDenoised;
     };
 
     static std::shared_ptr<Image> createImage(std::shared_ptr<Device> pDevice, std::shared_ptr<Swapchain> pSwapchain)
@@ -20,6 +28,16 @@ public:
         return image;
     }
 
+    static std::shared_ptr<Image> createStorageImage(std::shared_ptr<Device> pDevice,
+                                                     std::shared_ptr<Swapchain> pSwapchain, VkFormat format)
+    {
+        auto image = pDevice->createImage(pSwapchain->getExtent().width, pSwapchain->getExtent().height, 1, 1,
+                                          VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
+                                          VK_IMAGE_USAGE_STORAGE_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        image->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+        return image;
+    }
+
     RayTracer() : App("Ray Tracer", 1920, 1080)
     {
         // Create a Vulkan instance and device
@@ -71,6 +89,12 @@ public:
         pipelineDesc.setHitGroup(0, 2);
         mpPipeline = mpDevice->createRayTracingPipeline(pShader, pipelineDesc);
 
+        // Create a compute pipeline that shows the accumulated image, as rays are only traced for some of the tiles
+        shaderDesc.clear();
+        shaderDesc.emplace_back("RayTracer/Resolve.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+        auto pResolveShader = mpDevice->createShader(shaderDesc);
+        mpResolvePipeline = mpDevice->createComputePipeline(pResolveShader, ComputePipelineDesc());
+
         // Create a scene and load scene
         mpScene = mpDevice->createScene();
         auto meshIndices = mpScene->addMeshFromFile(GetResourcePath("scenes/crytek_sponza/sponza.obj"));
@@ -92,22 +116,26 @@ public:
         mpScene->compile();
         mpScene->syncToDevice();
 
-        // Load environment map
-        mpEnvironmentMap = mpDevice->createTextureFromFile(TextureType::Texture2D, VK_FORMAT_R8G8B8A8_UNORM,
+        // Load environment map, as a cube map so that the miss shader samples it with the ray direction itself
+        mpEnvironmentMap = mpDevice->createTextureFromFile(TextureType::CubeMap, VK_FORMAT_R8G8B8A8_UNORM,
                                                            GetResourcePath("hdris/lilienstein_4k.hdr"));
         mpScene->setEnvironmentMap(mpEnvironmentMap);
 
         // Set specialization constants now that the scene parameters are calculated
-        mSpecializationConstants[0] = mpScene->getVertexCount();   // VERTEX_COUNT
-        mSpecializationConstants[1] = mpScene->getIndexCount();    // INDEX_COUNT
         mSpecializationConstants[2] = mpScene->getMaterialCount(); // MATERIAL_COUNT
         mSpecializationConstants[3] = mpScene->getTextureCount();  // TEXTURE_COUNT
         mSpecializationConstants[4] = mpScene->getMeshCount();     // MESH_COUNT
         mpPipeline->recreate();                                    // Rebuild layouts
 
-        // Create acceleration structure
-        mpAccelerationStructure =
-            mpDevice->createAccelerationStructure(mpScene, VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
+        // Create acceleration structure, with the BLASes compacted as the scene's geometry does not change. They are
+        // built progressively, so rendering starts with the meshes of the first batch and the rest appear over the
+        // following frames.
+        AccelerationStructureDesc accelerationStructureDesc = {.progressive = true};
+        mpAccelerationStructure = mpDevice->createAccelerationStructure(
+            mpScene,
+            VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR |
+                VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR,
+            accelerationStructureDesc);
 
         // Setup camera
         mpCamera = mpDevice->createCamera();
@@ -118,8 +146,11 @@ public:
         // Attach the scene's resources now that the acceleration structure is built
         mpScene->createRayTracingDescriptors(pShader, mpCamera, mpAccelerationStructure);
 
-        // The image the rays are written to
-        pShader->setResource("image", mpImage);
+        // The samples are accumulated, and only the tiles that have not converged get new ones
+        createAccumulator();
+
+        // Single samples can instead be denoised, guided by the normals and depths the rays write
+        createDenoiser();
 
         // Initialize GUI
         App::createGUI(mpDevice, mpPass);
@@ -140,11 +171,24 @@ public:
 
         mAngle += mRotationSpeed * delta;
 
+        // A moving scene makes every earlier sample stale
+        glm::mat4 view = mpCamera->getViewMatrix();
+        if (view != mPrevView || mRotationSpeed != 0.0f || !mAccumulate || mDenoise ||
+            !mpAccelerationStructure->isComplete()) {
+            mPrevView = view;
+            mpAccumulator->reset();
+        }
+
         glm::mat4 transform = glm::scale(glm::vec3(0.5f));
         transform = glm::translate(transform, glm::vec3(0.0f, 5.0f, 0.0f));
         transform = glm::rotate(transform, mAngle, glm::vec3(1.0f, 0.0f, 0.0f));
         transform = glm::rotate(transform, 3.0f * mAngle, glm::vec3(0.0f, 1.0f, 0.0f));
-        mpScene->getNodes()[mCubeIndex].setTransform(transform);
+
+        // Setting the transform marks the node as changed, so only do it when it moves
+        Node& cube = mpScene->getNodes()[mCubeIndex];
+        if (cube.getTransform() != transform) {
+            cube.setTransform(transform);
+        }
 
         // Update acceleration structure
         mpAccelerationStructure->update(VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR);
@@ -156,23 +200,28 @@ public:
         if (mpSwapchain->recreated()) {
             mpCamera->setAspectRatio(mpSwapchain->getAspectRatio());
             mpPass->update(mpSwapchain->getExtent());
-            // Also update render image since swapchain changed
+            // Also update render image, accumulation and denoiser since swapchain changed
             mpImage = createImage(mpDevice, mpSwapchain);
-            mpPipeline->getShader()->setResource("image", mpImage);
+            createAccumulator();
+            createDenoiser();
+        } else if (mRecreateDenoiser) {
+            createDenoiser();
         }
 
         // Acquire frame from swapchain
         VkCommandBuffer cmd = mpSwapchain->acquireNextImage();
 
+        // Pick the tiles to sample this frame
+        mpAccumulator->prepare(cmd);
+
         // Bind pipeline
         mpPipeline->bind(cmd);
 
-        // Prepare image for writing
-        mpPipeline->write(cmd, mpImage->getImage());
-
         // Push constants
         PushConstants pushConstants = {
             .renderMode = mRenderMode,
+            .accumulate = mAccumulate && !mDenoise,
+            .seed = mFrameCounter++,
         };
         vkCmdPushConstants(cmd, mpPipeline->getLayout(), VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof pushConstants,
                            &pushConstants);
@@ -180,16 +229,53 @@ public:
         // Bind descriptors
         mpPipeline->getShader()->bindResources(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR);
 
-        // Trace rays
+        // Trace rays for the scheduled tiles, with the launch size written by the accumulator
         auto rayGenSBT = mpPipeline->getRayGenSBT();
         auto missSBT = mpPipeline->getMissSBT();
         auto hitSBT = mpPipeline->getHitSBT();
         auto callSBT = mpPipeline->getCallSBT();
-        vkCmdTraceRaysKHR(cmd, &rayGenSBT, &missSBT, &hitSBT, &callSBT, mpSwapchain->getExtent().width,
-                          mpSwapchain->getExtent().height, 1);
+        mpAccumulator->beginSamples(cmd);
+        vkCmdTraceRaysIndirectKHR(cmd, &rayGenSBT, &missSBT, &hitSBT, &callSBT,
+                                  mpAccumulator->getTraceRaysIndirectAddress());
+        mpAccumulator->endSamples(cmd);
+
+        // Make the samples and guides visible to the denoiser and the resolve, and prepare image for writing
+        for (auto& pImage : {mpAccumulator->getMeanImage(), mpGuide}) {
+            Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_RAY_TRACING_SHADER_BIT_KHR,
+                                  VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                  VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                                  VK_IMAGE_LAYOUT_GENERAL);
+        }
+        Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                              VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+
+        // Denoise this frame's samples, which are all there is of the accumulation as it starts over every frame
+        if (mDenoise) {
+            mpDenoiser->denoise(cmd, mpCamera, mpAccumulator->getMeanImage(), mpGuide, mpDenoised);
+            Helpers::imageBarrier(cmd, mpDenoised->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                  VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                                  VK_ACCESS_2_SHADER_STORAGE_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                                  VK_IMAGE_LAYOUT_GENERAL);
+        }
+
+        // Resolve the accumulated image, including the tiles that were not sampled
+        ResolvePushConstants resolvePushConstants = {
+            .showSampleCount = mShowSampleCount,
+            .frameCount = mpAccumulator->getFrameCount(),
+            .showDenoised = mDenoise,
+        };
+        mpResolvePipeline->bind(cmd);
+        vkCmdPushConstants(cmd, mpResolvePipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof resolvePushConstants, &resolvePushConstants);
+        mpResolvePipeline->getShader()->bindResources(cmd, VK_PIPELINE_BIND_POINT_COMPUTE);
+        mpResolvePipeline->dispatch(cmd, mpImage->getWidth(), mpImage->getHeight());
 
         // Prepare image for reading
-        mpPipeline->read(cmd, mpImage->getImage());
+        Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+                              VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                              VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL);
 
         // Start pass
         mpPass->begin(cmd, mpImage);
@@ -216,7 +302,65 @@ public:
                 "Diffuse",
                 "Normal",
             };
-            ImGui::Combo("Render mode", &mRenderMode, renderModes, IM_ARRAYSIZE(renderModes));
+            if (ImGui::Combo("Render mode", &mRenderMode, renderModes, IM_ARRAYSIZE(renderModes))) {
+                mpAccumulator->reset();
+            }
+            ImGui::SliderFloat("Rotation speed", &mRotationSpeed, 0.0f, 1.0f);
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("The accumulation starts over every frame while the cube rotates.");
+            }
+            ImGui::Text("BLAS memory: %.1f MB",
+                        static_cast<double>(mpAccelerationStructure->getBLASMemorySize()) / (1024.0 * 1024.0));
+            ImGui::Text("TLAS: %u builds, %u refits, %u instances written",
+                        mpAccelerationStructure->getTLASBuildCount(), mpAccelerationStructure->getTLASRefitCount(),
+                        mpAccelerationStructure->getPatchedInstanceCount());
+
+            ImGui::SeparatorText("Accumulation");
+            ImGui::Checkbox("Accumulate", &mAccumulate);
+            if (ImGui::SliderFloat("Error threshold", &mAccumulatorDesc.errorThreshold, 0.001f, 0.1f, "%.3f",
+                                   ImGuiSliderFlags_Logarithmic)) {
+                mpAccumulator->setErrorThreshold(mAccumulatorDesc.errorThreshold);
+            }
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Relative standard error of the pixels of a tile below which the tile gets no more "
+                                  "samples.");
+            }
+            int minSampleCount = static_cast<int>(mAccumulatorDesc.minSampleCount);
+            if (ImGui::SliderInt("Min samples", &minSampleCount, 2, 256)) {
+                mAccumulatorDesc.minSampleCount = static_cast<uint32_t>(minSampleCount);
+                mpAccumulator->setMinSampleCount(mAccumulatorDesc.minSampleCount);
+            }
+            if (ImGui::SliderFloat("Time budget (ms)", &mAccumulatorDesc.frameTimeBudget, 0.0f, 16.0f, "%.1f")) {
+                mpAccumulator->setFrameTimeBudget(mAccumulatorDesc.frameTimeBudget);
+            }
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Device time the rays of a frame may take, which limits how many tiles are traced. "
+                                  "0 traces every tile that has not converged.");
+            }
+            ImGui::Checkbox("Show sample count", &mShowSampleCount);
+            ImGui::Text("Frames: %u", mpAccumulator->getFrameCount());
+            ImGui::Text("Tiles: %u traced, %u converged of %u", mpAccumulator->getScheduledTileCount(),
+                        mpAccumulator->getConvergedTileCount(), mpAccumulator->getTileCount());
+            ImGui::Text("Ray time: %.2f ms", mpAccumulator->getSampleTime());
+
+            ImGui::SeparatorText("Denoiser");
+            if (ImGui::Checkbox("Denoise", &mDenoise)) {
+                mpDenoiser->reset();
+            }
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Trace one sample per pixel every frame and denoise it, instead of accumulating.");
+            }
+            int iterationCount = static_cast<int>(mDenoiserDesc.iterationCount);
+            if (ImGui::SliderInt("Iterations", &iterationCount, 1, static_cast<int>(Denoiser::kMaxIterationCount))) {
+                mDenoiserDesc.iterationCount = static_cast<uint32_t>(iterationCount);
+                mpDenoiser->setIterationCount(mDenoiserDesc.iterationCount);
+            }
+            if (ImGui::SliderFloat("Color alpha", &mDenoiserDesc.colorAlpha, 0.01f, 1.0f)) {
+                mpDenoiser->setAlpha(mDenoiserDesc.colorAlpha, mDenoiserDesc.momentsAlpha);
+            }
+            if (ImGui::Checkbox("Half resolution", &mDenoiserDesc.halfResolution)) {
+                mRecreateDenoiser = true;
+            }
         }
 
         ImGui::End();
@@ -238,11 +382,49 @@ public:
     }
 
 private:
+    // The accumulation has to match the size of the render image
+    void createAccumulator()
+    {
+        mpAccumulator = mpDevice->createAccumulator(mpImage->getWidth(), mpImage->getHeight(), mAccumulatorDesc);
+        mpAccumulator->attach(mpPipeline->getShader());
+        mpAccumulator->attach(mpResolvePipeline->getShader());
+        mpResolvePipeline->getShader()->setResource("image", mpImage, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
+    // The denoiser's images have to match the size of the render image too, and are bound even when not denoising
+    void createDenoiser()
+    {
+        // Replacing the denoiser waits for the device, after which the old images are no longer in use
+        mpDenoiser = mpDevice->createDenoiser(mpImage->getWidth(), mpImage->getHeight(), mDenoiserDesc);
+        mRecreateDenoiser = false;
+
+        mpGuide = createStorageImage(mpDevice, mpSwapchain, VK_FORMAT_R32G32B32A32_SFLOAT);
+        mpDenoised = createStorageImage(mpDevice, mpSwapchain, VK_FORMAT_R16G16B16A16_SFLOAT);
+
+        VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+        for (auto& pImage : {mpGuide, mpDenoised}) {
+            Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                                  VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT,
+                                  VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+        }
+        Helpers::cmdEnd(mpDevice, cmd);
+
+        mpPipeline->getShader()->setResource("guide", mpGuide, VK_IMAGE_LAYOUT_GENERAL);
+        mpResolvePipeline->getShader()->setResource("denoised", mpDenoised, VK_IMAGE_LAYOUT_GENERAL);
+    }
+
     std::shared_ptr<Device> mpDevice;
     std::shared_ptr<Swapchain> mpSwapchain;
     std::shared_ptr<Pass> mpPass;
     std::shared_ptr<RayTracingPipeline> mpPipeline;
     std::shared_ptr<Image> mpImage;
+    std::shared_ptr<ComputePipeline> mpResolvePipeline;
+    std::shared_ptr<Accumulator> mpAccumulator;
+    AccumulatorDesc mAccumulatorDesc;
+    std::shared_ptr<Image> mpGuide;
+    std::shared_ptr<Image> mpDenoised;
+    std::shared_ptr<Denoiser> mpDenoiser;
+    DenoiserDesc mDenoiserDesc;
 
     std::shared_ptr<AccelerationStructure> mpAccelerationStructure;
     std::shared_ptr<Scene> mpScene;
@@ -256,6 +438,13 @@ private:
 
     int mRenderMode = 0;
 
+    bool mAccumulate = true;
+    bool mShowSampleCount = false;
+    bool mDenoise = false;
+    bool mRecreateDenoiser = false;
+    uint32_t mFrameCounter = 0;
+    glm::mat4 mPrevView = glm::mat4(0.0f);
+
     uint32_t mCubeIndex;
     float mRotationSpeed = 0.2f;
     float mAngle = 0.0f;
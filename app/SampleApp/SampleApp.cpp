@@ -78,6 +78,13 @@ public:
         // Create a pipeline for rendering using the shader
         mpPipeline = mpDevice->createPipeline(mpPass, pShader, PipelineDesc());
 
+        // Create a second pipeline that samples the same texture as a virtual texture instead
+        std::vector<ShaderDesc> virtualShaderDesc;
+        virtualShaderDesc.emplace_back("SampleApp/VertexShader.vert", "main", VK_SHADER_STAGE_VERTEX_BIT);
+        virtualShaderDesc.emplace_back("SampleApp/VirtualTexture.frag", "main", VK_SHADER_STAGE_FRAGMENT_BIT);
+        auto pVirtualShader = mpDevice->createShader(virtualShaderDesc);
+        mpVirtualPipeline = mpDevice->createPipeline(mpPass, pVirtualShader, PipelineDesc());
+
         // Setup camera
         mpCamera = mpDevice->createCamera();
         mpCamera->setPosition(glm::vec3(5.0f, 0.0f, 0.0f));
@@ -89,6 +96,13 @@ public:
         mpTexture = mpDevice->createTextureFromFile(TextureType::Texture2D, VK_FORMAT_R8G8B8A8_UNORM,
                                                     GetResourcePath("textures/icon.png"));
 
+        // Split the texture into small tiles, so that only some of them are needed up close, and stream them into a
+        // cache that has room for a few of them
+        std::filesystem::path tilePath = GetExecutablePath() / "icon.tiles";
+        if (VirtualTexture::createTileFile(GetResourcePath("textures/icon.png"), tilePath, 32, 2)) {
+            mpVirtualTexture = mpDevice->createVirtualTexture(tilePath, {.cacheSize = 8});
+        }
+
         // Vertices in scene
         setupVertexBuffers();
 
@@ -100,6 +114,12 @@ public:
         pShader->setResource("mesh", mpUniform);
         pShader->setResource("diffuseTexture", mpTexture);
 
+        pVirtualShader->setResource("camera", mpCamera->getUniformBuffer());
+        pVirtualShader->setResource("mesh", mpUniform);
+        if (mpVirtualTexture) {
+            mpVirtualTexture->attach(pVirtualShader);
+        }
+
         // Initialize GUI
         App::createGUI(mpDevice, mpPass);
     }
@@ -135,18 +155,30 @@ public:
 
         // Acquire frame from swapchain and prepare rasterizer
         VkCommandBuffer cmd = mpSwapchain->acquireNextImage();
+
+        // Stream in the tiles of the virtual texture that the last round of frames asked for, before the pass
+        // samples them
+        bool useVirtualTexture = mUseVirtualTexture && mpVirtualTexture;
+        if (useVirtualTexture) {
+            mpVirtualTexture->update(cmd);
+        }
+
         mpPass->begin(cmd, glm::vec4(0.0f, 0.4f, 0.2f, 1.0f));
 
         // Bind the pipeline for rendering
-        mpPipeline->bind(cmd);
+        auto pPipeline = useVirtualTexture ? mpVirtualPipeline : mpPipeline;
+        pPipeline->bind(cmd);
 
         // Turn off back-face culling
         vkCmdSetCullMode(cmd, VK_CULL_MODE_NONE);
 
         // Bind the resources attached to the shader
-        auto pShader = mpPipeline->getShader();
+        auto pShader = pPipeline->getShader();
         pShader->bindResources(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, 0);
         pShader->bindResources(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, 1);
+        if (useVirtualTexture) {
+            pShader->bindResources(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, 2);
+        }
 
         // Bind vertex and index buffers
         VkBuffer vertexBuffer = mpVertexBuffer->getBuffer();
@@ -170,12 +202,15 @@ public:
         ImGui::SetCurrentContext(pContext);
 
         // Render the base GUI, the menu bar with its subwindows
-        App::baseGUI(mpDevice, mpSwapchain, mpPipeline);
+        App::baseGUI(mpDevice, mpSwapchain, {mpPipeline, mpVirtualPipeline});
 
         // Here we can add app-specific GUI elements
         if (ImGui::Begin("Sample App GUI")) {
             ImGui::Text("Rotation speed:");
             ImGui::SliderFloat("rad/s", &mRotationSpeed, 0.0f, 2.0f, "%.2f");
+            if (mpVirtualTexture) {
+                ImGui::Checkbox("Virtual texture", &mUseVirtualTexture);
+            }
         }
 
         ImGui::End();
@@ -184,7 +219,8 @@ public:
     void appKeyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
     {
         // Invoke the base application's keyboard commands
-        App::baseKeyCallback(window, key, scancode, action, mods, mpDevice, mpSwapchain, mpPipeline);
+        App::baseKeyCallback(window, key, scancode, action, mods, mpDevice, mpSwapchain,
+                             {mpPipeline, mpVirtualPipeline});
 
         // Here we can add app-specific keyboard commands
         if (key == GLFW_KEY_O && action == GLFW_PRESS) {
@@ -212,10 +248,12 @@ private:
     std::shared_ptr<Swapchain> mpSwapchain;
     std::shared_ptr<Pass> mpPass;
     std::shared_ptr<Pipeline> mpPipeline;
+    std::shared_ptr<Pipeline> mpVirtualPipeline;
 
     std::shared_ptr<Camera> mpCamera;
 
     std::shared_ptr<Texture> mpTexture;
+    std::shared_ptr<VirtualTexture> mpVirtualTexture;
 
     std::shared_ptr<Buffer> mpVertexBuffer;
     std::shared_ptr<Buffer> mpIndexBuffer;
@@ -225,6 +263,7 @@ private:
 
     float mRotationSpeed = 0.2f;
     float mAngle = 0.0f;
+    bool mUseVirtualTexture = false;
 
     std::shared_ptr<DynamicBuffer> mpUniform;
 };
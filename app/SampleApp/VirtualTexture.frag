@@ -0,0 +1,20 @@
+#version 460
+
+#extension GL_GOOGLE_include_directive : require
+
+layout(location = 0) in vec2 texCoord;
+
+layout(location = 0) out vec4 fragColor;
+
+// Only the tiles of the icon that are seen at the level they are seen at are kept on the device
+#define VIRTUAL_TEXTURE_SET     2
+#define VIRTUAL_TEXTURE_BINDING 0
+#include "VirtualTexture.glsl"
+
+void main() {
+    fragColor = sampleVirtualTexture(texCoord);
+
+    if (fragColor.a < 0.5) {
+        discard;
+    }
+}
@@ -1,10 +1,13 @@
 #version 460
 
+#extension GL_GOOGLE_include_directive : require
+
 layout(location = 0) in vec3 inNormal;
 layout(location = 1) in vec2 inTexCoord;
 layout(location = 2) in vec3 inTangent;
 layout(location = 3) in vec3 inBinormal;
 layout(location = 4) in mat3 inNormalMatrix;
+layout(location = 7) in vec3 inView;
 
 layout(location = 0) out vec4 fragColor;
 
@@ -27,6 +30,11 @@ layout(set = 2, binding = 5) uniform sampler2D normalTexture;
 
 layout(set = 3, binding = 0) uniform sampler2D environmentMap;
 
+// Image-based lighting of the environment map, bound together with it
+#define ENV_LIGHTING_SET     3
+#define ENV_LIGHTING_BINDING 1
+#include "EnvironmentLighting.glsl"
+
 layout(push_constant) uniform PushConstant {
     vec3 lineColor;
     int _pad0;
@@ -97,7 +105,9 @@ void main() {
     if (pushConstant.renderMode == 7) {
         if ((materialParams.hasTexture & NORMAL_TEXTURE_BIT) != 0) {
             mat3 TBN = mat3(normalize(inTangent), normalize(inBinormal), normalize(inNormal));
-            vec3 normal = texture(normalTexture, inTexCoord).rgb * 2.0 - 1.0;
+            // z is rebuilt from x and y, as BC5-compressed normal maps only keep those two
+            vec2 xy = texture(normalTexture, inTexCoord).rg * 2.0 - 1.0;
+            vec3 normal = vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0)));
             fragColor.rgb = normalize(inNormalMatrix * TBN * normal);
         } else {
             fragColor = vec4(inNormal, 1.0);
@@ -110,8 +120,30 @@ void main() {
         fragColor = vec4(inTexCoord, 0.0, 1.0);
     }
 
-    // Line render
+    // Image-based lighting, with the Phong exponent mapped to a GGX roughness
     if (pushConstant.renderMode == 9) {
+        vec3 normal = normalize(inNormalMatrix * inNormal);
+        if ((materialParams.hasTexture & NORMAL_TEXTURE_BIT) != 0) {
+            mat3 TBN = mat3(normalize(inTangent), normalize(inBinormal), normalize(inNormal));
+            vec2 xy = texture(normalTexture, inTexCoord).rg * 2.0 - 1.0;
+            normal = normalize(inNormalMatrix * TBN * vec3(xy, sqrt(max(1.0 - dot(xy, xy), 0.0))));
+        }
+
+        vec3 f0 = materialParams.specular;
+        if ((materialParams.hasTexture & SPECULAR_TEXTURE_BIT) != 0) {
+            f0 = texture(specularTexture, inTexCoord).rgb;
+        }
+        float roughness = sqrt(sqrt(2.0 / (max(materialParams.shininess, 0.0) + 2.0)));
+
+        vec3 view = normalize(inView);
+        if (dot(normal, view) < 0.0) {
+            normal = -normal;
+        }
+        fragColor.rgb = environmentLighting(normal, view, fragColor.rgb, f0, roughness);
+    }
+
+    // Line render
+    if (pushConstant.renderMode == 10) {
         fragColor = vec4(pushConstant.lineColor, 1.0);
     }
 }
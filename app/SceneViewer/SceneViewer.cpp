@@ -21,6 +21,7 @@ public:
     {
         // Create a new scene
         mpScene = mpDevice->createScene();
+        mpScene->setEnvironmentMap(mpEnvironmentMap->getTexture());
 
         // Load scene nodes from file
          auto nodeIndices = mpScene->addNodesFromFile(mScenePath);
@@ -41,6 +42,21 @@ public:
         mpScene->syncToDevice();
     }
 
+    void loadEnvironmentMap(const std::filesystem::path& path)
+    {
+        // The frames in flight may still be sampling the lighting of the old map
+        vkDeviceWaitIdle(mpDevice->getDevice());
+
+        mEnvironmentMapPath = path;
+        mpEnvironmentMap = std::make_shared<EnvironmentMap>(mpDevice, path, VK_FORMAT_R16G16B16A16_SFLOAT,
+                                                            EnvironmentLightingDesc{.enable = true});
+
+        auto pShader = mPipelines[PIPELINE_FILL]->getShader();
+        mpEnvironmentMap->attachLighting(pShader);
+        pShader->setResource("environmentMap", mpEnvironmentMap->getTexture());
+        mpScene->setEnvironmentMap(mpEnvironmentMap->getTexture());
+    }
+
     SceneViewer() : App("SceneViewer", 1920, 1080)
     {
         // Create a Vulkan instance and device
@@ -75,8 +91,13 @@ public:
         mpCamera->setTarget(glm::vec3(0.0f, 0.0f, 0.0f));
         mpCamera->setFov(60.0f);
 
+        // Light the scene with a uniform white environment until a map has been loaded
+        mpEnvironmentMap = std::make_shared<EnvironmentMap>(mpDevice);
+        mpEnvironmentMap->attachLighting(pShader);
+
         // Start with an empty scene
         mpScene = mpDevice->createScene();
+        mpScene->setEnvironmentMap(mpEnvironmentMap->getTexture());
 
         // Initialize GUI
         App::createGUI(mpDevice, mpPass);
@@ -147,7 +168,7 @@ public:
 
             PushConstants pushConstants = {
                 .lineColor = mLineColor,
-                .renderMode = 9,
+                .renderMode = 10,
                 .discardOnZeroAlpha = mDiscardOnZeroAlpha,
             };
             vkCmdPushConstants(cmd, mPipelines[PIPELINE_LINE]->getLayout(), VK_SHADER_STAGE_FRAGMENT_BIT, 0,
@@ -187,10 +208,20 @@ public:
             }
 
             ImGui::Text("Scene: %s", mScenePath.string().c_str());
+
+            if (ImGui::Button("Load environment map")) {
+                auto path = OpenFile(mpWindow, "Supported image files (*.hdr, *.png)\0*.HDR;*.PNG\0All (*.*)\0*.*\0");
+                if (!path.empty()) {
+                    loadEnvironmentMap(path);
+                }
+            }
+            ImGui::Text("Environment map: %s", mEnvironmentMapPath.string().c_str());
+
             const char* renderModes[] = {
                 "Diffuse",  "Specular",  "Ambient",
                 "Emission", "Shininess", "Index of refraction",
                 "Opacity",  "Normal",    "Texture coordinates",
+                "Image-based lighting",
             };
             ImGui::Combo("Render mode", &mRenderMode, renderModes, IM_ARRAYSIZE(renderModes));
             const char* frontFace[] = {"Counter clockwise", "Clockwise"};
@@ -260,6 +291,9 @@ private:
     std::filesystem::path mScenePath;
     std::shared_ptr<Scene> mpScene;
 
+    std::filesystem::path mEnvironmentMapPath;
+    std::shared_ptr<EnvironmentMap> mpEnvironmentMap;
+
     int mRenderMode = 0;
     bool mDiscardOnZeroAlpha = false;
     bool mDrawPolygonLines = false;
@@ -22,6 +22,7 @@ layout(location = 1) out vec2 outTexCoord;
 layout(location = 2) out vec3 outTangent;
 layout(location = 3) out vec3 outBinormal;
 layout(location = 4) out mat3 outNormalMatrix;
+layout(location = 7) out vec3 outView;
 
 void main() {
     outNormalMatrix = transpose(inverse(mat3(mesh.model)));
@@ -31,5 +32,8 @@ void main() {
     outTangent = normalize(vertexTangent);
     outBinormal = normalize(vertexBinormal);
 
-    gl_Position = camera.proj * camera.view * mesh.model * vec4(vertexPosition, 1.0);
+    vec4 worldPosition = mesh.model * vec4(vertexPosition, 1.0);
+    outView = camera.view_inv[3].xyz - worldPosition.xyz;
+
+    gl_Position = camera.proj * camera.view * worldPosition;
 }
@@ -1,9 +1,5 @@
 #version 460
 
-#define M_PI    3.14159265358979323846
-#define M_1_PI  0.318309886183790671538
-#define M_1_2PI 0.5 * M_1_PI
-
 layout(location = 0) in vec2 inTexCoord;
 
 layout(location = 0) out vec4 fragColor;
@@ -15,7 +11,8 @@ layout(set = 0, binding = 0) uniform CameraUniformDynamic {
     mat4 proj_inv;
 } camera;
 
-layout(set = 1, binding = 0) uniform sampler2D environmentMap;
+// The cube map of the environment, sampled with the direction itself
+layout(set = 1, binding = 0) uniform samplerCube environmentMap;
 
 // Must match the push constant block in RayMarcher.frag so that the pipeline layouts stay compatible
 layout(push_constant) uniform PushConstant {
@@ -25,7 +22,6 @@ layout(push_constant) uniform PushConstant {
     vec3 gridMax;
     float envIntensity;
     vec2 viewPort;
-    uint frameIndex;
     uint flags;
     uint bouncesAndSamples;
     float albedo;
@@ -60,16 +56,6 @@ vec3 display(vec3 radiance)
     return linearToSrgb(tonemapACES(radiance));
 }
 
-
-vec2 worldToLatlongMap(vec3 dir)
-{
-    vec3 p = normalize(dir);
-    vec2 uv;
-    uv.x = atan(-p.z, p.x) * M_1_2PI + 0.5;
-    uv.y = acos(-p.y) * M_1_PI;
-    return uv;
-}
-
 void main()
 {
 	const vec2 ray_nds = 2.0 * gl_FragCoord.xy / pushConstant.viewPort - 1.0;
@@ -79,6 +65,6 @@ void main()
 	vec3 ray_world = (camera.view_inv * ray_view).xyz;
 	ray_world = normalize(ray_world);
 
-    vec3 radiance = pushConstant.envIntensity * texture(environmentMap, worldToLatlongMap(ray_world)).rgb;
+    vec3 radiance = pushConstant.envIntensity * texture(environmentMap, ray_world).rgb;
     fragColor = vec4(display(radiance), 1.0);
 }
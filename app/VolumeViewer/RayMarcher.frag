@@ -1,5 +1,7 @@
 #version 460
 
+#extension GL_GOOGLE_include_directive : require
+
 #define M_PI    3.14159265358979323846
 #define M_1_PI  0.318309886183790671538
 #define M_1_2PI 0.5 * M_1_PI
@@ -12,6 +14,25 @@ layout(constant_id = 0) const int MAX_STEPS = 1000;
 layout(constant_id = 1) const float STEP_SIZE = 0.002;
 layout(constant_id = 2) const float DENSITY = 1.0;
 
+// How the volume is stored, must match VolumeViewer.cpp
+const int LAYOUT_DENSE        = 0;
+const int LAYOUT_BRICK_ATLAS  = 1;
+const int LAYOUT_BRICK_BUFFER = 2;
+layout(constant_id = 3) const int VOLUME_LAYOUT = LAYOUT_DENSE;
+
+// Must match SparseVolume
+const int BRICK_SIZE = 8;
+const int BRICK_APRON = 1;
+const int PADDED_BRICK_SIZE = BRICK_SIZE + 2 * BRICK_APRON;
+const uint EMPTY_BRICK = 0xffffffffu;
+
+// Voxels per majorant cell along each axis, must match Volume::kMajorantCellSize and the brick size of SparseVolume
+const int MAJORANT_CELL_SIZE = 8;
+
+// Transmittance below which ratio tracking plays Russian roulette, and the probability of ending it there
+const float RATIO_RR_THRESHOLD = 0.1;
+const float RATIO_RR_PROBABILITY = 0.75;
+
 // Feature flags, must match VolumeViewer.cpp
 const uint FLAG_PATH_TRACING     = 1u << 0;
 const uint FLAG_ACCUMULATE       = 1u << 1;
@@ -28,10 +49,6 @@ const uint FLAG_DEBUG_TRUNCATION = 1u << 10;
 // Value of the NEE depth field that means "no limit"
 const int NEE_DEPTH_UNLIMITED = 255;
 
-// Optical depth beyond which a shadow ray is considered fully blocked (exp(-24) is far below one 32-bit float ULP
-// of the accumulated result). Without this, dense volumes make every shadow march run to MAX_STEPS.
-const float TAU_CUTOFF = 24.0;
-
 layout(set = 0, binding = 0) uniform CameraUniformDynamic {
     mat4 view;
     mat4 view_inv;
@@ -41,17 +58,28 @@ layout(set = 0, binding = 0) uniform CameraUniformDynamic {
 
 layout(set = 1, binding = 0) uniform sampler3D volume;
 layout(set = 1, binding = 1) uniform sampler2D environmentMap;
-layout(set = 1, binding = 2, rgba32f) uniform image2D accumImage;
 
-// Cumulative distribution functions for importance sampling the environment map, normalized to [0, 1]. The marginal
-// selects a row, the conditional selects a texel within that row.
-layout(std430, set = 1, binding = 3) readonly buffer MarginalDistribution {
-    float marginalCdf[];
+// Alias tables for importance sampling the environment map. The marginal selects a row, the conditional selects a
+// texel within that row.
+#define ENV_ALIAS_SET                 1
+#define ENV_MARGINAL_ALIAS_BINDING    3
+#define ENV_CONDITIONAL_ALIAS_BINDING 4
+#include "EnvironmentSampling.glsl"
+
+// Bricked volumes, with placeholders bound for whichever storage is not in use
+layout(set = 1, binding = 5) uniform usampler3D brickTable;
+layout(set = 1, binding = 6) uniform sampler3D brickAtlas;
+layout(std430, set = 1, binding = 7) readonly buffer BrickBuffer {
+    float brickVoxels[];
 };
 
-layout(std430, set = 1, binding = 4) readonly buffer ConditionalDistribution {
-    float conditionalCdf[];
-};
+// Smallest and largest density in each cell of MAJORANT_CELL_SIZE^3 voxels, before the DENSITY scale
+layout(set = 1, binding = 8) uniform sampler3D majorants;
+
+// Progressive accumulation, which only traces the pixels of the tiles that have not converged
+#define ACCUMULATION_SET     1
+#define ACCUMULATION_BINDING 9
+#include "Accumulation.glsl"
 
 // Push constants are limited to 128 bytes on some devices, hence the packing of bounces and samples
 layout(push_constant) uniform PushConstant {
@@ -61,7 +89,6 @@ layout(push_constant) uniform PushConstant {
     vec3 gridMax;
     float envIntensity;
     vec2 viewPort;
-    uint frameIndex;
     uint flags;
     uint bouncesAndSamples;
     float albedo;
@@ -152,72 +179,25 @@ vec3 environmentRadiance(vec3 dir)
     return pc.envIntensity * radiance;
 }
 
-// Largest index i in [0, n - 1] such that cdf[i] <= xi, where the CDF holds n + 1 values
-int findIntervalMarginal(int n, float xi)
-{
-    int first = 0;
-    int len = n + 1;
-    while (len > 0) {
-        int halfLen = len >> 1;
-        int middle = first + halfLen;
-        if (marginalCdf[middle] <= xi) {
-            first = middle + 1;
-            len -= halfLen + 1;
-        } else {
-            len = halfLen;
-        }
-    }
-    return clamp(first - 1, 0, n - 1);
-}
-
-int findIntervalConditional(int base, int n, float xi)
-{
-    int first = 0;
-    int len = n + 1;
-    while (len > 0) {
-        int halfLen = len >> 1;
-        int middle = first + halfLen;
-        if (conditionalCdf[base + middle] <= xi) {
-            first = middle + 1;
-            len -= halfLen + 1;
-        } else {
-            len = halfLen;
-        }
-    }
-    return clamp(first - 1, 0, n - 1);
-}
-
-// Sample a direction proportionally to the radiance in the environment map, by inverting the marginal CDF over rows
-// and then the conditional CDF within the chosen row. Returns the pdf with respect to solid angle.
+// Sample a direction proportionally to the radiance in the environment map. Returns the pdf with respect to solid
+// angle.
 vec3 sampleEnvironmentDirection(out float pdf)
 {
     ivec2 size = textureSize(environmentMap, 0);
 
-    float xiU = rand();
-    float xiV = rand();
-
-    int row = findIntervalMarginal(size.y, xiV);
-    float marginalBin = marginalCdf[row + 1] - marginalCdf[row];
-    float dv = marginalBin > 0.0 ? (xiV - marginalCdf[row]) / marginalBin : 0.0;
-    float v = (float(row) + dv) / float(size.y);
-
-    int base = row * (size.x + 1);
-    int col = findIntervalConditional(base, size.x, xiU);
-    float conditionalBin = conditionalCdf[base + col + 1] - conditionalCdf[base + col];
-    float du = conditionalBin > 0.0 ? (xiU - conditionalCdf[base + col]) / conditionalBin : 0.0;
-    float u = (float(col) + du) / float(size.x);
+    float pdfTexture;
+    vec2 uv = sampleEnvironmentUV(size, vec4(rand2(), rand2()), pdfTexture);
 
-    float sinTheta = sin(v * M_PI);
+    float sinTheta = sin(uv.y * M_PI);
     if (sinTheta <= 0.0) {
         pdf = 0.0;
         return vec3(0.0, 1.0, 0.0);
     }
 
     // Convert the density from texture space to solid angle, where dw = 2 pi^2 sin(theta) du dv
-    float pdfTexture = (marginalBin * float(size.y)) * (conditionalBin * float(size.x));
     pdf = pdfTexture / (2.0 * M_PI * M_PI * sinTheta);
 
-    return latlongMapToWorld(u, v);
+    return latlongMapToWorld(uv.x, uv.y);
 }
 
 // The pdf that sampleEnvironmentDirection would have produced for a given direction, needed to weight the two
@@ -229,22 +209,13 @@ float environmentPdf(vec3 dir)
         return 1.0 / (4.0 * M_PI);
     }
 
-    ivec2 size = textureSize(environmentMap, 0);
     vec2 uv = worldToLatlongMap(dir);
-
     float sinTheta = sin(uv.y * M_PI);
     if (sinTheta <= 0.0) {
         return 0.0;
     }
 
-    int col = clamp(int(uv.x * float(size.x)), 0, size.x - 1);
-    int row = clamp(int(uv.y * float(size.y)), 0, size.y - 1);
-    int base = row * (size.x + 1);
-
-    float marginalBin = marginalCdf[row + 1] - marginalCdf[row];
-    float conditionalBin = conditionalCdf[base + col + 1] - conditionalCdf[base + col];
-
-    return (marginalBin * float(size.y)) * (conditionalBin * float(size.x)) / (2.0 * M_PI * M_PI * sinTheta);
+    return environmentUVPdf(textureSize(environmentMap, 0), uv) / (2.0 * M_PI * M_PI * sinTheta);
 }
 
 // Power heuristic with an exponent of two
@@ -270,10 +241,60 @@ vec3 toModelDir(vec3 d)
     return (pc.model_inv * vec4(d, 0.0)).xyz;
 }
 
+float brickVoxel(uint brick, ivec3 p)
+{
+    return brickVoxels[brick * uint(PADDED_BRICK_SIZE * PADDED_BRICK_SIZE * PADDED_BRICK_SIZE) +
+                       uint((p.z * PADDED_BRICK_SIZE + p.y) * PADDED_BRICK_SIZE + p.x)];
+}
+
+// Trilinear filtering within the padded voxels of a brick, which the apron keeps from reading outside it
+float sampleBrickBuffer(uint brick, vec3 p)
+{
+    p -= 0.5;
+    ivec3 i = ivec3(floor(p));
+    vec3 f = p - vec3(i);
+
+    float c00 = mix(brickVoxel(brick, i + ivec3(0, 0, 0)), brickVoxel(brick, i + ivec3(1, 0, 0)), f.x);
+    float c10 = mix(brickVoxel(brick, i + ivec3(0, 1, 0)), brickVoxel(brick, i + ivec3(1, 1, 0)), f.x);
+    float c01 = mix(brickVoxel(brick, i + ivec3(0, 0, 1)), brickVoxel(brick, i + ivec3(1, 0, 1)), f.x);
+    float c11 = mix(brickVoxel(brick, i + ivec3(0, 1, 1)), brickVoxel(brick, i + ivec3(1, 1, 1)), f.x);
+    return mix(mix(c00, c10, f.y), mix(c01, c11, f.y), f.z);
+}
+
+// Brick table entry of the brick that a position falls in, along with the position in voxels
+uint brickAt(vec3 posModel, out ivec3 brick, out vec3 voxel)
+{
+    ivec3 gridSize = textureSize(brickTable, 0);
+    voxel = (posModel - pc.gridMin) / (pc.gridMax - pc.gridMin) * vec3(gridSize * BRICK_SIZE);
+    brick = ivec3(floor(voxel / float(BRICK_SIZE)));
+    if (any(lessThan(brick, ivec3(0))) || any(greaterThanEqual(brick, gridSize))) {
+        return EMPTY_BRICK;
+    }
+    return texelFetch(brickTable, brick, 0).r;
+}
+
 float densityAt(vec3 posModel)
 {
-    vec3 uvw = (posModel - pc.gridMin) / (pc.gridMax - pc.gridMin);
-    return DENSITY * texture(volume, uvw).r;
+    if (VOLUME_LAYOUT == LAYOUT_DENSE) {
+        vec3 uvw = (posModel - pc.gridMin) / (pc.gridMax - pc.gridMin);
+        return DENSITY * texture(volume, uvw).r;
+    }
+
+    ivec3 brick;
+    vec3 voxel;
+    uint entry = brickAt(posModel, brick, voxel);
+    if (entry == EMPTY_BRICK) {
+        return 0.0;
+    }
+
+    vec3 local = voxel - vec3(brick * BRICK_SIZE) + float(BRICK_APRON);
+    if (VOLUME_LAYOUT == LAYOUT_BRICK_BUFFER) {
+        return DENSITY * sampleBrickBuffer(entry, local);
+    }
+
+    ivec3 slot = ivec3(entry & 0x3ffu, (entry >> 10) & 0x3ffu, (entry >> 20) & 0x3ffu);
+    vec3 uvw = (vec3(slot * PADDED_BRICK_SIZE) + local) / vec3(textureSize(brickAtlas, 0));
+    return DENSITY * texture(brickAtlas, uvw).r;
 }
 
 // Intersect a ray with the volume AABB. Origin and direction are in model space, but the returned t
@@ -290,54 +311,134 @@ bool intersectVolume(vec3 o, vec3 d, out float tEnter, out float tExit)
     return tExit > tEnter;
 }
 
-// Sample a free-flight distance by marching until the accumulated optical depth reaches -log(1 - xi). Returns the
-// scattering distance, or a negative value if the ray did not scatter. The density sampled at t is taken to hold
-// over the step that starts there, so the sample covers [t, t + STEP_SIZE].
+// Walk over the cells of the majorant grid that a ray passes through, as in Amanatides and Woo's voxel traversal.
+// Both volume layouts have cells of MAJORANT_CELL_SIZE voxels, but dense volumes may end in a partial cell.
+struct MajorantWalk {
+    ivec3 cell;
+    ivec3 cellStep;
+    vec3 tNext;  // Distance along the ray to the next cell boundary on each axis
+    vec3 tDelta; // Distance along the ray between cell boundaries on each axis
+};
+
+MajorantWalk beginMajorantWalk(vec3 o, vec3 d, float t)
+{
+    vec3 voxels = VOLUME_LAYOUT == LAYOUT_DENSE ? vec3(textureSize(volume, 0))
+                                                : vec3(textureSize(brickTable, 0) * BRICK_SIZE);
+    vec3 cellsPerUnit = voxels / float(MAJORANT_CELL_SIZE) / (pc.gridMax - pc.gridMin);
+    vec3 p = (o + t * d - pc.gridMin) * cellsPerUnit;
+    vec3 dc = d * cellsPerUnit;
+    bvec3 parallel = equal(dc, vec3(0.0));
+
+    MajorantWalk walk;
+    walk.cell = clamp(ivec3(floor(p)), ivec3(0), textureSize(majorants, 0) - 1);
+    walk.cellStep = ivec3(sign(dc));
+    walk.tNext = mix(t + (vec3(walk.cell + max(walk.cellStep, ivec3(0))) - p) / dc, vec3(1e30), parallel);
+    walk.tDelta = mix(abs(1.0 / dc), vec3(1e30), parallel);
+    return walk;
+}
+
+// Distance along the ray to where it leaves the current cell
+float majorantCellExit(MajorantWalk walk)
+{
+    return min(min(walk.tNext.x, walk.tNext.y), walk.tNext.z);
+}
+
+void stepMajorantWalk(inout MajorantWalk walk)
+{
+    if (walk.tNext.x <= walk.tNext.y && walk.tNext.x <= walk.tNext.z) {
+        walk.cell.x += walk.cellStep.x;
+        walk.tNext.x += walk.tDelta.x;
+    } else if (walk.tNext.y <= walk.tNext.z) {
+        walk.cell.y += walk.cellStep.y;
+        walk.tNext.y += walk.tDelta.y;
+    } else {
+        walk.cell.z += walk.cellStep.z;
+        walk.tNext.z += walk.tDelta.z;
+    }
+}
+
+// Smallest and largest extinction in the current cell
+vec2 majorantRange(MajorantWalk walk)
+{
+    ivec3 cell = clamp(walk.cell, ivec3(0), textureSize(majorants, 0) - 1);
+    return DENSITY * texelFetch(majorants, cell, 0).rg;
+}
+
+// Sample a free-flight distance with delta tracking. Tentative collisions are drawn against the majorant of each
+// cell of the majorant grid and accepted with probability sigma / majorant, which is unbiased for any majorant that
+// bounds the density. Cells with a majorant of zero are stepped over without sampling, and since free flight is
+// memoryless, a collision drawn beyond the end of a cell is simply drawn again from where the ray enters the next.
+// Returns the scattering distance, or a negative value if the ray did not scatter.
 //
-// exhausted is set when the march ran out of steps while still inside the volume. The ray neither scattered nor
+// exhausted is set when the walk ran out of steps while still inside the volume. The ray neither scattered nor
 // left, so the caller must not treat it as having reached the environment.
 float sampleScatterDistance(vec3 o, vec3 d, float tEnter, float tExit, out bool exhausted)
 {
     exhausted = false;
 
-    float tauTarget = -log(max(1.0 - rand(), 1e-7));
-    float tau = 0.0;
-    float t = tEnter + rand() * STEP_SIZE;
+    MajorantWalk walk = beginMajorantWalk(o, d, tEnter);
+    float t = tEnter;
     for (int i = 0; i < MAX_STEPS; i++) {
-        if (t >= tExit) {
-            return -1.0;
+        float tCellExit = min(majorantCellExit(walk), tExit);
+        float majorant = majorantRange(walk).y;
+        if (majorant > 0.0) {
+            float tCollision = t - log(max(1.0 - rand(), 1e-7)) / majorant;
+            if (tCollision < tCellExit) {
+                t = tCollision;
+                if (rand() * majorant < densityAt(o + t * d)) {
+                    return t;
+                }
+                continue;
+            }
         }
 
-        float sigma = densityAt(o + t * d);
-        tau += sigma * STEP_SIZE;
-        if (tau >= tauTarget) {
-            // The target was passed somewhere inside the step that ends at t + STEP_SIZE, so walk back from its end
-            float overshoot = (tau - tauTarget) / max(sigma, 1e-6);
-            return t + STEP_SIZE - min(overshoot, STEP_SIZE);
+        if (tCellExit >= tExit) {
+            return -1.0;
         }
-        t += STEP_SIZE;
+        t = tCellExit;
+        stepMajorantWalk(walk);
     }
 
     exhausted = true;
     return -1.0;
 }
 
-// Transmittance along a shadow ray. Returns zero if the march runs out of steps before leaving the volume, since
-// the part that was never marched could contain any amount of medium and assuming it is empty would leak light.
+// Transmittance along a shadow ray with ratio tracking, which weighs every tentative collision by the probability
+// 1 - sigma / majorant of it being a null collision instead of stopping at the first real one. Cells whose smallest
+// and largest density are the same are homogeneous and crossed in one go, and empty cells are skipped. Once the
+// transmittance is low, Russian roulette ends most of the walks and boosts the rest to keep the estimate unbiased.
+// Returns zero if the walk runs out of steps before leaving the volume, since the part that was never walked could
+// contain any amount of medium and assuming it is empty would leak light.
 float transmittance(vec3 o, vec3 d, float tEnter, float tExit)
 {
-    float tau = 0.0;
-    float t = tEnter + 0.5 * STEP_SIZE;
+    MajorantWalk walk = beginMajorantWalk(o, d, tEnter);
+    float T = 1.0;
+    float t = tEnter;
     for (int i = 0; i < MAX_STEPS; i++) {
-        if (t >= tExit) {
-            return exp(-tau);
+        float tCellExit = min(majorantCellExit(walk), tExit);
+        vec2 range = majorantRange(walk);
+        if (range.y > 0.0 && range.x >= range.y) {
+            T *= exp(-range.y * (tCellExit - t));
+        } else if (range.y > 0.0) {
+            float tCollision = t - log(max(1.0 - rand(), 1e-7)) / range.y;
+            if (tCollision < tCellExit) {
+                t = tCollision;
+                T *= 1.0 - min(densityAt(o + t * d) / range.y, 1.0);
+                if (T < RATIO_RR_THRESHOLD) {
+                    if (rand() < RATIO_RR_PROBABILITY) {
+                        return 0.0;
+                    }
+                    T /= 1.0 - RATIO_RR_PROBABILITY;
+                }
+                continue;
+            }
         }
 
-        tau += densityAt(o + t * d) * STEP_SIZE;
-        if (tau > TAU_CUTOFF) {
-            return 0.0;
+        if (tCellExit >= tExit) {
+            return T;
         }
-        t += STEP_SIZE;
+        t = tCellExit;
+        stepMajorantWalk(walk);
     }
 
     return 0.0;
@@ -590,9 +691,18 @@ void main()
         return;
     }
 
-    initRNG(uvec2(gl_FragCoord.xy), pc.seed);
-
     bool accumulate = (pc.flags & FLAG_ACCUMULATE) != 0u;
+    bool debugTruncation = (pc.flags & FLAG_DEBUG_TRUNCATION) != 0u;
+    ivec2 coord = ivec2(gl_FragCoord.xy);
+
+    // Pixels of tiles that were not scheduled show what they have accumulated so far
+    if (accumulate && !accumulationScheduled(coord)) {
+        vec3 mean = accumulatedMean(coord);
+        fragColor = vec4(debugTruncation ? mean : display(mean), 1.0);
+        return;
+    }
+
+    initRNG(uvec2(gl_FragCoord.xy), pc.seed);
 
     vec3 total = vec3(0.0);
     int truncatedCount = 0;
@@ -614,20 +724,12 @@ void main()
     }
 
     // Accumulate the truncation rate in place of radiance so that it converges the same way
-    bool debugTruncation = (pc.flags & FLAG_DEBUG_TRUNCATION) != 0u;
     if (debugTruncation) {
         radiance = vec3(float(truncatedCount) / float(spp));
     }
 
     if (accumulate) {
-        ivec2 coord = ivec2(gl_FragCoord.xy);
-        // Alpha channel holds the accumulated frame count
-        vec4 accum = vec4(radiance, 1.0);
-        if (pc.frameIndex != 0u) {
-            accum += imageLoad(accumImage, coord);
-        }
-        imageStore(accumImage, coord, accum);
-        radiance = accum.rgb / accum.a;
+        radiance = accumulateSample(coord, radiance);
     }
 
     // The truncation rate is a fraction, not a radiance, so it is shown as is
@@ -23,6 +23,13 @@ public:
     // Value of the NEE depth field that means "no limit", must match RayMarcher.frag
     static constexpr int NEE_DEPTH_UNLIMITED = 255;
 
+    // How the volume is stored, must match RayMarcher.frag
+    enum VolumeLayout : int {
+        LAYOUT_DENSE = 0,
+        LAYOUT_BRICK_ATLAS = 1,
+        LAYOUT_BRICK_BUFFER = 2,
+    };
+
     // Push constants are limited to 128 bytes on some devices, hence the packing of bounces and samples
     struct PushConstant {
         glm::mat4 inverseModel;
@@ -31,19 +38,19 @@ public:
         glm::vec3 gridMax;
         float envIntensity;
         glm::vec2 viewport;
-        uint32_t frameIndex;
         uint32_t flags;
         uint32_t bouncesAndSamples;
         float albedo;
         uint32_t seed;
         float exposure;
     };
-    static_assert(sizeof(PushConstant) == 128, "PushConstant must match the block in RayMarcher.frag");
+    static_assert(sizeof(PushConstant) == 124, "PushConstant must match the block in RayMarcher.frag");
 
     struct SpecializationConstants {
         int maxSteps;
         float stepSize;
         float density;
+        int volumeLayout;
     };
 
     VolumeViewer() : App("VolumeViewer", 1920, 1080)
@@ -72,13 +79,16 @@ public:
         mpEnvironmentMapPipeline = mpDevice->createPipeline(mpPass, pEnvMapShader, pipelineDesc);
 
         // Specialization constants for ray marching shader
-        mSpecializationConstants = {.maxSteps = 1000, .stepSize = 0.01f, .density = 1.0f};
+        mSpecializationConstants = {
+            .maxSteps = 1000, .stepSize = 0.01f, .density = 1.0f, .volumeLayout = LAYOUT_BRICK_ATLAS};
         mSpecializationMapEntries.push_back(
             {.constantID = 0, .offset = offsetof(SpecializationConstants, maxSteps), .size = sizeof(uint32_t)});
         mSpecializationMapEntries.push_back(
             {.constantID = 1, .offset = offsetof(SpecializationConstants, stepSize), .size = sizeof(float)});
         mSpecializationMapEntries.push_back(
             {.constantID = 2, .offset = offsetof(SpecializationConstants, density), .size = sizeof(float)});
+        mSpecializationMapEntries.push_back(
+            {.constantID = 3, .offset = offsetof(SpecializationConstants, volumeLayout), .size = sizeof(int)});
         mSpecializationInfo = {
             .mapEntryCount = count(mSpecializationMapEntries),
             .pMapEntries = mSpecializationMapEntries.data(),
@@ -119,8 +129,26 @@ public:
         mpDummyEnvironmentMap = std::make_shared<EnvironmentMap>(mpDevice);
         setEnvironmentMapResources();
 
-        // Buffer for temporal accumulation
-        createAccumulationImage();
+        // Placeholders bound in place of the volume representations that are not in use
+        const float emptyDensity = 0.0f;
+        mpPlaceholderVolume = std::make_shared<Texture>(mpDevice, TextureType::Texture3D, VK_FORMAT_R32_SFLOAT,
+                                                        &emptyDensity, 1, 1, 1, sizeof(float));
+        const uint32_t emptyBrick = SparseVolume::kEmptyBrick;
+        mpPlaceholderBrickTable = std::make_shared<Texture>(mpDevice, TextureType::Texture3D, VK_FORMAT_R32_UINT,
+                                                            &emptyBrick, 1, 1, 1, sizeof(uint32_t));
+        mpPlaceholderBrickTable->setMagFilter(VK_FILTER_NEAREST);
+        mpPlaceholderBrickTable->setMinFilter(VK_FILTER_NEAREST);
+        mpPlaceholderBrickBuffer = mpDevice->createBuffer(sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        const glm::vec2 emptyMajorants = glm::vec2(0.0f);
+        mpPlaceholderMajorants = std::make_shared<Texture>(mpDevice, TextureType::Texture3D, VK_FORMAT_R32G32_SFLOAT,
+                                                           &emptyMajorants, 1, 1, 1, sizeof(glm::vec2));
+        mpPlaceholderMajorants->setMagFilter(VK_FILTER_NEAREST);
+        mpPlaceholderMajorants->setMinFilter(VK_FILTER_NEAREST);
+        setVolumeResources();
+
+        // Progressive accumulation, which spends the samples on the tiles that are still noisy
+        createAccumulator();
 
         // Initialize GUI
         App::createGUI(mpDevice, mpPass);
@@ -152,9 +180,8 @@ public:
             // update() ran before the swapchain was recreated, so push the new projection for this frame too
             mpCamera->update();
             mpPass->update(mpSwapchain->getExtent());
-            // The accumulation buffer must match the new resolution
-            createAccumulationImage();
-            resetAccumulation();
+            // The accumulation must match the new resolution, and starts over with it
+            createAccumulator();
         }
 
         // Restart accumulation whenever the camera moves
@@ -167,24 +194,16 @@ public:
         // Acquire frame from swapchain and prepare rasterizer
         VkCommandBuffer cmd = mpSwapchain->acquireNextImage();
 
-        // Make last frame's accumulation writes visible before this frame reads them
-        Helpers::imageBarrier(cmd, mpAccumImage->getImage(), VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
-                              VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
-                              VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-                              VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+        // Pick the tiles to trace this frame, which also makes last frame's samples visible to this one
+        mpAccumulator->prepare(cmd);
 
         mpPass->begin(cmd, glm::vec4(0.0f, 0.0f, 0.0f, 1.0f));
 
         // Push constants
         VkExtent2D extent = mpSwapchain->getExtent();
 
-        glm::vec3 volumeDim(1.0f);
-        if (mpVolume) {
-            volumeDim = glm::vec3(mpVolume->getImage()->getWidth(), mpVolume->getImage()->getHeight(),
-                                  mpVolume->getImage()->getDepth());
-        }
-        glm::vec3 gridMin = mVolumeModelPosition - (mVolumeModelScale * volumeDim / 2.0f);
-        glm::vec3 gridMax = gridMin + mVolumeModelScale * volumeDim;
+        glm::vec3 gridMin = mVolumeModelPosition - (mVolumeModelScale * mVolumeSize / 2.0f);
+        glm::vec3 gridMax = gridMin + mVolumeModelScale * mVolumeSize;
 
         uint32_t flags = 0;
         flags |= mPathTracing ? FLAG_PATH_TRACING : 0;
@@ -206,7 +225,6 @@ public:
             .gridMax = gridMax,
             .envIntensity = mEnvIntensity,
             .viewport = glm::vec2(extent.width, extent.height),
-            .frameIndex = mAccumulatedFrames,
             .flags = flags,
             .bouncesAndSamples = static_cast<uint32_t>(mMaxBounces) |
                                  (static_cast<uint32_t>(mSamplesPerFrame) << 16) |
@@ -228,15 +246,20 @@ public:
         }
 
         // Render volume
-        if (mpVolume) {
+        if (mpVolume || mpSparseVolume) {
             auto pShader = mpRayMarchingPipeline->getShader();
             mpRayMarchingPipeline->bind(cmd);
             pShader->bindResources(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, 0);
             pShader->bindResources(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, 1);
-            vkCmdDraw(cmd, 3, 1, 0, 0);
 
-            if (mPathTracing && mAccumulate) {
-                mAccumulatedFrames++;
+            // Only the time spent tracing counts against the budget of the accumulator
+            bool accumulate = mPathTracing && mAccumulate;
+            if (accumulate) {
+                mpAccumulator->beginSamples(cmd);
+            }
+            vkCmdDraw(cmd, 3, 1, 0, 0);
+            if (accumulate) {
+                mpAccumulator->endSamples(cmd);
             }
         }
 
@@ -261,23 +284,33 @@ public:
             if (ImGui::Button("Load##Volume")) {
                 mVolumePath = OpenFile(mpWindow, "OpenVDB file (*.vdb)\0*.VDB\0All (*.*)\0*.*\0");
                 if (!mVolumePath.empty()) {
-                    mpVolume = std::make_shared<Texture>(mpDevice, TextureType::Texture3D, VK_FORMAT_R32_SFLOAT,
-                                                         mVolumePath, false);
-                    mpVolume->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
-                                             VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
-                                             VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER);
-
-                    mpRayMarchingPipeline->getShader()->setResource("volume", mpVolume);
-
-                    glm::vec3 volumeDim = glm::vec3(mpVolume->getImage()->getWidth(), mpVolume->getImage()->getHeight(),
-                                                    mpVolume->getImage()->getDepth());
-                    mVolumeModelScale = 1.0f / glm::max(volumeDim.x, glm::max(volumeDim.y, volumeDim.z));
+                    loadVolume();
+                    mVolumeModelScale = 1.0f / glm::max(mVolumeSize.x, glm::max(mVolumeSize.y, mVolumeSize.z));
                     resetAccum = true;
                 }
             }
             ImGui::SameLine();
             ImGui::TextUnformatted(mVolumePath.string().c_str());
             bool recreatePipeline = false;
+
+            const char* layouts[] = {"Dense", "Brick atlas", "Brick buffer"};
+            if (ImGui::Combo("Layout", &mSpecializationConstants.volumeLayout, layouts, IM_ARRAYSIZE(layouts))) {
+                if (!mVolumePath.empty()) {
+                    loadVolume();
+                }
+                recreatePipeline = true;
+            }
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Dense keeps every voxel of the bounding box. The bricked layouts keep only the "
+                                  "8x8x8 bricks that hold anything. The atlas is "
+                                  "filtered by the texture units, the buffer by the shader.");
+            }
+            if (mpSparseVolume) {
+                ImGui::Text("Bricks: %u of %u, %.1f MiB", mpSparseVolume->getBrickCount(),
+                            mpSparseVolume->getBrickGridSize().x * mpSparseVolume->getBrickGridSize().y *
+                                mpSparseVolume->getBrickGridSize().z,
+                            static_cast<double>(mpSparseVolume->getMemorySize()) / (1 << 20));
+            }
             recreatePipeline |= ImGui::DragFloat("Density", &mSpecializationConstants.density, 0.1f, 0.0f, 10000.0f);
 
             bool newModelMatrix = false;
@@ -306,9 +339,16 @@ public:
 
             ImGui::SeparatorText("Ray Marcher");
             recreatePipeline |= ImGui::DragInt("Max steps", &mSpecializationConstants.maxSteps, 1.0f);
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("The path tracer counts majorant cells and tentative collisions as steps.");
+            }
 
             recreatePipeline |=
                 ImGui::DragFloat("Step size", &mSpecializationConstants.stepSize, 0.0001f, 0.0f, 0.0f, "%.4f");
+            if (ImGui::IsItemHovered()) {
+                ImGui::SetTooltip("Only used with path tracing off. The path tracer takes steps of its own length, "
+                                  "drawn against the majorant of each cell.");
+            }
 
             if (recreatePipeline) {
                 mpRayMarchingPipeline->recreate();
@@ -367,11 +407,40 @@ public:
                 }
                 resetAccum |= ImGui::SliderFloat("Environment intensity", &mEnvIntensity, 0.0f, 10.0f);
                 resetAccum |= ImGui::SliderInt("Samples per frame", &mSamplesPerFrame, 1, 16);
-                ImGui::Text("Accumulated frames: %u", mAccumulatedFrames);
+                ImGui::Text("Accumulated frames: %u", mpAccumulator->getFrameCount());
                 ImGui::SameLine();
                 if (ImGui::Button("Reset")) {
                     resetAccum = true;
                 }
+
+                // Convergence settings only decide which tiles get more samples, so they need no reset
+                if (mAccumulate) {
+                    if (ImGui::SliderFloat("Error threshold", &mAccumulatorDesc.errorThreshold, 0.001f, 0.1f,
+                                           "%.3f", ImGuiSliderFlags_Logarithmic)) {
+                        mpAccumulator->setErrorThreshold(mAccumulatorDesc.errorThreshold);
+                    }
+                    if (ImGui::IsItemHovered()) {
+                        ImGui::SetTooltip("Relative standard error of the pixels of a tile below which the tile is "
+                                          "no longer traced. Dense clouds converge slowly where light barely gets "
+                                          "through, so that is where the samples go.");
+                    }
+                    int minSampleCount = static_cast<int>(mAccumulatorDesc.minSampleCount);
+                    if (ImGui::SliderInt("Min samples", &minSampleCount, 2, 256)) {
+                        mAccumulatorDesc.minSampleCount = static_cast<uint32_t>(minSampleCount);
+                        mpAccumulator->setMinSampleCount(mAccumulatorDesc.minSampleCount);
+                    }
+                    if (ImGui::SliderFloat("Time budget (ms)", &mAccumulatorDesc.frameTimeBudget, 0.0f, 33.0f,
+                                           "%.1f")) {
+                        mpAccumulator->setFrameTimeBudget(mAccumulatorDesc.frameTimeBudget);
+                    }
+                    if (ImGui::IsItemHovered()) {
+                        ImGui::SetTooltip("Device time the path tracer may take per frame, which limits how many "
+                                          "tiles are traced. 0 traces every tile that has not converged.");
+                    }
+                    ImGui::Text("Tiles: %u traced, %u converged of %u", mpAccumulator->getScheduledTileCount(),
+                                mpAccumulator->getConvergedTileCount(), mpAccumulator->getTileCount());
+                    ImGui::Text("Trace time: %.2f ms", mpAccumulator->getSampleTime());
+                }
             }
 
             // Display settings do not affect the accumulated radiance, so they must not reset it
@@ -413,40 +482,81 @@ public:
 private:
     void resetAccumulation()
     {
-        mAccumulatedFrames = 0;
+        mpAccumulator->reset();
     }
 
-    void createAccumulationImage()
+    void createAccumulator()
     {
-        mpAccumImage = mpDevice->createImage(mpSwapchain->getExtent().width, mpSwapchain->getExtent().height, 1, 1,
-                                             VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32G32B32A32_SFLOAT,
-                                             VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT,
-                                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-        mpAccumImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
-
-        // Transition to general layout for storage image access
-        VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
-        Helpers::imageBarrier(cmd, mpAccumImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
-                              VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
-                              VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
-                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
-        Helpers::cmdEnd(mpDevice, cmd);
-
-        mpRayMarchingPipeline->getShader()->setResource("accumImage", mpAccumImage);
+        mpAccumulator = mpDevice->createAccumulator(mpSwapchain->getExtent().width, mpSwapchain->getExtent().height,
+                                                    mAccumulatorDesc);
+        mpAccumulator->attach(mpRayMarchingPipeline->getShader());
+    }
+
+    // Loads the volume in the selected layout, dropping the previous one
+    void loadVolume()
+    {
+        mpVolume.reset();
+        mpSparseVolume.reset();
+
+        if (mSpecializationConstants.volumeLayout == LAYOUT_DENSE) {
+            // Loaded as a volume rather than a plain texture, for the majorant grid that comes with it
+            mpVolume = std::make_shared<Volume>(mpDevice, mVolumePath);
+            if (!mpVolume->getTexture()) {
+                mpVolume.reset();
+            } else {
+                mpVolume->getTexture()->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+                                                       VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER,
+                                                       VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_BORDER);
+                mVolumeSize = glm::vec3(mpVolume->getSize());
+            }
+        } else {
+            SparseVolumeDesc desc = {
+                .storage = mSpecializationConstants.volumeLayout == LAYOUT_BRICK_ATLAS ? BrickStorage::Atlas
+                                                                                        : BrickStorage::Buffer,
+            };
+            mpSparseVolume = std::make_shared<SparseVolume>(mpDevice, mVolumePath, desc);
+            if (mpSparseVolume->getBrickCount() == 0) {
+                mpSparseVolume.reset();
+            } else {
+                mVolumeSize = glm::vec3(mpSparseVolume->getSize());
+            }
+        }
+
+        setVolumeResources();
+    }
+
+    // Attaches the volume in whichever layout it was loaded, with placeholders for the other layouts
+    void setVolumeResources()
+    {
+        auto pShader = mpRayMarchingPipeline->getShader();
+        pShader->setResource("volume", mpVolume ? mpVolume->getTexture() : mpPlaceholderVolume);
+
+        std::shared_ptr<Texture> pBrickTable = mpSparseVolume ? mpSparseVolume->getBrickTable() : nullptr;
+        std::shared_ptr<Texture> pBrickAtlas = mpSparseVolume ? mpSparseVolume->getBrickAtlas() : nullptr;
+        std::shared_ptr<Buffer> pBrickBuffer = mpSparseVolume ? mpSparseVolume->getBrickBuffer() : nullptr;
+        pShader->setResource("brickTable", pBrickTable ? pBrickTable : mpPlaceholderBrickTable);
+        pShader->setResource("brickAtlas", pBrickAtlas ? pBrickAtlas : mpPlaceholderVolume);
+        pShader->setResource("BrickBuffer", pBrickBuffer ? pBrickBuffer : mpPlaceholderBrickBuffer);
+
+        std::shared_ptr<Texture> pMajorants = mpVolume         ? mpVolume->getGrid("density")->pMajorants
+                                              : mpSparseVolume ? mpSparseVolume->getMajorants()
+                                                               : nullptr;
+        pShader->setResource("majorants", pMajorants ? pMajorants : mpPlaceholderMajorants);
     }
 
-    // Attaches the environment map, and the distribution used to importance sample it, to both shaders. Falls back
-    // to the white placeholder until a map has been loaded.
+    // Attaches the environment map, and the distribution used to importance sample it, to both shaders. The
+    // background only looks the map up, so it gets the cube map. Falls back to the white placeholder until a map has
+    // been loaded.
     void setEnvironmentMapResources()
     {
         auto pEnvMap = mpEnvironmentMap ? mpEnvironmentMap : mpDummyEnvironmentMap;
 
-        mpEnvironmentMapPipeline->getShader()->setResource("environmentMap", pEnvMap->getTexture());
+        mpEnvironmentMapPipeline->getShader()->setResource("environmentMap", pEnvMap->getCubeMap());
 
         auto pShader = mpRayMarchingPipeline->getShader();
         pShader->setResource("environmentMap", pEnvMap->getTexture());
-        pShader->setResource("MarginalDistribution", pEnvMap->getMarginalDistribution());
-        pShader->setResource("ConditionalDistribution", pEnvMap->getConditionalDistribution());
+        pShader->setResource("MarginalAliasTable", pEnvMap->getMarginalAliasTable());
+        pShader->setResource("ConditionalAliasTable", pEnvMap->getConditionalAliasTable());
     }
 
     std::shared_ptr<Device> mpDevice;
@@ -463,13 +573,20 @@ private:
     std::filesystem::path mEnvironmentMapPath;
 
     std::shared_ptr<Pipeline> mpRayMarchingPipeline;
-    std::shared_ptr<Texture> mpVolume;
+    std::shared_ptr<Volume> mpVolume;
+    std::shared_ptr<SparseVolume> mpSparseVolume;
+    std::shared_ptr<Texture> mpPlaceholderVolume;
+    std::shared_ptr<Texture> mpPlaceholderBrickTable;
+    std::shared_ptr<Buffer> mpPlaceholderBrickBuffer;
+    std::shared_ptr<Texture> mpPlaceholderMajorants;
     std::filesystem::path mVolumePath;
+    glm::vec3 mVolumeSize = glm::vec3(1.0f);
     float mVolumeModelScale = 1.0;
     glm::vec3 mVolumeModelPosition = glm::vec3(0.0f);
     glm::mat4 mVolumeModelMatrix = glm::mat4(1.0f);
 
-    std::shared_ptr<Image> mpAccumImage;
+    std::shared_ptr<Accumulator> mpAccumulator;
+    AccumulatorDesc mAccumulatorDesc;
 
     std::vector<VkSpecializationMapEntry> mSpecializationMapEntries;
     VkSpecializationInfo mSpecializationInfo;
@@ -499,7 +616,6 @@ private:
     float mExposure = 1.0f;
     bool mDebugTruncation = false;
 
-    uint32_t mAccumulatedFrames = 0;
     uint32_t mFrameCounter = 0;
     glm::mat4 mPrevView = glm::mat4(0.0f);
 };
@@ -8,10 +8,39 @@
 
 using namespace Mandrill;
 
+namespace
+{
+    // Offsets of acceleration structures within a buffer must be multiples of 256 bytes
+    constexpr VkDeviceSize kAccelerationStructureAlignment = 256;
+
+    // Usage of buffers that hold BLASes
+    constexpr VkBufferUsageFlags kBLASBufferUsage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
+                                                    VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT;
+
+    VkDeviceAddress getAddress(VkDevice device, VkAccelerationStructureKHR accelerationStructure)
+    {
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo = {
+            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
+            .accelerationStructure = accelerationStructure,
+        };
+        return vkGetAccelerationStructureDeviceAddressKHR(device, &addressInfo);
+    }
+
+    float surfaceArea(const AABB& aabb)
+    {
+        if (aabb.empty()) {
+            return 0.0f;
+        }
+        glm::vec3 extent = aabb.max - aabb.min;
+        return 2.0f * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+    }
+} // namespace
 
 AccelerationStructure::AccelerationStructure(ptr<Device> pDevice, std::weak_ptr<Scene> wpScene,
-                                             VkBuildAccelerationStructureFlagsKHR flags)
-    : mpDevice(pDevice), mwpScene(wpScene), mTLAS(nullptr)
+                                             VkBuildAccelerationStructureFlagsKHR flags,
+                                             const AccelerationStructureDesc& desc)
+    : mpDevice(pDevice), mwpScene(wpScene), mDesc(desc), mBLASFlags(flags), mTLAS(nullptr)
 {
     ptr<Scene> pScene = mwpScene.lock();
     if (!pScene) {
@@ -42,94 +71,432 @@ AccelerationStructure::~AccelerationStructure()
 
 void AccelerationStructure::update(VkBuildAccelerationStructureFlagsKHR flags)
 {
-    createTLAS(flags, true);
+    ptr<Scene> pScene = mwpScene.lock();
+    if (!pScene) {
+        Log::Error("Scene not valid for acceleration structure");
+        return;
+    }
+
+    // A progressive build adds one batch per update, whose instances become active, which a refit cannot do
+    bool blasesAdded = false;
+    if (!mPendingBatches.empty()) {
+        buildBLASBatch(mPendingBatches.front());
+        mPendingBatches.pop_front();
+        if (mPendingBatches.empty()) {
+            finishBLASes();
+        }
+        blasesAdded = true;
+    }
+
+    // Meshes added to the scene since the last build start out without a BLAS
+    uint32_t builtCount = count(mBLASes);
+    mBLASes.resize(pScene->getMeshCount());
+    for (uint32_t i = builtCount; i < count(mBLASes); i++) {
+        mBLASes[i].accelerationStructure = VK_NULL_HANDLE;
+        mBLASes[i].revision = std::numeric_limits<uint32_t>::max();
+        mBLASes[i].built = false;
+        mBLASes[i].address = 0;
+    }
+
+    std::vector<uint32_t> staleMeshes;
+    for (uint32_t i = 0; i < count(mBLASes); i++) {
+        if (mBLASes[i].revision != pScene->getMeshRevision(i)) {
+            staleMeshes.push_back(i);
+        }
+    }
+
+    if (!staleMeshes.empty()) {
+        rebuildBLASes(staleMeshes);
+    }
+
+    createTLAS(flags, !blasesAdded);
 }
 
-void AccelerationStructure::createBLASes(VkBuildAccelerationStructureFlagsKHR flags)
+VkDeviceSize AccelerationStructure::getBLASMemorySize() const
 {
-    const uint32_t ACCELERATION_STRUCTURE_ALIGNMENT = 256;
+    VkDeviceSize size = mpBLASBuffer ? mpBLASBuffer->getSize() : 0;
+    for (auto& blas : mBLASes) {
+        size += blas.pBuffer ? blas.pBuffer->getSize() : 0;
+    }
+    return size;
+}
 
-    VkDeviceSize scratchSize = 0;
-    VkDeviceSize totalAccelerationStructureSize = 0;
+void AccelerationStructure::describeBLAS(BLAS& blas, const ptr<Scene>& pScene, uint32_t meshIndex,
+                                         VkBuildAccelerationStructureFlagsKHR flags)
+{
+    VkDeviceOrHostAddressConstKHR vertexAddress = {.deviceAddress = pScene->getMeshVertexAddress(meshIndex)};
+    VkDeviceOrHostAddressConstKHR indexAddress = {.deviceAddress = pScene->getMeshIndexAddress(meshIndex)};
+
+    VkAccelerationStructureGeometryTrianglesDataKHR triangles = {
+        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
+        .vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
+        .vertexData = vertexAddress,
+        .vertexStride = sizeof(Vertex),
+        .maxVertex = pScene->getMeshVertexCount(meshIndex) - 1,
+        .indexType = VK_INDEX_TYPE_UINT32,
+        .indexData = indexAddress,
+        .transformData = {0}, // Identity transform
+    };
+
+    VkAccelerationStructureGeometryDataKHR geometry = {
+        .triangles = triangles,
+    };
+
+    blas.geometry = {
+        .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
+        .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
+        .geometry = geometry,
+        .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
+    };
 
+    blas.buildRange = {
+        .primitiveCount = pScene->getMeshIndexCount(meshIndex) / 3,
+        .primitiveOffset = 0,
+        .firstVertex = 0,
+        .transformOffset = 0,
+    };
+
+    blas.buildInfo = {
+        .geometry =
+            {
+                .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
+                .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
+                .flags = flags,
+                .mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
+                .srcAccelerationStructure = VK_NULL_HANDLE,
+                .geometryCount = 1,
+                .pGeometries = &blas.geometry,
+            },
+        .size =
+            {
+                .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
+            },
+    };
+
+    vkGetAccelerationStructureBuildSizesKHR(mpDevice->getDevice(), VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
+                                            &blas.buildInfo.geometry, &blas.buildRange.primitiveCount,
+                                            &blas.buildInfo.size);
+
+    blas.buildInfo.range = &blas.buildRange;
+    blas.revision = pScene->getMeshRevision(meshIndex);
+}
+
+void AccelerationStructure::rebuildBLASes(const std::vector<uint32_t>& meshIndices)
+{
     ptr<Scene> pScene = mwpScene.lock();
-    if (!pScene) {
-        Log::Error("Scene not valid for acceleration structure");
+
+    // The old BLASes may still be traced by frames in flight
+    vkDeviceWaitIdle(mpDevice->getDevice());
+
+    // A BLAS still waiting in a progressive build is built here instead
+    bool pending = !mPendingBatches.empty();
+    for (auto& batch : mPendingBatches) {
+        std::erase_if(batch, [&](uint32_t meshIndex) {
+            return std::find(meshIndices.begin(), meshIndices.end(), meshIndex) != meshIndices.end();
+        });
+    }
+    std::erase_if(mPendingBatches, [](const std::vector<uint32_t>& batch) { return batch.empty(); });
+    if (pending && mPendingBatches.empty()) {
+        finishBLASes();
     }
 
-    // Loop over the meshes in the scene
-    for (uint32_t meshIndex = 0; meshIndex < pScene->getMeshCount(); meshIndex++) {
-        BLAS* blas = &mBLASes[meshIndex];
-
-        VkDeviceOrHostAddressConstKHR vertexAddress = {.deviceAddress = pScene->getMeshVertexAddress(meshIndex)};
-        VkDeviceOrHostAddressConstKHR indexAddress = {.deviceAddress = pScene->getMeshIndexAddress(meshIndex)};
-
-        VkAccelerationStructureGeometryTrianglesDataKHR triangles = {
-            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR,
-            .vertexFormat = VK_FORMAT_R32G32B32_SFLOAT,
-            .vertexData = vertexAddress,
-            .vertexStride = sizeof(Vertex),
-            .maxVertex = pScene->getMeshVertexCount(meshIndex) - 1,
-            .indexType = VK_INDEX_TYPE_UINT32,
-            .indexData = indexAddress,
-            .transformData = {0}, // Identity transform
-        };
+    std::vector<uint32_t> builds;
+    for (auto meshIndex : meshIndices) {
+        BLAS& blas = mBLASes[meshIndex];
 
-        VkAccelerationStructureGeometryDataKHR geometry = {
-            .triangles = triangles,
-        };
+        vkDestroyAccelerationStructureKHR(mpDevice->getDevice(), blas.accelerationStructure, nullptr);
+        blas.accelerationStructure = VK_NULL_HANDLE;
+        blas.pBuffer.reset();
+        blas.built = false;
+        blas.address = 0;
+
+        if (pScene->getMeshIndexCount(meshIndex) == 0) {
+            blas.revision = pScene->getMeshRevision(meshIndex);
+            continue; // Removed, so instances of it are left without geometry
+        }
+        if (pScene->getMeshGeometryIndex(meshIndex) != meshIndex) {
+            blas.revision = pScene->getMeshRevision(meshIndex);
+            continue; // Instances of it use the BLAS of the mesh it shares geometry with
+        }
 
-        blas->geometry = {
-            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR,
-            .geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR,
-            .geometry = geometry,
-            .flags = VK_GEOMETRY_OPAQUE_BIT_KHR,
+        describeBLAS(blas, pScene, meshIndex, mBLASFlags);
+
+        // A BLAS rebuilt on its own gets its own storage, leaving its old part of the shared buffer unused until the
+        // whole acceleration structure is rebuilt
+        blas.pBuffer = make_ptr<Buffer>(mpDevice, blas.buildInfo.size.accelerationStructureSize, kBLASBufferUsage,
+                                        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+        VkAccelerationStructureCreateInfoKHR ci = {
+            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+            .buffer = blas.pBuffer->getBuffer(),
+            .offset = 0,
+            .size = blas.buildInfo.size.accelerationStructureSize,
+            .type = blas.buildInfo.geometry.type,
         };
+        Check::Vk(vkCreateAccelerationStructureKHR(mpDevice->getDevice(), &ci, nullptr, &blas.accelerationStructure));
+
+        builds.push_back(meshIndex);
+    }
+
+    for (auto& batch : partitionBLASes(builds)) {
+        buildBLASBatch(batch);
+    }
+
+    if (mBLASFlags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+        std::vector<BLAS*> blases;
+        for (auto meshIndex : builds) {
+            blases.push_back(&mBLASes[meshIndex]);
+        }
+        compactBLASes(blases, false);
+    }
+}
+
+std::vector<std::vector<uint32_t>>
+AccelerationStructure::partitionBLASes(const std::vector<uint32_t>& meshIndices) const
+{
+    const VkDeviceSize alignment =
+        mpDevice->getProperties().accelerationStructure.minAccelerationStructureScratchOffsetAlignment;
+
+    std::vector<std::vector<uint32_t>> batches;
+    VkDeviceSize batchScratchSize = 0;
+    for (auto meshIndex : meshIndices) {
+        VkDeviceSize scratchSize = Helpers::alignTo(mBLASes[meshIndex].buildInfo.size.buildScratchSize, alignment);
+        if (batches.empty() || batchScratchSize + scratchSize > mDesc.scratchBudget) {
+            batches.emplace_back();
+            batchScratchSize = 0;
+        }
+        batches.back().push_back(meshIndex);
+        batchScratchSize += scratchSize;
+    }
+
+    return batches;
+}
+
+void AccelerationStructure::buildBLASBatch(const std::vector<uint32_t>& meshIndices)
+{
+    const VkDeviceSize alignment =
+        mpDevice->getProperties().accelerationStructure.minAccelerationStructureScratchOffsetAlignment;
+
+    VkDeviceSize scratchSize = 0;
+    for (auto meshIndex : meshIndices) {
+        scratchSize += Helpers::alignTo(mBLASes[meshIndex].buildInfo.size.buildScratchSize, alignment);
+    }
+    reserveScratch(scratchSize);
+
+    // Every BLAS gets its own part of the scratch, so that nothing orders the builds
+    std::vector<VkAccelerationStructureBuildGeometryInfoKHR> geometries;
+    std::vector<const VkAccelerationStructureBuildRangeInfoKHR*> ranges;
+    VkDeviceAddress scratchAddress = mScratchAddress;
+    for (auto meshIndex : meshIndices) {
+        BLAS& blas = mBLASes[meshIndex];
+
+        // The build info points into the BLAS, which moves when meshes added to the scene grow mBLASes while the
+        // batch waits in a progressive build
+        blas.buildInfo.geometry.pGeometries = &blas.geometry;
+        blas.buildInfo.range = &blas.buildRange;
+        blas.buildInfo.geometry.dstAccelerationStructure = blas.accelerationStructure;
+        blas.buildInfo.geometry.scratchData.deviceAddress = scratchAddress;
+        scratchAddress += Helpers::alignTo(blas.buildInfo.size.buildScratchSize, alignment);
+
+        geometries.push_back(blas.buildInfo.geometry);
+        ranges.push_back(blas.buildInfo.range);
+        blas.built = true;
+        blas.address = getAddress(mpDevice->getDevice(), blas.accelerationStructure);
+    }
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    vkCmdBuildAccelerationStructuresKHR(cmd, count(geometries), geometries.data(), ranges.data());
+
+    // Synchronize access to the scratch area with the next batch
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+        .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0,
+                         nullptr);
+    Helpers::cmdEnd(mpDevice, cmd);
+}
+
+void AccelerationStructure::finishBLASes()
+{
+    // BLASes rebuilt on their own in the meantime have been compacted already
+    if (mBLASFlags & VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) {
+        std::vector<BLAS*> blases;
+        for (auto& blas : mBLASes) {
+            if (blas.built && blas.accelerationStructure != VK_NULL_HANDLE && !blas.pBuffer) {
+                blases.push_back(&blas);
+            }
+        }
+        compactBLASes(blases, true);
+    }
+
+    // The scratch was sized for the largest batch, which the top level seldom needs. Later builds allocate again.
+    mpScratch.reset();
+}
+
+void AccelerationStructure::compactBLASes(const std::vector<BLAS*>& blases, bool shared)
+{
+    if (blases.empty()) {
+        return;
+    }
+
+    const uint32_t blasCount = count(blases);
+    std::vector<VkAccelerationStructureKHR> handles;
+    for (BLAS* blas : blases) {
+        handles.push_back(blas->accelerationStructure);
+    }
+
+    // The compacted sizes are only known once the builds are done
+    VkQueryPoolCreateInfo qci = {
+        .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR,
+        .queryCount = blasCount,
+    };
+    VkQueryPool queryPool;
+    Check::Vk(vkCreateQueryPool(mpDevice->getDevice(), &qci, nullptr, &queryPool));
 
-        blas->buildRange = {
-            .primitiveCount = pScene->getMeshIndexCount(meshIndex) / 3,
-            .primitiveOffset = 0,
-            .firstVertex = 0,
-            .transformOffset = 0,
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    vkCmdResetQueryPool(cmd, queryPool, 0, blasCount);
+
+    // The builds were submitted earlier, but their writes still have to be made visible to the query
+    VkMemoryBarrier barrier = {
+        .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+        .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
+        .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
+    };
+    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
+                         VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr, 0,
+                         nullptr);
+    vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, blasCount, handles.data(),
+                                                  VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, queryPool,
+                                                  0);
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    std::vector<VkDeviceSize> compactedSizes(blasCount);
+    Check::Vk(vkGetQueryPoolResults(mpDevice->getDevice(), queryPool, 0, blasCount,
+                                    sizeof(VkDeviceSize) * compactedSizes.size(), compactedSizes.data(),
+                                    sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT));
+    vkDestroyQueryPool(mpDevice->getDevice(), queryPool, nullptr);
+
+    VkDeviceSize uncompactedSize = 0;
+    VkDeviceSize compactedSize = 0;
+    std::vector<VkDeviceSize> offsets(blasCount);
+    for (uint32_t i = 0; i < blasCount; i++) {
+        uncompactedSize += Helpers::alignTo(blases[i]->buildInfo.size.accelerationStructureSize,
+                                            kAccelerationStructureAlignment);
+        offsets[i] = compactedSize;
+        compactedSize += Helpers::alignTo(compactedSizes[i], kAccelerationStructureAlignment);
+    }
+
+    ptr<Buffer> pSharedBuffer;
+    if (shared) {
+        pSharedBuffer =
+            make_ptr<Buffer>(mpDevice, compactedSize, kBLASBufferUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    std::vector<VkAccelerationStructureKHR> compacted(blasCount);
+    std::vector<ptr<Buffer>> buffers(blasCount);
+    cmd = Helpers::cmdBegin(mpDevice);
+    for (uint32_t i = 0; i < blasCount; i++) {
+        if (!shared) {
+            buffers[i] = make_ptr<Buffer>(mpDevice, compactedSizes[i], kBLASBufferUsage,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+
+        VkAccelerationStructureCreateInfoKHR ci = {
+            .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
+            .buffer = shared ? pSharedBuffer->getBuffer() : buffers[i]->getBuffer(),
+            .offset = shared ? offsets[i] : 0,
+            .size = compactedSizes[i],
+            .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
         };
+        Check::Vk(vkCreateAccelerationStructureKHR(mpDevice->getDevice(), &ci, nullptr, &compacted[i]));
 
-        blas->buildInfo = {
-            .geometry =
-                {
-                    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
-                    .type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR,
-                    .flags = flags,
-                    .mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
-                    .srcAccelerationStructure = VK_NULL_HANDLE,
-                    .geometryCount = 1,
-                    .pGeometries = &blas->geometry,
-                },
-            .size =
-                {
-                    .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR,
-                },
+        VkCopyAccelerationStructureInfoKHR copy = {
+            .sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR,
+            .src = handles[i],
+            .dst = compacted[i],
+            .mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR,
         };
+        vkCmdCopyAccelerationStructureKHR(cmd, &copy);
+    }
+    Helpers::cmdEnd(mpDevice, cmd);
 
-        vkGetAccelerationStructureBuildSizesKHR(mpDevice->getDevice(), VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
-                                                &blas->buildInfo.geometry, &blas->buildRange.primitiveCount,
-                                                &blas->buildInfo.size);
+    // The copies are done, so the storage the BLASes were built in can go
+    for (uint32_t i = 0; i < blasCount; i++) {
+        vkDestroyAccelerationStructureKHR(mpDevice->getDevice(), handles[i], nullptr);
+        blases[i]->accelerationStructure = compacted[i];
+        blases[i]->address = getAddress(mpDevice->getDevice(), compacted[i]);
+        blases[i]->pBuffer = buffers[i];
+    }
+    if (shared) {
+        mpBLASBuffer = pSharedBuffer;
+    }
 
-        scratchSize = std::max(scratchSize, blas->buildInfo.size.buildScratchSize);
-        totalAccelerationStructureSize +=
-            Helpers::alignTo(blas->buildInfo.size.accelerationStructureSize, ACCELERATION_STRUCTURE_ALIGNMENT);
+    Log::Info("Compacted {} BLASes from {:.1f} MB to {:.1f} MB", blasCount,
+              static_cast<double>(uncompactedSize) / (1024.0 * 1024.0),
+              static_cast<double>(compactedSize) / (1024.0 * 1024.0));
+}
 
-        blas->buildInfo.range = &blas->buildRange;
+void AccelerationStructure::reserveScratch(VkDeviceSize size)
+{
+    // Builds are given addresses aligned to the scratch offset alignment, counted from an aligned start, which the
+    // buffer itself is not guaranteed to have
+    const VkDeviceSize alignment =
+        mpDevice->getProperties().accelerationStructure.minAccelerationStructureScratchOffsetAlignment;
+    const VkDeviceSize paddedSize = std::max(size, VkDeviceSize(1)) + alignment - 1;
+    if (mpScratch && paddedSize <= mpScratch->getSize()) {
+        return;
+    }
+
+    mpScratch = make_ptr<Buffer>(mpDevice, paddedSize,
+                                 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mScratchAddress = Helpers::alignTo(mpScratch->getDeviceAddress(), alignment);
+}
+
+void AccelerationStructure::createBLASes(VkBuildAccelerationStructureFlagsKHR flags)
+{
+    VkDeviceSize totalAccelerationStructureSize = 0;
+
+    ptr<Scene> pScene = mwpScene.lock();
+    if (!pScene) {
+        Log::Error("Scene not valid for acceleration structure");
+    }
+
+    // Loop over the meshes in the scene
+    for (uint32_t meshIndex = 0; meshIndex < pScene->getMeshCount(); meshIndex++) {
+        BLAS& blas = mBLASes[meshIndex];
+        blas.accelerationStructure = VK_NULL_HANDLE;
+        blas.built = false;
+        blas.address = 0;
+
+        // Removed meshes leave an empty slot behind, as do meshes that share the geometry and BLAS of another
+        if (pScene->getMeshIndexCount(meshIndex) == 0 || pScene->getMeshGeometryIndex(meshIndex) != meshIndex) {
+            blas.revision = pScene->getMeshRevision(meshIndex);
+            continue;
+        }
+
+        describeBLAS(blas, pScene, meshIndex, flags);
+
+        totalAccelerationStructureSize +=
+            Helpers::alignTo(blas.buildInfo.size.accelerationStructureSize, kAccelerationStructureAlignment);
     }
 
     // Allocate buffer for BLASes
-    mpBLASBuffer = make_ptr<Buffer>(mpDevice, totalAccelerationStructureSize,
-                                    VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR |
-                                        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+    mpBLASBuffer = make_ptr<Buffer>(mpDevice, totalAccelerationStructureSize, kBLASBufferUsage,
                                     VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
     // Create acceleration structures
     VkDeviceSize offset = 0;
-    for (auto& blas : mBLASes) {
+    for (uint32_t meshIndex = 0; meshIndex < count(mBLASes); meshIndex++) {
+        BLAS& blas = mBLASes[meshIndex];
+        if (pScene->getMeshIndexCount(meshIndex) == 0 || pScene->getMeshGeometryIndex(meshIndex) != meshIndex) {
+            continue;
+        }
+
         VkAccelerationStructureCreateInfoKHR ci = {
             .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR,
             .buffer = mpBLASBuffer->getBuffer(),
@@ -138,108 +505,174 @@ void AccelerationStructure::createBLASes(VkBuildAccelerationStructureFlagsKHR fl
             .type = blas.buildInfo.geometry.type,
         };
 
-        offset += Helpers::alignTo(blas.buildInfo.size.accelerationStructureSize, ACCELERATION_STRUCTURE_ALIGNMENT);
+        offset += Helpers::alignTo(blas.buildInfo.size.accelerationStructureSize, kAccelerationStructureAlignment);
 
         Check::Vk(vkCreateAccelerationStructureKHR(mpDevice->getDevice(), &ci, nullptr, &blas.accelerationStructure));
     }
 
-    // Allocate scratch buffer
-    mpScratch = make_ptr<Buffer>(mpDevice, scratchSize,
-                                 VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    VkDeviceAddress scratchAddress = mpScratch->getDeviceAddress();
-
-    // Build acceleration structures in batches of 256 MB
-    uint32_t batchStart = 0;
-    uint32_t batchLength = 0;
-    VkDeviceSize batchSize = 0;
-    const VkDeviceSize batchMemoryLimit = 256'000'000;
-
-    for (uint32_t i = 0; i < count(mBLASes); i++) {
-        BLAS* blas = &mBLASes[i];
-
-        batchLength += 1;
-        batchSize += blas->buildInfo.size.accelerationStructureSize;
-
-        blas->buildInfo.geometry.dstAccelerationStructure = blas->accelerationStructure;
-        blas->buildInfo.geometry.scratchData.deviceAddress = scratchAddress;
-
-        if (batchSize >= batchMemoryLimit || i == count(mBLASes) - 1) {
-            VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
-            for (uint32_t j = batchStart; j < batchStart + batchLength; j++) {
-                BLAS* b = &mBLASes[j];
-                vkCmdBuildAccelerationStructuresKHR(cmd, 1, &b->buildInfo.geometry, &b->buildInfo.range);
-
-                // Synchronize access to the scratch area
-                VkMemoryBarrier barrier = {
-                    .sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER,
-                    .srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR,
-                    .dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR,
-                };
-                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR,
-                                     VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &barrier, 0, nullptr,
-                                     0, nullptr);
-            }
+    // Build in batches that fit the scratch budget, all now or, when building progressively, one per update()
+    std::vector<uint32_t> builds;
+    for (uint32_t meshIndex = 0; meshIndex < count(mBLASes); meshIndex++) {
+        if (mBLASes[meshIndex].accelerationStructure != VK_NULL_HANDLE) {
+            builds.push_back(meshIndex);
+        }
+    }
 
-            Helpers::cmdEnd(mpDevice, cmd);
+    auto batches = partitionBLASes(builds);
+    mPendingBatches.assign(batches.begin(), batches.end());
+    uint32_t batchCount = mDesc.progressive ? std::min(count(batches), 1u) : count(batches);
+    for (uint32_t i = 0; i < batchCount; i++) {
+        buildBLASBatch(mPendingBatches.front());
+        mPendingBatches.pop_front();
+    }
 
-            batchLength = 0;
-            batchSize = 0;
-            batchStart = i + 1;
-        }
+    if (mPendingBatches.empty()) {
+        finishBLASes();
     }
 }
 
-void AccelerationStructure::createTLAS(VkBuildAccelerationStructureFlagsKHR flags, bool update)
+bool AccelerationStructure::patchInstances(const ptr<Scene>& pScene, bool& activityChanged)
 {
-    ptr<Scene> pScene = mwpScene.lock();
-    if (!pScene) {
-        Log::Error("Scene not valid for acceleration structure");
+    auto& nodes = pScene->getNodes();
+
+    // Instances are laid out node after node, so a node that gained or lost meshes moves every instance after it
+    bool layoutChanged = nodes.size() != mNodeRecords.size();
+    for (uint32_t i = 0; i < count(mNodeRecords) && !layoutChanged; i++) {
+        layoutChanged = nodes[i].getMeshIndices() != mNodeRecords[i].meshIndices;
     }
 
-    uint32_t instanceCount = 0;
-    for (auto& node : pScene->getNodes()) {
-        instanceCount += count(node.getMeshIndices());
+    if (layoutChanged) {
+        mNodeRecords.resize(nodes.size());
+        uint32_t instanceCount = 0;
+        for (uint32_t i = 0; i < count(nodes); i++) {
+            mNodeRecords[i].firstInstance = instanceCount;
+            mNodeRecords[i].meshIndices = nodes[i].getMeshIndices();
+            instanceCount += count(mNodeRecords[i].meshIndices);
+        }
+
+        mInstances.assign(instanceCount, {});
+        mBounds.assign(instanceCount, {});
+        mBuildBounds.assign(instanceCount, {});
+        mInflations.assign(instanceCount, 0.0f);
+
+        // The builds that read the instance buffer are done, so it can be written in place or replaced
+        VkDeviceSize size = std::max(instanceCount, 1u) * sizeof(VkAccelerationStructureInstanceKHR);
+        if (!mpInstances || mpInstances->getSize() < size) {
+            mpInstances = make_ptr<Buffer>(mpDevice, size,
+                                           VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                                               VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+                                           VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        }
     }
 
-    auto instances = std::vector<VkAccelerationStructureInstanceKHR>(instanceCount);
-    uint32_t instanceIndex = 0;
-    for (auto& node : pScene->getNodes()) {
-        for (auto& meshIndex : node.getMeshIndices()) {
-            VkAccelerationStructureDeviceAddressInfoKHR addressInfo = {
-                .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR,
-                .accelerationStructure = mBLASes[meshIndex].accelerationStructure,
-            };
+    auto* pMappedInstances = static_cast<VkAccelerationStructureInstanceKHR*>(mpInstances->getHostMap());
+    mPatchedInstanceCount = 0;
+    for (uint32_t i = 0; i < count(nodes); i++) {
+        const Node& node = nodes[i];
+        NodeRecord& record = mNodeRecords[i];
+        uint8_t mask = node.getVisible() ? node.getRayMask() : 0x00;
+
+        // A node that was hidden and still is cannot be hit either way, so its changes wait until it is shown
+        bool nodeChanged = layoutChanged || (node.getRevision() != record.revision && (mask != 0 || record.mask != 0));
+
+        glm::mat4 nodeTransform = node.getTransform();
+        for (uint32_t j = 0; j < count(record.meshIndices); j++) {
+            uint32_t meshIndex = record.meshIndices[j];
+            uint32_t instanceIndex = record.firstInstance + j;
+            VkAccelerationStructureInstanceKHR& instance = mInstances[instanceIndex];
+
+            // An instance whose mesh has no built BLAS is kept but made inactive, so that the instance indices still
+            // line up with the scene's instance data. A mesh that shares the geometry of another uses that mesh's BLAS.
+            uint32_t geometryIndex = pScene->getMeshGeometryIndex(meshIndex);
+            VkDeviceAddress address = 0;
+            if (geometryIndex < count(mBLASes) && mBLASes[geometryIndex].built) {
+                address = mBLASes[geometryIndex].address;
+            }
 
-            VkDeviceAddress address = vkGetAccelerationStructureDeviceAddressKHR(mpDevice->getDevice(), &addressInfo);
+            // Instances of rebuilt or compacted BLASes have to follow them to their new addresses
+            if (!nodeChanged && instance.accelerationStructureReference == address) {
+                continue;
+            }
+            activityChanged |= (instance.accelerationStructureReference != 0) != (address != 0);
 
-            glm::mat4 nodeTransform = node.getTransform();
             VkTransformMatrixKHR transform;
-            for (int i = 0; i < 4; i++) {
-                transform.matrix[0][i] = nodeTransform[i].x;
-                transform.matrix[1][i] = nodeTransform[i].y;
-                transform.matrix[2][i] = nodeTransform[i].z;
+            for (int k = 0; k < 4; k++) {
+                transform.matrix[0][k] = nodeTransform[k].x;
+                transform.matrix[1][k] = nodeTransform[k].y;
+                transform.matrix[2][k] = nodeTransform[k].z;
             }
 
-            instances[instanceIndex] = {
+            // Visibility and ray masks only change the mask, which leaves the instance active and a refit possible
+            instance = {
                 .transform = transform,
                 .instanceCustomIndex = pScene->getMeshMaterialIndex(meshIndex),
-                .mask = node.getVisible() ? 0xffu : 0x00u,
+                .mask = address ? uint32_t(mask) : 0x00u,
                 .instanceShaderBindingTableRecordOffset = 0,
                 .flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR,
                 .accelerationStructureReference = address,
             };
+            pMappedInstances[instanceIndex] = instance;
+            mPatchedInstanceCount++;
+
+            // A refit grows the box the instance had at the last build to also hold where it is now, and the boxes
+            // above it with it
+            AABB bounds = {};
+            if (address) {
+                bounds = pScene->getMeshBoundingBox(meshIndex);
+                bounds.transform(nodeTransform);
+            }
+            mBounds[instanceIndex] = bounds;
+
+            float inflation = 0.0f;
+            if (!mBuildBounds[instanceIndex].empty()) {
+                AABB grown = mBuildBounds[instanceIndex];
+                grown.expand(bounds);
+                inflation = surfaceArea(grown) - surfaceArea(mBuildBounds[instanceIndex]);
+            }
+            mInflation += inflation - mInflations[instanceIndex];
+            mInflations[instanceIndex] = inflation;
+        }
 
-            instanceIndex += 1;
+        if (nodeChanged) {
+            record.revision = node.getRevision();
+            record.mask = mask;
         }
     }
 
-    VkDeviceSize size = instances.size() * sizeof(VkAccelerationStructureInstanceKHR);
-    mpInstances = make_ptr<Buffer>(mpDevice, size,
-                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
-                                       VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    mpInstances->copyFromHost(instances.data(), size, 0);
+    return layoutChanged;
+}
+
+void AccelerationStructure::createTLAS(VkBuildAccelerationStructureFlagsKHR flags, bool update)
+{
+    ptr<Scene> pScene = mwpScene.lock();
+    if (!pScene) {
+        Log::Error("Scene not valid for acceleration structure");
+    }
+
+    bool activityChanged = false;
+    bool layoutChanged = patchInstances(pScene, activityChanged);
+    if (update && mTLAS != nullptr && !layoutChanged && mPatchedInstanceCount == 0) {
+        return; // The top level is up to date
+    }
+
+    uint32_t instanceCount = count(mInstances);
+
+    // Refitting only works for the same set of active instances, and keeps the hierarchy of the last build, whose
+    // boxes loosen as instances move away from where they were built. Past the threshold a full build pays off.
+    update = update && mTLAS != nullptr && !layoutChanged && !activityChanged &&
+             mInflation <= mDesc.rebuildThreshold * mBuildArea;
+    if (update) {
+        mTLASRefitCount++;
+    } else {
+        mBuildBounds = mBounds;
+        mInflations.assign(instanceCount, 0.0f);
+        mInflation = 0.0f;
+        mBuildArea = 0.0f;
+        for (auto& bounds : mBuildBounds) {
+            mBuildArea += surfaceArea(bounds);
+        }
+        mTLASBuildCount++;
+    }
 
     VkDeviceOrHostAddressConstKHR deviceAddress = {.deviceAddress = mpInstances->getDeviceAddress()};
     VkAccelerationStructureGeometryInstancesDataKHR instanceData = {
@@ -257,7 +690,8 @@ void AccelerationStructure::createTLAS(VkBuildAccelerationStructureFlagsKHR flag
     mBuildInfo.geometry = {
         .sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR,
         .type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR,
-        .flags = flags | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
+        .flags = (flags & ~VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR) |
+                 VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR,
         .mode =
             update ? VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR : VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR,
         .srcAccelerationStructure = update ? mTLAS : VK_NULL_HANDLE,
@@ -272,7 +706,13 @@ void AccelerationStructure::createTLAS(VkBuildAccelerationStructureFlagsKHR flag
     vkGetAccelerationStructureBuildSizesKHR(mpDevice->getDevice(), VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR,
                                             &mBuildInfo.geometry, &instanceCount, &mBuildInfo.size);
 
-    if (mTLAS == nullptr || !update) {
+    // A full build can reuse the existing TLAS when it is large enough, which keeps its handle in any descriptors
+    if (mTLAS == nullptr || mBuildInfo.size.accelerationStructureSize > mTLASSize) {
+        if (mTLAS != nullptr) {
+            vkDeviceWaitIdle(mpDevice->getDevice());
+            vkDestroyAccelerationStructureKHR(mpDevice->getDevice(), mTLAS, nullptr);
+        }
+
         // Allocate buffer for the TLAS
         mpTLASBuffer =
             make_ptr<Buffer>(mpDevice, mBuildInfo.size.accelerationStructureSize,
@@ -289,18 +729,15 @@ void AccelerationStructure::createTLAS(VkBuildAccelerationStructureFlagsKHR flag
         };
 
         Check::Vk(vkCreateAccelerationStructureKHR(mpDevice->getDevice(), &ci, nullptr, &mTLAS));
+        mTLASSize = mBuildInfo.size.accelerationStructureSize;
     }
 
     // Create bigger scratch buffer if needed. The same buffer serves both build and update, so take the larger.
     VkDeviceSize scratchSize = std::max(mBuildInfo.size.buildScratchSize, mBuildInfo.size.updateScratchSize);
-    if (scratchSize > mpScratch->getSize()) {
-        VkBufferUsageFlags usage = mpScratch->getUsage();
-        VkMemoryPropertyFlags properties = mpScratch->getProperties();
-        mpScratch = make_ptr<Buffer>(mpDevice, scratchSize, usage, properties);
-    }
+    reserveScratch(scratchSize);
 
     mBuildInfo.geometry.dstAccelerationStructure = mTLAS;
-    mBuildInfo.geometry.scratchData.deviceAddress = mpScratch->getDeviceAddress();
+    mBuildInfo.geometry.scratchData.deviceAddress = mScratchAddress;
 
     mBuildRange = {
         .primitiveCount = instanceCount,
@@ -2,6 +2,7 @@
 
 #include "Common.h"
 
+#include "AABB.h"
 #include "Buffer.h"
 #include "Device.h"
 
@@ -14,11 +15,35 @@ namespace Mandrill
     };
 
     struct BLAS {
-        VkAccelerationStructureKHR accelerationStructure;
+        VkAccelerationStructureKHR accelerationStructure; // VK_NULL_HANDLE for a mesh without geometry
         VkAccelerationStructureGeometryKHR geometry;
         VkAccelerationStructureBuildRangeInfoKHR buildRange;
 
         AccelerationStructureBuildInfo buildInfo;
+
+        ptr<Buffer> pBuffer;     // Storage of a BLAS rebuilt on its own, empty if it lives in the shared BLAS buffer
+        uint32_t revision;       // Revision of the mesh geometry the BLAS was built from
+        bool built;              // False while the build waits for a later update(), which keeps its instances inactive
+        VkDeviceAddress address; // Address that instances reference once built, which changes when compacted
+    };
+
+    /// <summary>
+    /// Settings for how an acceleration structure builds its BLASes.
+    /// </summary>
+    struct AccelerationStructureDesc {
+        // Scratch memory that BLAS builds may use at once. BLASes are built in batches whose scratch fits, each batch
+        // with a single build command and every BLAS in its own part of the scratch, so that the device can build them
+        // in parallel. A BLAS that needs more than the budget gets a batch of its own.
+        VkDeviceSize scratchBudget = 256ull * 1024 * 1024;
+
+        // Build only the first batch in the constructor and one more per update() after that, so that rendering can
+        // start with a partial top level, in which the meshes whose BLASes are not built yet are inactive
+        bool progressive = false;
+
+        // Refit the top level as long as the moved instances have grown the surface area of the boxes it was built
+        // with by less than this fraction, and rebuild it from scratch after that. A refit keeps the hierarchy of
+        // the last build, whose boxes loosen the farther instances move from where they were built.
+        float rebuildThreshold = 0.5f;
     };
 
     // Forward declare Descriptor and Scene
@@ -35,12 +60,18 @@ namespace Mandrill
 
         /// <summary>
         /// Create a new acceleration structure.
+        ///
+        /// With VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR in the flags, every BLAS is copied into a
+        /// tightly packed buffer at its compacted size once built, and the buffer it was built in is freed. This
+        /// typically saves around half of the BLAS memory of a static scene, for a little more build time.
         /// </summary>
         /// <param name="pDevice">Device to use</param>
         /// <param name="wpScene">Scene to create the acceleration structure of</param>
         /// <param name="flags">Flags for building acceleration structure</param>
+        /// <param name="desc">Scratch budget and whether to build progressively</param>
         MANDRILL_API AccelerationStructure(ptr<Device> pDevice, std::weak_ptr<Scene> wpScene,
-                                           VkBuildAccelerationStructureFlagsKHR flags);
+                                           VkBuildAccelerationStructureFlagsKHR flags,
+                                           const AccelerationStructureDesc& desc = {});
 
         /// <summary>
         /// Destructor for acceleration structure.
@@ -48,10 +79,66 @@ namespace Mandrill
         MANDRILL_API ~AccelerationStructure();
 
         /// <summary>
-        /// Rebuild the top level of the acceleration structure to account for updates in instance transforms.
+        /// Bring the acceleration structure up to date with the scene.
+        ///
+        /// When building progressively, the next batch of BLASes is built first. The BLASes of meshes whose geometry
+        /// changed since they were built, as told by Scene::getMeshRevision(), are rebuilt on their own, as are those
+        /// of meshes added to the scene since, with the flags the acceleration structure was created with and
+        /// compacted if those allow it. The flags given here only apply to the top level.
+        ///
+        /// Only the instances of nodes whose revision changed, as told by Node::getRevision(), and of BLASes that
+        /// were rebuilt are written again, and the top level is left alone if there are none. Hidden nodes and ray
+        /// masks only change the masks of the instances, so they never force a rebuild, and a node that stays hidden
+        /// is not written at all until it is shown again. The top level is refit while the quality lost to moved
+        /// instances stays below the rebuild threshold, and rebuilt once it does not, if nodes gained or lost meshes,
+        /// or if instances became active or inactive. If the new top level does not fit where the old one was, it
+        /// gets a new handle and shaders need it attached again.
         /// </summary>
         MANDRILL_API void update(VkBuildAccelerationStructureFlagsKHR flags);
 
+        /// <summary>
+        /// Check if every BLAS has been built, which is only not the case while building progressively.
+        /// </summary>
+        /// <returns>True if the top level holds every mesh, otherwise false</returns>
+        MANDRILL_API bool isComplete() const
+        {
+            return mPendingBatches.empty();
+        }
+
+        /// <summary>
+        /// Get the number of times the top level has been built from scratch.
+        /// </summary>
+        /// <returns>Number of builds</returns>
+        MANDRILL_API uint32_t getTLASBuildCount() const
+        {
+            return mTLASBuildCount;
+        }
+
+        /// <summary>
+        /// Get the number of times the top level has been refit.
+        /// </summary>
+        /// <returns>Number of refits</returns>
+        MANDRILL_API uint32_t getTLASRefitCount() const
+        {
+            return mTLASRefitCount;
+        }
+
+        /// <summary>
+        /// Get the number of instances written in the last update.
+        /// </summary>
+        /// <returns>Number of instances</returns>
+        MANDRILL_API uint32_t getPatchedInstanceCount() const
+        {
+            return mPatchedInstanceCount;
+        }
+
+        /// <summary>
+        /// Get the device memory held by the BLASes, including parts of the shared BLAS buffer left unused by BLASes
+        /// that were rebuilt on their own.
+        /// </summary>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API VkDeviceSize getBLASMemorySize() const;
+
         /// <summary>
         /// Get the TLAS acceleration structure handle.
         /// </summary>
@@ -88,24 +175,90 @@ namespace Mandrill
 
     private:
         /// <summary>
-        /// Create the bottom levels of the acceleration structure. One BLAS per node in scene.
+        /// Create the bottom levels of the acceleration structure. One BLAS per mesh with geometry of its own, which
+        /// the instances of every mesh that shares the geometry reference.
         /// </summary>
         /// <param name="flags">Flags to set the build mode</param>
         /// <returns></returns>
         MANDRILL_API void createBLASes(VkBuildAccelerationStructureFlagsKHR flags);
 
         /// <summary>
-        /// Create the top level of the acceleration structure.
+        /// Fill in how to build the BLAS of a mesh and query its sizes.
         /// </summary>
+        /// <param name="blas">BLAS to describe</param>
+        /// <param name="pScene">Scene the mesh belongs to</param>
+        /// <param name="meshIndex">Index of the mesh in the scene</param>
         /// <param name="flags">Flags to set the build mode</param>
-        /// <param name="update">Update to rebuild TLAS with updated matrices</param>
+        MANDRILL_API void describeBLAS(BLAS& blas, const ptr<Scene>& pScene, uint32_t meshIndex,
+                                       VkBuildAccelerationStructureFlagsKHR flags);
+
+        /// <summary>
+        /// Rebuild the BLASes of some meshes, each into storage of its own, with the flags of the initial build.
+        /// </summary>
+        /// <param name="meshIndices">Indices of the meshes whose BLASes to rebuild</param>
+        MANDRILL_API void rebuildBLASes(const std::vector<uint32_t>& meshIndices);
+
+        /// <summary>
+        /// Split BLASes into batches whose scratch fits the scratch budget.
+        /// </summary>
+        /// <param name="meshIndices">Indices of the meshes whose BLASes to build</param>
+        /// <returns>Mesh indices of each batch</returns>
+        MANDRILL_API std::vector<std::vector<uint32_t>> partitionBLASes(const std::vector<uint32_t>& meshIndices) const;
+
+        /// <summary>
+        /// Build a batch of described and created BLASes with one build command, each in its own part of the scratch.
+        /// </summary>
+        /// <param name="meshIndices">Indices of the meshes whose BLASes to build</param>
+        MANDRILL_API void buildBLASBatch(const std::vector<uint32_t>& meshIndices);
+
+        /// <summary>
+        /// Compact the BLASes in the shared BLAS buffer if the flags allow it, and release the scratch, once the last
+        /// batch of the initial build is done.
+        /// </summary>
+        MANDRILL_API void finishBLASes();
+
+        /// <summary>
+        /// Copy built BLASes into storage of their compacted sizes and free the storage they were built in. The BLASes
+        /// must have been built with VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR.
+        /// </summary>
+        /// <param name="blases">BLASes to compact</param>
+        /// <param name="shared">Pack the compacted BLASes into a new shared BLAS buffer, instead of one each</param>
+        MANDRILL_API void compactBLASes(const std::vector<BLAS*>& blases, bool shared);
+
+        /// <summary>
+        /// Make sure the scratch buffer holds at least a given size from mScratchAddress on.
+        /// </summary>
+        /// <param name="size">Required size in bytes</param>
+        MANDRILL_API void reserveScratch(VkDeviceSize size);
+
+        /// <summary>
+        /// Write the instances that changed since the last update into the instance buffer, and all of them if the
+        /// nodes gained or lost meshes.
+        /// </summary>
+        /// <param name="pScene">Scene to take the instances from</param>
+        /// <param name="activityChanged">Set to true if an instance became active or inactive</param>
+        /// <returns>Whether the layout of the instances changed</returns>
+        MANDRILL_API bool patchInstances(const ptr<Scene>& pScene, bool& activityChanged);
+
+        /// <summary>
+        /// Create the top level of the acceleration structure, or bring it up to date.
+        /// </summary>
+        /// <param name="flags">Flags to set the build mode</param>
+        /// <param name="update">Allow a refit instead of a full build</param>
         /// <returns></returns>
         MANDRILL_API void createTLAS(VkBuildAccelerationStructureFlagsKHR flags, bool update = false);
 
         ptr<Device> mpDevice;
         std::weak_ptr<Scene> mwpScene; // Use weak pointer to scene so scene can destruct freely
 
+        AccelerationStructureDesc mDesc;
+        VkBuildAccelerationStructureFlagsKHR mBLASFlags; // Flags of the initial build, for its compaction and rebuilds
+
+        // Batches of the initial build still to run when building progressively
+        std::deque<std::vector<uint32_t>> mPendingBatches;
+
         VkAccelerationStructureKHR mTLAS;
+        VkDeviceSize mTLASSize = 0;
         VkAccelerationStructureGeometryKHR mGeometry;
         VkAccelerationStructureBuildRangeInfoKHR mBuildRange;
 
@@ -116,6 +269,29 @@ namespace Mandrill
         ptr<Buffer> mpBLASBuffer;
         ptr<Buffer> mpTLASBuffer;
         ptr<Buffer> mpScratch;
-        ptr<Buffer> mpInstances;
+        VkDeviceAddress mScratchAddress = 0; // Start of the scratch, aligned for builds
+        ptr<Buffer> mpInstances; // Host visible, so that single instances can be written in place
+
+        // Where the instances of each node start, and what they were written from
+        struct NodeRecord {
+            uint32_t firstInstance;
+            uint32_t revision;
+            uint8_t mask;
+            std::vector<uint32_t> meshIndices;
+        };
+        std::vector<NodeRecord> mNodeRecords;
+
+        // Host copy of the instance buffer, with the world space box of each instance now and at the last full build,
+        // and how much its move since has grown the surface area of the box it was built with
+        std::vector<VkAccelerationStructureInstanceKHR> mInstances;
+        std::vector<AABB> mBounds;
+        std::vector<AABB> mBuildBounds;
+        std::vector<float> mInflations;
+        float mBuildArea = 0.0f;
+        float mInflation = 0.0f;
+
+        uint32_t mTLASBuildCount = 0;
+        uint32_t mTLASRefitCount = 0;
+        uint32_t mPatchedInstanceCount = 0;
     };
 } // namespace Mandrill
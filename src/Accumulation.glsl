@@ -0,0 +1,104 @@
+// Progressive accumulation with the Accumulator. Define ACCUMULATION_SET and ACCUMULATION_BINDING before including
+// this file, which declares four resources at consecutive bindings from there, and attach them with
+// Accumulator::attach(). Define ACCUMULATION_BUFFERS_ONLY as well to declare only the two tile buffers.
+//
+// A shader that samples pixels calls accumulateSample() once per new sample and shows accumulatedMean(). Ray
+// generation shaders launched with Accumulator::getTraceRaysIndirectAddress() find their pixel with
+// accumulationLaunchPixel(), while shaders that run for every pixel skip the ones whose tile was not scheduled with
+// accumulationScheduled().
+
+// Must match Accumulator::kTileSize
+#define ACCUMULATION_TILE_SIZE 16
+
+// Most workgroups along x that every device can dispatch, beyond which the tiles of a dispatch continue along y
+#define ACCUMULATION_MAX_DISPATCH_X 65535u
+
+// Must match AccumulationTileHeader in Accumulator.cpp
+struct AccumulationTileHeader {
+    uint dispatchX;      // VkDispatchIndirectCommand, one workgroup per scheduled tile, in rows along y
+    uint dispatchY;
+    uint dispatchZ;
+    uint traceWidth;     // VkTraceRaysIndirectCommandKHR, one tile per layer of the launch
+    uint traceHeight;
+    uint traceDepth;
+    uint scheduledCount; // Tiles in the list
+    uint convergedCount; // Tiles that need no more samples
+};
+
+// Must match AccumulationTileState in Accumulator.cpp
+struct AccumulationTileState {
+    float error;     // Root mean square of the relative standard error of the pixels
+    uint minCount;   // Fewest samples of any pixel in the tile
+    uint scheduled;  // Whether the tile is in this frame's list
+    uint _pad0;
+};
+
+// Tiles to sample this frame, each packed as x | y << 16
+layout(std430, set = ACCUMULATION_SET, binding = ACCUMULATION_BINDING + 0) buffer AccumulationTiles {
+    AccumulationTileHeader accumulationHeader;
+    uint accumulationTiles[];
+};
+
+layout(std430, set = ACCUMULATION_SET, binding = ACCUMULATION_BINDING + 1) buffer AccumulationTileStates {
+    AccumulationTileState accumulationTileStates[];
+};
+
+#ifndef ACCUMULATION_BUFFERS_ONLY
+// Running mean in rgb and sample count in a, and the sum of squared differences from the mean of the luminance
+layout(set = ACCUMULATION_SET, binding = ACCUMULATION_BINDING + 2, rgba32f) uniform image2D accumulationMean;
+layout(set = ACCUMULATION_SET, binding = ACCUMULATION_BINDING + 3, r32f) uniform image2D accumulationMoments;
+#endif
+
+float accumulationLuminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+ivec2 accumulationUnpackTile(uint packedTile)
+{
+    return ivec2(packedTile & 0xffffu, packedTile >> 16);
+}
+
+// Pixel of an invocation of a launch of ACCUMULATION_TILE_SIZE x ACCUMULATION_TILE_SIZE x scheduled tiles
+ivec2 accumulationLaunchPixel(uvec3 launchID)
+{
+    return accumulationUnpackTile(accumulationTiles[launchID.z]) * ACCUMULATION_TILE_SIZE + ivec2(launchID.xy);
+}
+
+#ifndef ACCUMULATION_BUFFERS_ONLY
+bool accumulationScheduled(ivec2 pixel)
+{
+    ivec2 tile = pixel / ACCUMULATION_TILE_SIZE;
+    int tileCountX = (imageSize(accumulationMean).x + ACCUMULATION_TILE_SIZE - 1) / ACCUMULATION_TILE_SIZE;
+    return accumulationTileStates[tile.y * tileCountX + tile.x].scheduled != 0u;
+}
+
+vec3 accumulatedMean(ivec2 pixel)
+{
+    return imageLoad(accumulationMean, pixel).rgb;
+}
+
+uint accumulatedCount(ivec2 pixel)
+{
+    return uint(imageLoad(accumulationMean, pixel).a);
+}
+
+// Welford's update of the mean and of the squared differences, which stays accurate over many samples where a sum of
+// squares would not. Returns the new mean.
+vec3 accumulateSample(ivec2 pixel, vec3 value)
+{
+    vec4 mean = imageLoad(accumulationMean, pixel);
+    float m2 = imageLoad(accumulationMoments, pixel).r;
+
+    float count = mean.a + 1.0;
+    float luminance = accumulationLuminance(value);
+    float delta = luminance - accumulationLuminance(mean.rgb);
+    mean.rgb += (value - mean.rgb) / count;
+    m2 += delta * (luminance - accumulationLuminance(mean.rgb));
+    mean.a = count;
+
+    imageStore(accumulationMean, pixel, mean);
+    imageStore(accumulationMoments, pixel, vec4(m2));
+    return mean.rgb;
+}
+#endif
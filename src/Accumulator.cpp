@@ -0,0 +1,301 @@
+#include "Accumulator.h"
+
+#include "Error.h"
+#include "Helpers.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    // Must match AccumulationTileHeader in Accumulation.glsl
+    struct AccumulationTileHeader {
+        VkDispatchIndirectCommand dispatch;
+        VkTraceRaysIndirectCommandKHR traceRays;
+        uint32_t scheduledCount;
+        uint32_t convergedCount;
+    };
+    static_assert(sizeof(AccumulationTileHeader) == 32, "AccumulationTileHeader must match Accumulation.glsl");
+
+    // Must match AccumulationTileState in Accumulation.glsl
+    struct AccumulationTileState {
+        float error;
+        uint32_t minCount;
+        uint32_t scheduled;
+        uint32_t pad0;
+    };
+
+    struct CompactPushConstant {
+        uint32_t tileCountX;
+        uint32_t tileCount;
+        uint32_t maxScheduled;
+        uint32_t start;
+        uint32_t minSampleCount;
+        uint32_t maxSampleCount;
+        float errorThreshold;
+    };
+
+    // How quickly the number of scheduled tiles follows the frame time budget. Lower is steadier, since the cost of
+    // a tile varies with what it shows.
+    constexpr float kBudgetSmoothing = 0.25f;
+} // namespace
+
+Accumulator::Accumulator(ptr<Device> pDevice, uint32_t width, uint32_t height, const AccumulatorDesc& desc)
+    : mpDevice(pDevice), mDesc(desc), mWidth(width), mHeight(height)
+{
+    mTileCountX = (mWidth + kTileSize - 1) / kTileSize;
+    mTileCountY = (mHeight + kTileSize - 1) / kTileSize;
+    mTileBudget = static_cast<float>(getTileCount());
+
+    mpMean = make_ptr<Image>(mpDevice, mWidth, mHeight, 1, 1, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32G32B32A32_SFLOAT,
+                             VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                             VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+    mpMean->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+    mpMoments = make_ptr<Image>(mpDevice, mWidth, mHeight, 1, 1, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_SFLOAT,
+                                VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT,
+                                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+    mpMoments->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+    // The list is read as launch arguments by indirect dispatches and indirect ray traces
+    VkDeviceSize tilesSize = sizeof(AccumulationTileHeader) + sizeof(uint32_t) * getTileCount();
+    mpTiles = make_ptr<Buffer>(mpDevice, tilesSize,
+                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT |
+                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT |
+                                   VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mpTileStates = make_ptr<Buffer>(mpDevice, sizeof(AccumulationTileState) * getTileCount(),
+                                    VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mpStatistics = make_ptr<Buffer>(mpDevice, sizeof(Statistics) * mpDevice->getFramesInFlightCount(),
+                                    VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::memset(mpStatistics->getHostMap(), 0, mpStatistics->getSize());
+
+    std::vector<ShaderDesc> shaderDesc;
+    shaderDesc.emplace_back("Mandrill/AccumulateTiles.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpEvaluateShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpEvaluatePipeline = make_ptr<ComputePipeline>(mpDevice, mpEvaluateShader);
+
+    shaderDesc.clear();
+    shaderDesc.emplace_back("Mandrill/AccumulateCompact.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpCompactShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpCompactPipeline = make_ptr<ComputePipeline>(mpDevice, mpCompactShader);
+
+    std::vector<DescriptorDesc> desc;
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, mpTiles);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, mpTileStates);
+    mpCompactDescriptor = make_ptr<Descriptor>(mpDevice, desc, mpCompactShader->getDescriptorSetLayout(0));
+
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, mpMean);
+    desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, mpMoments);
+    desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    mpEvaluateDescriptor = make_ptr<Descriptor>(mpDevice, desc, mpEvaluateShader->getDescriptorSetLayout(0));
+
+    // The frame time budget needs timestamps, which not every device can write on every queue
+    const VkPhysicalDeviceLimits& limits = mpDevice->getProperties().physicalDevice.limits;
+    if (limits.timestampComputeAndGraphics) {
+        VkQueryPoolCreateInfo ci = {
+            .sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+            .queryType = VK_QUERY_TYPE_TIMESTAMP,
+            .queryCount = 2 * mpDevice->getFramesInFlightCount(),
+        };
+        Check::Vk(vkCreateQueryPool(mpDevice->getDevice(), &ci, nullptr, &mQueryPool));
+        mTimestampPeriod = limits.timestampPeriod;
+    } else {
+        Log::Warning("The device cannot write timestamps on every queue, so the accumulator ignores the frame time "
+                     "budget");
+    }
+    mQueriesWritten.resize(mpDevice->getFramesInFlightCount(), false);
+
+    // The images stay in the general layout from here on, and the first prepare() clears them
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    for (auto& pImage : {mpMean, mpMoments}) {
+        Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                              VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_READ_BIT,
+                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    }
+    vkCmdFillBuffer(cmd, mpTiles->getBuffer(), 0, VK_WHOLE_SIZE, 0);
+    Helpers::cmdEnd(mpDevice, cmd);
+}
+
+Accumulator::~Accumulator()
+{
+    Check::Vk(vkDeviceWaitIdle(mpDevice->getDevice()));
+
+    if (mQueryPool) {
+        vkDestroyQueryPool(mpDevice->getDevice(), mQueryPool, nullptr);
+    }
+}
+
+void Accumulator::prepare(VkCommandBuffer cmd)
+{
+    uint32_t frame = mpDevice->getFrameInFlightIndex();
+
+    // The frame that last used this frame in flight has finished, so its counts and timestamps can be read
+    const Statistics& statistics = static_cast<const Statistics*>(mpStatistics->getHostMap())[frame];
+    mScheduledTileCount = statistics.scheduledCount;
+    mConvergedTileCount = statistics.convergedCount;
+
+    if (mQueriesWritten[frame]) {
+        std::array<uint64_t, 2> timestamps;
+        VkResult result = vkGetQueryPoolResults(mpDevice->getDevice(), mQueryPool, 2 * frame, 2, sizeof(timestamps),
+                                                timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result == VK_SUCCESS) {
+            mSampleTime = static_cast<float>(timestamps[1] - timestamps[0]) * mTimestampPeriod * 1e-6f;
+        }
+    }
+    updateTileBudget();
+
+    if (mQueryPool) {
+        vkCmdResetQueryPool(cmd, mQueryPool, 2 * frame, 2);
+        mQueriesWritten[frame] = false;
+    }
+
+    // Last frame's samples have to land, and its launches have to be done with the list, before either changes
+    barrier(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_MEMORY_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT |
+                VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            VK_ACCESS_2_MEMORY_READ_BIT | VK_ACCESS_2_MEMORY_WRITE_BIT);
+
+    if (mResetPending) {
+        // Every tile starts out with no samples, which schedules all of them
+        VkClearColorValue clearColor = {};
+        VkImageSubresourceRange range = {
+            .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+            .baseMipLevel = 0,
+            .levelCount = 1,
+            .baseArrayLayer = 0,
+            .layerCount = 1,
+        };
+        vkCmdClearColorImage(cmd, mpMean->getImage(), VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &range);
+        vkCmdClearColorImage(cmd, mpMoments->getImage(), VK_IMAGE_LAYOUT_GENERAL, &clearColor, 1, &range);
+        vkCmdFillBuffer(cmd, mpTileStates->getBuffer(), 0, VK_WHOLE_SIZE, 0);
+
+        barrier(cmd, VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+        mResetPending = false;
+        mFrameCount = 0;
+    } else {
+        // Only the tiles sampled last frame can have changed, so only they are evaluated
+        mpEvaluatePipeline->bind(cmd);
+        mpEvaluateDescriptor->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpEvaluatePipeline->getLayout(), 0);
+        vkCmdDispatchIndirect(cmd, mpTiles->getBuffer(), offsetof(AccumulationTileHeader, dispatch));
+
+        barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT,
+                VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+    }
+
+    // Take turns over the tiles when the budget does not cover all of them, so that none is starved
+    uint32_t maxScheduled = static_cast<uint32_t>(mTileBudget);
+    CompactPushConstant pushConstant = {
+        .tileCountX = mTileCountX,
+        .tileCount = getTileCount(),
+        .maxScheduled = maxScheduled,
+        .start = static_cast<uint32_t>((static_cast<uint64_t>(mFrameCount) * maxScheduled) % getTileCount()),
+        .minSampleCount = std::max(mDesc.minSampleCount, 2u),
+        .maxSampleCount = mDesc.maxSampleCount,
+        .errorThreshold = mDesc.errorThreshold,
+    };
+
+    mpCompactPipeline->bind(cmd);
+    mpCompactDescriptor->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpCompactPipeline->getLayout(), 0);
+    vkCmdPushConstants(cmd, mpCompactPipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(CompactPushConstant), &pushConstant);
+    mpCompactPipeline->dispatchGroups(cmd, 1);
+
+    barrier(cmd, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+            VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT,
+            VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+            VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_READ_BIT |
+                VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_TRANSFER_READ_BIT);
+
+    // Keep the counts for when this frame in flight comes around again
+    VkBufferCopy region = {
+        .srcOffset = offsetof(AccumulationTileHeader, scheduledCount),
+        .dstOffset = sizeof(Statistics) * frame,
+        .size = sizeof(Statistics),
+    };
+    vkCmdCopyBuffer(cmd, mpTiles->getBuffer(), mpStatistics->getBuffer(), 1, &region);
+    Helpers::bufferBarrier(cmd, mpStatistics->getBuffer(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                           VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_HOST_BIT, VK_ACCESS_2_HOST_READ_BIT);
+
+    mFrameCount++;
+}
+
+void Accumulator::beginSamples(VkCommandBuffer cmd)
+{
+    if (mQueryPool) {
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, mQueryPool,
+                             2 * mpDevice->getFrameInFlightIndex());
+    }
+}
+
+void Accumulator::endSamples(VkCommandBuffer cmd)
+{
+    if (mQueryPool) {
+        uint32_t frame = mpDevice->getFrameInFlightIndex();
+        vkCmdWriteTimestamp2(cmd, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, mQueryPool, 2 * frame + 1);
+        mQueriesWritten[frame] = true;
+    }
+}
+
+void Accumulator::reset()
+{
+    mResetPending = true;
+}
+
+void Accumulator::attach(ptr<Shader> pShader) const
+{
+    // Resources that the shader never touches may have been left out when it was compiled
+    if (pShader->hasResource("AccumulationTiles")) {
+        pShader->setResource("AccumulationTiles", mpTiles);
+    }
+    if (pShader->hasResource("AccumulationTileStates")) {
+        pShader->setResource("AccumulationTileStates", mpTileStates);
+    }
+    if (pShader->hasResource("accumulationMean")) {
+        pShader->setResource("accumulationMean", mpMean, VK_IMAGE_LAYOUT_GENERAL);
+    }
+    if (pShader->hasResource("accumulationMoments")) {
+        pShader->setResource("accumulationMoments", mpMoments, VK_IMAGE_LAYOUT_GENERAL);
+    }
+}
+
+VkDeviceAddress Accumulator::getTraceRaysIndirectAddress() const
+{
+    return mpTiles->getDeviceAddress() + offsetof(AccumulationTileHeader, traceRays);
+}
+
+void Accumulator::updateTileBudget()
+{
+    const float tileCount = static_cast<float>(getTileCount());
+
+    if (mDesc.frameTimeBudget <= 0.0f || !mQueryPool) {
+        mTileBudget = tileCount;
+        return;
+    }
+
+    // The time per tile of a finished frame tells how many tiles fit in the budget
+    if (mSampleTime > 0.0f && mScheduledTileCount > 0) {
+        float tileTime = mSampleTime / static_cast<float>(mScheduledTileCount);
+        float target = mDesc.frameTimeBudget / tileTime;
+        mTileBudget += (target - mTileBudget) * kBudgetSmoothing;
+    }
+
+    mTileBudget = std::clamp(mTileBudget, 1.0f, tileCount);
+}
+
+void Accumulator::barrier(VkCommandBuffer cmd, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess,
+                          VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess)
+{
+    for (auto& pImage : {mpMean, mpMoments}) {
+        Helpers::imageBarrier(cmd, pImage->getImage(), srcStage, srcAccess, dstStage, dstAccess,
+                              VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+    }
+    for (auto& pBuffer : {mpTiles, mpTileStates}) {
+        Helpers::bufferBarrier(cmd, pBuffer->getBuffer(), srcStage, srcAccess, dstStage, dstAccess);
+    }
+}
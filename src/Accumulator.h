@@ -0,0 +1,281 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "ComputePipeline.h"
+#include "Descriptor.h"
+#include "Device.h"
+#include "Image.h"
+#include "Shader.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Settings for an accumulator. They can be changed between frames with the setters of Accumulator.
+    /// </summary>
+    struct AccumulatorDesc {
+        // Samples every pixel of a tile gets before the tile may be considered converged
+        uint32_t minSampleCount = 8;
+
+        // Samples after which a tile is considered converged whatever its error, 0 for no limit
+        uint32_t maxSampleCount = 0;
+
+        // Root mean square of the relative standard error of the pixels of a tile below which it is converged
+        float errorThreshold = 0.01f;
+
+        // Device time in milliseconds that the sampling between beginSamples() and endSamples() may take, which
+        // limits the number of tiles scheduled per frame. 0 schedules every tile that has not converged.
+        float frameTimeBudget = 0.0f;
+    };
+
+    /// <summary>
+    /// Progressive accumulation with adaptive sampling. The accumulator keeps a running mean and variance per pixel
+    /// in storage images, estimates per tile of kTileSize x kTileSize pixels how far the mean is from converging,
+    /// and makes a compacted list of the tiles that still need samples. The list drives the next frame's sampling,
+    /// so the device spends its time where the noise is.
+    ///
+    /// Every frame, call prepare() before sampling, outside of any render pass. It evaluates the tiles sampled in
+    /// the previous frame and schedules the ones to sample in this one. Shaders include Mandrill/Accumulation.glsl,
+    /// get the accumulator's resources with attach(), and either launch rays with
+    /// getTraceRaysIndirectAddress(), one tile per layer of the launch, or skip the pixels of tiles that were not
+    /// scheduled. Wrap the sampling in beginSamples() and endSamples() to let a frame time budget limit how many
+    /// tiles are scheduled.
+    ///
+    /// The images stay in VK_IMAGE_LAYOUT_GENERAL. The mean image holds the running mean in rgb and the sample count
+    /// in a, and the moments image the sum of squared differences from the mean of the luminance, updated with
+    /// Welford's method.
+    /// </summary>
+    class Accumulator
+    {
+    public:
+        MANDRILL_NON_COPYABLE(Accumulator)
+
+        /// <summary>
+        /// Width and height of a tile in pixels, which must match ACCUMULATION_TILE_SIZE in Accumulation.glsl.
+        /// </summary>
+        static constexpr uint32_t kTileSize = 16;
+
+        /// <summary>
+        /// Create a new accumulator.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="width">Width of the accumulated image</param>
+        /// <param name="height">Height of the accumulated image</param>
+        /// <param name="desc">Convergence criteria and frame time budget</param>
+        MANDRILL_API Accumulator(ptr<Device> pDevice, uint32_t width, uint32_t height,
+                                 const AccumulatorDesc& desc = {});
+
+        /// <summary>
+        /// Destructor for accumulator.
+        /// </summary>
+        MANDRILL_API ~Accumulator();
+
+        /// <summary>
+        /// Record the evaluation of the tiles sampled in the previous frame and the scheduling of the tiles to sample
+        /// in this one, or the clearing of the accumulation if reset() has been called since. Call once per frame
+        /// after waiting for the frame in flight, outside of any render pass. The resources are made visible to
+        /// every later stage, and the launch arguments to indirect commands.
+        /// </summary>
+        /// <param name="cmd">Command buffer to use</param>
+        MANDRILL_API void prepare(VkCommandBuffer cmd);
+
+        /// <summary>
+        /// Record the start of the sampling whose device time counts against the frame time budget.
+        /// </summary>
+        /// <param name="cmd">Command buffer to use</param>
+        MANDRILL_API void beginSamples(VkCommandBuffer cmd);
+
+        /// <summary>
+        /// Record the end of the sampling whose device time counts against the frame time budget.
+        /// </summary>
+        /// <param name="cmd">Command buffer to use</param>
+        MANDRILL_API void endSamples(VkCommandBuffer cmd);
+
+        /// <summary>
+        /// Start the accumulation over, for instance when the camera or the scene has changed. The images are
+        /// cleared by the next prepare().
+        /// </summary>
+        MANDRILL_API void reset();
+
+        /// <summary>
+        /// Attach the images and buffers to a shader that includes Accumulation.glsl. Resources that the shader does
+        /// not use are skipped.
+        /// </summary>
+        /// <param name="pShader">Shader to attach the resources to</param>
+        MANDRILL_API void attach(ptr<Shader> pShader) const;
+
+        /// <summary>
+        /// Get the address of the VkTraceRaysIndirectCommandKHR that launches kTileSize x kTileSize x scheduled
+        /// tiles rays, for vkCmdTraceRaysIndirectKHR().
+        /// </summary>
+        /// <returns>Device address of the launch arguments</returns>
+        MANDRILL_API VkDeviceAddress getTraceRaysIndirectAddress() const;
+
+        /// <summary>
+        /// Get the image holding the running mean in rgb and the sample count in a.
+        /// </summary>
+        /// <returns>Pointer to image</returns>
+        MANDRILL_API ptr<Image> getMeanImage() const
+        {
+            return mpMean;
+        }
+
+        /// <summary>
+        /// Get the image holding the sum of squared differences from the mean of the luminance.
+        /// </summary>
+        /// <returns>Pointer to image</returns>
+        MANDRILL_API ptr<Image> getMomentsImage() const
+        {
+            return mpMoments;
+        }
+
+        /// <summary>
+        /// Get the buffer with the launch arguments followed by the list of scheduled tiles.
+        /// </summary>
+        /// <returns>Pointer to buffer</returns>
+        MANDRILL_API ptr<Buffer> getTileBuffer() const
+        {
+            return mpTiles;
+        }
+
+        /// <summary>
+        /// Get the number of tiles the image is divided into.
+        /// </summary>
+        /// <returns>Number of tiles</returns>
+        MANDRILL_API uint32_t getTileCount() const
+        {
+            return mTileCountX * mTileCountY;
+        }
+
+        /// <summary>
+        /// Get the number of tiles scheduled in the last frame that the device has finished.
+        /// </summary>
+        /// <returns>Number of tiles</returns>
+        MANDRILL_API uint32_t getScheduledTileCount() const
+        {
+            return mScheduledTileCount;
+        }
+
+        /// <summary>
+        /// Get the number of tiles that had converged in the last frame that the device has finished.
+        /// </summary>
+        /// <returns>Number of tiles</returns>
+        MANDRILL_API uint32_t getConvergedTileCount() const
+        {
+            return mConvergedTileCount;
+        }
+
+        /// <summary>
+        /// Get the device time the sampling took in the last frame that the device has finished.
+        /// </summary>
+        /// <returns>Time in milliseconds, or 0 if it has not been measured</returns>
+        MANDRILL_API float getSampleTime() const
+        {
+            return mSampleTime;
+        }
+
+        /// <summary>
+        /// Get the number of frames accumulated since the last reset.
+        /// </summary>
+        /// <returns>Number of frames</returns>
+        MANDRILL_API uint32_t getFrameCount() const
+        {
+            return mFrameCount;
+        }
+
+        /// <summary>
+        /// Get the settings in use.
+        /// </summary>
+        /// <returns>Settings</returns>
+        MANDRILL_API const AccumulatorDesc& getDesc() const
+        {
+            return mDesc;
+        }
+
+        /// <summary>
+        /// Set the samples every pixel of a tile gets before the tile may be considered converged.
+        /// </summary>
+        /// <param name="count">Number of samples</param>
+        MANDRILL_API void setMinSampleCount(uint32_t count)
+        {
+            mDesc.minSampleCount = count;
+        }
+
+        /// <summary>
+        /// Set the samples after which a tile is considered converged whatever its error.
+        /// </summary>
+        /// <param name="count">Number of samples, 0 for no limit</param>
+        MANDRILL_API void setMaxSampleCount(uint32_t count)
+        {
+            mDesc.maxSampleCount = count;
+        }
+
+        /// <summary>
+        /// Set the relative error below which a tile is considered converged.
+        /// </summary>
+        /// <param name="threshold">Root mean square of the relative standard error of the pixels</param>
+        MANDRILL_API void setErrorThreshold(float threshold)
+        {
+            mDesc.errorThreshold = threshold;
+        }
+
+        /// <summary>
+        /// Set the device time that the sampling may take.
+        /// </summary>
+        /// <param name="milliseconds">Time in milliseconds, 0 to schedule every tile that has not converged</param>
+        MANDRILL_API void setFrameTimeBudget(float milliseconds)
+        {
+            mDesc.frameTimeBudget = milliseconds;
+        }
+
+    private:
+        struct Statistics {
+            uint32_t scheduledCount;
+            uint32_t convergedCount;
+        };
+
+        void updateTileBudget();
+
+        // Same barrier on both images and both buffers
+        void barrier(VkCommandBuffer cmd, VkPipelineStageFlags2 srcStage, VkAccessFlags2 srcAccess,
+                     VkPipelineStageFlags2 dstStage, VkAccessFlags2 dstAccess);
+
+        ptr<Device> mpDevice;
+
+        AccumulatorDesc mDesc;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        uint32_t mTileCountX;
+        uint32_t mTileCountY;
+
+        ptr<Image> mpMean;
+        ptr<Image> mpMoments;
+
+        // Launch arguments and counts followed by the scheduled tiles, and the state of every tile
+        ptr<Buffer> mpTiles;
+        ptr<Buffer> mpTileStates;
+
+        // Counts copied from the tile buffer, one copy per frame in flight
+        ptr<Buffer> mpStatistics;
+
+        ptr<Shader> mpEvaluateShader;
+        ptr<ComputePipeline> mpEvaluatePipeline;
+        ptr<Descriptor> mpEvaluateDescriptor;
+        ptr<Shader> mpCompactShader;
+        ptr<ComputePipeline> mpCompactPipeline;
+        ptr<Descriptor> mpCompactDescriptor;
+
+        // Two timestamps per frame in flight around the sampling, and which frames have written both
+        VkQueryPool mQueryPool = VK_NULL_HANDLE;
+        std::vector<bool> mQueriesWritten;
+        float mTimestampPeriod = 0.0f;
+
+        bool mResetPending = true;
+        float mTileBudget;
+        uint32_t mFrameCount = 0;
+        uint32_t mScheduledTileCount = 0;
+        uint32_t mConvergedTileCount = 0;
+        float mSampleTime = 0.0f;
+    };
+} // namespace Mandrill
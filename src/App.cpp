@@ -314,6 +314,11 @@ void App::baseGUI(ptr<Device> pDevice, ptr<Swapchain> pSwapchain, std::vector<pt
                 pSwapchain->recreate();
             }
 
+            bool lowLatency = pDevice->getLowLatency();
+            if (ImGui::MenuItem("Low latency", "", &lowLatency)) {
+                pDevice->setLowLatency(lowLatency);
+            }
+
             if (ImGui::MenuItem("Reload shaders", "R")) {
                 for (auto& pipeline : pPipelines) {
                     if (pipeline) {
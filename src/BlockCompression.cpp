@@ -0,0 +1,624 @@
+#include "BlockCompression.h"
+
+#include "HalfFloat.h"
+#include "Helpers.h"
+#include "Log.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    // Texels of one block, with the channels as floats so that fitting does not have to convert back and forth
+    struct Block {
+        glm::vec4 texels[16];
+    };
+
+    // Gather a block, repeating the edge texels where the block reaches past the image
+    Block loadBlock(const uint8_t* pRGBA, uint32_t width, uint32_t height, uint32_t blockX, uint32_t blockY)
+    {
+        Block block;
+        for (uint32_t y = 0; y < 4; y++) {
+            for (uint32_t x = 0; x < 4; x++) {
+                uint32_t px = std::min(blockX * 4 + x, width - 1);
+                uint32_t py = std::min(blockY * 4 + y, height - 1);
+                const uint8_t* pTexel = pRGBA + (static_cast<size_t>(py) * width + px) * 4;
+                block.texels[y * 4 + x] = glm::vec4(pTexel[0], pTexel[1], pTexel[2], pTexel[3]);
+            }
+        }
+        return block;
+    }
+
+    // Find the endpoints of the line that best fits the texels, looking only at the channels in the mask. The line
+    // follows the principal axis found by power iteration on the covariance, and is cut off at the outermost texels.
+    void fitLine(const Block& block, const glm::vec4& mask, glm::vec4& start, glm::vec4& end)
+    {
+        glm::vec4 mean(0.0f);
+        for (const auto& texel : block.texels) {
+            mean += texel * mask;
+        }
+        mean /= 16.0f;
+
+        glm::mat4 covariance(0.0f);
+        for (const auto& texel : block.texels) {
+            glm::vec4 d = texel * mask - mean;
+            covariance += glm::outerProduct(d, d);
+        }
+
+        // Start from the diagonal of the bounding box, which is already close for most blocks
+        glm::vec4 lo(255.0f), hi(0.0f);
+        for (const auto& texel : block.texels) {
+            lo = glm::min(lo, texel * mask);
+            hi = glm::max(hi, texel * mask);
+        }
+        glm::vec4 axis = hi - lo;
+
+        for (int i = 0; i < 4; i++) {
+            glm::vec4 next = covariance * axis;
+            float length = glm::length(next);
+            if (length < 1e-6f) {
+                break;
+            }
+            axis = next / length;
+        }
+
+        float axisLength = glm::length(axis);
+        if (axisLength < 1e-6f) {
+            start = end = mean; // Every texel is the same
+            return;
+        }
+        axis /= axisLength;
+
+        float tMin = std::numeric_limits<float>::max();
+        float tMax = std::numeric_limits<float>::lowest();
+        for (const auto& texel : block.texels) {
+            float t = glm::dot(texel * mask - mean, axis);
+            tMin = std::min(tMin, t);
+            tMax = std::max(tMax, t);
+        }
+
+        start = glm::clamp(mean + axis * tMin, 0.0f, 255.0f);
+        end = glm::clamp(mean + axis * tMax, 0.0f, 255.0f);
+    }
+
+    // Move the endpoints to where they best reproduce the texels for the weights the texels were given, by least
+    // squares. Fitting the axis alone leaves them off for blocks whose texels are not spread evenly along it.
+    bool refineEndpoints(const Block& block, const float* pWeights, glm::vec4& start, glm::vec4& end)
+    {
+        float aa = 0.0f, ab = 0.0f, bb = 0.0f;
+        glm::vec4 ax(0.0f), bx(0.0f);
+        for (uint32_t i = 0; i < 16; i++) {
+            float b = pWeights[i];
+            float a = 1.0f - b;
+            aa += a * a;
+            ab += a * b;
+            bb += b * b;
+            ax += a * block.texels[i];
+            bx += b * block.texels[i];
+        }
+
+        float determinant = aa * bb - ab * ab;
+        if (std::abs(determinant) < 1e-6f) {
+            return false; // Every texel has the same weight
+        }
+
+        start = glm::clamp((ax * bb - bx * ab) / determinant, 0.0f, 255.0f);
+        end = glm::clamp((bx * aa - ax * ab) / determinant, 0.0f, 255.0f);
+        return true;
+    }
+
+    uint16_t packRGB565(const glm::vec4& c)
+    {
+        uint32_t r = static_cast<uint32_t>(std::round(c.r * 31.0f / 255.0f));
+        uint32_t g = static_cast<uint32_t>(std::round(c.g * 63.0f / 255.0f));
+        uint32_t b = static_cast<uint32_t>(std::round(c.b * 31.0f / 255.0f));
+        return static_cast<uint16_t>((r << 11) | (g << 5) | b);
+    }
+
+    glm::vec4 unpackRGB565(uint16_t c)
+    {
+        uint32_t r = (c >> 11) & 31;
+        uint32_t g = (c >> 5) & 63;
+        uint32_t b = c & 31;
+        return glm::vec4((r << 3) | (r >> 2), (g << 2) | (g >> 4), (b << 3) | (b >> 2), 255.0f);
+    }
+
+    float distanceRGB(const glm::vec4& a, const glm::vec4& b)
+    {
+        glm::vec3 d = glm::vec3(a) - glm::vec3(b);
+        return glm::dot(d, d);
+    }
+
+    // Choose the nearest of the four colours for every texel, returning the squared error
+    float assignColorIndices(const Block& block, uint16_t color0, uint16_t color1, uint32_t& indices)
+    {
+        glm::vec4 palette[4];
+        palette[0] = unpackRGB565(color0);
+        palette[1] = unpackRGB565(color1);
+        palette[2] = (2.0f * palette[0] + palette[1]) / 3.0f;
+        palette[3] = (palette[0] + 2.0f * palette[1]) / 3.0f;
+
+        float error = 0.0f;
+        indices = 0;
+        for (uint32_t i = 0; i < 16; i++) {
+            uint32_t best = 0;
+            float bestDistance = std::numeric_limits<float>::max();
+            for (uint32_t p = 0; p < 4; p++) {
+                float distance = distanceRGB(block.texels[i], palette[p]);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    best = p;
+                }
+            }
+            indices |= best << (2 * i);
+            error += bestDistance;
+        }
+        return error;
+    }
+
+    // Colour block shared by BC1 and BC3, always in the four-colour mode
+    void encodeColorBlock(const Block& block, std::byte* pOut)
+    {
+        static const float weights[4] = {0.0f, 1.0f, 1.0f / 3.0f, 2.0f / 3.0f};
+
+        glm::vec4 start, end;
+        fitLine(block, glm::vec4(1.0f, 1.0f, 1.0f, 0.0f), start, end);
+
+        uint16_t color0 = packRGB565(start);
+        uint16_t color1 = packRGB565(end);
+        uint32_t indices = 0;
+        float error = assignColorIndices(block, color0, color1, indices);
+
+        float texelWeights[16];
+        for (uint32_t i = 0; i < 16; i++) {
+            texelWeights[i] = weights[(indices >> (2 * i)) & 3];
+        }
+        if (refineEndpoints(block, texelWeights, start, end)) {
+            uint16_t refined0 = packRGB565(start);
+            uint16_t refined1 = packRGB565(end);
+            uint32_t refinedIndices = 0;
+            float refinedError = assignColorIndices(block, refined0, refined1, refinedIndices);
+            if (refinedError < error) {
+                color0 = refined0;
+                color1 = refined1;
+                indices = refinedIndices;
+            }
+        }
+
+        // The four-colour mode needs the first endpoint to be the larger one. Swapping them swaps indices 0 with 1
+        // and 2 with 3. Equal endpoints select the three-colour mode instead, so every texel takes the first one.
+        if (color0 < color1) {
+            std::swap(color0, color1);
+            indices ^= 0x55555555;
+        } else if (color0 == color1) {
+            indices = 0;
+        }
+
+        std::memcpy(pOut, &color0, 2);
+        std::memcpy(pOut + 2, &color1, 2);
+        std::memcpy(pOut + 4, &indices, 4);
+    }
+
+    // Single-channel block, as used for alpha in BC3 and for each channel of BC5
+    void encodeChannelBlock(const Block& block, uint32_t channel, std::byte* pOut)
+    {
+        float lo = 255.0f, hi = 0.0f;
+        for (const auto& texel : block.texels) {
+            lo = std::min(lo, texel[channel]);
+            hi = std::max(hi, texel[channel]);
+        }
+
+        // The first endpoint being larger selects the mode with six values interpolated between the two
+        uint8_t value0 = static_cast<uint8_t>(hi);
+        uint8_t value1 = static_cast<uint8_t>(lo);
+
+        uint64_t indices = 0;
+        if (value0 != value1) {
+            float values[8];
+            values[0] = value0;
+            values[1] = value1;
+            for (uint32_t i = 1; i < 7; i++) {
+                values[i + 1] = ((7 - i) * value0 + i * value1) / 7.0f;
+            }
+
+            for (uint32_t i = 0; i < 16; i++) {
+                uint64_t best = 0;
+                float bestDistance = std::numeric_limits<float>::max();
+                for (uint32_t v = 0; v < 8; v++) {
+                    float distance = std::abs(block.texels[i][channel] - values[v]);
+                    if (distance < bestDistance) {
+                        bestDistance = distance;
+                        best = v;
+                    }
+                }
+                indices |= best << (3 * i);
+            }
+        }
+
+        pOut[0] = static_cast<std::byte>(value0);
+        pOut[1] = static_cast<std::byte>(value1);
+        for (uint32_t i = 0; i < 6; i++) {
+            pOut[2 + i] = static_cast<std::byte>((indices >> (8 * i)) & 0xff);
+        }
+    }
+
+    // Packs fields into a 128-bit block from the least significant bit up
+    class BitWriter
+    {
+    public:
+        void write(uint64_t value, uint32_t bitCount)
+        {
+            for (uint32_t i = 0; i < bitCount; i++, mBit++) {
+                if (value & (uint64_t(1) << i)) {
+                    mBits[mBit / 64] |= uint64_t(1) << (mBit % 64);
+                }
+            }
+        }
+
+        void store(std::byte* pOut) const
+        {
+            std::memcpy(pOut, mBits, sizeof(mBits));
+        }
+
+    private:
+        uint64_t mBits[2] = {};
+        uint32_t mBit = 0;
+    };
+
+    // Quantize an endpoint to 7 bits per channel plus a shared lowest bit, trying both values of that bit
+    void quantizeBC7Endpoint(const glm::vec4& endpoint, glm::uvec4& quantized, uint32_t& pBit, glm::vec4& restored)
+    {
+        float bestError = std::numeric_limits<float>::max();
+        for (uint32_t p = 0; p < 2; p++) {
+            glm::uvec4 q = glm::uvec4(glm::clamp(glm::round((endpoint - static_cast<float>(p)) / 2.0f), 0.0f, 127.0f));
+            glm::vec4 r = glm::vec4((q << 1u) | p);
+            glm::vec4 d = r - endpoint;
+            float error = glm::dot(d, d);
+            if (error < bestError) {
+                bestError = error;
+                quantized = q;
+                pBit = p;
+                restored = r;
+            }
+        }
+    }
+
+    const uint32_t kBC7Weights[16] = {0, 4, 9, 13, 17, 21, 26, 30, 34, 38, 43, 47, 51, 55, 60, 64};
+
+    // Quantized BC7 mode 6 endpoints together with the indices chosen for them
+    struct BC7Fit {
+        glm::uvec4 q0, q1;
+        uint32_t p0, p1;
+        uint32_t indices[16];
+        float error;
+    };
+
+    BC7Fit fitBC7(const Block& block, const glm::vec4& start, const glm::vec4& end)
+    {
+        BC7Fit fit;
+        glm::vec4 e0, e1;
+        quantizeBC7Endpoint(start, fit.q0, fit.p0, e0);
+        quantizeBC7Endpoint(end, fit.q1, fit.p1, e1);
+
+        glm::vec4 palette[16];
+        for (uint32_t i = 0; i < 16; i++) {
+            float w = static_cast<float>(kBC7Weights[i]);
+            palette[i] = glm::floor(((64.0f - w) * e0 + w * e1 + 32.0f) / 64.0f);
+        }
+
+        fit.error = 0.0f;
+        for (uint32_t i = 0; i < 16; i++) {
+            float bestDistance = std::numeric_limits<float>::max();
+            for (uint32_t p = 0; p < 16; p++) {
+                glm::vec4 d = block.texels[i] - palette[p];
+                float distance = glm::dot(d, d);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    fit.indices[i] = p;
+                }
+            }
+            fit.error += bestDistance;
+        }
+        return fit;
+    }
+
+    // BC7 in mode 6: one subset, RGBA endpoints with 7 bits per channel and a p-bit each, and 4-bit indices
+    void encodeBC7Block(const Block& block, std::byte* pOut)
+    {
+        glm::vec4 start, end;
+        fitLine(block, glm::vec4(1.0f), start, end);
+
+        BC7Fit fit = fitBC7(block, start, end);
+
+        float texelWeights[16];
+        for (uint32_t i = 0; i < 16; i++) {
+            texelWeights[i] = kBC7Weights[fit.indices[i]] / 64.0f;
+        }
+        if (refineEndpoints(block, texelWeights, start, end)) {
+            BC7Fit refined = fitBC7(block, start, end);
+            if (refined.error < fit.error) {
+                fit = refined;
+            }
+        }
+
+        // The first index is stored without its top bit, so it has to be in the lower half. The weights are
+        // symmetric, which makes swapping the endpoints and mirroring the indices give the same texels.
+        if (fit.indices[0] & 8) {
+            std::swap(fit.q0, fit.q1);
+            std::swap(fit.p0, fit.p1);
+            for (auto& index : fit.indices) {
+                index = 15 - index;
+            }
+        }
+
+        BitWriter writer;
+        writer.write(1 << 6, 7); // Mode 6
+        for (uint32_t c = 0; c < 4; c++) {
+            writer.write(fit.q0[c], 7);
+            writer.write(fit.q1[c], 7);
+        }
+        writer.write(fit.p0, 1);
+        writer.write(fit.p1, 1);
+        writer.write(fit.indices[0], 3);
+        for (uint32_t i = 1; i < 16; i++) {
+            writer.write(fit.indices[i], 4);
+        }
+        writer.store(pOut);
+    }
+
+    // BC6H is fitted on the bit patterns of the half floats, scaled to the range the fitting works in. The largest
+    // finite half is 0x7bff.
+    constexpr float kHalfToBlock = 255.0f / 0x7bff;
+
+    // Gather a block of half floats, repeating the edge texels where the block reaches past the image
+    Block loadHalfBlock(const uint16_t* pRGBA, uint32_t width, uint32_t height, uint32_t blockX, uint32_t blockY)
+    {
+        Block block;
+        for (uint32_t y = 0; y < 4; y++) {
+            for (uint32_t x = 0; x < 4; x++) {
+                uint32_t px = std::min(blockX * 4 + x, width - 1);
+                uint32_t py = std::min(blockY * 4 + y, height - 1);
+                const uint16_t* pTexel = pRGBA + (static_cast<size_t>(py) * width + px) * 4;
+                block.texels[y * 4 + x] = glm::vec4(pTexel[0], pTexel[1], pTexel[2], 0.0f) * kHalfToBlock;
+            }
+        }
+        return block;
+    }
+
+    // Expand a 10-bit unsigned BC6H endpoint to the 16 bits it is interpolated at
+    uint32_t unquantizeBC6H(uint32_t value)
+    {
+        if (value == 0) {
+            return 0;
+        }
+        if (value == 1023) {
+            return 0xffff;
+        }
+        return ((value << 16) + 0x8000) >> 10;
+    }
+
+    // Turn an interpolated value into the bit pattern of the half float it decodes to
+    uint32_t finishBC6H(uint32_t value)
+    {
+        return (value * 31) >> 6;
+    }
+
+    // Quantize one channel of an endpoint to the 10-bit value that decodes closest to it
+    uint32_t quantizeBC6H(float value)
+    {
+        const float half = value / kHalfToBlock;
+        const int32_t guess = static_cast<int32_t>(half / 31.0f); // Decodes to about 31 * value + 15
+
+        uint32_t best = 0;
+        float bestError = std::numeric_limits<float>::max();
+        for (int32_t q = guess - 1; q <= guess + 1; q++) {
+            uint32_t candidate = static_cast<uint32_t>(std::clamp(q, 0, 1023));
+            float error = std::abs(static_cast<float>(finishBC6H(unquantizeBC6H(candidate))) - half);
+            if (error < bestError) {
+                bestError = error;
+                best = candidate;
+            }
+        }
+        return best;
+    }
+
+    // Quantized BC6H mode 11 endpoints together with the indices chosen for them
+    struct BC6HFit {
+        glm::uvec4 q0, q1;
+        uint32_t indices[16];
+        float error;
+    };
+
+    BC6HFit fitBC6H(const Block& block, const glm::vec4& start, const glm::vec4& end)
+    {
+        BC6HFit fit;
+        for (uint32_t c = 0; c < 3; c++) {
+            fit.q0[c] = quantizeBC6H(start[c]);
+            fit.q1[c] = quantizeBC6H(end[c]);
+        }
+
+        // The palette is interpolated at 16 bits and only then turned into half floats, exactly as the decoder does
+        glm::vec4 palette[16];
+        for (uint32_t i = 0; i < 16; i++) {
+            const uint32_t w = kBC7Weights[i];
+            for (uint32_t c = 0; c < 3; c++) {
+                uint32_t value = ((64 - w) * unquantizeBC6H(fit.q0[c]) + w * unquantizeBC6H(fit.q1[c]) + 32) >> 6;
+                palette[i][c] = static_cast<float>(finishBC6H(value)) * kHalfToBlock;
+            }
+            palette[i][3] = 0.0f;
+        }
+
+        fit.error = 0.0f;
+        for (uint32_t i = 0; i < 16; i++) {
+            float bestDistance = std::numeric_limits<float>::max();
+            for (uint32_t p = 0; p < 16; p++) {
+                float distance = distanceRGB(block.texels[i], palette[p]);
+                if (distance < bestDistance) {
+                    bestDistance = distance;
+                    fit.indices[i] = p;
+                }
+            }
+            fit.error += bestDistance;
+        }
+        return fit;
+    }
+
+    // BC6H in mode 11: one region, unsigned RGB endpoints with 10 bits per channel, and 4-bit indices
+    void encodeBC6HBlock(const Block& block, std::byte* pOut)
+    {
+        glm::vec4 start, end;
+        fitLine(block, glm::vec4(1.0f, 1.0f, 1.0f, 0.0f), start, end);
+
+        BC6HFit fit = fitBC6H(block, start, end);
+
+        float texelWeights[16];
+        for (uint32_t i = 0; i < 16; i++) {
+            texelWeights[i] = kBC7Weights[fit.indices[i]] / 64.0f;
+        }
+        if (refineEndpoints(block, texelWeights, start, end)) {
+            BC6HFit refined = fitBC6H(block, start, end);
+            if (refined.error < fit.error) {
+                fit = refined;
+            }
+        }
+
+        // As in BC7, the first index is stored without its top bit
+        if (fit.indices[0] & 8) {
+            std::swap(fit.q0, fit.q1);
+            for (auto& index : fit.indices) {
+                index = 15 - index;
+            }
+        }
+
+        BitWriter writer;
+        writer.write(0x03, 5); // Mode 11
+        for (uint32_t c = 0; c < 3; c++) {
+            writer.write(fit.q0[c], 10);
+        }
+        for (uint32_t c = 0; c < 3; c++) {
+            writer.write(fit.q1[c], 10);
+        }
+        writer.write(fit.indices[0], 3);
+        for (uint32_t i = 1; i < 16; i++) {
+            writer.write(fit.indices[i], 4);
+        }
+        writer.store(pOut);
+    }
+
+    void encodeBlock(TextureCompression compression, const Block& block, std::byte* pOut)
+    {
+        switch (compression) {
+        case TextureCompression::BC1:
+            encodeColorBlock(block, pOut);
+            break;
+        case TextureCompression::BC3:
+            encodeChannelBlock(block, 3, pOut);
+            encodeColorBlock(block, pOut + 8);
+            break;
+        case TextureCompression::BC5:
+            encodeChannelBlock(block, 0, pOut);
+            encodeChannelBlock(block, 1, pOut + 8);
+            break;
+        case TextureCompression::BC7:
+            encodeBC7Block(block, pOut);
+            break;
+        case TextureCompression::BC6H:
+            encodeBC6HBlock(block, pOut);
+            break;
+        default:
+            break;
+        }
+    }
+
+    // Encode every block of an image, with the rows of blocks interleaved between the threads so that a region that
+    // is expensive to fit is shared out as well
+    template <typename LoadBlock>
+    std::vector<std::byte> encodeBlocks(TextureCompression compression, uint32_t width, uint32_t height,
+                                        uint32_t threadCount, LoadBlock loadBlock)
+    {
+        const uint32_t blocksX = (width + 3) / 4;
+        const uint32_t blocksY = (height + 3) / 4;
+        const uint32_t blockSize = BlockCompression::getBlockSize(compression);
+
+        std::vector<std::byte> blocks(BlockCompression::getEncodedSize(compression, width, height));
+
+        Helpers::parallelFor(blocksY, threadCount, [&](uint32_t by) {
+            for (uint32_t bx = 0; bx < blocksX; bx++) {
+                Block block = loadBlock(bx, by);
+                encodeBlock(compression, block, blocks.data() + (static_cast<size_t>(by) * blocksX + bx) * blockSize);
+            }
+        });
+
+        return blocks;
+    }
+} // namespace
+
+VkFormat BlockCompression::getFormat(TextureCompression compression)
+{
+    switch (compression) {
+    case TextureCompression::BC1:
+        return VK_FORMAT_BC1_RGB_UNORM_BLOCK;
+    case TextureCompression::BC3:
+        return VK_FORMAT_BC3_UNORM_BLOCK;
+    case TextureCompression::BC5:
+        return VK_FORMAT_BC5_UNORM_BLOCK;
+    case TextureCompression::BC7:
+        return VK_FORMAT_BC7_UNORM_BLOCK;
+    case TextureCompression::BC6H:
+        return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+    default:
+        return VK_FORMAT_R8G8B8A8_UNORM;
+    }
+}
+
+uint32_t BlockCompression::getBlockSize(TextureCompression compression)
+{
+    switch (compression) {
+    case TextureCompression::BC1:
+        return 8;
+    case TextureCompression::BC3:
+    case TextureCompression::BC5:
+    case TextureCompression::BC7:
+    case TextureCompression::BC6H:
+        return 16;
+    default:
+        return 4 * 4 * 4;
+    }
+}
+
+size_t BlockCompression::getEncodedSize(TextureCompression compression, uint32_t width, uint32_t height)
+{
+    size_t blocksX = (width + 3) / 4;
+    size_t blocksY = (height + 3) / 4;
+    return blocksX * blocksY * getBlockSize(compression);
+}
+
+std::vector<std::byte> BlockCompression::encode(TextureCompression compression, const uint8_t* pRGBA, uint32_t width,
+                                                uint32_t height, uint32_t threadCount)
+{
+    if (compression == TextureCompression::None || compression == TextureCompression::BC6H) {
+        Log::Error("BlockCompression: Compression {} cannot encode 8-bit images", static_cast<uint32_t>(compression));
+        return {};
+    }
+
+    return encodeBlocks(compression, width, height, threadCount, [&](uint32_t bx, uint32_t by) {
+        return loadBlock(pRGBA, width, height, bx, by);
+    });
+}
+
+std::vector<std::byte> BlockCompression::encodeBC6H(const float* pRGBA, uint32_t width, uint32_t height,
+                                                    uint32_t threadCount)
+{
+    // Converted up front, which also clamps values too large for half floats. Negative values have no place in the
+    // unsigned format and are clamped to zero through their sign bit.
+    std::vector<uint16_t> halfs(static_cast<size_t>(width) * height * 4);
+    HalfFloat::pack(pRGBA, halfs.data(), halfs.size());
+    for (auto& half : halfs) {
+        if (half & 0x8000) {
+            half = 0;
+        }
+    }
+
+    return encodeBlocks(TextureCompression::BC6H, width, height, threadCount, [&](uint32_t bx, uint32_t by) {
+        return loadHalfBlock(halfs.data(), width, height, bx, by);
+    });
+}
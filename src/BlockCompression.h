@@ -0,0 +1,81 @@
+#pragma once
+
+#include "Common.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Block-compressed formats that textures can be encoded to on the CPU.
+    /// </summary>
+    enum class TextureCompression : uint32_t {
+        None,
+        BC1,  // RGB at 4 bits per texel, for colour without alpha
+        BC3,  // RGBA at 8 bits per texel, for colour with alpha
+        BC5,  // Two channels at 8 bits per texel, for tangent-space normals
+        BC7,  // RGBA at 8 bits per texel, for colour at a higher quality than BC1 and BC3
+        BC6H, // Unsigned half-float RGB at 8 bits per texel, for HDR images such as environment maps
+    };
+
+    /// <summary>
+    /// CPU encoders for the BC formats. Every format works on blocks of 4 x 4 texels, and images whose size is not a
+    /// multiple of four have their edge texels repeated to fill the last blocks.
+    ///
+    /// The encoders fit the endpoints of each block along the principal axis of its texels, which is fast enough to
+    /// run at load time. BC7 only uses mode 6, a single subset with RGBA endpoints, which covers most colour textures
+    /// well. BC6H likewise only uses mode 11, a single region with 10-bit endpoints, and fits the endpoints to the bit
+    /// patterns of the half floats, which spreads the error evenly over the range in proportion to the values. Results
+    /// are meant to be cached rather than encoded on every run.
+    /// </summary>
+    namespace BlockCompression
+    {
+        /// <summary>
+        /// Get the Vulkan format that blocks of a compression are uploaded as.
+        /// </summary>
+        /// <param name="compression">Compression to look up</param>
+        /// <returns>Format of the compressed image</returns>
+        MANDRILL_API VkFormat getFormat(TextureCompression compression);
+
+        /// <summary>
+        /// Get the size of one block of 4 x 4 texels.
+        /// </summary>
+        /// <param name="compression">Compression to look up</param>
+        /// <returns>Size of a block in bytes</returns>
+        MANDRILL_API uint32_t getBlockSize(TextureCompression compression);
+
+        /// <summary>
+        /// Get the size of an encoded image.
+        /// </summary>
+        /// <param name="compression">Compression to use</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API size_t getEncodedSize(TextureCompression compression, uint32_t width, uint32_t height);
+
+        /// <summary>
+        /// Encode an image with four 8-bit channels.
+        /// </summary>
+        /// <param name="compression">Compression to use, anything but TextureCompression::None and
+        /// TextureCompression::BC6H</param>
+        /// <param name="pRGBA">Texels of the image, four bytes each and row by row</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <param name="threadCount">Number of threads to split the rows of blocks over, 0 to use one per
+        /// core</param>
+        /// <returns>The encoded blocks, row by row</returns>
+        MANDRILL_API std::vector<std::byte> encode(TextureCompression compression, const uint8_t* pRGBA, uint32_t width,
+                                                   uint32_t height, uint32_t threadCount = 0);
+
+        /// <summary>
+        /// Encode an image with four floating-point channels to BC6H. Alpha is dropped, and negative values are
+        /// clamped to zero.
+        /// </summary>
+        /// <param name="pRGBA">Texels of the image, four floats each and row by row</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <param name="threadCount">Number of threads to split the rows of blocks over, 0 to use one per
+        /// core</param>
+        /// <returns>The encoded blocks, row by row</returns>
+        MANDRILL_API std::vector<std::byte> encodeBC6H(const float* pRGBA, uint32_t width, uint32_t height,
+                                                       uint32_t threadCount = 0);
+    } // namespace BlockCompression
+} // namespace Mandrill
@@ -48,7 +48,9 @@ Buffer::Buffer(ptr<Device> pDevice, VkDeviceSize size, VkBufferUsageFlags usage,
 
 Buffer::~Buffer()
 {
-    vkDeviceWaitIdle(mpDevice->getDevice());
+    if (mWaitOnDestroy) {
+        vkDeviceWaitIdle(mpDevice->getDevice());
+    }
 
     if (mpHostMap) {
         vkUnmapMemory(mpDevice->getDevice(), mMemory);
@@ -31,6 +31,16 @@ namespace Mandrill
         /// </summary>
         MANDRILL_API ~Buffer();
 
+        /// <summary>
+        /// Set whether the destructor waits for the device to be idle before destroying the buffer. Only turn this off
+        /// when the device is known to have finished every frame that used the buffer.
+        /// </summary>
+        /// <param name="wait">Whether to wait</param>
+        MANDRILL_API void setWaitOnDestroy(bool wait)
+        {
+            mWaitOnDestroy = wait;
+        }
+
         /// <summary>
         /// Copy data from host to the buffer. If the buffer was not created to have host-coherent memory, a staging
         /// buffer will be used to transfer the data.
@@ -120,5 +130,7 @@ namespace Mandrill
         VkMemoryPropertyFlags mProperties;
         VkDeviceSize mSize;
         void* mpHostMap;
+
+        bool mWaitOnDestroy = true;
     };
 } // namespace Mandrill
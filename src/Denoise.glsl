@@ -0,0 +1,24 @@
+// Shared by the passes of the Denoiser. Guides hold a world space normal in xyz and the linear depth along the view
+// direction in w, with a depth of 0 or less where nothing was hit.
+
+float denoiseLuminance(vec3 c)
+{
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+
+bool denoiseHasGeometry(vec4 guide)
+{
+    return guide.w > 0.0;
+}
+
+// Edge-stopping weight of a neighbour from how much its normal and depth differ from those of the center. The depth
+// tolerance is how much the depth may change over the distance to the neighbour while staying on the same surface.
+float denoiseGeometryWeight(vec4 center, vec4 other, float phiNormal, float depthTolerance)
+{
+    if (!denoiseHasGeometry(other)) {
+        return 0.0;
+    }
+    float wNormal = pow(max(dot(center.xyz, other.xyz), 0.0), phiNormal);
+    float wDepth = exp(-abs(center.w - other.w) / max(depthTolerance, 1e-6));
+    return wNormal * wDepth;
+}
@@ -0,0 +1,305 @@
+#include "Denoiser.h"
+
+#include "Error.h"
+#include "Helpers.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    struct ReprojectPushConstant {
+        glm::mat4 reprojection;
+        glm::vec4 unproject;
+        glm::ivec2 inputSize;
+        float colorAlpha;
+        float momentsAlpha;
+        uint32_t halfResolution;
+        uint32_t reset;
+    };
+
+    struct VariancePushConstant {
+        float normalPhi;
+        float depthPhi;
+    };
+
+    struct AtrousPushConstant {
+        int32_t stepSize;
+        uint32_t feedback;
+        float colorPhi;
+        float normalPhi;
+        float depthPhi;
+    };
+
+    struct ResolvePushConstant {
+        uint32_t halfResolution;
+        float normalPhi;
+        float depthPhi;
+    };
+} // namespace
+
+Denoiser::Denoiser(ptr<Device> pDevice, uint32_t width, uint32_t height, const DenoiserDesc& desc)
+    : mpDevice(pDevice), mDesc(desc), mWidth(width), mHeight(height)
+{
+    if (!mpDevice->supportsStorageImageWithoutFormat()) {
+        Log::Warning("The device cannot use storage images without a format, so the denoiser will not work");
+    }
+
+    mDesc.iterationCount = std::clamp(mDesc.iterationCount, 1u, kMaxIterationCount);
+    mFilterWidth = mDesc.halfResolution ? (mWidth + 1) / 2 : mWidth;
+    mFilterHeight = mDesc.halfResolution ? (mHeight + 1) / 2 : mHeight;
+
+    // Colors are kept at half precision, and the moments and depths at full precision since they span a wider range
+    mpHistoryColor = createImage(VK_FORMAT_R16G16B16A16_SFLOAT);
+    mpIntegrated = createImage(VK_FORMAT_R16G16B16A16_SFLOAT);
+    for (uint32_t i = 0; i < 2; i++) {
+        mMoments[i] = createImage(VK_FORMAT_R32G32B32A32_SFLOAT);
+        mGuides[i] = createImage(VK_FORMAT_R32G32B32A32_SFLOAT);
+        mFiltered[i] = createImage(VK_FORMAT_R16G16B16A16_SFLOAT);
+    }
+
+    std::vector<ShaderDesc> shaderDesc;
+    shaderDesc.emplace_back("Mandrill/DenoiseReproject.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpReprojectShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpReprojectPipeline = make_ptr<ComputePipeline>(mpDevice, mpReprojectShader);
+
+    shaderDesc.clear();
+    shaderDesc.emplace_back("Mandrill/DenoiseVariance.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpVarianceShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpVariancePipeline = make_ptr<ComputePipeline>(mpDevice, mpVarianceShader);
+
+    shaderDesc.clear();
+    shaderDesc.emplace_back("Mandrill/DenoiseAtrous.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpAtrousShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpAtrousPipeline = make_ptr<ComputePipeline>(mpDevice, mpAtrousShader);
+
+    shaderDesc.clear();
+    shaderDesc.emplace_back("Mandrill/DenoiseResolve.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    mpResolveShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpResolvePipeline = make_ptr<ComputePipeline>(mpDevice, mpResolveShader);
+
+    auto storage = [](std::vector<DescriptorDesc>& desc, ptr<Image> pImage) {
+        desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, pImage);
+        desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    };
+
+    // The passes that only touch the filter's own images get all their descriptors up front, one per parity and,
+    // for the filter iterations, per direction of the ping-pong
+    for (uint32_t parity = 0; parity < 2; parity++) {
+        std::vector<DescriptorDesc> desc;
+        storage(desc, mpIntegrated);
+        storage(desc, mMoments[parity]);
+        storage(desc, mGuides[parity]);
+        storage(desc, mFiltered[0]);
+        mVarianceDescriptors[parity] =
+            make_ptr<Descriptor>(mpDevice, desc, mpVarianceShader->getDescriptorSetLayout(0));
+
+        for (uint32_t src = 0; src < 2; src++) {
+            desc.clear();
+            storage(desc, mFiltered[src]);
+            storage(desc, mGuides[parity]);
+            storage(desc, mFiltered[1 - src]);
+            storage(desc, mpHistoryColor);
+            mAtrousDescriptors[parity][src] =
+                make_ptr<Descriptor>(mpDevice, desc, mpAtrousShader->getDescriptorSetLayout(0));
+        }
+    }
+
+    // The images stay in the general layout from here on, and the history is ignored until the first frame
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    for (auto& pImage : {mpHistoryColor, mpIntegrated, mMoments[0], mMoments[1], mGuides[0], mGuides[1],
+                         mFiltered[0], mFiltered[1]}) {
+        Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                              VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL);
+    }
+    Helpers::cmdEnd(mpDevice, cmd);
+}
+
+Denoiser::~Denoiser()
+{
+    Check::Vk(vkDeviceWaitIdle(mpDevice->getDevice()));
+}
+
+void Denoiser::denoise(VkCommandBuffer cmd, ptr<Camera> pCamera, ptr<Image> pColor, ptr<Image> pGuide,
+                       ptr<Image> pOutput)
+{
+    for (auto& pImage : {pColor, pGuide, pOutput}) {
+        if (pImage->getWidth() != mWidth || pImage->getHeight() != mHeight ||
+            !(pImage->getUsage() & VK_IMAGE_USAGE_STORAGE_BIT)) {
+            Log::Error("Denoiser: Images need storage usage and a size of {} x {}, but got one of {} x {}", mWidth,
+                       mHeight, pImage->getWidth(), pImage->getHeight());
+            return;
+        }
+    }
+
+    Target& target = getTarget(pColor, pGuide, pOutput);
+    const uint32_t cur = mParity;
+    const uint32_t iterationCount = mDesc.iterationCount;
+    const uint32_t feedbackIteration = std::min(mDesc.feedbackIteration, iterationCount - 1);
+
+    // The previous frame's history has to have landed before it is reprojected, and its reads have to be done
+    // before it is overwritten
+    for (auto& pImage : {mpHistoryColor, mpIntegrated, mMoments[0], mMoments[1], mGuides[0], mGuides[1],
+                         mFiltered[0], mFiltered[1]}) {
+        barrier(cmd, pImage);
+    }
+
+    // Reprojection goes from this frame's view space straight to the previous frame's clip space. View space
+    // positions are found from the depth, assuming a perspective projection, so that the previous frame's depth
+    // is the w of its clip position.
+    glm::mat4 view = pCamera->getViewMatrix();
+    glm::mat4 proj = pCamera->getProjectionMatrix();
+    ReprojectPushConstant reprojectPushConstant = {
+        .reprojection = mPrevViewProjection * glm::inverse(view),
+        .unproject =
+            glm::vec4(1.0f / proj[0][0], 1.0f / proj[1][1], proj[2][0] / proj[0][0], proj[2][1] / proj[1][1]),
+        .inputSize = glm::ivec2(mWidth, mHeight),
+        .colorAlpha = mDesc.colorAlpha,
+        .momentsAlpha = mDesc.momentsAlpha,
+        .halfResolution = mDesc.halfResolution,
+        .reset = mResetPending,
+    };
+    mPrevViewProjection = proj * view;
+    mResetPending = false;
+
+    mpReprojectPipeline->bind(cmd);
+    target.reprojectDescriptors[cur]->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpReprojectPipeline->getLayout(), 0);
+    vkCmdPushConstants(cmd, mpReprojectPipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(ReprojectPushConstant), &reprojectPushConstant);
+    mpReprojectPipeline->dispatch(cmd, mFilterWidth, mFilterHeight);
+    barrier(cmd, mpIntegrated);
+    barrier(cmd, mMoments[cur]);
+    barrier(cmd, mGuides[cur]);
+
+    VariancePushConstant variancePushConstant = {
+        .normalPhi = mDesc.normalPhi,
+        .depthPhi = mDesc.depthPhi,
+    };
+    mpVariancePipeline->bind(cmd);
+    mVarianceDescriptors[cur]->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpVariancePipeline->getLayout(), 0);
+    vkCmdPushConstants(cmd, mpVariancePipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(VariancePushConstant), &variancePushConstant);
+    mpVariancePipeline->dispatch(cmd, mFilterWidth, mFilterHeight);
+    barrier(cmd, mFiltered[0]);
+
+    // Each iteration reads the image the one before wrote, and spreads its taps twice as far
+    mpAtrousPipeline->bind(cmd);
+    for (uint32_t i = 0; i < iterationCount; i++) {
+        AtrousPushConstant atrousPushConstant = {
+            .stepSize = 1 << i,
+            .feedback = i == feedbackIteration,
+            .colorPhi = mDesc.colorPhi,
+            .normalPhi = mDesc.normalPhi,
+            .depthPhi = mDesc.depthPhi,
+        };
+        mAtrousDescriptors[cur][i % 2]->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpAtrousPipeline->getLayout(), 0);
+        vkCmdPushConstants(cmd, mpAtrousPipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                           sizeof(AtrousPushConstant), &atrousPushConstant);
+        mpAtrousPipeline->dispatch(cmd, mFilterWidth, mFilterHeight);
+        barrier(cmd, mFiltered[(i + 1) % 2]);
+    }
+
+    ResolvePushConstant resolvePushConstant = {
+        .halfResolution = mDesc.halfResolution,
+        .normalPhi = mDesc.normalPhi,
+        .depthPhi = mDesc.depthPhi,
+    };
+    mpResolvePipeline->bind(cmd);
+    target.resolveDescriptors[cur][iterationCount % 2]->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+                                                              mpResolvePipeline->getLayout(), 0);
+    vkCmdPushConstants(cmd, mpResolvePipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0,
+                       sizeof(ResolvePushConstant), &resolvePushConstant);
+    mpResolvePipeline->dispatch(cmd, mWidth, mHeight);
+
+    mParity = 1 - cur;
+}
+
+void Denoiser::addToRenderGraph(ptr<RenderGraph> pRenderGraph, const std::string& name, ptr<Camera> pCamera,
+                                const std::string& color, const std::string& guide, const std::string& output)
+{
+    // The pass is owned by the graph, so it must not keep the graph alive
+    std::weak_ptr<RenderGraph> wpRenderGraph = pRenderGraph;
+    pRenderGraph->addPass(name, {color, guide}, {output},
+                          [this, wpRenderGraph, pCamera, color, guide, output](VkCommandBuffer cmd) {
+                              auto pRenderGraph = wpRenderGraph.lock();
+                              denoise(cmd, pCamera, pRenderGraph->getResource(color),
+                                      pRenderGraph->getResource(guide), pRenderGraph->getResource(output));
+                          });
+}
+
+void Denoiser::reset()
+{
+    mResetPending = true;
+}
+
+ptr<Image> Denoiser::createImage(VkFormat format)
+{
+    auto pImage = make_ptr<Image>(mpDevice, mFilterWidth, mFilterHeight, 1, 1, VK_SAMPLE_COUNT_1_BIT, format,
+                                  VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_STORAGE_BIT,
+                                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+    pImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+    return pImage;
+}
+
+Denoiser::Target& Denoiser::getTarget(ptr<Image> pColor, ptr<Image> pGuide, ptr<Image> pOutput)
+{
+    // Images that have been destroyed may have their handles reused by new images
+    for (auto it = mTargets.begin(); it != mTargets.end();) {
+        if (it->second.wpColor.expired() || it->second.wpGuide.expired() || it->second.wpOutput.expired()) {
+            it = mTargets.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    std::array<VkImage, 3> key = {pColor->getImage(), pGuide->getImage(), pOutput->getImage()};
+    auto it = mTargets.find(key);
+    if (it != mTargets.end()) {
+        return it->second;
+    }
+
+    Target target = {.wpColor = pColor, .wpGuide = pGuide, .wpOutput = pOutput};
+
+    auto storage = [](std::vector<DescriptorDesc>& desc, ptr<Image> pImage) {
+        desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, pImage);
+        desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    };
+
+    for (uint32_t parity = 0; parity < 2; parity++) {
+        uint32_t prev = 1 - parity;
+
+        std::vector<DescriptorDesc> desc;
+        storage(desc, pColor);
+        storage(desc, pGuide);
+        storage(desc, mpHistoryColor);
+        storage(desc, mMoments[prev]);
+        storage(desc, mGuides[prev]);
+        storage(desc, mpIntegrated);
+        storage(desc, mMoments[parity]);
+        storage(desc, mGuides[parity]);
+        target.reprojectDescriptors[parity] =
+            make_ptr<Descriptor>(mpDevice, desc, mpReprojectShader->getDescriptorSetLayout(0));
+
+        for (uint32_t last = 0; last < 2; last++) {
+            desc.clear();
+            storage(desc, mFiltered[last]);
+            storage(desc, mGuides[parity]);
+            storage(desc, pColor);
+            storage(desc, pGuide);
+            storage(desc, pOutput);
+            target.resolveDescriptors[parity][last] =
+                make_ptr<Descriptor>(mpDevice, desc, mpResolveShader->getDescriptorSetLayout(0));
+        }
+    }
+
+    return mTargets.emplace(key, target).first->second;
+}
+
+void Denoiser::barrier(VkCommandBuffer cmd, ptr<Image> pImage)
+{
+    Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_GENERAL, VK_IMAGE_LAYOUT_GENERAL);
+}
@@ -0,0 +1,214 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Camera.h"
+#include "ComputePipeline.h"
+#include "Descriptor.h"
+#include "Device.h"
+#include "Image.h"
+#include "RenderGraph.h"
+#include "Shader.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Settings for a denoiser. They can be changed between frames with the setters of Denoiser, except for the
+    /// resolution, which is fixed when the denoiser is created.
+    /// </summary>
+    struct DenoiserDesc {
+        // Iterations of the à-trous filter, each reaching twice as far as the one before, from 1 to kMaxIterationCount
+        uint32_t iterationCount = 4;
+
+        // Iteration whose output becomes the color history for the next frame. Earlier iterations keep more detail
+        // in the history, later ones less noise.
+        uint32_t feedbackIteration = 0;
+
+        // Least weight of a new sample in the color and moments histories, so that they can follow changes
+        float colorAlpha = 0.2f;
+        float momentsAlpha = 0.2f;
+
+        // How strictly the filter stops at luminance, normal and depth edges. Higher colorPhi and depthPhi let more
+        // through, while a higher normalPhi lets less through.
+        float colorPhi = 4.0f;
+        float normalPhi = 128.0f;
+        float depthPhi = 1.0f;
+
+        // Filter at half the width and height, and upsample guided by the full resolution normals and depths, which
+        // makes the filter about four times cheaper
+        bool halfResolution = false;
+    };
+
+    /// <summary>
+    /// Edge-avoiding spatiotemporal denoiser for images with few samples per pixel, after spatiotemporal
+    /// variance-guided filtering (SVGF).
+    ///
+    /// Every frame, the previous frame's filtered color and the moments of the luminance are reprojected to the
+    /// current frame with the camera's matrices from then and now, and blended with the new samples where the
+    /// previous normals and depths agree. The variance is estimated from the moments, or spatially where the
+    /// history is short, and guides an à-trous wavelet filter that stops at edges in luminance, normal and depth.
+    ///
+    /// Besides the noisy color, the denoiser needs a guide image with the world space normal in xyz and the linear
+    /// depth along the view direction in w, with a depth of 0 or less where nothing was hit, such as the background.
+    /// The camera has to use a perspective projection. The color, guide and output images need storage usage, must
+    /// be in VK_IMAGE_LAYOUT_GENERAL, and are declared without a format, which the device has to support. The filter
+    /// keeps its own history images at the filter resolution.
+    /// </summary>
+    class Denoiser
+    {
+    public:
+        MANDRILL_NON_COPYABLE(Denoiser)
+
+        /// <summary>
+        /// Largest number of iterations of the à-trous filter.
+        /// </summary>
+        static constexpr uint32_t kMaxIterationCount = 5;
+
+        /// <summary>
+        /// Create a new denoiser.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="width">Width of the images to denoise</param>
+        /// <param name="height">Height of the images to denoise</param>
+        /// <param name="desc">Filter settings and resolution</param>
+        MANDRILL_API Denoiser(ptr<Device> pDevice, uint32_t width, uint32_t height, const DenoiserDesc& desc = {});
+
+        /// <summary>
+        /// Destructor for denoiser.
+        /// </summary>
+        MANDRILL_API ~Denoiser();
+
+        /// <summary>
+        /// Record the denoising of one frame, outside of any render pass. The writes to the color and guide images
+        /// have to be visible to compute shaders, and the output is left written by compute shaders.
+        /// </summary>
+        /// <param name="cmd">Command buffer to use</param>
+        /// <param name="pCamera">Camera the frame was rendered with</param>
+        /// <param name="pColor">Noisy color</param>
+        /// <param name="pGuide">Normal in xyz and linear depth in w</param>
+        /// <param name="pOutput">Image to write the denoised color to</param>
+        MANDRILL_API void denoise(VkCommandBuffer cmd, ptr<Camera> pCamera, ptr<Image> pColor, ptr<Image> pGuide,
+                                  ptr<Image> pOutput);
+
+        /// <summary>
+        /// Add a pass that denoises resources of a render graph. The resources need storage usage, and neither
+        /// sampled nor attachment usage, so that the graph keeps them in the general layout around the pass. The
+        /// denoiser must outlive the graph.
+        /// </summary>
+        /// <param name="pRenderGraph">Render graph to add the pass to</param>
+        /// <param name="name">Name of the pass</param>
+        /// <param name="pCamera">Camera the frames are rendered with</param>
+        /// <param name="color">Name of the noisy color resource</param>
+        /// <param name="guide">Name of the guide resource</param>
+        /// <param name="output">Name of the resource to write the denoised color to</param>
+        MANDRILL_API void addToRenderGraph(ptr<RenderGraph> pRenderGraph, const std::string& name, ptr<Camera> pCamera,
+                                           const std::string& color, const std::string& guide,
+                                           const std::string& output);
+
+        /// <summary>
+        /// Discard the history, for instance after a cut or when the scene has changed.
+        /// </summary>
+        MANDRILL_API void reset();
+
+        /// <summary>
+        /// Get the settings in use.
+        /// </summary>
+        /// <returns>Settings</returns>
+        MANDRILL_API const DenoiserDesc& getDesc() const
+        {
+            return mDesc;
+        }
+
+        /// <summary>
+        /// Set the number of iterations of the à-trous filter.
+        /// </summary>
+        /// <param name="count">Number of iterations, clamped to 1 to kMaxIterationCount</param>
+        MANDRILL_API void setIterationCount(uint32_t count)
+        {
+            mDesc.iterationCount = std::clamp(count, 1u, kMaxIterationCount);
+        }
+
+        /// <summary>
+        /// Set the iteration whose output becomes the color history.
+        /// </summary>
+        /// <param name="iteration">Iteration, clamped to the last one</param>
+        MANDRILL_API void setFeedbackIteration(uint32_t iteration)
+        {
+            mDesc.feedbackIteration = iteration;
+        }
+
+        /// <summary>
+        /// Set the least weight of a new sample in the histories.
+        /// </summary>
+        /// <param name="colorAlpha">Weight in the color history</param>
+        /// <param name="momentsAlpha">Weight in the moments history</param>
+        MANDRILL_API void setAlpha(float colorAlpha, float momentsAlpha)
+        {
+            mDesc.colorAlpha = colorAlpha;
+            mDesc.momentsAlpha = momentsAlpha;
+        }
+
+        /// <summary>
+        /// Set how strictly the filter stops at edges.
+        /// </summary>
+        /// <param name="colorPhi">Luminance difference allowed, in standard deviations</param>
+        /// <param name="normalPhi">Exponent of the agreement of the normals</param>
+        /// <param name="depthPhi">Depth difference allowed, relative to the depth gradient</param>
+        MANDRILL_API void setEdgeStopping(float colorPhi, float normalPhi, float depthPhi)
+        {
+            mDesc.colorPhi = colorPhi;
+            mDesc.normalPhi = normalPhi;
+            mDesc.depthPhi = depthPhi;
+        }
+
+    private:
+        // Descriptors of the passes that use the caller's images, one per history parity and, for the resolve, per
+        // image that the filter ends in
+        struct Target {
+            std::weak_ptr<Image> wpColor;
+            std::weak_ptr<Image> wpGuide;
+            std::weak_ptr<Image> wpOutput;
+            std::array<ptr<Descriptor>, 2> reprojectDescriptors;
+            std::array<std::array<ptr<Descriptor>, 2>, 2> resolveDescriptors;
+        };
+
+        ptr<Image> createImage(VkFormat format);
+        Target& getTarget(ptr<Image> pColor, ptr<Image> pGuide, ptr<Image> pOutput);
+
+        // Make the writes of the previous pass visible to the next
+        void barrier(VkCommandBuffer cmd, ptr<Image> pImage);
+
+        ptr<Device> mpDevice;
+
+        DenoiserDesc mDesc;
+        uint32_t mWidth;
+        uint32_t mHeight;
+        uint32_t mFilterWidth;
+        uint32_t mFilterHeight;
+
+        // Moments and guides swap between this frame's and the previous frame's every frame
+        ptr<Image> mpHistoryColor;
+        std::array<ptr<Image>, 2> mMoments;
+        std::array<ptr<Image>, 2> mGuides;
+        ptr<Image> mpIntegrated;
+        std::array<ptr<Image>, 2> mFiltered;
+        uint32_t mParity = 0;
+
+        ptr<Shader> mpReprojectShader;
+        ptr<ComputePipeline> mpReprojectPipeline;
+        ptr<Shader> mpVarianceShader;
+        ptr<ComputePipeline> mpVariancePipeline;
+        std::array<ptr<Descriptor>, 2> mVarianceDescriptors;
+        ptr<Shader> mpAtrousShader;
+        ptr<ComputePipeline> mpAtrousPipeline;
+        std::array<std::array<ptr<Descriptor>, 2>, 2> mAtrousDescriptors;
+        ptr<Shader> mpResolveShader;
+        ptr<ComputePipeline> mpResolvePipeline;
+
+        std::map<std::array<VkImage, 3>, Target> mTargets;
+
+        // View and projection of the previous frame, to reproject its history
+        glm::mat4 mPrevViewProjection = glm::mat4(1.0f);
+        bool mResetPending = true;
+    };
+} // namespace Mandrill
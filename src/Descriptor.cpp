@@ -87,7 +87,9 @@ Descriptor::Descriptor(ptr<Device> pDevice, const std::vector<DescriptorDesc>& d
 
 Descriptor::~Descriptor()
 {
-    Check::Vk(vkDeviceWaitIdle(mpDevice->getDevice()));
+    if (mWaitOnDestroy) {
+        Check::Vk(vkDeviceWaitIdle(mpDevice->getDevice()));
+    }
 
     // Allocated descriptor sets are implicitly freed
     vkDestroyDescriptorPool(mpDevice->getDevice(), mPool, nullptr);
@@ -112,6 +112,16 @@ namespace Mandrill
         /// </summary>
         MANDRILL_API ~Descriptor();
 
+        /// <summary>
+        /// Set whether the destructor waits for the device to be idle before destroying the descriptor pool. Only turn
+        /// this off when the device is known to have finished every frame that used the descriptor set.
+        /// </summary>
+        /// <param name="wait">Whether to wait</param>
+        MANDRILL_API void setWaitOnDestroy(bool wait)
+        {
+            mWaitOnDestroy = wait;
+        }
+
         /// <summary>
         /// Bind descriptor with vector of dynamic offsets.
         /// </summary>
@@ -170,5 +180,7 @@ namespace Mandrill
 
         VkDescriptorPool mPool;
         VkDescriptorSet mSet;
+
+        bool mWaitOnDestroy = true;
     };
 } // namespace Mandrill
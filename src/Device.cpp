@@ -1,12 +1,16 @@
 #include "Device.h"
 
 #include "AccelerationStructure.h"
+#include "Accumulator.h"
 #include "Buffer.h"
 #include "ComputePipeline.h"
+#include "Denoiser.h"
 #include "Descriptor.h"
+#include "Downsampler.h"
 #include "DynamicBuffer.h"
 #include "Error.h"
 #include "Extension.h"
+#include "FrameAllocator.h"
 #include "Image.h"
 #include "Log.h"
 #include "Pass.h"
@@ -16,6 +20,11 @@
 #include "Scene.h"
 #include "Shader.h"
 #include "Texture.h"
+#include "TextureLoader.h"
+#include "TextureStreamer.h"
+#include "VirtualTexture.h"
+
+#include <bit>
 
 #if MANDRILL_LINUX
 #include <csignal>
@@ -100,6 +109,8 @@ Device::Device(GLFWwindow* pWindow, const std::vector<const char*>& extensions,
         mFramesInFlightCount = 1;
     }
 
+    mFrameLatency = mFramesInFlightCount;
+
     createInstance();
 
 #if defined(_DEBUG)
@@ -109,11 +120,21 @@ Device::Device(GLFWwindow* pWindow, const std::vector<const char*>& extensions,
     createSurface();
     createDevice(extensions, pFeatures, physicalDeviceIndex);
     createCommandPool();
+    createFrameTimeline();
     createExtensionProcAddrs();
 }
 
 Device::~Device()
 {
+    // The downsamplers wait for the device and destroy their views, so they go while the device is still there
+    mDownsamplers.clear();
+
+    for (auto& [key, sampler] : mSamplers) {
+        vkDestroySampler(mDevice, sampler, nullptr);
+    }
+    if (mFrameTimeline) {
+        vkDestroySemaphore(mDevice, mFrameTimeline, nullptr);
+    }
     if (mCommandPool) {
         vkDestroyCommandPool(mDevice, mCommandPool, nullptr);
     }
@@ -133,6 +154,75 @@ Device::~Device()
     }
 }
 
+VkSampler Device::getSampler(const VkSamplerCreateInfo& ci)
+{
+    if (ci.pNext) {
+        Log::Error("Device: Samplers with chained structures cannot be cached");
+        return VK_NULL_HANDLE;
+    }
+
+    const VkPhysicalDeviceLimits& limits = mProperties.physicalDevice.limits;
+
+    VkSamplerCreateInfo qualityCI = ci;
+    qualityCI.mipLodBias = std::clamp(ci.mipLodBias + mSamplerQuality.lodBias, -limits.maxSamplerLodBias,
+                                      limits.maxSamplerLodBias);
+    if (ci.anisotropyEnable) {
+        qualityCI.maxAnisotropy =
+            std::min({ci.maxAnisotropy, mSamplerQuality.maxAnisotropy, limits.maxSamplerAnisotropy});
+        qualityCI.anisotropyEnable = qualityCI.maxAnisotropy > 1.0f ? VK_TRUE : VK_FALSE;
+    }
+    if (!qualityCI.anisotropyEnable) {
+        qualityCI.maxAnisotropy = 1.0f;
+    }
+
+    // Every field that affects sampling, with the floats by their bits
+    SamplerKey key = {{
+        qualityCI.flags,
+        static_cast<uint32_t>(qualityCI.magFilter),
+        static_cast<uint32_t>(qualityCI.minFilter),
+        static_cast<uint32_t>(qualityCI.mipmapMode),
+        static_cast<uint32_t>(qualityCI.addressModeU),
+        static_cast<uint32_t>(qualityCI.addressModeV),
+        static_cast<uint32_t>(qualityCI.addressModeW),
+        std::bit_cast<uint32_t>(qualityCI.mipLodBias),
+        qualityCI.anisotropyEnable,
+        std::bit_cast<uint32_t>(qualityCI.maxAnisotropy),
+        qualityCI.compareEnable,
+        static_cast<uint32_t>(qualityCI.compareOp),
+        std::bit_cast<uint32_t>(qualityCI.minLod),
+        std::bit_cast<uint32_t>(qualityCI.maxLod),
+        static_cast<uint32_t>(qualityCI.borderColor),
+        qualityCI.unnormalizedCoordinates,
+    }};
+
+    std::lock_guard lock(mSamplerMutex);
+
+    auto it = mSamplers.find(key);
+    if (it != mSamplers.end()) {
+        return it->second;
+    }
+
+    if (mSamplers.size() >= limits.maxSamplerAllocationCount) {
+        Log::Error("Device: Out of samplers, {} distinct ones have been created", mSamplers.size());
+        return VK_NULL_HANDLE;
+    }
+
+    VkSampler sampler = VK_NULL_HANDLE;
+    Check::Vk(vkCreateSampler(mDevice, &qualityCI, nullptr, &sampler));
+    mSamplers.emplace(key, sampler);
+
+    return sampler;
+}
+
+size_t Device::SamplerKeyHash::operator()(const SamplerKey& key) const
+{
+    size_t hash = 0;
+    for (uint32_t field : key.fields) {
+        hash ^= std::hash<uint32_t>()(field) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+    }
+    return hash;
+}
+
 VkSampleCountFlagBits Device::getSampleCount() const
 {
     VkSampleCountFlags counts = mProperties.physicalDevice.limits.framebufferColorSampleCounts &
@@ -160,6 +250,31 @@ VkSampleCountFlagBits Device::getSampleCount() const
     return VK_SAMPLE_COUNT_1_BIT;
 }
 
+uint64_t Device::getCompletedFrameNumber() const
+{
+    uint64_t value = 0;
+    Check::Vk(vkGetSemaphoreCounterValue(mDevice, mFrameTimeline, &value));
+    return value;
+}
+
+bool Device::waitForFrame(uint64_t frameNumber, uint64_t timeout) const
+{
+    VkSemaphoreWaitInfo wi = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO,
+        .semaphoreCount = 1,
+        .pSemaphores = &mFrameTimeline,
+        .pValues = &frameNumber,
+    };
+
+    VkResult result = vkWaitSemaphores(mDevice, &wi, timeout);
+    if (result == VK_TIMEOUT) {
+        return false;
+    }
+
+    Check::Vk(result);
+    return true;
+}
+
 
 void Device::createInstance()
 {
@@ -323,6 +438,11 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
         VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
     };
 
+    std::vector<const char*> presentWaitExtensions = {
+        VK_KHR_PRESENT_ID_EXTENSION_NAME,
+        VK_KHR_PRESENT_WAIT_EXTENSION_NAME,
+    };
+
     std::vector<const char*> deviceExtensions;
     deviceExtensions.insert(deviceExtensions.end(), baseExtensions.begin(), baseExtensions.end());
     deviceExtensions.insert(deviceExtensions.end(), extensions.begin(), extensions.end());
@@ -355,8 +475,18 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
 
     Log::Info("Available devices ({}):", n);
     for (uint32_t i = 0; i < n; i++) {
+        VkPhysicalDeviceMaintenance4Properties maintenance4 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_4_PROPERTIES,
+        };
+
+        VkPhysicalDeviceMaintenance3Properties maintenance3 = {
+            .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_3_PROPERTIES,
+            .pNext = &maintenance4,
+        };
+
         VkPhysicalDeviceRayTracingPipelinePropertiesKHR rtp = {
             .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR,
+            .pNext = &maintenance3,
         };
 
         VkPhysicalDeviceAccelerationStructurePropertiesKHR asp = {
@@ -387,6 +517,10 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
             vkGetPhysicalDeviceMemoryProperties(mPhysicalDevice, &mProperties.memory);
             mProperties.rayTracingPipeline = rtp;
             mProperties.accelerationStructure = asp;
+            mProperties.maintenance3 = maintenance3;
+            mProperties.maintenance4 = maintenance4;
+            mProperties.maintenance3.pNext = nullptr;
+            mProperties.maintenance4.pNext = nullptr;
         }
 
         Log::Info(" * [{}] {}, driver: {} {}, Vulkan {}.{}.{} {}", i, prop.properties.deviceName, driver.driverName,
@@ -405,6 +539,14 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
         Log::Warning("The chosen physical device does not support ray tracing");
     }
 
+    // Present wait is only used by the low-latency mode. Its features have to be enabled along with the extensions,
+    // which cannot be done when the application brings its own feature chain.
+    mPresentWaitSupport = !pFeatures && checkDeviceExtensionSupport(mPhysicalDevice, presentWaitExtensions, print);
+
+    if (mPresentWaitSupport) {
+        deviceExtensions.insert(deviceExtensions.end(), presentWaitExtensions.begin(), presentWaitExtensions.end());
+    }
+
     // Check for extension support
     print = true;
     if (!checkDeviceExtensionSupport(mPhysicalDevice, deviceExtensions, print)) {
@@ -423,6 +565,17 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
         .pQueuePriorities = &queuePriority,
     };
 
+    // Block-compressed textures are optional, and are only used when the device can sample them
+    VkPhysicalDeviceFeatures supportedFeatures;
+    vkGetPhysicalDeviceFeatures(mPhysicalDevice, &supportedFeatures);
+    mTextureCompressionBCSupport = pFeatures ? pFeatures->features.textureCompressionBC
+                                             : supportedFeatures.textureCompressionBC;
+
+    // Storage images without a format let the Downsampler work on any format, and are only used when supported
+    const VkPhysicalDeviceFeatures& storageFeatures = pFeatures ? pFeatures->features : supportedFeatures;
+    mStorageImageWithoutFormatSupport = storageFeatures.shaderStorageImageReadWithoutFormat &&
+                                        storageFeatures.shaderStorageImageWriteWithoutFormat;
+
     // Default features
     VkPhysicalDeviceFeatures2 features2 = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2,
@@ -433,8 +586,11 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
                 .wideLines = VK_TRUE,
                 .largePoints = VK_TRUE,
                 .samplerAnisotropy = VK_TRUE,
+                .textureCompressionBC = mTextureCompressionBCSupport,
                 .vertexPipelineStoresAndAtomics = VK_TRUE,
                 .fragmentStoresAndAtomics = VK_TRUE,
+                .shaderStorageImageReadWithoutFormat = mStorageImageWithoutFormatSupport,
+                .shaderStorageImageWriteWithoutFormat = mStorageImageWithoutFormatSupport,
                 .shaderInt64 = VK_TRUE,
             },
     };
@@ -443,6 +599,8 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
     VkPhysicalDeviceRayTracingPipelineFeaturesKHR rtFeatures = {
         .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR,
         .rayTracingPipeline = VK_TRUE,
+        // Lets the Accumulator launch rays only for the tiles it scheduled
+        .rayTracingPipelineTraceRaysIndirect = VK_TRUE,
     };
 
     VkPhysicalDeviceAccelerationStructureFeaturesKHR asFeature = {
@@ -451,10 +609,29 @@ void Device::createDevice(const std::vector<const char*>& extensions, VkPhysical
         .accelerationStructure = VK_TRUE,
     };
 
-    VkPhysicalDeviceVulkan11Features vk11Features = {
-        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+    // Present wait features
+    VkPhysicalDevicePresentIdFeaturesKHR presentIdFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR,
         // Hook on the ray tracing features
         .pNext = mRayTracingSupport ? &asFeature : nullptr,
+        .presentId = VK_TRUE,
+    };
+
+    VkPhysicalDevicePresentWaitFeaturesKHR presentWaitFeatures = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR,
+        .pNext = &presentIdFeatures,
+        .presentWait = VK_TRUE,
+    };
+
+    void* pOptionalFeatures = mRayTracingSupport ? static_cast<void*>(&asFeature) : nullptr;
+    if (mPresentWaitSupport) {
+        pOptionalFeatures = &presentWaitFeatures;
+    }
+
+    VkPhysicalDeviceVulkan11Features vk11Features = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES,
+        // Hook on the optional features
+        .pNext = pOptionalFeatures,
     };
 
     VkPhysicalDeviceVulkan12Features vk12Features = {
@@ -509,6 +686,22 @@ void Device::createCommandPool()
     vkGetDeviceQueue(mDevice, mQueueFamilyIndex, 0, &mQueue);
 }
 
+void Device::createFrameTimeline()
+{
+    VkSemaphoreTypeCreateInfo tci = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO,
+        .semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE,
+        .initialValue = 0,
+    };
+
+    VkSemaphoreCreateInfo ci = {
+        .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
+        .pNext = &tci,
+    };
+
+    Check::Vk(vkCreateSemaphore(mDevice, &ci, nullptr, &mFrameTimeline));
+}
+
 void Device::createSurface()
 {
     Check::Vk(glfwCreateWindowSurface(mInstance, mpWindow, nullptr, &mSurface));
@@ -530,11 +723,20 @@ void Device::createExtensionProcAddrs()
         vkGetDeviceProcAddr(mDevice, "vkGetAccelerationStructureBuildSizesKHR"));
     vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(
         vkGetDeviceProcAddr(mDevice, "vkGetAccelerationStructureDeviceAddressKHR"));
+    vkCmdWriteAccelerationStructuresPropertiesKHR =
+        reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(
+            vkGetDeviceProcAddr(mDevice, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(
+        vkGetDeviceProcAddr(mDevice, "vkCmdCopyAccelerationStructureKHR"));
     vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(
         vkGetDeviceProcAddr(mDevice, "vkGetRayTracingShaderGroupHandlesKHR"));
     vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(mDevice, "vkCmdTraceRaysKHR"));
+    vkCmdTraceRaysIndirectKHR = reinterpret_cast<PFN_vkCmdTraceRaysIndirectKHR>(
+        vkGetDeviceProcAddr(mDevice, "vkCmdTraceRaysIndirectKHR"));
     vkSetDebugUtilsObjectNameEXT = reinterpret_cast<PFN_vkSetDebugUtilsObjectNameEXT>(
         vkGetDeviceProcAddr(mDevice, "vkSetDebugUtilsObjectNameEXT"));
+    vkWaitForPresentKHR =
+        reinterpret_cast<PFN_vkWaitForPresentKHR>(vkGetDeviceProcAddr(mDevice, "vkWaitForPresentKHR"));
 }
 
 ptr<AccelerationStructure> Device::createAccelerationStructure(std::weak_ptr<Scene> wpScene,
@@ -543,6 +745,18 @@ ptr<AccelerationStructure> Device::createAccelerationStructure(std::weak_ptr<Sce
     return make_ptr<AccelerationStructure>(shared_from_this(), wpScene, flags);
 }
 
+ptr<AccelerationStructure> Device::createAccelerationStructure(std::weak_ptr<Scene> wpScene,
+                                                               VkBuildAccelerationStructureFlagsKHR flags,
+                                                               const AccelerationStructureDesc& desc)
+{
+    return make_ptr<AccelerationStructure>(shared_from_this(), wpScene, flags, desc);
+}
+
+ptr<Accumulator> Device::createAccumulator(uint32_t width, uint32_t height, const AccumulatorDesc& desc)
+{
+    return make_ptr<Accumulator>(shared_from_this(), width, height, desc);
+}
+
 ptr<Buffer> Device::createBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties)
 {
     return make_ptr<Buffer>(shared_from_this(), size, usage, properties);
@@ -553,11 +767,38 @@ ptr<Camera> Device::createCamera()
     return make_ptr<Camera>(shared_from_this());
 }
 
+ptr<Denoiser> Device::createDenoiser(uint32_t width, uint32_t height, const DenoiserDesc& desc)
+{
+    return make_ptr<Denoiser>(shared_from_this(), width, height, desc);
+}
+
 ptr<Descriptor> Device::createDescriptor(const std::vector<DescriptorDesc>& desc, VkDescriptorSetLayout layout)
 {
     return make_ptr<Descriptor>(shared_from_this(), desc, layout);
 }
 
+ptr<Downsampler> Device::createDownsampler(DownsampleReduction reduction)
+{
+    return make_ptr<Downsampler>(shared_from_this(), reduction);
+}
+
+ptr<Downsampler> Device::getDownsampler(DownsampleReduction reduction)
+{
+    std::lock_guard lock(mDownsamplerMutex);
+
+    auto it = mDownsamplers.find(reduction);
+    if (it != mDownsamplers.end()) {
+        return it->second;
+    }
+
+    // A pointer that shares no ownership, as the device owning a downsampler that owns the device would keep both
+    // alive forever
+    ptr<Device> pDevice(ptr<Device>(), this);
+    ptr<Downsampler> pDownsampler = make_ptr<Downsampler>(pDevice, reduction);
+    mDownsamplers[reduction] = pDownsampler;
+    return pDownsampler;
+}
+
 ptr<DynamicBuffer> Device::createDynamicBuffer(VkDeviceSize elementSize, uint32_t elementCount,
                                                VkBufferUsageFlags usage)
 {
@@ -569,6 +810,11 @@ ptr<DynamicBuffer> Device::createPerFrameBuffer(VkDeviceSize elementSize, VkBuff
     return make_ptr<DynamicBuffer>(shared_from_this(), elementSize, mFramesInFlightCount, usage);
 }
 
+ptr<FrameAllocator> Device::createFrameAllocator(VkDeviceSize sizePerFrame, VkBufferUsageFlags usage)
+{
+    return make_ptr<FrameAllocator>(shared_from_this(), sizePerFrame, usage);
+}
+
 ptr<Image> Device::createImage(uint32_t width, uint32_t height, uint32_t depth, uint32_t mipLevels,
                                VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling,
                                VkImageUsageFlags usage, VkMemoryPropertyFlags properties)
@@ -653,3 +899,34 @@ ptr<Texture> Device::createTextureFromImage(ptr<Image> pImage, bool mipmaps)
 {
     return make_ptr<Texture>(shared_from_this(), pImage, mipmaps);
 }
+
+ptr<Texture> Device::createTextureFromMipChain(const MipChain& mipChain)
+{
+    return make_ptr<Texture>(shared_from_this(), mipChain);
+}
+
+ptr<Texture> Device::createCubeMapFromFaces(VkFormat format, const std::array<std::filesystem::path, 6>& faces,
+                                            bool mipmaps)
+{
+    return make_ptr<Texture>(shared_from_this(), format, faces, mipmaps);
+}
+
+ptr<Texture> Device::createCubeMapFromLatLong(ptr<Texture> pLatLong, uint32_t size, VkFormat format, bool mipmaps)
+{
+    return make_ptr<Texture>(shared_from_this(), pLatLong, size, format, mipmaps);
+}
+
+ptr<TextureLoader> Device::createTextureLoader(uint32_t threadCount)
+{
+    return make_ptr<TextureLoader>(shared_from_this(), threadCount);
+}
+
+ptr<TextureStreamer> Device::createTextureStreamer(const TextureStreamingDesc& desc)
+{
+    return make_ptr<TextureStreamer>(shared_from_this(), desc);
+}
+
+ptr<VirtualTexture> Device::createVirtualTexture(const std::filesystem::path& path, const VirtualTextureDesc& desc)
+{
+    return make_ptr<VirtualTexture>(shared_from_this(), path, desc);
+}
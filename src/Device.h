@@ -5,15 +5,24 @@
 namespace Mandrill
 {
     // Forward declarations for factory methods
+    struct AccelerationStructureDesc;
     class AccelerationStructure;
+    struct AccumulatorDesc;
+    class Accumulator;
     class Buffer;
     class Camera;
     struct ComputePipelineDesc;
     class ComputePipeline;
+    struct DenoiserDesc;
+    class Denoiser;
     struct DescriptorDesc;
     class Descriptor;
+    enum class DownsampleReduction : uint32_t;
+    class Downsampler;
     class DynamicBuffer;
+    class FrameAllocator;
     class Image;
+    struct MipChain;
     class Pass;
     struct PipelineDesc;
     class Pipeline;
@@ -27,12 +36,31 @@ namespace Mandrill
     class Swapchain;
     enum class TextureType : uint32_t;
     class Texture;
+    class TextureLoader;
+    struct TextureStreamingDesc;
+    class TextureStreamer;
+    struct VirtualTextureDesc;
+    class VirtualTexture;
 
     struct MANDRILL_API DeviceProperties {
         VkPhysicalDeviceProperties physicalDevice;
         VkPhysicalDeviceMemoryProperties memory;
         VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipeline;
         VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructure;
+        VkPhysicalDeviceMaintenance3Properties maintenance3; // Largest single allocation
+        VkPhysicalDeviceMaintenance4Properties maintenance4; // Largest single buffer
+    };
+
+    /// <summary>
+    /// Quality settings that the device applies to every sampler it hands out.
+    /// </summary>
+    struct SamplerQuality {
+        // Most samples of anisotropic filtering, clamped to what the device supports. Samplers that ask for
+        // anisotropic filtering get it turned off when this is 1 or less.
+        float maxAnisotropy = std::numeric_limits<float>::max();
+
+        // Added to the LOD bias of every sampler, where negative values sharpen and positive values blur
+        float lodBias = 0.0f;
     };
 
     /// <summary>
@@ -191,6 +219,111 @@ namespace Mandrill
             return mFrameInFlightIndex;
         }
 
+        /// <summary>
+        /// Get the number of the frame the host is currently recording. Frames are numbered from 1 and the number
+        /// grows by one every time the swapchain presents, so unlike the frame in flight index it never wraps around.
+        /// </summary>
+        /// <returns>Number of the current frame</returns>
+        MANDRILL_API uint64_t getFrameNumber() const
+        {
+            return mFrameNumber;
+        }
+
+        /// <summary>
+        /// Get the number of the last frame the device has finished executing. Everything a frame with this number or
+        /// lower used is safe to reuse or read back on the host, which is what deferred deletion, ring buffers and
+        /// readbacks need to know.
+        /// </summary>
+        /// <returns>Number of the last completed frame, 0 if no frame has completed yet</returns>
+        MANDRILL_API uint64_t getCompletedFrameNumber() const;
+
+        /// <summary>
+        /// Block until the device has finished executing a given frame.
+        /// </summary>
+        /// <param name="frameNumber">Number of the frame to wait for</param>
+        /// <param name="timeout">How long to wait at most, in nanoseconds</param>
+        /// <returns>True if the frame has completed, false if the wait timed out</returns>
+        MANDRILL_API bool waitForFrame(uint64_t frameNumber, uint64_t timeout = UINT64_MAX) const;
+
+        /// <summary>
+        /// Get the timeline semaphore that every frame's submission signals with its frame number. Wait on it with
+        /// a frame number to order other work, like an upload on another queue, after a frame.
+        /// </summary>
+        /// <returns>Timeline semaphore handle</returns>
+        MANDRILL_API VkSemaphore getFrameTimelineSemaphore() const
+        {
+            return mFrameTimeline;
+        }
+
+        /// <summary>
+        /// Get how many frames the host may run ahead of the device.
+        /// </summary>
+        /// <returns>Frame latency</returns>
+        MANDRILL_API uint32_t getFrameLatency() const
+        {
+            return mFrameLatency;
+        }
+
+        /// <summary>
+        /// Set how many frames the host may run ahead of the device. It defaults to the number of frames in flight,
+        /// and lowering it trades throughput for input latency without reallocating any per-frame resources. It is
+        /// clamped to between 1 and the number of frames in flight.
+        /// </summary>
+        /// <param name="frameLatency">Number of frames the host may be ahead</param>
+        MANDRILL_API void setFrameLatency(uint32_t frameLatency)
+        {
+            mFrameLatency = std::clamp(frameLatency, 1u, mFramesInFlightCount);
+        }
+
+        /// <summary>
+        /// Check if low-latency mode is activated.
+        /// </summary>
+        /// <returns>True if low-latency mode is activated, otherwise false</returns>
+        MANDRILL_API bool getLowLatency() const
+        {
+            return mLowLatency;
+        }
+
+        /// <summary>
+        /// Set low-latency mode. In low-latency mode the swapchain waits for the previous frame to be presented
+        /// before it starts on the next one, so input is sampled as late as possible. Where VK_KHR_present_wait is
+        /// unavailable the wait falls back to the previous frame completing on the device.
+        /// </summary>
+        /// <param name="lowLatency">True to activate low-latency mode, otherwise false</param>
+        MANDRILL_API void setLowLatency(bool lowLatency)
+        {
+            mLowLatency = lowLatency;
+        }
+
+        /// <summary>
+        /// Check if the device can wait for presentation to finish, which low-latency mode prefers.
+        /// </summary>
+        /// <returns>True if VK_KHR_present_wait is enabled, otherwise false</returns>
+        MANDRILL_API bool supportsPresentWait() const
+        {
+            return mPresentWaitSupport;
+        }
+
+        /// <summary>
+        /// Check if the device can sample the BC block-compressed formats.
+        /// </summary>
+        /// <returns>True if textureCompressionBC is enabled, otherwise false</returns>
+        MANDRILL_API bool supportsTextureCompressionBC() const
+        {
+            return mTextureCompressionBCSupport;
+        }
+
+        /// <summary>
+        /// Check if the device can read and write storage images declared without a format, which the Downsampler
+        /// needs to work on images of any format.
+        /// </summary>
+        /// <returns>True if shaderStorageImageReadWithoutFormat and shaderStorageImageWriteWithoutFormat are enabled,
+        /// otherwise false</returns>
+        MANDRILL_API bool supportsStorageImageWithoutFormat() const
+        {
+            return mStorageImageWithoutFormatSupport;
+        }
+
         /// <summary>
         /// Turn a frame in flight index that may be kCurrentFrameInFlight into a concrete one. Used by the parts of
         /// the framework that let the caller leave the frame out.
@@ -208,6 +341,36 @@ namespace Mandrill
         /// <returns>Sample count</returns>
         MANDRILL_API VkSampleCountFlagBits getSampleCount() const;
 
+        /// <summary>
+        /// Get a sampler from the device's sampler cache, creating it the first time it is asked for. The sampler
+        /// quality is applied to the create info first, and equal create infos share a sampler, so the number of
+        /// samplers follows the number of distinct states rather than the number of textures. Samplers live as long
+        /// as the device and are never destroyed by the caller. Chained structures are not supported.
+        /// </summary>
+        /// <param name="ci">How the sampler filters and addresses, where pNext has to be nullptr</param>
+        /// <returns>Sampler handle, or VK_NULL_HANDLE if it could not be created</returns>
+        MANDRILL_API VkSampler getSampler(const VkSamplerCreateInfo& ci);
+
+        /// <summary>
+        /// Get the quality settings applied to every sampler.
+        /// </summary>
+        /// <returns>Sampler quality</returns>
+        MANDRILL_API SamplerQuality getSamplerQuality() const
+        {
+            return mSamplerQuality;
+        }
+
+        /// <summary>
+        /// Set the quality settings applied to every sampler from now on. Samplers made with the old settings stay
+        /// valid, so frames in flight are not waited for. Textures pick up the new settings the next time their
+        /// sampler is asked for, which happens when descriptors are created.
+        /// </summary>
+        /// <param name="quality">Sampler quality</param>
+        MANDRILL_API void setSamplerQuality(const SamplerQuality& quality)
+        {
+            mSamplerQuality = quality;
+        }
+
         /// <summary>
         /// Create a new acceleration structure.
         /// </summary>
@@ -216,6 +379,25 @@ namespace Mandrill
         MANDRILL_API ptr<AccelerationStructure> createAccelerationStructure(std::weak_ptr<Scene> wpScene,
                                                                             VkBuildAccelerationStructureFlagsKHR flags);
 
+        /// <summary>
+        /// Create a new acceleration structure with a given scratch budget, optionally built progressively.
+        /// </summary>
+        /// <param name="wpScene">Scene to create the acceleration structure of</param>
+        /// <param name="flags">Flags for building acceleration structure</param>
+        /// <param name="desc">Scratch budget and whether to build progressively</param>
+        MANDRILL_API ptr<AccelerationStructure> createAccelerationStructure(std::weak_ptr<Scene> wpScene,
+                                                                            VkBuildAccelerationStructureFlagsKHR flags,
+                                                                            const AccelerationStructureDesc& desc);
+
+        /// <summary>
+        /// Create a new accumulator for progressive, adaptive sampling.
+        /// </summary>
+        /// <param name="width">Width of the accumulated image</param>
+        /// <param name="height">Height of the accumulated image</param>
+        /// <param name="desc">Convergence criteria and frame time budget</param>
+        /// <returns>A new accumulator</returns>
+        MANDRILL_API ptr<Accumulator> createAccumulator(uint32_t width, uint32_t height, const AccumulatorDesc& desc);
+
         /// <summary>
         /// Create a new buffer.
         /// </summary>
@@ -232,6 +414,15 @@ namespace Mandrill
         /// <returns>A new camera</returns>
         MANDRILL_API ptr<Camera> createCamera();
 
+        /// <summary>
+        /// Create a new spatiotemporal denoiser.
+        /// </summary>
+        /// <param name="width">Width of the images to denoise</param>
+        /// <param name="height">Height of the images to denoise</param>
+        /// <param name="desc">Filter settings and resolution</param>
+        /// <returns>A new denoiser</returns>
+        MANDRILL_API ptr<Denoiser> createDenoiser(uint32_t width, uint32_t height, const DenoiserDesc& desc);
+
         /// <summary>
         /// Create a new descriptor.
         /// </summary>
@@ -241,6 +432,22 @@ namespace Mandrill
         MANDRILL_API ptr<Descriptor> createDescriptor(const std::vector<DescriptorDesc>& desc,
                                                       VkDescriptorSetLayout layout);
 
+        /// <summary>
+        /// Create a new single-pass downsampler.
+        /// </summary>
+        /// <param name="reduction">How each texel is made from the four it covers</param>
+        /// <returns>A new downsampler</returns>
+        MANDRILL_API ptr<Downsampler> createDownsampler(DownsampleReduction reduction);
+
+        /// <summary>
+        /// Get the device's own downsampler for a reduction, which is created on first use and shared by every
+        /// caller, such as textures making their mipmaps. Use createDownsampler() for one that is used from several
+        /// command buffers in flight at once.
+        /// </summary>
+        /// <param name="reduction">How each texel is made from the four it covers</param>
+        /// <returns>Shared downsampler</returns>
+        MANDRILL_API ptr<Downsampler> getDownsampler(DownsampleReduction reduction);
+
         /// <summary>
         /// Create a new dynamic buffer, holding several aligned copies of the same data.
         /// </summary>
@@ -262,6 +469,19 @@ namespace Mandrill
         MANDRILL_API ptr<DynamicBuffer>
         createPerFrameBuffer(VkDeviceSize elementSize, VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT);
 
+        /// <summary>
+        /// Create a new frame allocator, handing out transient memory that only has to live for the current frame.
+        /// </summary>
+        /// <param name="sizePerFrame">Size of the arena of each frame in flight in bytes</param>
+        /// <param name="usage">How the buffer will be used, which also decides the default alignment of the
+        /// ranges</param>
+        /// <returns>A new frame allocator</returns>
+        MANDRILL_API ptr<FrameAllocator>
+        createFrameAllocator(VkDeviceSize sizePerFrame,
+                             VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                                        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                        VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+
         /// <summary>
         /// Create a new Image and allocate memory for it.
         /// </summary>
@@ -417,6 +637,58 @@ namespace Mandrill
         /// <returns></returns>
         MANDRILL_API ptr<Texture> createTextureFromImage(ptr<Image> pImage, bool mipmaps = false);
 
+        /// <summary>
+        /// Create a new 2D texture from mip levels prepared on the host, such as block-compressed ones.
+        /// </summary>
+        /// <param name="mipChain">Levels to upload</param>
+        /// <returns>A new texture</returns>
+        MANDRILL_API ptr<Texture> createTextureFromMipChain(const MipChain& mipChain);
+
+        /// <summary>
+        /// Create a cube map from six image files, one per face in the order +X, -X, +Y, -Y, +Z, -Z.
+        /// </summary>
+        /// <param name="format">Format to use</param>
+        /// <param name="faces">Paths to the face files</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        /// <returns>A new texture</returns>
+        MANDRILL_API ptr<Texture> createCubeMapFromFaces(VkFormat format,
+                                                         const std::array<std::filesystem::path, 6>& faces,
+                                                         bool mipmaps = false);
+
+        /// <summary>
+        /// Create a cube map from a lat-long texture, converted in a compute dispatch.
+        /// </summary>
+        /// <param name="pLatLong">Lat-long texture to convert</param>
+        /// <param name="size">Width and height of each face</param>
+        /// <param name="format">Format to use</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        /// <returns>A new texture</returns>
+        MANDRILL_API ptr<Texture> createCubeMapFromLatLong(ptr<Texture> pLatLong, uint32_t size, VkFormat format,
+                                                           bool mipmaps = false);
+
+        /// <summary>
+        /// Create a loader that decodes a batch of textures on several threads.
+        /// </summary>
+        /// <param name="threadCount">Number of worker threads, 0 to use one per core</param>
+        /// <returns>A new texture loader</returns>
+        MANDRILL_API ptr<TextureLoader> createTextureLoader(uint32_t threadCount = 0);
+
+        /// <summary>
+        /// Create a streamer that keeps only the requested mip levels of textures on the device.
+        /// </summary>
+        /// <param name="desc">How to stream the textures</param>
+        /// <returns>A new texture streamer</returns>
+        MANDRILL_API ptr<TextureStreamer> createTextureStreamer(const TextureStreamingDesc& desc);
+
+        /// <summary>
+        /// Create a virtual texture that keeps only the tiles shaders ask for in a cache on the device.
+        /// </summary>
+        /// <param name="path">Path to a file made by VirtualTexture::createTileFile()</param>
+        /// <param name="desc">How large the cache is and how tiles are loaded</param>
+        /// <returns>A new virtual texture</returns>
+        MANDRILL_API ptr<VirtualTexture> createVirtualTexture(const std::filesystem::path& path,
+                                                              const VirtualTextureDesc& desc);
+
     private:
         // The swapchain owns the pacing of the frames in flight and keeps the device's index in step with its own
         friend class Swapchain;
@@ -426,6 +698,11 @@ namespace Mandrill
             mFrameInFlightIndex = frameInFlightIndex;
         }
 
+        void advanceFrameNumber()
+        {
+            mFrameNumber += 1;
+        }
+
 #if defined(_DEBUG)
         void createDebugMessenger();
 #endif
@@ -433,6 +710,7 @@ namespace Mandrill
         void createDevice(const std::vector<const char*>& extensions, VkPhysicalDeviceFeatures2* pFeatures,
                           uint32_t physicalDeviceIndex);
         void createCommandPool();
+        void createFrameTimeline();
         void createSurface();
         void createExtensionProcAddrs();
 
@@ -453,12 +731,39 @@ namespace Mandrill
         uint32_t mFramesInFlightCount;
         // Kept in step with the swapchain, which advances it once a frame has been presented
         uint32_t mFrameInFlightIndex = 0;
+        // How far the host may run ahead, at most the number of frames in flight
+        uint32_t mFrameLatency;
+
+        // Signalled with the frame number by each frame's submission. Frame 0 is never submitted, so the initial
+        // value means that nothing has completed yet.
+        VkSemaphore mFrameTimeline = VK_NULL_HANDLE;
+        uint64_t mFrameNumber = 1;
 
         uint32_t mQueueFamilyIndex;
         VkCommandPool mCommandPool;
         VkQueue mQueue;
 
         bool mRayTracingSupport;
+        bool mPresentWaitSupport = false;
+        bool mTextureCompressionBCSupport = false;
+        bool mStorageImageWithoutFormatSupport = false;
         bool mVsync;
+        bool mLowLatency = false;
+
+        // Samplers by the create info they were made from, after the quality was applied
+        struct SamplerKey {
+            std::array<uint32_t, 16> fields;
+            bool operator==(const SamplerKey&) const = default;
+        };
+        struct SamplerKeyHash {
+            size_t operator()(const SamplerKey& key) const;
+        };
+        std::unordered_map<SamplerKey, VkSampler, SamplerKeyHash> mSamplers;
+        std::mutex mSamplerMutex;
+        SamplerQuality mSamplerQuality;
+
+        // Shared downsamplers by reduction, which refer back to the device without keeping it alive
+        std::unordered_map<DownsampleReduction, ptr<Downsampler>> mDownsamplers;
+        std::mutex mDownsamplerMutex;
     };
 } // namespace Mandrill
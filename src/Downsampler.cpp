@@ -0,0 +1,178 @@
+#include "Downsampler.h"
+
+#include "Error.h"
+#include "Helpers.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    // A workgroup reduces a 64 x 64 tile, and the last workgroup reduces at most 64 x 64 of the texels left behind
+    constexpr uint32_t kTileSize = 64;
+    constexpr uint32_t kMaxGroupCount = 64;
+    constexpr uint32_t kMaxSize = kTileSize * kMaxGroupCount;
+
+    struct PushConstant {
+        glm::ivec2 size;
+        uint32_t levelCount;
+    };
+} // namespace
+
+Downsampler::Downsampler(ptr<Device> pDevice, DownsampleReduction reduction) : mpDevice(pDevice), mReduction(reduction)
+{
+    if (!mpDevice->supportsStorageImageWithoutFormat()) {
+        Log::Warning("The device cannot use storage images without a format, so the downsampler will not work");
+    }
+
+    mSpecializationMapEntry = {
+        .constantID = 0,
+        .offset = 0,
+        .size = sizeof(DownsampleReduction),
+    };
+
+    mSpecializationInfo = {
+        .mapEntryCount = 1,
+        .pMapEntries = &mSpecializationMapEntry,
+        .dataSize = sizeof(DownsampleReduction),
+        .pData = &mReduction,
+    };
+
+    std::vector<ShaderDesc> shaderDesc;
+    shaderDesc.emplace_back("Mandrill/Downsample.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT, &mSpecializationInfo);
+    mpShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    mpPipeline = make_ptr<ComputePipeline>(mpDevice, mpShader);
+
+    // The counter has to start at zero, after which the last workgroup of every dispatch puts it back
+    VkDeviceSize size = sizeof(glm::vec4) + sizeof(glm::vec4) * kMaxGroupCount * kMaxGroupCount;
+    mpAtomics = make_ptr<Buffer>(mpDevice, size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    vkCmdFillBuffer(cmd, mpAtomics->getBuffer(), 0, VK_WHOLE_SIZE, 0);
+    Helpers::cmdEnd(mpDevice, cmd);
+}
+
+Downsampler::~Downsampler()
+{
+    Check::Vk(vkDeviceWaitIdle(mpDevice->getDevice()));
+
+    for (auto& [image, target] : mTargets) {
+        destroyTarget(target);
+    }
+}
+
+bool Downsampler::supports(ptr<Device> pDevice, ptr<Image> pImage)
+{
+    if (!pDevice->supportsStorageImageWithoutFormat() || !(pImage->getUsage() & VK_IMAGE_USAGE_STORAGE_BIT)) {
+        return false;
+    }
+
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(pDevice->getPhysicalDevice(), pImage->getFormat(), &props);
+    if (!(props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        return false;
+    }
+
+    return pImage->getWidth() <= kMaxSize && pImage->getHeight() <= kMaxSize && pImage->getDepth() == 1 &&
+           pImage->getArrayLayers() == 1 && pImage->getMipLevels() <= kMaxLevelCount + 1;
+}
+
+void Downsampler::downsample(VkCommandBuffer cmd, ptr<Image> pImage)
+{
+    if (!supports(mpDevice, pImage)) {
+        Log::Error("Downsampler: Image of format {} and size {} x {} with {} levels cannot be downsampled",
+                   static_cast<uint32_t>(pImage->getFormat()), pImage->getWidth(), pImage->getHeight(),
+                   pImage->getMipLevels());
+        return;
+    }
+
+    if (pImage->getMipLevels() < 2) {
+        return;
+    }
+
+    Target& target = getTarget(pImage);
+
+    // A previous dispatch may still be using the counter and the texels it hands over
+    Helpers::bufferBarrier(cmd, mpAtomics->getBuffer(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                           VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                           VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT);
+
+    mpPipeline->bind(cmd);
+    target.pDescriptor->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, mpPipeline->getLayout(), 0);
+
+    PushConstant pushConstant = {
+        .size = glm::ivec2(pImage->getWidth(), pImage->getHeight()),
+        .levelCount = pImage->getMipLevels() - 1,
+    };
+    vkCmdPushConstants(cmd, mpPipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(PushConstant),
+                       &pushConstant);
+
+    mpPipeline->dispatchGroups(cmd, (pImage->getWidth() + kTileSize - 1) / kTileSize,
+                               (pImage->getHeight() + kTileSize - 1) / kTileSize);
+}
+
+Downsampler::Target& Downsampler::getTarget(ptr<Image> pImage)
+{
+    // Images that have been destroyed leave their views behind, and their handles may be reused by new images
+    for (auto it = mTargets.begin(); it != mTargets.end();) {
+        if (it->second.wpImage.expired()) {
+            destroyTarget(it->second);
+            it = mTargets.erase(it);
+        } else {
+            it++;
+        }
+    }
+
+    auto it = mTargets.find(pImage->getImage());
+    if (it != mTargets.end()) {
+        return it->second;
+    }
+
+    Target target = {.wpImage = pImage};
+
+    // One view per level, so that each level can be bound as its own storage image
+    for (uint32_t level = 0; level < pImage->getMipLevels(); level++) {
+        VkImageViewCreateInfo ci = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image = pImage->getImage(),
+            .viewType = VK_IMAGE_VIEW_TYPE_2D,
+            .format = pImage->getFormat(),
+            .subresourceRange =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .baseMipLevel = level,
+                    .levelCount = 1,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+        };
+
+        VkImageView view;
+        Check::Vk(vkCreateImageView(mpDevice->getDevice(), &ci, nullptr, &view));
+        target.views.push_back(view);
+    }
+
+    // Every binding has to hold a valid view, so the levels the image does not have repeat its last one. The shader
+    // never writes to them.
+    std::vector<DescriptorDesc> desc;
+    for (uint32_t level = 0; level <= kMaxLevelCount; level++) {
+        desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, pImage);
+        desc.back().imageView = target.views[std::min(level, count(target.views) - 1)];
+        desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, mpAtomics);
+    target.pDescriptor = make_ptr<Descriptor>(mpDevice, desc, mpShader->getDescriptorSetLayout(0));
+
+    return mTargets.emplace(pImage->getImage(), std::move(target)).first->second;
+}
+
+void Downsampler::destroyTarget(Target& target)
+{
+    // The descriptor waits for the device to be idle before it goes, after which the views are no longer in use
+    target.pDescriptor = nullptr;
+
+    for (auto view : target.views) {
+        vkDestroyImageView(mpDevice->getDevice(), view, nullptr);
+    }
+    target.views.clear();
+}
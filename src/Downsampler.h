@@ -0,0 +1,113 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "ComputePipeline.h"
+#include "Descriptor.h"
+#include "Device.h"
+#include "Image.h"
+#include "Shader.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// How a Downsampler makes each texel from the four it covers in the level above.
+    /// </summary>
+    enum class DownsampleReduction : uint32_t {
+        Average, // Mipmaps of render targets, and the mean luminance in the last level
+        Min,     // Depth pyramids for occlusion culling with reversed depth
+        Max,     // Depth pyramids for occlusion culling, and the peak luminance in the last level
+    };
+
+    /// <summary>
+    /// Single-pass compute downsampler, which makes up to 12 mip levels of an image in one dispatch instead of one
+    /// blit and two barriers per level.
+    ///
+    /// Every workgroup reduces a 64 x 64 tile of the first level through six levels in shared memory. The workgroup
+    /// that finishes last, found with an atomic counter, then reduces the texels the others left behind through the
+    /// remaining six levels. The first level can therefore be at most 4096 texels on a side.
+    ///
+    /// Images need storage usage, a single layer and a format that supports storage images, and the device has to
+    /// support storage images without a format. sRGB and depth formats cannot be storage images, so a depth pyramid
+    /// is made by first copying or resolving depth into the first level of, for instance, an R32_SFLOAT image.
+    ///
+    /// Levels are halved and rounded down like Vulkan expects. The texels left over on the far edge of an odd-sized
+    /// level are not included in the level below.
+    /// </summary>
+    class Downsampler
+    {
+    public:
+        MANDRILL_NON_COPYABLE(Downsampler)
+
+        /// <summary>
+        /// Largest number of levels made by one dispatch, not counting the first.
+        /// </summary>
+        static constexpr uint32_t kMaxLevelCount = 12;
+
+        /// <summary>
+        /// Create a new downsampler.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="reduction">How each texel is made from the four it covers</param>
+        MANDRILL_API Downsampler(ptr<Device> pDevice, DownsampleReduction reduction);
+
+        /// <summary>
+        /// Destructor for downsampler.
+        /// </summary>
+        MANDRILL_API ~Downsampler();
+
+        /// <summary>
+        /// Check whether an image can be downsampled.
+        /// </summary>
+        /// <param name="pDevice">Device the image belongs to</param>
+        /// <param name="pImage">Image to check</param>
+        /// <returns>True if the image can be downsampled, otherwise false</returns>
+        MANDRILL_API static bool supports(ptr<Device> pDevice, ptr<Image> pImage);
+
+        /// <summary>
+        /// Record the making of every level of an image from its first one. All levels must be in
+        /// VK_IMAGE_LAYOUT_GENERAL, with the writes to the first level made visible to compute shaders. The levels are
+        /// left in the same layout, and the caller makes the writes visible to whatever reads them.
+        ///
+        /// The views and descriptors of an image are kept between calls, so a pyramid that is rebuilt every frame only
+        /// costs the dispatch.
+        /// </summary>
+        /// <param name="cmd">Command buffer to use</param>
+        /// <param name="pImage">Image to downsample</param>
+        MANDRILL_API void downsample(VkCommandBuffer cmd, ptr<Image> pImage);
+
+        /// <summary>
+        /// Get the reduction the downsampler was created with.
+        /// </summary>
+        /// <returns>Reduction in use</returns>
+        MANDRILL_API DownsampleReduction getReduction() const
+        {
+            return mReduction;
+        }
+
+    private:
+        struct Target {
+            std::weak_ptr<Image> wpImage;
+            std::vector<VkImageView> views;
+            ptr<Descriptor> pDescriptor;
+        };
+
+        Target& getTarget(ptr<Image> pImage);
+        void destroyTarget(Target& target);
+
+        ptr<Device> mpDevice;
+
+        DownsampleReduction mReduction;
+        VkSpecializationMapEntry mSpecializationMapEntry;
+        VkSpecializationInfo mSpecializationInfo;
+
+        ptr<Shader> mpShader;
+        ptr<ComputePipeline> mpPipeline;
+
+        // Atomic counter followed by one texel of level 6 per workgroup
+        ptr<Buffer> mpAtomics;
+
+        std::unordered_map<VkImage, Target> mTargets;
+    };
+} // namespace Mandrill
@@ -5,25 +5,6 @@
 
 using namespace Mandrill;
 
-namespace
-{
-    // Which limit the copies have to be aligned to depends on what the buffer is bound as. A buffer that is used as
-    // both takes the stricter of the two.
-    VkDeviceSize getRequiredAlignment(ptr<Device> pDevice, VkBufferUsageFlags usage)
-    {
-        const VkPhysicalDeviceLimits& limits = pDevice->getProperties().physicalDevice.limits;
-
-        VkDeviceSize alignment = 1;
-        if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
-            alignment = std::max(alignment, limits.minUniformBufferOffsetAlignment);
-        }
-        if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
-            alignment = std::max(alignment, limits.minStorageBufferOffsetAlignment);
-        }
-        return alignment;
-    }
-} // namespace
-
 DynamicBuffer::DynamicBuffer(ptr<Device> pDevice, VkDeviceSize elementSize, uint32_t elementCount,
                              VkBufferUsageFlags usage)
     : mpDevice(pDevice), mElementSize(elementSize), mElementCount(elementCount)
@@ -38,7 +19,7 @@ DynamicBuffer::DynamicBuffer(ptr<Device> pDevice, VkDeviceSize elementSize, uint
         mElementCount = 1;
     }
 
-    mStride = Helpers::alignTo(mElementSize, getRequiredAlignment(pDevice, usage));
+    mStride = Helpers::alignTo(mElementSize, Helpers::getOffsetAlignment(pDevice, usage));
 
     mpBuffer = pDevice->createBuffer(mStride * mElementCount, usage,
                                      VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
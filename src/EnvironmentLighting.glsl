@@ -0,0 +1,56 @@
+// Image-based lighting with the split-sum approximation, from the lighting that EnvironmentMap generates. Define
+// ENV_LIGHTING_SET and ENV_LIGHTING_BINDING before including this file, which declares three resources at consecutive
+// bindings from there, and attach them with EnvironmentMap::attachLighting().
+//
+// A shader shades a surface with environmentLighting(), or looks up the diffuse and specular parts on their own with
+// environmentIrradiance() and environmentSpecular(). Directions are in world space.
+
+// Nine spherical harmonics coefficients of the irradiance, already convolved with the cosine lobe
+layout(std140, set = ENV_LIGHTING_SET, binding = ENV_LIGHTING_BINDING + 0) uniform EnvironmentSH {
+    vec4 coefficients[9]; // Colour in xyz, w unused
+} environmentSH;
+
+// Lat-long radiance convolved with GGX lobes, one level per roughness from 0 to 1
+layout(set = ENV_LIGHTING_SET, binding = ENV_LIGHTING_BINDING + 1) uniform sampler2D environmentSpecularMap;
+
+// Scale and bias to F0 of the specular BRDF, by n.v along x and roughness along y
+layout(set = ENV_LIGHTING_SET, binding = ENV_LIGHTING_BINDING + 2) uniform sampler2D environmentBRDF;
+
+// Same mapping as the lat-long texture of EnvironmentMap
+vec2 environmentLatLong(vec3 dir)
+{
+    return vec2(atan(-dir.z, dir.x) * 0.15915494 + 0.5, acos(clamp(-dir.y, -1.0, 1.0)) * 0.31830989);
+}
+
+// Irradiance arriving at a surface with normal n, in the band order and with the constants of EnvironmentMap
+vec3 environmentIrradiance(vec3 n)
+{
+    vec3 irradiance = environmentSH.coefficients[0].xyz * 0.282095;
+    irradiance += environmentSH.coefficients[1].xyz * 0.488603 * n.y;
+    irradiance += environmentSH.coefficients[2].xyz * 0.488603 * n.z;
+    irradiance += environmentSH.coefficients[3].xyz * 0.488603 * n.x;
+    irradiance += environmentSH.coefficients[4].xyz * 1.092548 * n.x * n.y;
+    irradiance += environmentSH.coefficients[5].xyz * 1.092548 * n.y * n.z;
+    irradiance += environmentSH.coefficients[6].xyz * 0.315392 * (3.0 * n.z * n.z - 1.0);
+    irradiance += environmentSH.coefficients[7].xyz * 1.092548 * n.x * n.z;
+    irradiance += environmentSH.coefficients[8].xyz * 0.546274 * (n.x * n.x - n.y * n.y);
+    return max(irradiance, vec3(0.0));
+}
+
+// Radiance arriving from the mirror direction r, prefiltered for a roughness
+vec3 environmentSpecular(vec3 r, float roughness)
+{
+    float level = clamp(roughness, 0.0, 1.0) * float(textureQueryLevels(environmentSpecularMap) - 1);
+    return textureLod(environmentSpecularMap, environmentLatLong(normalize(r)), level).rgb;
+}
+
+// Light reflected towards v by a surface with normal n, a Lambertian diffuse albedo and a GGX specular lobe whose
+// reflectance at normal incidence is f0. Both n and v are normalized and point away from the surface.
+vec3 environmentLighting(vec3 n, vec3 v, vec3 albedo, vec3 f0, float roughness)
+{
+    float nDotV = clamp(dot(n, v), 0.0, 1.0);
+    vec2 brdf = texture(environmentBRDF, vec2(nDotV, clamp(roughness, 0.0, 1.0))).rg;
+    vec3 specular = environmentSpecular(reflect(-v, n), roughness) * (f0 * brdf.x + brdf.y);
+    vec3 diffuse = albedo * 0.31830989 * environmentIrradiance(n);
+    return diffuse + specular;
+}
@@ -1,8 +1,11 @@
 #include "EnvironmentMap.h"
 
+#include "HalfFloat.h"
+#include "Helpers.h"
 #include "Log.h"
-
-#include <stb_image.h>
+#include "MipGenerator.h"
+#include "TextureCache.h"
+#include "TextureLoader.h"
 
 #include <cmath>
 
@@ -14,33 +17,471 @@ namespace
 
     // Keeps the density non-zero everywhere, which bounds radiance / pdf in regions where the map is black
     constexpr float DENSITY_FLOOR = 1e-4f;
+
+    // Bump whenever the generated lighting changes, so that entries cached by earlier versions miss
+    constexpr uint32_t kLightingVersion = 1;
+
+    // The source is filtered at a level of at most this width for the irradiance, far more than band 2 can resolve
+    constexpr uint32_t kIrradianceSourceWidth = 256;
+
+    // Build an alias table with Vose's method, which pairs each entry below the mean weight with one above it so that
+    // every entry ends up holding exactly the mean. Weights must not all be zero.
+    void buildAliasTable(const float* pWeights, uint32_t count, AliasTableEntry* pTable)
+    {
+        double sum = 0.0;
+        for (uint32_t i = 0; i < count; i++) {
+            sum += pWeights[i];
+        }
+        const double mean = sum / static_cast<double>(count);
+
+        std::vector<double> scaled(count);
+        std::vector<uint32_t> small;
+        std::vector<uint32_t> large;
+        for (uint32_t i = 0; i < count; i++) {
+            scaled[i] = pWeights[i] / mean;
+            pTable[i] = {.probability = 1.0f, .alias = i, .pdf = static_cast<float>(scaled[i])};
+            (scaled[i] < 1.0 ? small : large).push_back(i);
+        }
+
+        while (!small.empty() && !large.empty()) {
+            const uint32_t s = small.back();
+            const uint32_t l = large.back();
+            small.pop_back();
+
+            pTable[s].probability = static_cast<float>(scaled[s]);
+            pTable[s].alias = l;
+
+            scaled[l] -= 1.0 - scaled[s];
+            if (scaled[l] < 1.0) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // Whatever is left over holds the mean up to rounding, and keeps itself. The probability was already set.
+        for (uint32_t i = 0; i < count; i++) {
+            pTable[i].aliasPdf = pTable[pTable[i].alias].pdf;
+        }
+    }
+
+    // Lat-long mapping of the shaders, where v = 0 looks straight down
+    glm::vec3 latLongToDirection(float u, float v)
+    {
+        const float theta = v * PI;
+        const float phi = (u - 0.5f) * 2.0f * PI;
+        const float sinTheta = std::sin(theta);
+        return glm::vec3(sinTheta * std::cos(phi), -std::cos(theta), -sinTheta * std::sin(phi));
+    }
+
+    glm::vec2 directionToLatLong(const glm::vec3& dir)
+    {
+        return glm::vec2(std::atan2(-dir.z, dir.x) / (2.0f * PI) + 0.5f,
+                         std::acos(std::clamp(-dir.y, -1.0f, 1.0f)) / PI);
+    }
+
+    // Bilinear lookup in faces laid out as the layers of a cube map, top row first, clamped to the edges of a face
+    glm::vec3 sampleCubeMap(const float* pFaces, uint32_t size, const glm::vec3& dir)
+    {
+        const glm::vec3 a = glm::abs(dir);
+        uint32_t face;
+        glm::vec2 st;
+        if (a.x >= a.y && a.x >= a.z) {
+            face = dir.x > 0.0f ? 0 : 1;
+            st = glm::vec2(dir.x > 0.0f ? -dir.z : dir.z, -dir.y) / a.x;
+        } else if (a.y >= a.z) {
+            face = dir.y > 0.0f ? 2 : 3;
+            st = glm::vec2(dir.x, dir.y > 0.0f ? dir.z : -dir.z) / a.y;
+        } else {
+            face = dir.z > 0.0f ? 4 : 5;
+            st = glm::vec2(dir.z > 0.0f ? dir.x : -dir.x, -dir.y) / a.z;
+        }
+
+        const float maxCoord = static_cast<float>(size - 1);
+        const glm::vec2 p = glm::clamp((st * 0.5f + 0.5f) * static_cast<float>(size) - 0.5f, 0.0f, maxCoord);
+        const glm::uvec2 p0 = glm::uvec2(p);
+        const glm::uvec2 p1 = glm::min(p0 + 1u, glm::uvec2(size - 1));
+        const glm::vec2 t = p - glm::vec2(p0);
+
+        const float* pFace = pFaces + 4 * static_cast<size_t>(face) * size * size;
+        auto texel = [&](uint32_t x, uint32_t y) {
+            const float* pTexel = &pFace[4 * (static_cast<size_t>(y) * size + x)];
+            return glm::vec3(pTexel[0], pTexel[1], pTexel[2]);
+        };
+
+        return glm::mix(glm::mix(texel(p0.x, p0.y), texel(p1.x, p0.y), t.x),
+                        glm::mix(texel(p0.x, p1.y), texel(p1.x, p1.y), t.x), t.y);
+    }
+
+    // Read a whole file and decode it as RGBA floats, flipped like Texture does
+    std::optional<DecodedImage> readImage(const std::filesystem::path& path, std::vector<uint8_t>& file)
+    {
+        std::filesystem::path fullPath = path;
+        if (path.is_relative()) {
+            fullPath = GetExecutablePath() / path;
+        }
+
+        std::ifstream is(fullPath, std::ios::binary | std::ios::ate);
+        if (!is.good()) {
+            Log::Error("Failed to open environment map {}", path.string());
+            return std::nullopt;
+        }
+        file.resize(static_cast<size_t>(is.tellg()));
+        is.seekg(0);
+        is.read(reinterpret_cast<char*>(file.data()), file.size());
+        if (!is.good()) {
+            Log::Error("Failed to read environment map {}", path.string());
+            return std::nullopt;
+        }
+
+        std::optional<DecodedImage> image =
+            TextureLoader::decode(file.data(), file.size(), VK_FORMAT_R32G32B32A32_SFLOAT);
+        if (!image) {
+            Log::Error("Failed to load environment map {}", path.string());
+        }
+        return image;
+    }
+
+    // Mip levels of the source, sampled bilinearly within a level and linearly between them, wrapping around in u
+    struct LatLongPyramid {
+        std::vector<std::vector<float>> levels;
+        uint32_t width = 0;
+        uint32_t height = 0;
+
+        glm::vec3 texel(uint32_t level, uint32_t x, uint32_t y) const
+        {
+            const float* pTexel = &levels[level][4 * (static_cast<size_t>(y) * std::max(width >> level, 1u) + x)];
+            return glm::vec3(pTexel[0], pTexel[1], pTexel[2]);
+        }
+
+        glm::vec3 sampleLevel(uint32_t level, const glm::vec2& uv) const
+        {
+            const uint32_t levelWidth = std::max(width >> level, 1u);
+            const uint32_t levelHeight = std::max(height >> level, 1u);
+
+            const float x = uv.x * static_cast<float>(levelWidth) - 0.5f;
+            const float y = std::clamp(uv.y * static_cast<float>(levelHeight) - 0.5f, 0.0f,
+                                       static_cast<float>(levelHeight - 1));
+            const float x0 = std::floor(x);
+            const float y0 = std::floor(y);
+            const float tx = x - x0;
+            const float ty = y - y0;
+
+            const int32_t w = static_cast<int32_t>(levelWidth);
+            const uint32_t left = static_cast<uint32_t>((static_cast<int32_t>(x0) % w + w) % w);
+            const uint32_t right = (left + 1) % levelWidth;
+            const uint32_t top = static_cast<uint32_t>(y0);
+            const uint32_t bottom = std::min(top + 1, levelHeight - 1);
+
+            return glm::mix(glm::mix(texel(level, left, top), texel(level, right, top), tx),
+                            glm::mix(texel(level, left, bottom), texel(level, right, bottom), tx), ty);
+        }
+
+        glm::vec3 sample(const glm::vec3& dir, float lod) const
+        {
+            const glm::vec2 uv = directionToLatLong(dir);
+            lod = std::clamp(lod, 0.0f, static_cast<float>(levels.size() - 1));
+            const uint32_t lower = static_cast<uint32_t>(lod);
+            const uint32_t upper = std::min(lower + 1, count(levels) - 1);
+            return glm::mix(sampleLevel(lower, uv), sampleLevel(upper, uv), lod - static_cast<float>(lower));
+        }
+    };
+
+    // Point i of a Hammersley set of n points
+    glm::vec2 hammersley(uint32_t i, uint32_t n)
+    {
+        uint32_t bits = i;
+        bits = (bits << 16) | (bits >> 16);
+        bits = ((bits & 0x55555555u) << 1) | ((bits & 0xaaaaaaaau) >> 1);
+        bits = ((bits & 0x33333333u) << 2) | ((bits & 0xccccccccu) >> 2);
+        bits = ((bits & 0x0f0f0f0fu) << 4) | ((bits & 0xf0f0f0f0u) >> 4);
+        bits = ((bits & 0x00ff00ffu) << 8) | ((bits & 0xff00ff00u) >> 8);
+        return glm::vec2(static_cast<float>(i) / static_cast<float>(n), static_cast<float>(bits) * 2.3283064e-10f);
+    }
+
+    // Half vector around +z, distributed as the GGX distribution times n.h
+    glm::vec3 sampleGGX(const glm::vec2& xi, float alpha)
+    {
+        const float phi = 2.0f * PI * xi.x;
+        const float cosTheta = std::sqrt((1.0f - xi.y) / (1.0f + (alpha * alpha - 1.0f) * xi.y));
+        const float sinTheta = std::sqrt(std::max(1.0f - cosTheta * cosTheta, 0.0f));
+        return glm::vec3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+    float evalGGX(float cosTheta, float alpha)
+    {
+        const float a2 = alpha * alpha;
+        const float d = cosTheta * cosTheta * (a2 - 1.0f) + 1.0f;
+        return a2 / (PI * d * d);
+    }
+
+    std::array<float, 9> evalSH(const glm::vec3& n)
+    {
+        return {
+            0.282095f,
+            0.488603f * n.y,
+            0.488603f * n.z,
+            0.488603f * n.x,
+            1.092548f * n.x * n.y,
+            1.092548f * n.y * n.z,
+            0.315392f * (3.0f * n.z * n.z - 1.0f),
+            1.092548f * n.x * n.z,
+            0.546274f * (n.x * n.x - n.y * n.y),
+        };
+    }
+
+    // Project the radiance onto spherical harmonics and convolve it with the cosine lobe, which only scales each
+    // band, after Ramamoorthi and Hanrahan
+    std::array<glm::vec4, 9> projectIrradiance(const LatLongPyramid& source, uint32_t threadCount)
+    {
+        uint32_t level = 0;
+        while ((source.width >> level) > kIrradianceSourceWidth && level + 1 < count(source.levels)) {
+            level++;
+        }
+        const uint32_t width = std::max(source.width >> level, 1u);
+        const uint32_t height = std::max(source.height >> level, 1u);
+
+        std::vector<std::array<glm::vec3, 9>> rows(height);
+        Helpers::parallelFor(height, threadCount, [&](uint32_t y) {
+            const float v = (static_cast<float>(y) + 0.5f) / static_cast<float>(height);
+            const float solidAngle = 2.0f * PI * PI * std::sin(PI * v) / (static_cast<float>(width) * height);
+
+            std::array<glm::vec3, 9> row = {};
+            for (uint32_t x = 0; x < width; x++) {
+                const float u = (static_cast<float>(x) + 0.5f) / static_cast<float>(width);
+                const glm::vec3 radiance = source.texel(level, x, y) * solidAngle;
+                const std::array<float, 9> basis = evalSH(latLongToDirection(u, v));
+                for (uint32_t i = 0; i < 9; i++) {
+                    row[i] += radiance * basis[i];
+                }
+            }
+            rows[y] = row;
+        });
+
+        const float bandScale[9] = {
+            PI, 2.0f * PI / 3.0f, 2.0f * PI / 3.0f, 2.0f * PI / 3.0f, PI / 4.0f, PI / 4.0f, PI / 4.0f, PI / 4.0f,
+            PI / 4.0f,
+        };
+
+        std::array<glm::vec4, 9> coefficients = {};
+        for (const auto& row : rows) {
+            for (uint32_t i = 0; i < 9; i++) {
+                coefficients[i] += glm::vec4(row[i] * bandScale[i], 0.0f);
+            }
+        }
+        return coefficients;
+    }
+
+    // Convolve the radiance with GGX lobes, assuming that the view direction is the normal. Samples are taken from
+    // lower levels of the source the less likely they are, after Colbert and Krivanek, which takes far fewer of them
+    // to get rid of the noise.
+    MipChain prefilterSpecular(const LatLongPyramid& source, uint32_t width, uint32_t levelCount,
+                               const EnvironmentLightingDesc& desc)
+    {
+        const uint32_t height = std::max(width / 2, 1u);
+        const float sourceTexelAngle = 4.0f * PI / (static_cast<float>(source.width) * source.height);
+
+        MipChain mipChain = {.format = VK_FORMAT_R16G16B16A16_SFLOAT, .width = width, .height = height};
+        for (uint32_t level = 0; level < levelCount; level++) {
+            const uint32_t levelWidth = std::max(width >> level, 1u);
+            const uint32_t levelHeight = std::max(height >> level, 1u);
+            const float roughness =
+                levelCount > 1 ? static_cast<float>(level) / static_cast<float>(levelCount - 1) : 0.0f;
+            const float alpha = roughness * roughness;
+
+            // The view direction is the normal, so every texel of a level takes the same samples about its normal
+            struct Sample {
+                glm::vec3 direction;
+                float weight;
+                float lod;
+            };
+            std::vector<Sample> samples;
+            if (level == 0) {
+                const float lod = std::log2(static_cast<float>(source.width) / static_cast<float>(levelWidth));
+                samples.push_back({.direction = glm::vec3(0.0f, 0.0f, 1.0f), .weight = 1.0f, .lod = lod});
+            } else {
+                for (uint32_t i = 0; i < desc.specularSampleCount; i++) {
+                    const glm::vec3 h = sampleGGX(hammersley(i, desc.specularSampleCount), alpha);
+                    const glm::vec3 l = 2.0f * h.z * h - glm::vec3(0.0f, 0.0f, 1.0f);
+                    if (l.z > 0.0f) {
+                        const float pdf = evalGGX(h.z, alpha) / 4.0f;
+                        const float sampleAngle = 1.0f / (static_cast<float>(desc.specularSampleCount) * pdf);
+                        const float lod = 0.5f * std::log2(sampleAngle / sourceTexelAngle) + 1.0f;
+                        samples.push_back({.direction = l, .weight = l.z, .lod = lod});
+                    }
+                }
+            }
+
+            std::vector<float> texels(4 * static_cast<size_t>(levelWidth) * levelHeight);
+            Helpers::parallelFor(levelHeight, desc.threadCount, [&](uint32_t y) {
+                const float v = (static_cast<float>(y) + 0.5f) / static_cast<float>(levelHeight);
+                for (uint32_t x = 0; x < levelWidth; x++) {
+                    const float u = (static_cast<float>(x) + 0.5f) / static_cast<float>(levelWidth);
+                    const glm::vec3 n = latLongToDirection(u, v);
+                    const glm::vec3 up =
+                        std::abs(n.z) < 0.999f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(1.0f, 0.0f, 0.0f);
+                    const glm::vec3 t = glm::normalize(glm::cross(up, n));
+                    const glm::vec3 b = glm::cross(n, t);
+
+                    glm::vec3 radiance(0.0f);
+                    float weight = 0.0f;
+                    for (const Sample& sample : samples) {
+                        const glm::vec3 l = sample.direction.x * t + sample.direction.y * b + sample.direction.z * n;
+                        radiance += source.sample(l, sample.lod) * sample.weight;
+                        weight += sample.weight;
+                    }
+                    radiance /= std::max(weight, 1e-6f);
+
+                    float* pTexel = &texels[4 * (static_cast<size_t>(y) * levelWidth + x)];
+                    pTexel[0] = radiance.r;
+                    pTexel[1] = radiance.g;
+                    pTexel[2] = radiance.b;
+                    pTexel[3] = 1.0f;
+                }
+            });
+
+            std::vector<std::byte> levelData(sizeof(uint16_t) * texels.size());
+            HalfFloat::pack(texels.data(), reinterpret_cast<uint16_t*>(levelData.data()), texels.size());
+            mipChain.levels.push_back(std::move(levelData));
+        }
+        return mipChain;
+    }
+
+    // Scale and bias to F0 of the specular BRDF integrated over the hemisphere, by n.v along x and roughness along y,
+    // as in the split-sum approximation of Karis
+    MipChain integrateBRDF(const EnvironmentLightingDesc& desc)
+    {
+        const uint32_t size = desc.brdfSize;
+        std::vector<float> texels(2 * static_cast<size_t>(size) * size);
+        Helpers::parallelFor(size, desc.threadCount, [&](uint32_t y) {
+            const float roughness = (static_cast<float>(y) + 0.5f) / static_cast<float>(size);
+            const float alpha = roughness * roughness;
+            const float k = alpha / 2.0f;
+
+            for (uint32_t x = 0; x < size; x++) {
+                const float nDotV = (static_cast<float>(x) + 0.5f) / static_cast<float>(size);
+                const glm::vec3 v(std::sqrt(1.0f - nDotV * nDotV), 0.0f, nDotV);
+
+                float scale = 0.0f;
+                float bias = 0.0f;
+                for (uint32_t i = 0; i < desc.brdfSampleCount; i++) {
+                    const glm::vec3 h = sampleGGX(hammersley(i, desc.brdfSampleCount), alpha);
+                    const float vDotH = std::max(glm::dot(v, h), 0.0f);
+                    const glm::vec3 l = 2.0f * vDotH * h - v;
+                    if (l.z > 0.0f && h.z > 0.0f) {
+                        const float g = nDotV / (nDotV * (1.0f - k) + k) * l.z / (l.z * (1.0f - k) + k);
+                        const float visibility = g * vDotH / (h.z * nDotV);
+                        const float fresnel = std::pow(1.0f - vDotH, 5.0f);
+                        scale += (1.0f - fresnel) * visibility;
+                        bias += fresnel * visibility;
+                    }
+                }
+
+                float* pTexel = &texels[2 * (static_cast<size_t>(y) * size + x)];
+                pTexel[0] = scale / static_cast<float>(desc.brdfSampleCount);
+                pTexel[1] = bias / static_cast<float>(desc.brdfSampleCount);
+            }
+        });
+
+        std::vector<std::byte> levelData(sizeof(uint16_t) * texels.size());
+        HalfFloat::pack(texels.data(), reinterpret_cast<uint16_t*>(levelData.data()), texels.size());
+        return {.format = VK_FORMAT_R16G16_SFLOAT, .width = size, .height = size, .levels = {std::move(levelData)}};
+    }
 } // namespace
 
-EnvironmentMap::EnvironmentMap(ptr<Device> pDevice, const std::filesystem::path& path, VkFormat format)
+EnvironmentMap::EnvironmentMap(ptr<Device> pDevice, const std::filesystem::path& path, VkFormat format,
+                               const EnvironmentLightingDesc& lighting)
     : mpDevice(pDevice)
 {
-    mpTexture = make_ptr<Texture>(pDevice, TextureType::Texture2D, format, path, false);
+    Log::Info("Loading environment map from {}", path.string());
 
-    std::filesystem::path fullPath = path;
-    if (path.is_relative()) {
-        fullPath = GetExecutablePath() / path;
+    // Decoded once for the texture and everything that is made from it
+    std::vector<uint8_t> file;
+    std::optional<DecodedImage> image = readImage(path, file);
+    if (!image) {
+        return;
     }
 
-    // The distribution has to match the orientation of the texture, which Texture loads flipped
-    stbi_set_flip_vertically_on_load(1);
+    const float* pData = reinterpret_cast<const float*>(image->data.data());
+    createTexture(pData, image->width, image->height, format);
+    createDistribution(pData, image->width, image->height);
+    if (lighting.enable) {
+        createLighting(pData, image->width, image->height, TextureCache::hash(file.data(), file.size()), lighting);
+    }
+}
 
-    std::string pathStr = fullPath.string();
-    int width, height, channels;
-    float* pData = stbi_loadf(pathStr.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+EnvironmentMap::EnvironmentMap(ptr<Device> pDevice, const std::array<std::filesystem::path, 6>& faces,
+                               VkFormat format, const EnvironmentLightingDesc& lighting)
+    : mpDevice(pDevice)
+{
+    // Faces one after the other, top row first as the layers of a cube map are laid out, where the decoder gives the
+    // bottom row first
+    std::vector<float> cube;
+    uint32_t size = 0;
+    uint64_t sourceKey = 0;
 
-    if (!pData) {
-        Log::Error("Failed to load environment map for importance sampling");
-        return;
+    for (uint32_t face = 0; face < 6; face++) {
+        Log::Info("Loading environment map face from {}", faces[face].string());
+
+        std::vector<uint8_t> file;
+        std::optional<DecodedImage> image = readImage(faces[face], file);
+        if (!image) {
+            return;
+        }
+
+        if (image->width != image->height || (face > 0 && image->width != size)) {
+            Log::Error("Environment map face {} is {} x {}, but faces have to be square and of the same size",
+                       faces[face].string(), image->width, image->height);
+            return;
+        }
+
+        size = image->width;
+        const size_t rowSize = 4 * static_cast<size_t>(size);
+        if (face == 0) {
+            cube.resize(rowSize * size * 6);
+        }
+
+        const float* pSource = reinterpret_cast<const float*>(image->data.data());
+        float* pFace = &cube[rowSize * size * face];
+        for (uint32_t y = 0; y < size; y++) {
+            std::memcpy(&pFace[rowSize * y], &pSource[rowSize * (size - 1 - y)], rowSize * sizeof(float));
+        }
+
+        sourceKey = face == 0 ? TextureCache::hash(file.data(), file.size())
+                              : TextureCache::hash(file.data(), file.size(), sourceKey);
     }
 
-    createDistribution(pData, width, height);
+    // Texels of the lat-long texture are about as large as those of the faces at the horizon
+    const uint32_t width = 4 * size;
+    const uint32_t height = 2 * size;
+    std::vector<float> latLong(4 * static_cast<size_t>(width) * height);
+    Helpers::parallelFor(height, 0, [&](uint32_t j) {
+        const float v = (static_cast<float>(j) + 0.5f) / static_cast<float>(height);
+        for (uint32_t i = 0; i < width; i++) {
+            const float u = (static_cast<float>(i) + 0.5f) / static_cast<float>(width);
+            const glm::vec3 radiance = sampleCubeMap(cube.data(), size, latLongToDirection(u, v));
+            float* pTexel = &latLong[4 * (static_cast<size_t>(j) * width + i)];
+            pTexel[0] = radiance.r;
+            pTexel[1] = radiance.g;
+            pTexel[2] = radiance.b;
+            pTexel[3] = 1.0f;
+        }
+    });
+
+    createTexture(latLong.data(), width, height, format);
+    createDistribution(latLong.data(), width, height);
+    if (lighting.enable) {
+        createLighting(latLong.data(), width, height, sourceKey, lighting);
+    }
 
-    stbi_image_free(pData);
+    if (mpTexture->getImage()->getFormat() == VK_FORMAT_R32G32B32A32_SFLOAT) {
+        mpCubeMap = make_ptr<Texture>(mpDevice, TextureType::CubeMap, VK_FORMAT_R32G32B32A32_SFLOAT, cube.data(), size,
+                                      size, 1, static_cast<uint32_t>(4 * sizeof(float)), true);
+    } else {
+        std::vector<uint16_t> halfData(cube.size());
+        HalfFloat::pack(cube.data(), halfData.data(), halfData.size());
+        mpCubeMap = make_ptr<Texture>(mpDevice, TextureType::CubeMap, VK_FORMAT_R16G16B16A16_SFLOAT, halfData.data(),
+                                      size, size, 1, static_cast<uint32_t>(4 * sizeof(uint16_t)), true);
+    }
 }
 
 EnvironmentMap::EnvironmentMap(ptr<Device> pDevice) : mpDevice(pDevice)
@@ -51,12 +492,69 @@ EnvironmentMap::EnvironmentMap(ptr<Device> pDevice) : mpDevice(pDevice)
                                   static_cast<uint32_t>(sizeof whiteTexel), false);
 
     createDistribution(whiteTexel, 1, 1);
+
+    // A specular map of a single level is as good as any for a uniform map
+    createLighting(whiteTexel, 1, 1, 0, {.enable = true, .specularWidth = 2, .specularLevelCount = 1});
 }
 
 EnvironmentMap::~EnvironmentMap()
 {
 }
 
+void EnvironmentMap::attachLighting(ptr<Shader> pShader) const
+{
+    if (!mpIrradiance) {
+        return;
+    }
+
+    pShader->setResource("environmentSH", mpIrradiance);
+    pShader->setResource("environmentSpecularMap", mpSpecular);
+    pShader->setResource("environmentBRDF", mpBRDFLUT);
+}
+
+ptr<Texture> EnvironmentMap::getCubeMap() const
+{
+    if (!mpCubeMap && mpTexture) {
+        const VkFormat format = mpTexture->getImage()->getFormat() == VK_FORMAT_R32G32B32A32_SFLOAT
+                                    ? VK_FORMAT_R32G32B32A32_SFLOAT
+                                    : VK_FORMAT_R16G16B16A16_SFLOAT;
+        mpCubeMap = make_ptr<Texture>(mpDevice, mpTexture, std::max(mWidth / 4, 1u), format, true);
+    }
+
+    return mpCubeMap;
+}
+
+void EnvironmentMap::createTexture(const float* pData, uint32_t width, uint32_t height, VkFormat format)
+{
+    if (format == VK_FORMAT_BC6H_UFLOAT_BLOCK && !mpDevice->supportsTextureCompressionBC()) {
+        Log::Warning("Device does not support BC6H, loading environment map as VK_FORMAT_E5B9G9R9_UFLOAT_PACK32");
+        format = VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+    }
+
+    const size_t valueCount = 4 * static_cast<size_t>(width) * height;
+    switch (format) {
+    case VK_FORMAT_R16G16B16A16_SFLOAT: {
+        std::vector<uint16_t> halfData(valueCount);
+        HalfFloat::pack(pData, halfData.data(), valueCount);
+        mpTexture = make_ptr<Texture>(mpDevice, TextureType::Texture2D, format, halfData.data(), width, height, 1,
+                                      static_cast<uint32_t>(4 * sizeof(uint16_t)), false);
+        break;
+    }
+    case VK_FORMAT_E5B9G9R9_UFLOAT_PACK32:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+        mpTexture = make_ptr<Texture>(mpDevice, TextureLoader::createHDRMipChain(pData, width, height, format, false));
+        break;
+    default:
+        if (format != VK_FORMAT_R32G32B32A32_SFLOAT) {
+            Log::Warning("Environment maps cannot be loaded as format {}, using VK_FORMAT_R32G32B32A32_SFLOAT instead",
+                         static_cast<uint32_t>(format));
+        }
+        mpTexture = make_ptr<Texture>(mpDevice, TextureType::Texture2D, VK_FORMAT_R32G32B32A32_SFLOAT, pData, width,
+                                      height, 1, static_cast<uint32_t>(4 * sizeof(float)), false);
+        break;
+    }
+}
+
 void EnvironmentMap::createDistribution(const float* pData, uint32_t width, uint32_t height)
 {
     mWidth = width;
@@ -65,17 +563,22 @@ void EnvironmentMap::createDistribution(const float* pData, uint32_t width, uint
     std::vector<float> conditional(static_cast<size_t>(height) * (static_cast<size_t>(width) + 1));
     std::vector<float> marginal(static_cast<size_t>(height) + 1);
     std::vector<float> rowIntegral(height);
+    std::vector<AliasTableEntry> conditionalAlias(static_cast<size_t>(height) * width);
+    std::vector<AliasTableEntry> marginalAlias(height);
 
-    for (uint32_t j = 0; j < height; j++) {
+    // Rows are independent of each other, so they are built on all cores
+    Helpers::parallelFor(height, 0, [&](uint32_t j) {
         // Rows near the poles cover less solid angle, so they should be sampled less often
         const float sinTheta = std::sin(PI * (static_cast<float>(j) + 0.5f) / static_cast<float>(height));
 
+        std::vector<float> weights(width);
         float* pRow = &conditional[static_cast<size_t>(j) * (static_cast<size_t>(width) + 1)];
         pRow[0] = 0.0f;
         for (uint32_t i = 0; i < width; i++) {
             const float* pTexel = &pData[4 * (static_cast<size_t>(j) * width + i)];
             const float luminance = 0.2126f * pTexel[0] + 0.7152f * pTexel[1] + 0.0722f * pTexel[2];
-            pRow[i + 1] = pRow[i] + (luminance + DENSITY_FLOOR) * sinTheta / static_cast<float>(width);
+            weights[i] = (luminance + DENSITY_FLOOR) * sinTheta / static_cast<float>(width);
+            pRow[i + 1] = pRow[i] + weights[i];
         }
 
         // The density floor guarantees a positive integral, so no division by zero is possible here
@@ -83,7 +586,9 @@ void EnvironmentMap::createDistribution(const float* pData, uint32_t width, uint
         for (uint32_t i = 1; i <= width; i++) {
             pRow[i] /= rowIntegral[j];
         }
-    }
+
+        buildAliasTable(weights.data(), width, &conditionalAlias[static_cast<size_t>(j) * width]);
+    });
 
     marginal[0] = 0.0f;
     for (uint32_t j = 0; j < height; j++) {
@@ -95,6 +600,8 @@ void EnvironmentMap::createDistribution(const float* pData, uint32_t width, uint
         marginal[j] /= total;
     }
 
+    buildAliasTable(rowIntegral.data(), height, marginalAlias.data());
+
     const VkDeviceSize marginalSize = marginal.size() * sizeof(float);
     const VkDeviceSize conditionalSize = conditional.size() * sizeof(float);
 
@@ -107,4 +614,90 @@ void EnvironmentMap::createDistribution(const float* pData, uint32_t width, uint
                                      VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
     mpConditional->copyFromHost(conditional.data(), conditionalSize);
+
+    const VkDeviceSize marginalAliasSize = marginalAlias.size() * sizeof(AliasTableEntry);
+    const VkDeviceSize conditionalAliasSize = conditionalAlias.size() * sizeof(AliasTableEntry);
+
+    mpMarginalAlias = make_ptr<Buffer>(mpDevice, marginalAliasSize,
+                                       VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mpMarginalAlias->copyFromHost(marginalAlias.data(), marginalAliasSize);
+
+    mpConditionalAlias = make_ptr<Buffer>(mpDevice, conditionalAliasSize,
+                                          VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                          VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mpConditionalAlias->copyFromHost(conditionalAlias.data(), conditionalAliasSize);
+}
+
+void EnvironmentMap::createLighting(const float* pData, uint32_t width, uint32_t height, uint64_t sourceKey,
+                                    const EnvironmentLightingDesc& desc)
+{
+    ptr<TextureCache> pCache = desc.cacheDirectory.empty() ? nullptr : make_ptr<TextureCache>(desc.cacheDirectory);
+
+    const uint32_t specularWidth = std::max(desc.specularWidth, 2u);
+    const uint32_t specularLevelCount = std::clamp(
+        desc.specularLevelCount, 1u, MipGenerator::getLevelCount(specularWidth, std::max(specularWidth / 2, 1u)));
+
+    // The mip levels of the source are only made if something is not in the cache
+    std::optional<LatLongPyramid> source;
+    auto getSource = [&]() -> const LatLongPyramid& {
+        if (!source) {
+            source = LatLongPyramid{
+                .levels = MipGenerator::generate(pData, width, height, {.threadCount = desc.threadCount}),
+                .width = width,
+                .height = height,
+            };
+        }
+        return *source;
+    };
+
+    // Looks an entry up in the cache, or makes it and stores it there
+    auto getCached = [&](uint64_t key, VkFormat format, const std::function<MipChain()>& make) {
+        std::optional<MipChain> mipChain = pCache ? pCache->load(key) : std::nullopt;
+        if (!mipChain || mipChain->format != format) {
+            mipChain = make();
+            if (pCache) {
+                pCache->store(key, *mipChain);
+            }
+        }
+        return *mipChain;
+    };
+
+    const uint32_t irradianceSettings[] = {kLightingVersion, 0, kIrradianceSourceWidth};
+    const uint64_t irradianceKey = TextureCache::hash(irradianceSettings, sizeof(irradianceSettings), sourceKey);
+    const MipChain irradiance = getCached(irradianceKey, VK_FORMAT_R32G32B32A32_SFLOAT, [&]() -> MipChain {
+        const std::array<glm::vec4, 9> coefficients = projectIrradiance(getSource(), desc.threadCount);
+        std::vector<std::byte> level(sizeof(coefficients));
+        std::memcpy(level.data(), coefficients.data(), sizeof(coefficients));
+        return {
+            .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+            .width = count(coefficients),
+            .height = 1,
+            .levels = {std::move(level)},
+        };
+    });
+    std::memcpy(mIrradiance.data(), irradiance.levels[0].data(), sizeof(mIrradiance));
+
+    mpIrradiance = make_ptr<Buffer>(mpDevice, sizeof(mIrradiance),
+                                    VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                        VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                    VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    mpIrradiance->copyFromHost(mIrradiance.data(), sizeof(mIrradiance));
+
+    const uint32_t specularSettings[] = {kLightingVersion, 1, specularWidth, specularLevelCount,
+                                         desc.specularSampleCount};
+    const uint64_t specularKey = TextureCache::hash(specularSettings, sizeof(specularSettings), sourceKey);
+    mpSpecular = make_ptr<Texture>(mpDevice, getCached(specularKey, VK_FORMAT_R16G16B16A16_SFLOAT, [&]() {
+                                       return prefilterSpecular(getSource(), specularWidth, specularLevelCount, desc);
+                                   }));
+    mpSpecular->setAddressMode(VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                               VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+
+    // The lookup table does not depend on the map, so every map shares the same entry
+    const uint32_t brdfSettings[] = {kLightingVersion, 2, desc.brdfSize, desc.brdfSampleCount};
+    const uint64_t brdfKey = TextureCache::hash(brdfSettings, sizeof(brdfSettings));
+    mpBRDFLUT = make_ptr<Texture>(mpDevice,
+                                  getCached(brdfKey, VK_FORMAT_R16G16_SFLOAT, [&]() { return integrateBRDF(desc); }));
+    mpBRDFLUT->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                              VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
 }
@@ -4,10 +4,50 @@
 
 #include "Buffer.h"
 #include "Device.h"
+#include "Shader.h"
 #include "Texture.h"
 
 namespace Mandrill
 {
+    /// <summary>
+    /// Entry of an alias table, as laid out in the storage buffers of EnvironmentMap. An entry is drawn uniformly and
+    /// kept with its probability, otherwise its alias is taken instead. The densities of both are stored alongside, so
+    /// that drawing a sample takes a single fetch.
+    /// </summary>
+    struct AliasTableEntry {
+        float probability; // Probability of keeping this entry rather than taking its alias
+        uint32_t alias;    // Index of the entry to take otherwise
+        float pdf;         // Density of this entry, its probability times the number of entries
+        float aliasPdf;    // Density of the alias
+    };
+
+    /// <summary>
+    /// Settings for the image-based lighting that an environment map can generate for rasterizers.
+    /// </summary>
+    struct EnvironmentLightingDesc {
+        // Whether to generate the lighting at all
+        bool enable = false;
+
+        // Width of the first level of the specular map, whose height is half of it
+        uint32_t specularWidth = 256;
+
+        // Number of levels of the specular map, for roughnesses evenly spaced from 0 in the first to 1 in the last
+        uint32_t specularLevelCount = 6;
+
+        // GGX samples per texel of the specular map
+        uint32_t specularSampleCount = 256;
+
+        // Width and height of the BRDF lookup table, and samples per texel of it
+        uint32_t brdfSize = 64;
+        uint32_t brdfSampleCount = 512;
+
+        // Directory to cache the results in, keyed by a hash of the file and of these settings. Empty to not cache.
+        std::filesystem::path cacheDirectory;
+
+        // Number of threads to generate the lighting on, 0 to use one per core
+        uint32_t threadCount = 0;
+    };
+
     /// <summary>
     /// Environment map stored as a lat-long texture, together with a distribution for importance sampling it.
     ///
@@ -23,6 +63,38 @@ namespace Mandrill
     /// <item>A conditional CDF over the texels within each row, holding height * (width + 1) values, where the CDF of
     /// row j starts at index j * (width + 1).</item>
     /// </list>
+    ///
+    /// The same distribution is also built as Walker/Vose alias tables of AliasTableEntry, which draw a sample in
+    /// constant time with one fetch from each table rather than a binary search through each CDF:
+    /// <list type="bullet">
+    /// <item>A marginal alias table over the rows, holding height entries.</item>
+    /// <item>A conditional alias table over the texels within each row, holding height * width entries, where the
+    /// table of row j starts at index j * width.</item>
+    /// </list>
+    /// The density of a texel in texture space is the pdf of its row in the marginal table times its pdf in the
+    /// conditional table. The tables take four times the memory of the CDFs. Shaders include EnvironmentSampling.glsl
+    /// to draw samples from them.
+    ///
+    /// Rasterizers can have the lighting of the map generated up front, on all cores, for the split-sum approximation
+    /// of image-based lighting:
+    /// <list type="bullet">
+    /// <item>Diffuse irradiance as nine spherical harmonics coefficients, already convolved with the cosine lobe, so
+    /// that the irradiance arriving at a normal n is the sum of coefficient i times basis function i at n. The basis
+    /// functions are the real ones of bands 0 to 2, in the order 1, y, z, x, xy, yz, 3z^2 - 1, xz, x^2 - y^2, with the
+    /// usual constants 0.282095, 0.488603, 1.092548, 0.315392 and 0.546274.</item>
+    /// <item>A specular map in the same lat-long layout as the texture, whose levels hold the radiance convolved with
+    /// GGX lobes of increasing roughness, to be sampled at level roughness * (level count - 1).</item>
+    /// <item>A BRDF lookup table indexed by (n.v, roughness), holding the scale and bias to apply to F0.</item>
+    /// </list>
+    /// Each of them is stored in a TextureCache when a cache directory is given, so that only the first load of a
+    /// map pays for it. Shaders include EnvironmentLighting.glsl, which evaluates all three, and get them with
+    /// attachLighting().
+    ///
+    /// The map is also available as a cube map, which sky and reflection lookups sample with the direction itself
+    /// rather than through the trigonometry of the lat-long mapping, and whose texels are spread far more evenly over
+    /// the sphere than the rows near the poles. It is converted from the texture on the device the first time it is
+    /// asked for. A map can also be made from the six faces of a cube map, in which case the lat-long texture that the
+    /// distribution and the lighting are built from is resampled from the faces on the host.
     /// </summary>
     class EnvironmentMap
     {
@@ -31,19 +103,37 @@ namespace Mandrill
 
         /// <summary>
         /// Create an environment map from a file. Use a floating-point format to keep the dynamic range of HDR files,
-        /// which is what makes importance sampling worthwhile in the first place.
+        /// which is what makes importance sampling worthwhile in the first place. VK_FORMAT_E5B9G9R9_UFLOAT_PACK32
+        /// takes a quarter of the memory of the default format and VK_FORMAT_BC6H_UFLOAT_BLOCK a sixteenth, which
+        /// matters for large maps, while the sampling distribution is still built from the full-precision file.
         ///
-        /// Note that the file is read twice, once for the texture and once for the sampling distribution.
+        /// The file is read and decoded once, for the texture, the sampling distribution and the lighting alike.
         /// </summary>
         /// <param name="pDevice">Device to use</param>
         /// <param name="path">Path to environment map file</param>
-        /// <param name="format">Format to use for the texture</param>
+        /// <param name="format">Format to use for the texture, VK_FORMAT_R32G32B32A32_SFLOAT,
+        /// VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 or VK_FORMAT_BC6H_UFLOAT_BLOCK</param>
+        /// <param name="lighting">Image-based lighting to generate</param>
         MANDRILL_API EnvironmentMap(ptr<Device> pDevice, const std::filesystem::path& path,
-                                    VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT);
+                                    VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                                    const EnvironmentLightingDesc& lighting = {});
+
+        /// <summary>
+        /// Create an environment map from the six faces of a cube map, in the order +X, -X, +Y, -Y, +Z, -Z. The faces
+        /// are uploaded as they are, and a lat-long texture twice as tall and four times as wide as a face is made
+        /// from them.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="faces">Paths to the face files, which have to be square and of the same size</param>
+        /// <param name="format">Format to use for the lat-long texture, as for a single file</param>
+        /// <param name="lighting">Image-based lighting to generate</param>
+        MANDRILL_API EnvironmentMap(ptr<Device> pDevice, const std::array<std::filesystem::path, 6>& faces,
+                                    VkFormat format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                                    const EnvironmentLightingDesc& lighting = {});
 
         /// <summary>
-        /// Create a uniform white environment map of a single texel. Useful as a placeholder before a map has been
-        /// loaded, so that descriptors can be created and bound regardless.
+        /// Create a uniform white environment map of a single texel, with its lighting. Useful as a placeholder
+        /// before a map has been loaded, so that descriptors can be created and bound regardless.
         /// </summary>
         /// <param name="pDevice">Device to use</param>
         MANDRILL_API EnvironmentMap(ptr<Device> pDevice);
@@ -62,6 +152,13 @@ namespace Mandrill
             return mpTexture;
         }
 
+        /// <summary>
+        /// Get the environment map as a cube map with mipmaps, with faces a quarter of the width of the texture. It
+        /// is kept in VK_FORMAT_R32G32B32A32_SFLOAT if the texture is, and in VK_FORMAT_R16G16B16A16_SFLOAT otherwise.
+        /// </summary>
+        /// <returns>Pointer to texture</returns>
+        MANDRILL_API ptr<Texture> getCubeMap() const;
+
         /// <summary>
         /// Get the buffer holding the marginal CDF over the rows.
         /// </summary>
@@ -80,6 +177,67 @@ namespace Mandrill
             return mpConditional;
         }
 
+        /// <summary>
+        /// Get the buffer holding the marginal alias table over the rows.
+        /// </summary>
+        /// <returns>Pointer to buffer</returns>
+        MANDRILL_API ptr<Buffer> getMarginalAliasTable() const
+        {
+            return mpMarginalAlias;
+        }
+
+        /// <summary>
+        /// Get the buffer holding the conditional alias table over the texels of each row.
+        /// </summary>
+        /// <returns>Pointer to buffer</returns>
+        MANDRILL_API ptr<Buffer> getConditionalAliasTable() const
+        {
+            return mpConditionalAlias;
+        }
+
+        /// <summary>
+        /// Get the spherical harmonics coefficients of the diffuse irradiance.
+        /// </summary>
+        /// <returns>Nine coefficients, with the colour in xyz and w unused</returns>
+        MANDRILL_API const std::array<glm::vec4, 9>& getIrradianceCoefficients() const
+        {
+            return mIrradiance;
+        }
+
+        /// <summary>
+        /// Get the buffer holding the spherical harmonics coefficients of the diffuse irradiance, as nine vec4s.
+        /// </summary>
+        /// <returns>Pointer to buffer, or nullptr if the lighting was not generated</returns>
+        MANDRILL_API ptr<Buffer> getIrradiance() const
+        {
+            return mpIrradiance;
+        }
+
+        /// <summary>
+        /// Get the specular map, with one level per roughness.
+        /// </summary>
+        /// <returns>Pointer to texture, or nullptr if the lighting was not generated</returns>
+        MANDRILL_API ptr<Texture> getSpecular() const
+        {
+            return mpSpecular;
+        }
+
+        /// <summary>
+        /// Get the BRDF lookup table.
+        /// </summary>
+        /// <returns>Pointer to texture, or nullptr if the lighting was not generated</returns>
+        MANDRILL_API ptr<Texture> getBRDFLUT() const
+        {
+            return mpBRDFLUT;
+        }
+
+        /// <summary>
+        /// Attach the irradiance, the specular map and the BRDF lookup table to a shader that includes
+        /// EnvironmentLighting.glsl. Nothing is attached if the lighting was not generated.
+        /// </summary>
+        /// <param name="pShader">Shader to attach the resources to</param>
+        MANDRILL_API void attachLighting(ptr<Shader> pShader) const;
+
         /// <summary>
         /// Get the width of the environment map.
         /// </summary>
@@ -99,13 +257,24 @@ namespace Mandrill
         }
 
     private:
+        void createTexture(const float* pData, uint32_t width, uint32_t height, VkFormat format);
         void createDistribution(const float* pData, uint32_t width, uint32_t height);
+        void createLighting(const float* pData, uint32_t width, uint32_t height, uint64_t sourceKey,
+                            const EnvironmentLightingDesc& desc);
 
         ptr<Device> mpDevice;
 
         ptr<Texture> mpTexture;
+        mutable ptr<Texture> mpCubeMap; // Converted when first asked for, unless loaded from faces
         ptr<Buffer> mpMarginal;
         ptr<Buffer> mpConditional;
+        ptr<Buffer> mpMarginalAlias;
+        ptr<Buffer> mpConditionalAlias;
+
+        std::array<glm::vec4, 9> mIrradiance = {};
+        ptr<Buffer> mpIrradiance;
+        ptr<Texture> mpSpecular;
+        ptr<Texture> mpBRDFLUT;
 
         uint32_t mWidth = 0;
         uint32_t mHeight = 0;
@@ -0,0 +1,57 @@
+// Importance sampling of an environment map with the alias tables of EnvironmentMap. Define ENV_ALIAS_SET,
+// ENV_MARGINAL_ALIAS_BINDING and ENV_CONDITIONAL_ALIAS_BINDING before including this file.
+//
+// Sampling is independent of how the map is projected: it works in texture space, and converting the density to
+// solid angle is left to the caller.
+
+// Must match AliasTableEntry
+struct AliasTableEntry {
+    float probability;
+    uint alias;
+    float pdf;
+    float aliasPdf;
+};
+
+layout(std430, set = ENV_ALIAS_SET, binding = ENV_MARGINAL_ALIAS_BINDING) readonly buffer MarginalAliasTable {
+    AliasTableEntry marginalAlias[];
+};
+
+layout(std430, set = ENV_ALIAS_SET, binding = ENV_CONDITIONAL_ALIAS_BINDING) readonly buffer ConditionalAliasTable {
+    AliasTableEntry conditionalAlias[];
+};
+
+// Sample texture coordinates proportionally to the distribution, with one fetch from each table. xi.x picks the row
+// and xi.y the texel within it, where the integer part of xi * n selects an entry and the fraction that is left
+// decides between the entry and its alias. xi.zw place the sample within the texel. Returns the pdf with respect to
+// texture space.
+vec2 sampleEnvironmentUV(ivec2 size, vec4 xi, out float pdf)
+{
+    float scaledV = xi.x * float(size.y);
+    int row = min(int(scaledV), size.y - 1);
+    AliasTableEntry rowEntry = marginalAlias[row];
+    float pdfV = rowEntry.pdf;
+    if (scaledV - float(row) >= rowEntry.probability) {
+        row = int(rowEntry.alias);
+        pdfV = rowEntry.aliasPdf;
+    }
+
+    float scaledU = xi.y * float(size.x);
+    int col = min(int(scaledU), size.x - 1);
+    AliasTableEntry colEntry = conditionalAlias[row * size.x + col];
+    float pdfU = colEntry.pdf;
+    if (scaledU - float(col) >= colEntry.probability) {
+        col = int(colEntry.alias);
+        pdfU = colEntry.aliasPdf;
+    }
+
+    pdf = pdfV * pdfU;
+    return (vec2(col, row) + xi.zw) / vec2(size);
+}
+
+// The pdf that sampleEnvironmentUV would have produced for texture coordinates, with respect to texture space
+float environmentUVPdf(ivec2 size, vec2 uv)
+{
+    int col = clamp(int(uv.x * float(size.x)), 0, size.x - 1);
+    int row = clamp(int(uv.y * float(size.y)), 0, size.y - 1);
+    return marginalAlias[row].pdf * conditionalAlias[row * size.x + col].pdf;
+}
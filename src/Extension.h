@@ -19,9 +19,13 @@ extern MANDRILL_API PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStr
 extern MANDRILL_API PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR_;
 extern MANDRILL_API PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR_;
 extern MANDRILL_API PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR_;
+extern MANDRILL_API PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR_;
+extern MANDRILL_API PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR_;
 extern MANDRILL_API PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR_;
 extern MANDRILL_API PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR_;
+extern MANDRILL_API PFN_vkCmdTraceRaysIndirectKHR vkCmdTraceRaysIndirectKHR_;
 extern MANDRILL_API PFN_vkSetDebugUtilsObjectNameEXT vkSetDebugUtilsObjectNameEXT_;
+extern MANDRILL_API PFN_vkWaitForPresentKHR vkWaitForPresentKHR_;
 
 // Add more extensions here, don't forget the macro below.
 }
@@ -34,9 +38,13 @@ extern MANDRILL_API PFN_vkSetDebugUtilsObjectNameEXT vkSetDebugUtilsObjectNameEX
 #define vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR_
 #define vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR_
 #define vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR_
+#define vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR_
+#define vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR_
 #define vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR_
 #define vkCmdTraceRaysKHR vkCmdTraceRaysKHR_
+#define vkCmdTraceRaysIndirectKHR vkCmdTraceRaysIndirectKHR_
 #define vkSetDebugUtilsObjectNameEXT vkSetDebugUtilsObjectNameEXT_
+#define vkWaitForPresentKHR vkWaitForPresentKHR_
 
 // Macro for loading a device function pointers as Xvk...()
 #define VK_LOAD(device, func_name)                                                                                     \
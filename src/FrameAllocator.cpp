@@ -0,0 +1,96 @@
+#include "FrameAllocator.h"
+
+#include "Helpers.h"
+#include "Log.h"
+
+using namespace Mandrill;
+
+FrameAllocator::FrameAllocator(ptr<Device> pDevice, VkDeviceSize sizePerFrame, VkBufferUsageFlags usage)
+    : mpDevice(pDevice)
+{
+    mAlignment = Helpers::getOffsetAlignment(pDevice, usage);
+
+    // Keep every arena starting on an aligned offset so that the default alignment holds across all of them
+    mSizePerFrame = Helpers::alignTo(std::max(sizePerFrame, VkDeviceSize(1)), mAlignment);
+
+    mArenas.resize(pDevice->getFramesInFlightCount());
+
+    mpBuffer = pDevice->createBuffer(mSizePerFrame * mArenas.size(), usage,
+                                     VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+        mDeviceAddress = mpBuffer->getDeviceAddress();
+    }
+}
+
+FrameAllocator::~FrameAllocator()
+{
+}
+
+FrameAllocator::Arena& FrameAllocator::getCurrentArena()
+{
+    Arena& arena = mArenas[mpDevice->getFrameInFlightIndex()];
+    uint64_t frameNumber = mpDevice->getFrameNumber();
+
+    if (arena.frameNumber != frameNumber) {
+        // The swapchain normally waited for this already, but an application that skips it must not overwrite data
+        // the device is still reading
+        if (arena.frameNumber != 0) {
+            mpDevice->waitForFrame(arena.frameNumber);
+        }
+
+        arena.head = 0;
+        arena.frameNumber = frameNumber;
+    }
+
+    return arena;
+}
+
+TransientAllocation FrameAllocator::allocate(VkDeviceSize size, VkDeviceSize alignment)
+{
+    if (alignment == 0) {
+        alignment = mAlignment;
+    }
+
+    if (alignment & (alignment - 1)) {
+        Log::Error("FrameAllocator: Alignment {} is not a power of two", alignment);
+        return {};
+    }
+
+    Arena& arena = getCurrentArena();
+    uint32_t arenaIndex = mpDevice->getFrameInFlightIndex();
+
+    VkDeviceSize arenaOffset = mSizePerFrame * arenaIndex;
+    VkDeviceSize offset = Helpers::alignTo(arenaOffset + arena.head, alignment);
+
+    if (offset + size > arenaOffset + mSizePerFrame) {
+        Log::Error("FrameAllocator: Out of memory, {} bytes requested with {} of {} bytes used this frame", size,
+                   arena.head, mSizePerFrame);
+        return {};
+    }
+
+    arena.head = offset + size - arenaOffset;
+
+    return TransientAllocation{
+        .pData = static_cast<std::byte*>(mpBuffer->getHostMap()) + offset,
+        .buffer = mpBuffer->getBuffer(),
+        .offset = offset,
+        .size = size,
+        .deviceAddress = mDeviceAddress ? mDeviceAddress + offset : 0,
+    };
+}
+
+TransientAllocation FrameAllocator::copyFromHost(const void* pData, VkDeviceSize size, VkDeviceSize alignment)
+{
+    TransientAllocation allocation = allocate(size, alignment);
+    if (allocation.pData) {
+        std::memcpy(allocation.pData, pData, size);
+    }
+    return allocation;
+}
+
+VkDeviceSize FrameAllocator::getUsedSize() const
+{
+    const Arena& arena = mArenas[mpDevice->getFrameInFlightIndex()];
+    return arena.frameNumber == mpDevice->getFrameNumber() ? arena.head : 0;
+}
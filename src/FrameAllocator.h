@@ -0,0 +1,125 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "Device.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// A range of transient memory handed out by a FrameAllocator. It is valid until the same frame in flight comes
+    /// around again, so it should be written once and used by the frame it was allocated in.
+    /// </summary>
+    struct TransientAllocation {
+        void* pData = nullptr;             // Host pointer to write the data through, nullptr if the allocation failed
+        VkBuffer buffer = VK_NULL_HANDLE;  // Buffer the range lives in
+        VkDeviceSize offset = 0;           // Offset from the start of the buffer, usable as a dynamic offset
+        VkDeviceSize size = 0;             // Size of the range in bytes
+        VkDeviceAddress deviceAddress = 0; // Device address of the start of the range, 0 without address usage
+    };
+
+    /// <summary>
+    /// Linear allocator for data that only lives for one frame, such as per-draw uniforms. One large host-visible
+    /// buffer is split into one arena per frame in flight, and allocating is a matter of bumping a pointer within the
+    /// arena of the current frame.
+    ///
+    /// An arena is reset the first time it is allocated from in a new frame. Before that happens the allocator makes
+    /// sure the device has finished the frame that last used the arena, which is normally already the case once the
+    /// swapchain has waited for its frame.
+    ///
+    /// Bind a range either with its offset as a dynamic offset into getBuffer(), or through its device address.
+    /// </summary>
+    class FrameAllocator
+    {
+    public:
+        MANDRILL_NON_COPYABLE(FrameAllocator)
+
+        /// <summary>
+        /// Create a new frame allocator.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="sizePerFrame">Size of the arena of each frame in flight in bytes</param>
+        /// <param name="usage">How the buffer will be used, which also decides the default alignment of the
+        /// ranges</param>
+        MANDRILL_API FrameAllocator(ptr<Device> pDevice, VkDeviceSize sizePerFrame,
+                                    VkBufferUsageFlags usage = VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT |
+                                                               VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
+                                                               VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT);
+
+        /// <summary>
+        /// Destructor for frame allocator.
+        /// </summary>
+        MANDRILL_API ~FrameAllocator();
+
+        /// <summary>
+        /// Allocate a range from the arena of the current frame in flight.
+        /// </summary>
+        /// <param name="size">Size of the range in bytes</param>
+        /// <param name="alignment">Alignment of the start of the range. Leave at 0 to use the alignment the device
+        /// requires of descriptor offsets for the usage the allocator was created with.</param>
+        /// <returns>The allocated range, with pData set to nullptr if the arena is full</returns>
+        MANDRILL_API TransientAllocation allocate(VkDeviceSize size, VkDeviceSize alignment = 0);
+
+        /// <summary>
+        /// Allocate a range from the arena of the current frame in flight and copy data into it.
+        /// </summary>
+        /// <param name="pData">Data to copy</param>
+        /// <param name="size">Size of the data in bytes</param>
+        /// <param name="alignment">Alignment of the start of the range, 0 for the default</param>
+        /// <returns>The allocated range, with pData set to nullptr if the arena is full</returns>
+        MANDRILL_API TransientAllocation copyFromHost(const void* pData, VkDeviceSize size, VkDeviceSize alignment = 0);
+
+        /// <summary>
+        /// Allocate a range from the arena of the current frame in flight and copy a value into it.
+        /// </summary>
+        /// <param name="value">Value to copy</param>
+        /// <returns>The allocated range, with pData set to nullptr if the arena is full</returns>
+        template <typename T> TransientAllocation copyFromHost(const T& value)
+        {
+            return copyFromHost(&value, sizeof(T));
+        }
+
+        /// <summary>
+        /// Get the number of bytes allocated from the arena of the current frame so far.
+        /// </summary>
+        /// <returns>Number of bytes in use</returns>
+        MANDRILL_API VkDeviceSize getUsedSize() const;
+
+        /// <summary>
+        /// Get the size of the arena of each frame in flight.
+        /// </summary>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API VkDeviceSize getSizePerFrame() const
+        {
+            return mSizePerFrame;
+        }
+
+        /// <summary>
+        /// Get the underlying buffer, holding the arenas of all frames in flight.
+        /// </summary>
+        /// <returns>Buffer holding all arenas</returns>
+        MANDRILL_API ptr<Buffer> getBuffer() const
+        {
+            return mpBuffer;
+        }
+
+    private:
+        struct Arena {
+            VkDeviceSize head = 0;    // Offset of the first free byte, relative to the start of the arena
+            uint64_t frameNumber = 0; // Frame that the allocations in the arena belong to
+        };
+
+        // Returns the arena of the current frame, reset if it still holds the allocations of an earlier frame
+        Arena& getCurrentArena();
+
+        ptr<Device> mpDevice;
+        ptr<Buffer> mpBuffer;
+
+        VkDeviceSize mSizePerFrame;
+        VkDeviceSize mAlignment;
+        VkDeviceAddress mDeviceAddress = 0;
+
+        std::vector<Arena> mArenas; // One per frame in flight
+    };
+} // namespace Mandrill
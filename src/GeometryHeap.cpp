@@ -0,0 +1,194 @@
+#include "GeometryHeap.h"
+
+#include "Helpers.h"
+#include "Log.h"
+
+using namespace Mandrill;
+
+GeometryHeap::GeometryHeap(ptr<Device> pDevice, VkDeviceSize size, VkBufferUsageFlags usage, VkDeviceSize alignment,
+                           VkDeviceSize maxSize)
+    : mpDevice(pDevice), mProperties(VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT),
+      mAlignment(std::max(alignment, VkDeviceSize(1)))
+{
+    // Whole ranges only, so that the last one still lines up
+    mMaxSize = std::max(maxSize / mAlignment * mAlignment, mAlignment);
+
+    // Growing and compacting copy the heap into a new buffer on the device
+    mUsage = usage | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+    // An empty buffer cannot be allocated, and a scene without geometry yet is a normal state to be in
+    size = std::min(alignUp(std::max(size, mAlignment)), mMaxSize);
+
+    mpBuffer = mpDevice->createBuffer(size, mUsage, mProperties);
+    mFreeBlocks[0] = size;
+}
+
+GeometryHeap::~GeometryHeap()
+{
+}
+
+std::optional<VkDeviceSize> GeometryHeap::allocate(VkDeviceSize size)
+{
+    size = alignUp(std::max(size, VkDeviceSize(1)));
+
+    auto fits = [size](const auto& block) { return block.second >= size; };
+
+    // First fit, which tends to keep the start of the heap dense and the free space towards the end
+    auto it = std::find_if(mFreeBlocks.begin(), mFreeBlocks.end(), fits);
+    if (it == mFreeBlocks.end()) {
+        if (!grow(size)) {
+            return std::nullopt;
+        }
+        it = std::find_if(mFreeBlocks.begin(), mFreeBlocks.end(), fits);
+    }
+
+    VkDeviceSize offset = it->first;
+    VkDeviceSize remaining = it->second - size;
+    mFreeBlocks.erase(it);
+    if (remaining > 0) {
+        mFreeBlocks[offset + size] = remaining;
+    }
+
+    mAllocations[offset] = size;
+    mUsedSize += size;
+
+    return offset;
+}
+
+void GeometryHeap::free(VkDeviceSize offset)
+{
+    auto allocation = mAllocations.find(offset);
+    if (allocation == mAllocations.end()) {
+        Log::Error("GeometryHeap: No range is allocated at offset {}", offset);
+        return;
+    }
+
+    VkDeviceSize size = allocation->second;
+    mAllocations.erase(allocation);
+    mUsedSize -= size;
+
+    // Merge with the free blocks on either side
+    auto next = mFreeBlocks.lower_bound(offset);
+    if (next != mFreeBlocks.end() && next->first == offset + size) {
+        size += next->second;
+        next = mFreeBlocks.erase(next);
+    }
+
+    if (next != mFreeBlocks.begin()) {
+        auto prev = std::prev(next);
+        if (prev->first + prev->second == offset) {
+            prev->second += size;
+            return;
+        }
+    }
+
+    mFreeBlocks[offset] = size;
+}
+
+std::vector<GeometryHeap::Relocation> GeometryHeap::compact()
+{
+    std::vector<std::pair<VkDeviceSize, VkDeviceSize>> allocations(mAllocations.begin(), mAllocations.end());
+    std::sort(allocations.begin(), allocations.end());
+
+    std::vector<Relocation> relocations;
+    std::vector<VkBufferCopy> regions;
+    std::unordered_map<VkDeviceSize, VkDeviceSize> packed;
+
+    VkDeviceSize offset = 0;
+    for (const auto& [oldOffset, size] : allocations) {
+        if (oldOffset != offset) {
+            relocations.push_back({oldOffset, offset});
+        }
+        regions.push_back({
+            .srcOffset = oldOffset,
+            .dstOffset = offset,
+            .size = size,
+        });
+        packed[offset] = size;
+        offset += size;
+    }
+
+    if (relocations.empty()) {
+        return {}; // Already compact
+    }
+
+    // Copy into a new buffer, since ranges within one buffer may not overlap their own destination
+    ptr<Buffer> pBuffer = mpDevice->createBuffer(getSize(), mUsage, mProperties);
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+    vkCmdCopyBuffer(cmd, mpBuffer->getBuffer(), pBuffer->getBuffer(), count(regions), regions.data());
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    mpBuffer = pBuffer;
+    mAllocations = std::move(packed);
+    mFreeBlocks.clear();
+    if (offset < getSize()) {
+        mFreeBlocks[offset] = getSize() - offset;
+    }
+    mGeneration += 1;
+
+    return relocations;
+}
+
+float GeometryHeap::getFragmentation() const
+{
+    VkDeviceSize freeSize = getSize() - mUsedSize;
+    if (freeSize == 0) {
+        return 0.0f;
+    }
+
+    VkDeviceSize largest = 0;
+    for (const auto& [offset, size] : mFreeBlocks) {
+        largest = std::max(largest, size);
+    }
+
+    return 1.0f - static_cast<float>(largest) / static_cast<float>(freeSize);
+}
+
+bool GeometryHeap::grow(VkDeviceSize size)
+{
+    VkDeviceSize oldSize = getSize();
+
+    // A free block at the end of the heap already covers part of the range
+    VkDeviceSize requiredSize = oldSize + size;
+    if (!mFreeBlocks.empty()) {
+        auto last = std::prev(mFreeBlocks.end());
+        if (last->first + last->second == oldSize) {
+            requiredSize -= last->second;
+        }
+    }
+
+    if (requiredSize > mMaxSize) {
+        return false;
+    }
+
+    // Grow geometrically so that a stream of small additions does not copy the whole heap every time
+    VkDeviceSize newSize = std::min(alignUp(std::max(oldSize * 2, requiredSize)), mMaxSize);
+
+    ptr<Buffer> pBuffer = mpDevice->createBuffer(newSize, mUsage, mProperties);
+
+    if (mUsedSize > 0) {
+        VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+        VkBufferCopy region = {
+            .size = oldSize,
+        };
+        vkCmdCopyBuffer(cmd, mpBuffer->getBuffer(), pBuffer->getBuffer(), 1, &region);
+        Helpers::cmdEnd(mpDevice, cmd);
+    }
+
+    mpBuffer = pBuffer;
+    mGeneration += 1;
+
+    // The new space joins the free block at the end of the old heap, if there is one
+    VkDeviceSize addedSize = newSize - oldSize;
+    if (!mFreeBlocks.empty()) {
+        auto last = std::prev(mFreeBlocks.end());
+        if (last->first + last->second == oldSize) {
+            last->second += addedSize;
+            return true;
+        }
+    }
+    mFreeBlocks[oldSize] = addedSize;
+
+    return true;
+}
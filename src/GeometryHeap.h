@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "Device.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// A device buffer that is handed out in ranges, for geometry that is added and removed while the application is
+    /// running. Free space is kept in a list of blocks that are merged with their neighbours when a range is freed.
+    ///
+    /// The heap grows when a range does not fit, up to a maximum size, and it can be compacted to gather the free space
+    /// in one block. Both replace the underlying buffer and move the ranges on the device, so anything that refers to
+    /// the buffer or to offsets in it has to be updated afterwards. getGeneration() tells when that has happened.
+    /// </summary>
+    class GeometryHeap
+    {
+    public:
+        MANDRILL_NON_COPYABLE(GeometryHeap)
+
+        /// <summary>
+        /// Where a range ended up after the heap was compacted.
+        /// </summary>
+        struct Relocation {
+            VkDeviceSize oldOffset;
+            VkDeviceSize newOffset;
+        };
+
+        /// <summary>
+        /// Create a new geometry heap.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="size">Initial size of the heap in bytes</param>
+        /// <param name="usage">How the buffer will be used, transfers within the heap are added on top</param>
+        /// <param name="alignment">Alignment of every range, which does not have to be a power of two so that ranges
+        /// can line up with whole vertices</param>
+        /// <param name="maxSize">Size the heap may grow to at most, such as the largest buffer the device can
+        /// allocate</param>
+        MANDRILL_API GeometryHeap(ptr<Device> pDevice, VkDeviceSize size, VkBufferUsageFlags usage,
+                                  VkDeviceSize alignment, VkDeviceSize maxSize = std::numeric_limits<VkDeviceSize>::max());
+
+        /// <summary>
+        /// Destructor for geometry heap.
+        /// </summary>
+        MANDRILL_API ~GeometryHeap();
+
+        /// <summary>
+        /// Allocate a range from the heap, growing the heap if there is no free block large enough.
+        /// </summary>
+        /// <param name="size">Size of the range in bytes</param>
+        /// <returns>Offset of the range from the start of the buffer, or nothing if the heap cannot grow enough to
+        /// fit it</returns>
+        MANDRILL_API std::optional<VkDeviceSize> allocate(VkDeviceSize size);
+
+        /// <summary>
+        /// Return a range to the heap.
+        /// </summary>
+        /// <param name="offset">Offset that was returned when the range was allocated</param>
+        MANDRILL_API void free(VkDeviceSize offset);
+
+        /// <summary>
+        /// Move all ranges to the start of the heap, in the order they have in the buffer, so that the free space
+        /// forms one block at the end. The copy happens on the device and does not need the data on the host.
+        /// </summary>
+        /// <returns>The ranges that moved</returns>
+        MANDRILL_API std::vector<Relocation> compact();
+
+        /// <summary>
+        /// Get how scattered the free space is, as the share of it that lies outside the largest free block.
+        /// </summary>
+        /// <returns>0 if the free space is in one block, approaching 1 the more it is split up</returns>
+        MANDRILL_API float getFragmentation() const;
+
+        /// <summary>
+        /// Get the buffer holding the heap.
+        /// </summary>
+        /// <returns>Buffer holding the heap</returns>
+        MANDRILL_API ptr<Buffer> getBuffer() const
+        {
+            return mpBuffer;
+        }
+
+        /// <summary>
+        /// Get the size of the heap.
+        /// </summary>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API VkDeviceSize getSize() const
+        {
+            return mpBuffer->getSize();
+        }
+
+        /// <summary>
+        /// Get the number of bytes that are allocated, alignment included.
+        /// </summary>
+        /// <returns>Allocated size in bytes</returns>
+        MANDRILL_API VkDeviceSize getUsedSize() const
+        {
+            return mUsedSize;
+        }
+
+        /// <summary>
+        /// Get a number that changes whenever the underlying buffer is replaced, which happens when the heap grows or
+        /// is compacted.
+        /// </summary>
+        /// <returns>Generation of the buffer</returns>
+        MANDRILL_API uint64_t getGeneration() const
+        {
+            return mGeneration;
+        }
+
+    private:
+        // Replace the buffer with one that has room for a range of the given size at the end, keeping the contents.
+        // Returns false if that would take the heap past its maximum size.
+        bool grow(VkDeviceSize size);
+
+        VkDeviceSize alignUp(VkDeviceSize value) const
+        {
+            return (value + mAlignment - 1) / mAlignment * mAlignment;
+        }
+
+        ptr<Device> mpDevice;
+        ptr<Buffer> mpBuffer;
+
+        VkBufferUsageFlags mUsage;
+        VkMemoryPropertyFlags mProperties;
+        VkDeviceSize mAlignment;
+        VkDeviceSize mMaxSize;
+        VkDeviceSize mUsedSize = 0;
+        uint64_t mGeneration = 0;
+
+        std::map<VkDeviceSize, VkDeviceSize> mFreeBlocks;           // Offset to size, ordered so neighbours can merge
+        std::unordered_map<VkDeviceSize, VkDeviceSize> mAllocations; // Offset to size
+    };
+} // namespace Mandrill
@@ -0,0 +1,94 @@
+#include "HalfFloat.h"
+
+#include <glm/gtc/packing.hpp>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define MANDRILL_HALF_FLOAT_F16C
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define F16C_TARGET
+#else
+#include <cpuid.h>
+#define F16C_TARGET __attribute__((target("f16c")))
+#endif
+#endif
+
+using namespace Mandrill;
+
+static constexpr float kHalfMax = 65504.0f;
+
+#ifdef MANDRILL_HALF_FLOAT_F16C
+static bool detectF16C()
+{
+    uint32_t ecx = 0;
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    ecx = static_cast<uint32_t>(info[2]);
+#else
+    uint32_t eax, ebx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        return false;
+    }
+#endif
+
+    // F16C instructions are VEX encoded, so the OS has to save the AVX state as well as the CPU supporting them
+    const bool f16c = ecx & (1u << 29);
+    const bool osxsave = ecx & (1u << 27);
+    const bool avx = ecx & (1u << 28);
+    if (!f16c || !osxsave || !avx) {
+        return false;
+    }
+
+#if defined(_MSC_VER)
+    const uint64_t xcr0 = _xgetbv(0);
+#else
+    uint32_t xcr0Low, xcr0High;
+    __asm__("xgetbv" : "=a"(xcr0Low), "=d"(xcr0High) : "c"(0));
+    const uint64_t xcr0 = (static_cast<uint64_t>(xcr0High) << 32) | xcr0Low;
+#endif
+    return (xcr0 & 0x6) == 0x6; // XMM and YMM state
+}
+
+F16C_TARGET static void packF16C(const float* pSrc, uint16_t* pDst, size_t count)
+{
+    const __m128 lo = _mm_set1_ps(-kHalfMax);
+    const __m128 hi = _mm_set1_ps(kHalfMax);
+
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(pSrc + i);
+        v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(pDst + i), _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+    }
+
+    for (; i < count; i++) {
+        pDst[i] = glm::packHalf1x16(std::clamp(pSrc[i], -kHalfMax, kHalfMax));
+    }
+}
+#endif
+
+void HalfFloat::pack(const float* pSrc, uint16_t* pDst, size_t count)
+{
+#ifdef MANDRILL_HALF_FLOAT_F16C
+    if (hasF16C()) {
+        packF16C(pSrc, pDst, count);
+        return;
+    }
+#endif
+
+    for (size_t i = 0; i < count; i++) {
+        pDst[i] = glm::packHalf1x16(std::clamp(pSrc[i], -kHalfMax, kHalfMax));
+    }
+}
+
+bool HalfFloat::hasF16C()
+{
+#ifdef MANDRILL_HALF_FLOAT_F16C
+    static const bool supported = detectF16C();
+    return supported;
+#else
+    return false;
+#endif
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "Common.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Conversion of whole arrays of floats to half floats. Uses the F16C instructions when the CPU has them, which
+    /// convert several values per instruction and are many times faster than converting one value at a time. This is
+    /// decided at run time, so the library does not need to be built for a particular CPU.
+    /// </summary>
+    namespace HalfFloat
+    {
+        /// <summary>
+        /// Convert floats to half floats, rounding to nearest. Values beyond the range of half floats are clamped to
+        /// the largest finite one, since infinities would propagate through any renderer that accumulates them.
+        /// </summary>
+        /// <param name="pSrc">Floats to convert</param>
+        /// <param name="pDst">Half floats to write, as their bit patterns</param>
+        /// <param name="count">Number of values</param>
+        MANDRILL_API void pack(const float* pSrc, uint16_t* pDst, size_t count);
+
+        /// <summary>
+        /// Check whether pack() uses the F16C instructions on this CPU.
+        /// </summary>
+        /// <returns>True if F16C is used</returns>
+        MANDRILL_API bool hasF16C();
+    } // namespace HalfFloat
+} // namespace Mandrill
@@ -298,6 +298,60 @@ namespace Mandrill
             return (value + alignment - 1) & ~(alignment - 1);
         }
 
+        /// <summary>
+        /// Get the alignment the device requires of descriptor offsets into a buffer. Which limit applies depends on
+        /// what the buffer is bound as, and a buffer that is used as both takes the stricter of the two.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="usage">How the buffer will be used</param>
+        /// <returns>Alignment in bytes</returns>
+        MANDRILL_API inline static VkDeviceSize getOffsetAlignment(ptr<Device> pDevice, VkBufferUsageFlags usage)
+        {
+            const VkPhysicalDeviceLimits& limits = pDevice->getProperties().physicalDevice.limits;
+
+            VkDeviceSize alignment = 1;
+            if (usage & VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT) {
+                alignment = std::max(alignment, limits.minUniformBufferOffsetAlignment);
+            }
+            if (usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) {
+                alignment = std::max(alignment, limits.minStorageBufferOffsetAlignment);
+            }
+            return alignment;
+        }
+
+        /// <summary>
+        /// Run a function over a range of indices on several threads, the calling thread being one of them. Indices
+        /// are interleaved between the threads rather than split into runs, so that a region of the range that is
+        /// expensive to process is shared out as well.
+        /// </summary>
+        /// <param name="count">Number of indices, from 0</param>
+        /// <param name="threadCount">Number of threads, 0 to use one per core</param>
+        /// <param name="function">Function to call once per index</param>
+        MANDRILL_API inline static void parallelFor(uint32_t count, uint32_t threadCount,
+                                                    const std::function<void(uint32_t)>& function)
+        {
+            if (threadCount == 0) {
+                threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+            }
+            threadCount = std::max(std::min(threadCount, count), 1u);
+
+            auto work = [&](uint32_t first) {
+                for (uint32_t i = first; i < count; i += threadCount) {
+                    function(i);
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (uint32_t i = 1; i < threadCount; i++) {
+                threads.emplace_back(work, i);
+            }
+            work(0);
+
+            for (auto& thread : threads) {
+                thread.join();
+            }
+        }
+
         /// <summary>
         /// Return a random value from the interval [0.0, 1.0)
         /// </summary>
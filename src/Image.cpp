@@ -19,18 +19,20 @@ namespace
 
 Image::Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t depth, uint32_t mipLevels,
              VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
-             VkMemoryPropertyFlags properties, VkImageType type)
+             VkMemoryPropertyFlags properties, VkImageType type, uint32_t arrayLayers, VkImageCreateFlags flags)
     : mpDevice(pDevice), mWidth(width), mHeight(height), mDepth(depth), mPitch(0), mMipLevels(mipLevels),
-      mFormat(format), mTiling(tiling), mUsage(usage), mProperties(properties), mImageView(VK_NULL_HANDLE),
-      mOwnMemory(true), mpHostMap(nullptr), mType(resolveImageType(type, height, depth))
+      mArrayLayers(arrayLayers), mFlags(flags), mFormat(format), mTiling(tiling), mUsage(usage),
+      mProperties(properties), mImageView(VK_NULL_HANDLE), mOwnMemory(true), mpHostMap(nullptr),
+      mType(resolveImageType(type, height, depth))
 {
     VkImageCreateInfo ci = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .flags = mFlags,
         .imageType = mType,
         .format = mFormat,
         .extent = {.width = mWidth, .height = mHeight, .depth = mDepth},
         .mipLevels = mipLevels,
-        .arrayLayers = 1,
+        .arrayLayers = mArrayLayers,
         .samples = samples,
         .tiling = mTiling,
         .usage = mUsage,
@@ -72,18 +74,21 @@ Image::Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t dept
 
 Image::Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t depth, uint32_t mipLevels,
              VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling, VkImageUsageFlags usage,
-             VkDeviceMemory memory, VkDeviceSize offset, VkImageType type)
+             VkDeviceMemory memory, VkDeviceSize offset, VkImageType type, uint32_t arrayLayers,
+             VkImageCreateFlags flags)
     : mpDevice(pDevice), mWidth(width), mHeight(height), mDepth(depth), mPitch(0), mMipLevels(mipLevels),
-      mFormat(format), mTiling(tiling), mUsage(usage), mProperties(0), mImageView(VK_NULL_HANDLE), mMemory(memory),
-      mOwnMemory(false), mpHostMap(nullptr), mType(resolveImageType(type, height, depth))
+      mArrayLayers(arrayLayers), mFlags(flags), mFormat(format), mTiling(tiling), mUsage(usage), mProperties(0),
+      mImageView(VK_NULL_HANDLE), mMemory(memory), mOwnMemory(false), mpHostMap(nullptr),
+      mType(resolveImageType(type, height, depth))
 {
     VkImageCreateInfo ci = {
         .sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .flags = mFlags,
         .imageType = mType,
         .format = format,
         .extent = {.width = mWidth, .height = mHeight, .depth = mDepth},
         .mipLevels = mipLevels,
-        .arrayLayers = 1,
+        .arrayLayers = mArrayLayers,
         .samples = samples,
         .tiling = mTiling,
         .usage = mUsage,
@@ -108,7 +113,9 @@ Image::Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t dept
 
 Image::~Image()
 {
-    vkDeviceWaitIdle(mpDevice->getDevice());
+    if (mWaitOnDestroy) {
+        vkDeviceWaitIdle(mpDevice->getDevice());
+    }
 
     if (mOwnMemory) {
         if (mpHostMap) {
@@ -141,7 +148,11 @@ void Image::createImageView(VkImageAspectFlags aspectFlags, VkImageViewType view
             viewType = VK_IMAGE_VIEW_TYPE_3D;
             break;
         default:
-            viewType = VK_IMAGE_VIEW_TYPE_2D;
+            if ((mFlags & VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT) && mArrayLayers == 6) {
+                viewType = VK_IMAGE_VIEW_TYPE_CUBE;
+            } else {
+                viewType = mArrayLayers > 1 ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
+            }
             break;
         }
     }
@@ -159,7 +170,7 @@ void Image::createImageView(VkImageAspectFlags aspectFlags, VkImageViewType view
                              .baseMipLevel = 0,
                              .levelCount = mMipLevels,
                              .baseArrayLayer = 0,
-                             .layerCount = 1},
+                             .layerCount = mArrayLayers},
     };
 
     Check::Vk(vkCreateImageView(mpDevice->getDevice(), &ci, nullptr, &mImageView));
@@ -31,10 +31,13 @@ namespace Mandrill
         /// <param name="properties">Which memory properties to require</param>
         /// <param name="type">Image type. Defaults to deriving it from the extent, which cannot tell a 1 x 1 2D
         /// image from a 1D one, so pass it explicitly when the dimensionality matters</param>
+        /// <param name="arrayLayers">Number of array layers, 6 for a cube map</param>
+        /// <param name="flags">Create flags, such as VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT</param>
         MANDRILL_API Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t depth, uint32_t mipLevels,
                            VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling,
                            VkImageUsageFlags usage, VkMemoryPropertyFlags properties,
-                           VkImageType type = VK_IMAGE_TYPE_MAX_ENUM);
+                           VkImageType type = VK_IMAGE_TYPE_MAX_ENUM, uint32_t arrayLayers = 1,
+                           VkImageCreateFlags flags = 0);
 
         /// <summary>
         /// Create a new Image using memory that has already been allocated.
@@ -52,22 +55,36 @@ namespace Mandrill
         /// <param name="offset">Where in the allocated memory the image should be stored</param>
         /// <param name="type">Image type. Defaults to deriving it from the extent, which cannot tell a 1 x 1 2D
         /// image from a 1D one, so pass it explicitly when the dimensionality matters</param>
+        /// <param name="arrayLayers">Number of array layers, 6 for a cube map</param>
+        /// <param name="flags">Create flags, such as VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT</param>
         MANDRILL_API Image(ptr<Device> pDevice, uint32_t width, uint32_t height, uint32_t depth, uint32_t mipLevels,
                            VkSampleCountFlagBits samples, VkFormat format, VkImageTiling tiling,
                            VkImageUsageFlags usage, VkDeviceMemory memory, VkDeviceSize offset,
-                           VkImageType type = VK_IMAGE_TYPE_MAX_ENUM);
+                           VkImageType type = VK_IMAGE_TYPE_MAX_ENUM, uint32_t arrayLayers = 1,
+                           VkImageCreateFlags flags = 0);
 
         /// <summary>
         /// Destructor for image
         /// </summary>
         MANDRILL_API ~Image();
 
+        /// <summary>
+        /// Set whether the destructor waits for the device to be idle before destroying the image. Only turn this off
+        /// when the device is known to have finished every frame that used the image.
+        /// </summary>
+        /// <param name="wait">Whether to wait</param>
+        MANDRILL_API void setWaitOnDestroy(bool wait)
+        {
+            mWaitOnDestroy = wait;
+        }
+
         /// <summary>
         /// Create a default image view for Image object.
         /// </summary>
         /// <param name="aspectFlags">Aspect flags to use for image view</param>
         /// <param name="viewType">View type. Defaults to matching the image type, which is what a shader sampling
-        /// the image expects</param>
+        /// the image expects. Cube-compatible images with six layers get a cube view, and other images with several
+        /// layers an array view.</param>
         MANDRILL_API void createImageView(VkImageAspectFlags aspectFlags,
                                           VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_MAX_ENUM);
 
@@ -192,6 +209,24 @@ namespace Mandrill
             return mMipLevels;
         }
 
+        /// <summary>
+        /// Get the number of array layers of the image.
+        /// </summary>
+        /// <returns>Image array layers</returns>
+        MANDRILL_API uint32_t getArrayLayers() const
+        {
+            return mArrayLayers;
+        }
+
+        /// <summary>
+        /// Get the create flags of the image.
+        /// </summary>
+        /// <returns>Create flags</returns>
+        MANDRILL_API VkImageCreateFlags getFlags() const
+        {
+            return mFlags;
+        }
+
     private:
         ptr<Device> mpDevice;
 
@@ -211,8 +246,12 @@ namespace Mandrill
         uint32_t mPitch;
 
         uint32_t mMipLevels;
+        uint32_t mArrayLayers;
+        VkImageCreateFlags mFlags;
         VkFormat mFormat;
         VkImageTiling mTiling;
         VkImageType mType;
+
+        bool mWaitOnDestroy = true;
     };
 } // namespace Mandrill
@@ -1,20 +1,28 @@
 #pragma once
 
 #include "AccelerationStructure.h"
+#include "Accumulator.h"
 #include "App.h"
+#include "BlockCompression.h"
 #include "Buffer.h"
 #include "Camera.h"
 #include "ComputePipeline.h"
+#include "Denoiser.h"
 #include "Descriptor.h"
 #include "Device.h"
+#include "Downsampler.h"
 #include "DynamicBuffer.h"
 #include "EnvironmentMap.h"
 #include "Error.h"
 #include "Extension.h"
+#include "FrameAllocator.h"
+#include "GeometryHeap.h"
+#include "HalfFloat.h"
 #include "Helpers.h"
 #include "Image.h"
 #include "Layout.h"
 #include "Log.h"
+#include "MipGenerator.h"
 #include "MLP.h"
 #include "Pass.h"
 #include "Pipeline.h"
@@ -22,5 +30,11 @@
 #include "RenderGraph.h"
 #include "Scene.h"
 #include "Shader.h"
+#include "SparseVolume.h"
 #include "Swapchain.h"
 #include "Texture.h"
+#include "TextureCache.h"
+#include "TextureLoader.h"
+#include "TextureStreamer.h"
+#include "VirtualTexture.h"
+#include "Volume.h"
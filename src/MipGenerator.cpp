@@ -0,0 +1,272 @@
+#include "MipGenerator.h"
+
+#include "Helpers.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    // Radius of the Kaiser filter in texels of the level being made, and the shape of its window
+    constexpr float kKaiserRadius = 2.0f;
+    constexpr float kKaiserAlpha = 4.0f;
+
+    constexpr float PI = 3.14159265358979323846f;
+
+    // Zeroth-order modified Bessel function of the first kind, from its power series
+    float besselI0(float x)
+    {
+        float sum = 1.0f;
+        float term = 1.0f;
+        for (int k = 1; k < 16; k++) {
+            term *= (x / (2.0f * k)) * (x / (2.0f * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    float kaiser(float x)
+    {
+        if (std::abs(x) >= kKaiserRadius) {
+            return 0.0f;
+        }
+
+        float sinc = x == 0.0f ? 1.0f : std::sin(PI * x) / (PI * x);
+        float t = x / kKaiserRadius;
+        return sinc * besselI0(kKaiserAlpha * std::sqrt(1.0f - t * t)) / besselI0(kKaiserAlpha);
+    }
+
+    // The source texels that make up one texel of the next level, and how much each one counts
+    struct Taps {
+        uint32_t first;
+        std::vector<float> weights;
+    };
+
+    // Work out the taps of every texel along one axis. Distances are measured in texels of the level being made, so
+    // that a source of odd size, which does not halve evenly, is still covered without gaps.
+    std::vector<Taps> createTaps(MipFilter filter, uint32_t srcSize, uint32_t dstSize)
+    {
+        const float scale = static_cast<float>(srcSize) / static_cast<float>(dstSize);
+        const float radius = filter == MipFilter::Kaiser ? kKaiserRadius : 0.5f;
+
+        std::vector<Taps> taps(dstSize);
+        for (uint32_t i = 0; i < dstSize; i++) {
+            const float center = (static_cast<float>(i) + 0.5f) * scale;
+            const int32_t first = static_cast<int32_t>(std::floor(center - radius * scale));
+            const int32_t last = static_cast<int32_t>(std::ceil(center + radius * scale));
+
+            // Taps past the edge are folded onto the edge texel, which clamps the image
+            const int32_t lo = std::max(first, 0);
+            const int32_t hi = std::min(last, static_cast<int32_t>(srcSize) - 1);
+            std::vector<float> weights(hi - lo + 1, 0.0f);
+            float total = 0.0f;
+            for (int32_t j = first; j <= last; j++) {
+                float d = (static_cast<float>(j) + 0.5f - center) / scale;
+                float w = filter == MipFilter::Kaiser ? kaiser(d) : (d > -0.5f && d <= 0.5f ? 1.0f : 0.0f);
+                weights[std::clamp(j, lo, hi) - lo] += w;
+                total += w;
+            }
+
+            // The box reaches just past the texels it covers, which only adds taps that count for nothing
+            size_t begin = 0;
+            size_t end = weights.size();
+            while (begin + 1 < end && weights[begin] == 0.0f) {
+                begin++;
+            }
+            while (end - 1 > begin && weights[end - 1] == 0.0f) {
+                end--;
+            }
+
+            taps[i].first = static_cast<uint32_t>(lo) + static_cast<uint32_t>(begin);
+            for (size_t j = begin; j < end; j++) {
+                taps[i].weights.push_back(weights[j] / total);
+            }
+        }
+        return taps;
+    }
+
+    // Make the next level from a level of four float channels per texel
+    std::vector<float> downsample(const std::vector<float>& src, uint32_t width, uint32_t height,
+                                  const MipGenerationDesc& desc)
+    {
+        const uint32_t dstWidth = std::max(width / 2, 1u);
+        const uint32_t dstHeight = std::max(height / 2, 1u);
+
+        const std::vector<Taps> tapsX = createTaps(desc.filter, width, dstWidth);
+        const std::vector<Taps> tapsY = createTaps(desc.filter, height, dstHeight);
+
+        // Rows first, at full height
+        std::vector<float> rows(static_cast<size_t>(dstWidth) * height * 4);
+        Helpers::parallelFor(height, desc.threadCount, [&](uint32_t y) {
+            const float* pSrc = &src[static_cast<size_t>(y) * width * 4];
+            float* pDst = &rows[static_cast<size_t>(y) * dstWidth * 4];
+            for (uint32_t x = 0; x < dstWidth; x++) {
+                const Taps& taps = tapsX[x];
+                float sum[4] = {};
+                for (uint32_t t = 0; t < taps.weights.size(); t++) {
+                    const float* pTexel = pSrc + (static_cast<size_t>(taps.first) + t) * 4;
+                    for (uint32_t c = 0; c < 4; c++) {
+                        sum[c] += taps.weights[t] * pTexel[c];
+                    }
+                }
+                std::memcpy(pDst + static_cast<size_t>(x) * 4, sum, sizeof(sum));
+            }
+        });
+
+        // Then columns, accumulating whole rows at a time
+        const size_t rowLength = static_cast<size_t>(dstWidth) * 4;
+        std::vector<float> dst(rowLength * dstHeight, 0.0f);
+        Helpers::parallelFor(dstHeight, desc.threadCount, [&](uint32_t y) {
+            const Taps& taps = tapsY[y];
+            float* pDst = &dst[y * rowLength];
+            for (uint32_t t = 0; t < taps.weights.size(); t++) {
+                const float* pRow = &rows[(static_cast<size_t>(taps.first) + t) * rowLength];
+                const float w = taps.weights[t];
+                for (size_t i = 0; i < rowLength; i++) {
+                    pDst[i] += w * pRow[i];
+                }
+            }
+        });
+
+        if (desc.filter == MipFilter::Kaiser) {
+            for (auto& value : dst) {
+                value = std::max(value, 0.0f);
+            }
+        }
+
+        return dst;
+    }
+
+    // Fraction of texels whose alpha, scaled, passes an alpha test
+    float getAlphaCoverage(const std::vector<float>& level, float reference, float scale)
+    {
+        size_t covered = 0;
+        for (size_t i = 3; i < level.size(); i += 4) {
+            covered += level[i] * scale > reference;
+        }
+        return static_cast<float>(covered) / static_cast<float>(level.size() / 4);
+    }
+
+    // Scale the alpha of a level so that its coverage matches, by bisection since coverage only grows with the scale
+    void preserveAlphaCoverage(std::vector<float>& level, float reference, float coverage)
+    {
+        float lo = 0.0f, hi = 4.0f;
+        for (int i = 0; i < 12; i++) {
+            float mid = 0.5f * (lo + hi);
+            if (getAlphaCoverage(level, reference, mid) < coverage) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        const float scale = 0.5f * (lo + hi);
+        for (size_t i = 3; i < level.size(); i += 4) {
+            level[i] = std::min(level[i] * scale, 1.0f);
+        }
+    }
+
+    // Make all levels of an image with four float channels, with alpha in [0, 1] if it is to be tested
+    std::vector<std::vector<float>> generateLevels(std::vector<float> level, uint32_t width, uint32_t height,
+                                                   const MipGenerationDesc& desc)
+    {
+        std::vector<std::vector<float>> levels;
+
+        // Opaque images keep full coverage without help, so they skip the search
+        bool testAlpha = false;
+        if (desc.preserveAlphaCoverage) {
+            for (size_t i = 3; i < level.size() && !testAlpha; i += 4) {
+                testAlpha = level[i] < 1.0f;
+            }
+        }
+        const float coverage = testAlpha ? getAlphaCoverage(level, desc.alphaReference, 1.0f) : 0.0f;
+
+        levels.push_back(std::move(level));
+        while (width > 1 || height > 1) {
+            std::vector<float> next = downsample(levels.back(), width, height, desc);
+            if (testAlpha) {
+                preserveAlphaCoverage(next, desc.alphaReference, coverage);
+            }
+
+            levels.push_back(std::move(next));
+            width = std::max(width / 2, 1u);
+            height = std::max(height / 2, 1u);
+        }
+
+        return levels;
+    }
+
+    // Linear values for every sRGB-encoded byte
+    const std::array<float, 256>& getSRGBToLinear()
+    {
+        static const std::array<float, 256> table = []() {
+            std::array<float, 256> t;
+            for (uint32_t i = 0; i < 256; i++) {
+                float c = static_cast<float>(i) / 255.0f;
+                t[i] = c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+            }
+            return t;
+        }();
+        return table;
+    }
+
+    // Linear values halfway between each pair of neighbouring sRGB bytes, so that encoding rounds to the nearest
+    const std::array<float, 255>& getSRGBThresholds()
+    {
+        static const std::array<float, 255> table = []() {
+            const auto& toLinear = getSRGBToLinear();
+            std::array<float, 255> t;
+            for (uint32_t i = 0; i < 255; i++) {
+                t[i] = 0.5f * (toLinear[i] + toLinear[i + 1]);
+            }
+            return t;
+        }();
+        return table;
+    }
+} // namespace
+
+uint32_t MipGenerator::getLevelCount(uint32_t width, uint32_t height)
+{
+    return static_cast<uint32_t>(std::floor(std::log2(std::max(width, height)))) + 1;
+}
+
+std::vector<std::vector<std::byte>> MipGenerator::generate(const uint8_t* pRGBA, uint32_t width, uint32_t height,
+                                                           const MipGenerationDesc& desc)
+{
+    const auto& toLinear = getSRGBToLinear();
+    const auto& thresholds = getSRGBThresholds();
+
+    const size_t valueCount = static_cast<size_t>(width) * height * 4;
+    std::vector<float> first(valueCount);
+    for (size_t i = 0; i < valueCount; i++) {
+        first[i] = desc.sRGB && i % 4 != 3 ? toLinear[pRGBA[i]] : static_cast<float>(pRGBA[i]) / 255.0f;
+    }
+
+    std::vector<std::vector<float>> levels = generateLevels(std::move(first), width, height, desc);
+
+    // The first level is copied as it was, and only the others are converted back
+    std::vector<std::vector<std::byte>> result(levels.size());
+    result[0].assign(reinterpret_cast<const std::byte*>(pRGBA), reinterpret_cast<const std::byte*>(pRGBA) + valueCount);
+    for (size_t l = 1; l < levels.size(); l++) {
+        const std::vector<float>& level = levels[l];
+        result[l].resize(level.size());
+        for (size_t i = 0; i < level.size(); i++) {
+            uint32_t value;
+            if (desc.sRGB && i % 4 != 3) {
+                value = static_cast<uint32_t>(std::upper_bound(thresholds.begin(), thresholds.end(), level[i]) -
+                                              thresholds.begin());
+            } else {
+                value = static_cast<uint32_t>(std::clamp(level[i], 0.0f, 1.0f) * 255.0f + 0.5f);
+            }
+            result[l][i] = static_cast<std::byte>(value);
+        }
+    }
+
+    return result;
+}
+
+std::vector<std::vector<float>> MipGenerator::generate(const float* pRGBA, uint32_t width, uint32_t height,
+                                                       const MipGenerationDesc& desc)
+{
+    std::vector<float> first(pRGBA, pRGBA + static_cast<size_t>(width) * height * 4);
+    return generateLevels(std::move(first), width, height, desc);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Common.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Filters that mip levels can be made with.
+    /// </summary>
+    enum class MipFilter : uint32_t {
+        Box,    // Average of the texels each texel covers, soft but cheap
+        Kaiser, // Windowed sinc over four texels to each side, keeping more detail without aliasing
+    };
+
+    /// <summary>
+    /// Settings for making mip levels on the CPU.
+    /// </summary>
+    struct MipGenerationDesc {
+        MipFilter filter = MipFilter::Box;
+
+        // Whether the colour channels hold sRGB-encoded values, which are then filtered in linear space. Averaging
+        // the encoded values darkens every level. Only applies to 8-bit images, and never to alpha.
+        bool sRGB = false;
+
+        // Whether to scale the alpha of each level so that as many texels pass an alpha test at alphaReference as in
+        // the first level. Without it, alpha-tested foliage and fences thin out and vanish in the distance.
+        bool preserveAlphaCoverage = false;
+        float alphaReference = 0.5f;
+
+        // Number of threads to split the rows of each level over, 0 to use one per core
+        uint32_t threadCount = 0;
+    };
+
+    /// <summary>
+    /// Makes every mip level of an image up front, so that a texture can be uploaded with a single copy and its levels
+    /// stored in a TextureCache instead of being made by the device on every load. Levels halve in size down to 1 x 1,
+    /// with odd sizes rounded down as Vulkan expects.
+    ///
+    /// Filtering is separable, first along rows and then along columns, in floating point. The loops run over whole
+    /// rows of contiguous channels so that the compiler can vectorize them, and the rows of each level are shared out
+    /// between threads. Edges are clamped.
+    /// </summary>
+    namespace MipGenerator
+    {
+        /// <summary>
+        /// Get the number of mip levels in a full chain.
+        /// </summary>
+        /// <param name="width">Width of the first level</param>
+        /// <param name="height">Height of the first level</param>
+        /// <returns>Number of levels</returns>
+        MANDRILL_API uint32_t getLevelCount(uint32_t width, uint32_t height);
+
+        /// <summary>
+        /// Make the mip levels of an image with four 8-bit channels.
+        /// </summary>
+        /// <param name="pRGBA">Texels of the first level, four bytes each and row by row</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <param name="desc">How to make the levels</param>
+        /// <returns>Every level, largest first and including a copy of the first one</returns>
+        MANDRILL_API std::vector<std::vector<std::byte>> generate(const uint8_t* pRGBA, uint32_t width, uint32_t height,
+                                                                  const MipGenerationDesc& desc = {});
+
+        /// <summary>
+        /// Make the mip levels of an image with four floating-point channels. Negative values from the lobes of the
+        /// Kaiser filter are clamped to zero.
+        /// </summary>
+        /// <param name="pRGBA">Texels of the first level, four floats each and row by row</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <param name="desc">How to make the levels, where sRGB is ignored</param>
+        /// <returns>Every level, largest first and including a copy of the first one</returns>
+        MANDRILL_API std::vector<std::vector<float>> generate(const float* pRGBA, uint32_t width, uint32_t height,
+                                                              const MipGenerationDesc& desc = {});
+    } // namespace MipGenerator
+} // namespace Mandrill
@@ -1,28 +1,24 @@
 #include "Scene.h"
 
 #include "Extension.h"
+#include "GeometryHeap.h"
 #include "Helpers.h"
 #include "Log.h"
 #include "Pipeline.h"
 #include "Shader.h"
+#include "TextureLoader.h"
 
 #include "tiny_obj_loader.h"
 #include "tinygltf/tiny_gltf.h"
 
 using namespace Mandrill;
 
-enum class MaterialTextureBit : uint32_t {
-    Diffuse = 1 << 0,
-    Specular = 1 << 1,
-    Ambient = 1 << 2,
-    Emission = 1 << 3,
-    Normal = 1 << 4,
-};
-
 Node::Node()
 {
     mTransform = glm::identity<glm::mat4>();
     mVisible = true;
+    mRayMask = 0xff;
+    mRevision = 0;
     mTransformIndex = 0;
 }
 
@@ -34,15 +30,17 @@ void Node::drawMeshes(VkCommandBuffer cmd, const ptr<const Scene> pScene) const
 {
     for (auto meshIndex : mMeshIndices) {
         const Mesh& mesh = pScene->mMeshes[meshIndex];
+        const Mesh& geometry = pScene->mMeshes[mesh.geometryIndex];
 
         // Bind vertex and index buffers
-        std::array<VkBuffer, 1> vertexBuffers = {pScene->mpVertexBuffer->getBuffer()};
-        std::array<VkDeviceSize, 1> offsets = {mesh.deviceVerticesOffset};
+        std::array<VkBuffer, 1> vertexBuffers = {pScene->getVertexBuffer(geometry.shard)->getBuffer()};
+        std::array<VkDeviceSize, 1> offsets = {geometry.deviceVerticesOffset};
         vkCmdBindVertexBuffers(cmd, 0, count(vertexBuffers), vertexBuffers.data(), offsets.data());
-        vkCmdBindIndexBuffer(cmd, pScene->mpIndexBuffer->getBuffer(), mesh.deviceIndicesOffset, VK_INDEX_TYPE_UINT32);
+        vkCmdBindIndexBuffer(cmd, pScene->getIndexBuffer(geometry.shard)->getBuffer(), geometry.deviceIndicesOffset,
+                             VK_INDEX_TYPE_UINT32);
 
         // Draw mesh
-        vkCmdDrawIndexed(cmd, count(mesh.indices), 1, 0, 0, 0);
+        vkCmdDrawIndexed(cmd, mesh.indexCount, 1, 0, 0, 0);
     }
 }
 
@@ -95,19 +93,21 @@ void Node::render(VkCommandBuffer cmd, const ptr<const Scene> pScene, uint32_t f
 
     for (auto meshIndex : mMeshIndices) {
         const Mesh& mesh = pScene->mMeshes[meshIndex];
+        const Mesh& geometry = pScene->mMeshes[mesh.geometryIndex];
 
         // Materials keep a prepared set each, so switching material is a single bind
         pResources->materialDescriptors[mesh.materialIndex]->bind(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
                                                                   mpPipeline->getLayout(), pResources->materialSet);
 
         // Bind vertex and index buffers
-        std::array<VkBuffer, 1> vertexBuffers = {pScene->mpVertexBuffer->getBuffer()};
-        std::array<VkDeviceSize, 1> offsets = {mesh.deviceVerticesOffset};
+        std::array<VkBuffer, 1> vertexBuffers = {pScene->getVertexBuffer(geometry.shard)->getBuffer()};
+        std::array<VkDeviceSize, 1> offsets = {geometry.deviceVerticesOffset};
         vkCmdBindVertexBuffers(cmd, 0, count(vertexBuffers), vertexBuffers.data(), offsets.data());
-        vkCmdBindIndexBuffer(cmd, pScene->mpIndexBuffer->getBuffer(), mesh.deviceIndicesOffset, VK_INDEX_TYPE_UINT32);
+        vkCmdBindIndexBuffer(cmd, pScene->getIndexBuffer(geometry.shard)->getBuffer(), geometry.deviceIndicesOffset,
+                             VK_INDEX_TYPE_UINT32);
 
         // Draw mesh
-        vkCmdDrawIndexed(cmd, count(mesh.indices), 1, 0, 0, 0);
+        vkCmdDrawIndexed(cmd, mesh.indexCount, 1, 0, 0, 0);
     }
 }
 
@@ -133,6 +133,9 @@ Scene::Scene(ptr<Device> pDevice) : mpDevice(pDevice), mVertexCount(0), mIndexCo
                                                         height, depth, bytesPerPixel);
     mTextures.insert(std::make_pair("", mpMissingTexture));
     mMaterials.push_back({});
+
+    mpTextureLoader = pDevice->createTextureLoader();
+    setTextureCacheDirectory(GetExecutablePath() / "TextureCache");
 }
 
 Scene::~Scene()
@@ -299,7 +302,7 @@ uint32_t Scene::addMaterial(Material material)
     auto setTexture = [this](std::unordered_map<std::string, ptr<Texture>>& loadedTextures, std::string texturePath,
                              MaterialTextureBit bit, ptr<Texture> pMissingTexture) {
         if (!texturePath.empty()) {
-            addTexture(texturePath);
+            addTexture(texturePath, bit);
         } else {
             loadedTextures.insert(std::make_pair(texturePath, pMissingTexture));
         }
@@ -312,28 +315,172 @@ uint32_t Scene::addMaterial(Material material)
     setTexture(mTextures, material.ambientTexturePath, MaterialTextureBit::Ambient, mpMissingTexture);
     setTexture(mTextures, material.emissionTexturePath, MaterialTextureBit::Emission, mpMissingTexture);
     setTexture(mTextures, material.normalTexturePath, MaterialTextureBit::Normal, mpMissingTexture);
+    loadTextures();
 
     mMaterials.push_back(material);
 
     return count(mMaterials) - 1;
 }
 
-uint32_t Scene::addMesh(const std::vector<Vertex> vertices, const std::vector<uint32_t> indices, uint32_t materialIndex)
+uint32_t Scene::addMesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices, uint32_t materialIndex)
 {
     std::vector<glm::vec3> positions;
     for (const auto& vertex : vertices) {
         positions.push_back(vertex.position);
     }
     Mesh mesh = {
-        .vertices = vertices,
-        .indices = indices,
         .materialIndex = materialIndex,
+        .vertexCount = count(vertices),
+        .indexCount = count(indices),
         .boundingBox = AABB::calculate(positions),
     };
+    mesh.vertices = std::move(vertices);
+    mesh.indices = std::move(indices);
+
+    mMeshes.push_back(std::move(mesh));
+    uint32_t meshIndex = count(mMeshes) - 1;
+
+    // A mesh that repeats the geometry of another needs no geometry of its own
+    if (shareGeometry(meshIndex)) {
+        return meshIndex;
+    }
 
-    mMeshes.push_back(mesh);
+    // Add to statistics
+    mVertexCount += mMeshes[meshIndex].vertexCount;
+    mIndexCount += mMeshes[meshIndex].indexCount;
+
+    // Once the scene is compiled the geometry heaps exist, and the mesh can go straight into them
+    if (!mShards.empty()) {
+        allocateMesh(mMeshes[meshIndex]);
+        uploadMeshes({meshIndex});
+        handleGeometryRelocation();
+    }
 
-    return count(mMeshes) - 1;
+    return meshIndex;
+}
+
+void Scene::removeMesh(uint32_t meshIndex)
+{
+    if (meshIndex >= count(mMeshes)) {
+        Log::Error("Scene: Cannot remove mesh {}, the scene has {} meshes", meshIndex, count(mMeshes));
+        return;
+    }
+
+    Mesh& mesh = mMeshes[meshIndex];
+
+    for (auto& node : mNodes) {
+        if (std::erase(node.mMeshIndices, meshIndex) > 0) {
+            node.mRevision++;
+        }
+    }
+
+    auto [first, last] = mMeshesByGeometry.equal_range(mesh.geometryHash);
+    for (auto it = first; it != last; ++it) {
+        if (it->second == meshIndex) {
+            mMeshesByGeometry.erase(it);
+            break;
+        }
+    }
+
+    // The geometry stays if the mesh only borrowed it, or if other meshes borrowed it from this one. Then the first
+    // of those takes the ranges over, which gives it a new revision, so that its BLAS is built.
+    bool geometryKept = mesh.geometryIndex != meshIndex;
+    if (!geometryKept) {
+        uint32_t successor = meshIndex;
+        std::tie(first, last) = mMeshesByGeometry.equal_range(mesh.geometryHash);
+        for (auto it = first; it != last; ++it) {
+            Mesh& other = mMeshes[it->second];
+            if (other.geometryIndex != meshIndex) {
+                continue;
+            }
+
+            if (successor == meshIndex) {
+                successor = it->second;
+                other.vertices = std::move(mesh.vertices);
+                other.indices = std::move(mesh.indices);
+                other.deviceVerticesOffset = mesh.deviceVerticesOffset;
+                other.deviceIndicesOffset = mesh.deviceIndicesOffset;
+                other.shard = mesh.shard;
+                other.resident = mesh.resident;
+                other.needsUpload = mesh.needsUpload;
+                other.revision += 1;
+            }
+            other.geometryIndex = successor;
+        }
+        geometryKept = successor != meshIndex;
+    }
+
+    const uint32_t shard = mesh.shard;
+    if (!geometryKept) {
+        if (mesh.resident) {
+            mShards[shard].pVertexHeap->free(mesh.deviceVerticesOffset);
+            mShards[shard].pIndexHeap->free(mesh.deviceIndicesOffset);
+        }
+
+        mVertexCount -= mesh.vertexCount;
+        mIndexCount -= mesh.indexCount;
+    }
+
+    // Keep the slot so that the indices of the other meshes stay valid
+    mesh.vertices = {};
+    mesh.indices = {};
+    mesh.vertexCount = 0;
+    mesh.indexCount = 0;
+    mesh.deviceVerticesOffset = 0;
+    mesh.deviceIndicesOffset = 0;
+    mesh.shard = 0;
+    mesh.resident = false;
+    mesh.needsUpload = false;
+    mesh.revision += 1;
+    mesh.geometryIndex = meshIndex;
+    mesh.geometryHash = 0;
+    mesh.boundingBox = {};
+
+    if (mShards.empty()) {
+        return;
+    }
+
+    // Gather the free space once it has become both a large part of the heaps and scattered enough that new meshes
+    // would struggle to use it
+    auto wasteful = [](const ptr<GeometryHeap>& pHeap) {
+        return pHeap->getUsedSize() < pHeap->getSize() / 2 && pHeap->getFragmentation() > 0.5f;
+    };
+    if (wasteful(mShards[shard].pVertexHeap) || wasteful(mShards[shard].pIndexHeap)) {
+        compactGeometry();
+    } else {
+        updateInstanceData();
+    }
+}
+
+void Scene::compactGeometry()
+{
+    // Offsets only move within their own shard, so the moves are kept apart per shard
+    std::vector<std::unordered_map<VkDeviceSize, VkDeviceSize>> vertexMoves(mShards.size());
+    std::vector<std::unordered_map<VkDeviceSize, VkDeviceSize>> indexMoves(mShards.size());
+    for (uint32_t i = 0; i < count(mShards); i++) {
+        for (const auto& relocation : mShards[i].pVertexHeap->compact()) {
+            vertexMoves[i][relocation.oldOffset] = relocation.newOffset;
+        }
+        for (const auto& relocation : mShards[i].pIndexHeap->compact()) {
+            indexMoves[i][relocation.oldOffset] = relocation.newOffset;
+        }
+    }
+
+    for (auto& mesh : mMeshes) {
+        if (!mesh.resident) {
+            continue;
+        }
+
+        if (auto it = vertexMoves[mesh.shard].find(mesh.deviceVerticesOffset); it != vertexMoves[mesh.shard].end()) {
+            mesh.deviceVerticesOffset = it->second;
+        }
+        if (auto it = indexMoves[mesh.shard].find(mesh.deviceIndicesOffset); it != indexMoves[mesh.shard].end()) {
+            mesh.deviceIndicesOffset = it->second;
+        }
+    }
+
+    updateInstanceData();
+    handleGeometryRelocation();
 }
 
 template <typename T, typename... Rest> inline void hashCombine(std::size_t& seed, T const& v, Rest&&... rest)
@@ -361,6 +508,47 @@ namespace std
     };
 } // namespace std
 
+bool Scene::shareGeometry(uint32_t meshIndex)
+{
+    Mesh& mesh = mMeshes[meshIndex];
+    mesh.geometryIndex = meshIndex;
+    if (mesh.indexCount == 0) {
+        return false;
+    }
+
+    size_t hash = 0;
+    for (const auto& vertex : mesh.vertices) {
+        hashCombine(hash, vertex);
+    }
+    for (auto index : mesh.indices) {
+        hashCombine(hash, index);
+    }
+    mesh.geometryHash = hash;
+    mMeshesByGeometry.emplace(hash, meshIndex);
+
+    auto [first, last] = mMeshesByGeometry.equal_range(hash);
+    for (auto it = first; it != last; ++it) {
+        if (it->second == meshIndex) {
+            continue;
+        }
+
+        // A hash can collide, so the geometry is only shared when the contents compare equal. Meshes whose host
+        // copies have been released after the upload cannot be compared, and are not shared with.
+        const Mesh& geometry = mMeshes[mMeshes[it->second].geometryIndex];
+        if (geometry.vertices.empty() || geometry.vertices != mesh.vertices || geometry.indices != mesh.indices) {
+            continue;
+        }
+
+        // The mesh keeps a record of its own, with its own material, but draws and traces the other's geometry
+        mesh.geometryIndex = mMeshes[it->second].geometryIndex;
+        mesh.vertices = {};
+        mesh.indices = {};
+        return true;
+    }
+
+    return false;
+}
+
 std::vector<uint32_t> Scene::addMeshFromFile(const std::filesystem::path& path,
                                              const std::filesystem::path& materialPath)
 {
@@ -377,10 +565,29 @@ std::vector<uint32_t> Scene::addMeshFromFile(const std::filesystem::path& path,
         return {};
     }
 
-    // Add to statistics
+    // The loaders only queue the textures of their materials, so that all of them are decoded together
+    loadTextures();
+
+    // The loaders rewrite the geometry after creating the meshes, so the counts, and what the geometry is the same
+    // as, are only final here
+    uint32_t sharedCount = 0;
     for (auto index : newMeshIndices) {
-        mVertexCount += count(mMeshes[index].vertices);
-        mIndexCount += count(mMeshes[index].indices);
+        Mesh& mesh = mMeshes[index];
+        mesh.vertexCount = count(mesh.vertices);
+        mesh.indexCount = count(mesh.indices);
+
+        // A mesh that shares the geometry of another stores none
+        if (shareGeometry(index)) {
+            sharedCount += 1;
+        } else {
+            // Add to statistics
+            mVertexCount += mesh.vertexCount;
+            mIndexCount += mesh.indexCount;
+        }
+    }
+
+    if (sharedCount > 0) {
+        Log::Info("{} of {} meshes share geometry with other meshes", sharedCount, count(newMeshIndices));
     }
 
     return newMeshIndices;
@@ -394,30 +601,27 @@ void Scene::compile()
         Log::Error("Scene: Sampler must be set before calling compile()");
     }
 
-    // Calculate size of buffers
-    size_t verticesSize = 0;
-    size_t indicesSize = 0;
-    for (auto& node : mNodes) {
-        for (auto meshIndex : node.mMeshIndices) {
-            auto& mesh = mMeshes[meshIndex];
-            verticesSize += sizeof(Vertex) * mesh.vertices.size();
-            indicesSize += sizeof(uint32_t) * mesh.indices.size();
-        }
-    }
-
-    // Allocate device buffers
-    mpVertexBuffer =
-        mpDevice->createBuffer(verticesSize,
-                               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT |
-                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                                   VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
-    mpIndexBuffer =
-        mpDevice->createBuffer(indicesSize,
-                               VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT |
-                                   VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT |
-                                   VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
-                               VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    // The first compile sizes the geometry heaps for all meshes there are, up to what one shard can hold. Later ones
+    // leave the meshes that are already on the device in place and only find room for new ones.
+    if (mShards.empty()) {
+        VkDeviceSize verticesSize = 0;
+        VkDeviceSize indicesSize = 0;
+        for (uint32_t i = 0; i < count(mMeshes); i++) {
+            if (mMeshes[i].geometryIndex == i) {
+                verticesSize += sizeof(Vertex) * mMeshes[i].vertexCount;
+                indicesSize += sizeof(uint32_t) * mMeshes[i].indexCount;
+            }
+        }
+
+        addShard(verticesSize, indicesSize);
+    }
+
+    // Meshes that share the geometry of another mesh use its ranges
+    for (uint32_t i = 0; i < count(mMeshes); i++) {
+        if (!mMeshes[i].resident && mMeshes[i].vertexCount > 0 && mMeshes[i].geometryIndex == i) {
+            allocateMesh(mMeshes[i]);
+        }
+    }
 
     VkDeviceSize alignment = mpDevice->getProperties().physicalDevice.limits.minUniformBufferOffsetAlignment;
 
@@ -449,6 +653,19 @@ void Scene::compile()
         *mMaterials[i].paramsDevice = mMaterials[i].params;
     }
 
+    // The texture array, the indices in the material buffer and the feedback slots all follow the order the keys
+    // have here, which stays put when mTextures rehashes before the next compile
+    mTextureKeys.clear();
+    std::unordered_map<std::string, uint32_t> textureIndices;
+    for (const auto& [key, pTexture] : mTextures) {
+        textureIndices[key] = count(mTextureKeys);
+        mTextureKeys.push_back(key);
+    }
+    auto getTextureIndex = [&](const std::string& key) {
+        auto it = textureIndices.find(key);
+        return it != textureIndices.end() ? it->second : count(mTextureKeys);
+    };
+
     // For ray tracing a global list is used and this struct keeps track of the texture indices
     VkDeviceSize materialBufferSize = sizeof(MaterialDevice) * mMaterials.size();
     mpMaterialBuffer = mpDevice->createBuffer(materialBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
@@ -457,38 +674,199 @@ void Scene::compile()
     MaterialDevice* materials = static_cast<MaterialDevice*>(mpMaterialBuffer->getHostMap());
     for (uint32_t i = 0; i < count(mMaterials); i++) {
         materials[i].params = mMaterials[i].params;
-        materials[i].diffuseTextureIndex =
-            static_cast<uint32_t>(std::distance(mTextures.begin(), mTextures.find(mMaterials[i].diffuseTexturePath)));
-        materials[i].specularTextureIndex =
-            static_cast<uint32_t>(std::distance(mTextures.begin(), mTextures.find(mMaterials[i].specularTexturePath)));
-        materials[i].ambientTextureIndex =
-            static_cast<uint32_t>(std::distance(mTextures.begin(), mTextures.find(mMaterials[i].ambientTexturePath)));
-        materials[i].emissionTextureIndex =
-            static_cast<uint32_t>(std::distance(mTextures.begin(), mTextures.find(mMaterials[i].emissionTexturePath)));
-        materials[i].normalTextureIndex =
-            static_cast<uint32_t>(std::distance(mTextures.begin(), mTextures.find(mMaterials[i].normalTexturePath)));
-    }
-
-    VkDeviceSize instanceDataBufferSize = sizeof(InstanceData) * mMeshes.size();
-    mpInstanceDataBuffer = mpDevice->createBuffer(instanceDataBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-                                                  VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        materials[i].diffuseTextureIndex = getTextureIndex(mMaterials[i].diffuseTexturePath);
+        materials[i].specularTextureIndex = getTextureIndex(mMaterials[i].specularTexturePath);
+        materials[i].ambientTextureIndex = getTextureIndex(mMaterials[i].ambientTexturePath);
+        materials[i].emissionTextureIndex = getTextureIndex(mMaterials[i].emissionTexturePath);
+        materials[i].normalTextureIndex = getTextureIndex(mMaterials[i].normalTexturePath);
+    }
+
+    // Ray-tracing shaders can report the finest level they sample of each streamed texture, indexed like the
+    // texture array. Nothing sampled reads as the largest value, which atomicMin() lowers.
+    if (mpTextureStreamer) {
+        const VkDeviceSize feedbackSize = sizeof(uint32_t) * mTextureKeys.size();
+        if (!mpTextureFeedback || mpTextureFeedback->getElementSize() != feedbackSize) {
+            mpTextureFeedback =
+                mpDevice->createDynamicBuffer(feedbackSize, framesInFlightCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+            for (uint32_t i = 0; i < framesInFlightCount; i++) {
+                std::memset(mpTextureFeedback->at(i), 0xff, feedbackSize);
+            }
+        }
+    }
+
+    updateInstanceData();
+    handleGeometryRelocation();
+}
+
+ptr<Buffer> Scene::getVertexBuffer(uint32_t shard) const
+{
+    return mShards[shard].pVertexHeap->getBuffer();
+}
+
+ptr<Buffer> Scene::getIndexBuffer(uint32_t shard) const
+{
+    return mShards[shard].pIndexHeap->getBuffer();
+}
+
+VkDeviceSize Scene::getMaxShardSize() const
+{
+    // Shaders bind each heap of a shard whole as a storage buffer, which the range of such a binding also limits
+    const DeviceProperties properties = mpDevice->getProperties();
+    return std::min({properties.maintenance3.maxMemoryAllocationSize, properties.maintenance4.maxBufferSize,
+                     static_cast<VkDeviceSize>(properties.physicalDevice.limits.maxStorageBufferRange)});
+}
+
+void Scene::addShard(VkDeviceSize verticesSize, VkDeviceSize indicesSize)
+{
+    const VkDeviceSize maxSize = getMaxShardSize();
+
+    GeometryShard shard;
+
+    // Vertex ranges line up with whole vertices, so that meshes can be drawn with a vertex offset of zero
+    shard.pVertexHeap = make_ptr<GeometryHeap>(
+        mpDevice, std::min(verticesSize, maxSize),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+        sizeof(Vertex), maxSize);
+    shard.pIndexHeap = make_ptr<GeometryHeap>(
+        mpDevice, std::min(indicesSize, maxSize),
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR,
+        sizeof(uint32_t), maxSize);
+
+    // A new shard counts as relocated geometry, so that the shaders learn about it the next time that is checked
+    shard.vertexGeneration = std::numeric_limits<uint64_t>::max();
+    shard.indexGeneration = std::numeric_limits<uint64_t>::max();
+
+    mShards.push_back(std::move(shard));
+}
+
+void Scene::allocateMesh(Mesh& mesh)
+{
+    const VkDeviceSize verticesSize = sizeof(Vertex) * mesh.vertexCount;
+    const VkDeviceSize indicesSize = sizeof(uint32_t) * mesh.indexCount;
+
+    if (verticesSize > getMaxShardSize() || indicesSize > getMaxShardSize()) {
+        Log::Error("Scene: A mesh with {} vertices and {} indices is larger than the device can allocate at once",
+                   mesh.vertexCount, mesh.indexCount);
+        return;
+    }
+
+    // A mesh keeps its vertices and indices in the same shard, which is the first one with room for both
+    for (uint32_t i = 0; i <= count(mShards); i++) {
+        if (i == count(mShards)) {
+            addShard(verticesSize, indicesSize); // Every shard is full, so start a new one
+        }
+
+        GeometryShard& shard = mShards[i];
+
+        std::optional<VkDeviceSize> verticesOffset = shard.pVertexHeap->allocate(verticesSize);
+        if (!verticesOffset) {
+            continue;
+        }
+
+        std::optional<VkDeviceSize> indicesOffset = shard.pIndexHeap->allocate(indicesSize);
+        if (!indicesOffset) {
+            shard.pVertexHeap->free(*verticesOffset);
+            continue;
+        }
+
+        mesh.shard = i;
+        mesh.deviceVerticesOffset = *verticesOffset;
+        mesh.deviceIndicesOffset = *indicesOffset;
+        mesh.resident = true;
+        mesh.needsUpload = true;
+        return;
+    }
+}
+
+void Scene::updateInstanceData()
+{
+    uint32_t instanceCount = 0;
+    for (const auto& node : mNodes) {
+        instanceCount += count(node.mMeshIndices);
+    }
+
+    // The buffer only grows, so that the descriptors pointing at it rarely have to change
+    VkDeviceSize instanceDataBufferSize = sizeof(InstanceData) * std::max(instanceCount, 1u);
+    if (!mpInstanceDataBuffer || mpInstanceDataBuffer->getSize() < instanceDataBufferSize) {
+        mpInstanceDataBuffer = mpDevice->createBuffer(instanceDataBufferSize, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                                                      VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        updateRayTracingResources();
+    }
+
+    // Meshes keep their own ranges in the heaps, so the addresses follow from those rather than from the order the
+    // meshes are drawn in. Addresses rather than offsets let instances reach geometry in any shard.
     InstanceData* instanceData = static_cast<InstanceData*>(mpInstanceDataBuffer->getHostMap());
     uint32_t instanceIndex = 0;
-    uint32_t verticesOffset = 0;
-    uint32_t indicesOffset = 0;
-    for (auto& node : mNodes) {
-        for (auto& meshIndex : node.getMeshIndices()) {
-            auto& mesh = mMeshes[meshIndex];
+    for (const auto& node : mNodes) {
+        for (auto meshIndex : node.mMeshIndices) {
+            const Mesh& mesh = mMeshes[mMeshes[meshIndex].geometryIndex];
+
+            instanceData[instanceIndex] = {};
+            if (mesh.resident) {
+                instanceData[instanceIndex] = {
+                    .vertexAddress = getMeshVertexAddress(meshIndex),
+                    .indexAddress = getMeshIndexAddress(meshIndex),
+                };
+            }
+
+            instanceIndex += 1;
+        }
+    }
+}
 
-            instanceData[instanceIndex].verticesOffset = verticesOffset;
-            instanceData[instanceIndex].indicesOffset = indicesOffset;
+void Scene::updateRayTracingResources()
+{
+    std::erase_if(mRayTracingShaders, [](const auto& wpShader) { return wpShader.expired(); });
 
-            verticesOffset += count(mesh.vertices);
-            indicesOffset += count(mesh.indices);
+    for (const auto& wpShader : mRayTracingShaders) {
+        ptr<Shader> pShader = wpShader.lock();
+        attachGeometryBuffers(pShader);
+        pShader->setResource("instanceDataBuffer", mpInstanceDataBuffer);
+    }
+}
 
-            instanceIndex += 1;
+void Scene::attachGeometryBuffers(ptr<Shader> pShader) const
+{
+    if (!pShader->hasResource("vertexBuffer") && !pShader->hasResource("indexBuffer")) {
+        return; // The shader reaches the geometry through the instance data
+    }
+
+    if (mShards.size() != 1) {
+        Log::Error("Scene: The shader declares vertexBuffer and indexBuffer, but the geometry is spread over {} "
+                   "shards. Read it through the addresses in the instance data instead.",
+                   mShards.size());
+        return;
+    }
+
+    if (pShader->hasResource("vertexBuffer")) {
+        pShader->setResource("vertexBuffer", getVertexBuffer(0));
+    }
+    if (pShader->hasResource("indexBuffer")) {
+        pShader->setResource("indexBuffer", getIndexBuffer(0));
+    }
+}
+
+void Scene::handleGeometryRelocation()
+{
+    bool relocated = false;
+    for (auto& shard : mShards) {
+        if (shard.pVertexHeap->getGeneration() != shard.vertexGeneration ||
+            shard.pIndexHeap->getGeneration() != shard.indexGeneration) {
+            shard.vertexGeneration = shard.pVertexHeap->getGeneration();
+            shard.indexGeneration = shard.pIndexHeap->getGeneration();
+            relocated = true;
         }
     }
+
+    if (!relocated) {
+        return;
+    }
+
+    // A new buffer has a new device address, even where the offsets stayed the same
+    updateInstanceData();
+    updateRayTracingResources();
 }
 
 void Scene::createDescriptors(ptr<Camera> pCamera)
@@ -564,73 +942,152 @@ void Scene::createDescriptorsForShader(ptr<Shader> pShader, ptr<Camera> pCamera)
     resources.materialSet = materialInfo->set;
     resources.materialDescriptors.reserve(mMaterials.size());
 
-    for (auto& mat : mMaterials) {
-        std::vector<DescriptorDesc> desc;
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, mpMaterialParams, mat.paramsOffset,
-                          sizeof(MaterialParams));
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[mat.diffuseTexturePath]);
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[mat.specularTexturePath]);
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[mat.ambientTexturePath]);
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[mat.emissionTexturePath]);
-        desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[mat.normalTexturePath]);
-
-        // The descriptor writes the bindings in the order they are described, so the shader has to declare the
-        // material resources in that same order within their set
-        resources.materialDescriptors.push_back(
-            mpDevice->createDescriptor(desc, pShader->getDescriptorSetLayout(resources.materialSet)));
+    for (const auto& mat : mMaterials) {
+        resources.materialDescriptors.push_back(createMaterialDescriptor(resources, mat));
     }
 
     mShaderResources.push_back(std::move(resources));
 }
 
+ptr<Descriptor> Scene::createMaterialDescriptor(const ShaderResources& resources, const Material& material)
+{
+    std::vector<DescriptorDesc> desc;
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, mpMaterialParams, material.paramsOffset,
+                      sizeof(MaterialParams));
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[material.diffuseTexturePath]);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[material.specularTexturePath]);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[material.ambientTexturePath]);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[material.emissionTexturePath]);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, mTextures[material.normalTexturePath]);
+
+    // The descriptor writes the bindings in the order they are described, so the shader has to declare the
+    // material resources in that same order within their set
+    return mpDevice->createDescriptor(desc, resources.pShader->getDescriptorSetLayout(resources.materialSet));
+}
+
 void Scene::createRayTracingDescriptors(ptr<Shader> pShader, ptr<Camera> pCamera,
                                         const ptr<AccelerationStructure> pAccelerationStructure)
 {
-    // Get a list of the textures
-    std::vector<ptr<Texture>> textures;
-    std::transform(mTextures.begin(), mTextures.end(), std::back_inserter(textures),
-                   [](const auto& entry) { return entry.second; });
-
     pShader->setResource("camera", pCamera->getUniformBuffer());
     pShader->setResource("scene", pAccelerationStructure);
-    pShader->setResource("vertexBuffer", mpVertexBuffer);
-    pShader->setResource("indexBuffer", mpIndexBuffer);
+    attachGeometryBuffers(pShader);
     pShader->setResource("instanceDataBuffer", mpInstanceDataBuffer);
     pShader->setResource("materialBuffer", mpMaterialBuffer);
-    pShader->setResource("textures", textures);
+    pShader->setResource("textures", getTextureArray());
 
     if (mpEnvironmentMap && pShader->hasResource("environmentMap")) {
         pShader->setResource("environmentMap", mpEnvironmentMap);
     }
+
+    if (mpTextureFeedback && pShader->hasResource("textureFeedback")) {
+        pShader->setResource("textureFeedback", mpTextureFeedback);
+    }
+
+    // The geometry and instance buffers are replaced when meshes are added or removed, and the shader has to follow
+    bool known = std::any_of(mRayTracingShaders.begin(), mRayTracingShaders.end(),
+                             [&pShader](const auto& wpShader) { return wpShader.lock() == pShader; });
+    if (!known) {
+        mRayTracingShaders.push_back(pShader);
+    }
 }
 
 void Scene::syncToDevice()
 {
-    std::vector<Vertex> vertices;
-    std::vector<uint32_t> indices;
-    VkDeviceSize verticesOffset = 0;
-    VkDeviceSize indicesOffset = 0;
+    std::vector<uint32_t> meshIndices;
+    for (uint32_t i = 0; i < count(mMeshes); i++) {
+        if (mMeshes[i].needsUpload) {
+            meshIndices.push_back(i);
+        }
+    }
 
-    for (auto& node : mNodes) {
-        for (auto meshIndex : node.mMeshIndices) {
-            auto& mesh = mMeshes[meshIndex];
+    uploadMeshes(meshIndices);
 
-            size_t vertSize = mesh.vertices.size() * sizeof(Vertex);
-            size_t indxSize = mesh.indices.size() * sizeof(uint32_t);
+    // Nodes may have been given other meshes since the last sync
+    updateInstanceData();
+}
 
-            vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
-            indices.insert(indices.end(), mesh.indices.begin(), mesh.indices.end());
+void Scene::uploadMeshes(const std::vector<uint32_t>& meshIndices)
+{
+    // Meshes are copied straight into a staging buffer of bounded size, which is flushed to the device whenever it
+    // fills up, instead of concatenating all geometry on the host first
+    constexpr VkDeviceSize maxStagingSize = 64 * 1024 * 1024;
+
+    VkDeviceSize totalSize = 0;
+    for (auto meshIndex : meshIndices) {
+        const Mesh& mesh = mMeshes[meshIndex];
+        totalSize += sizeof(Vertex) * mesh.vertices.size() + sizeof(uint32_t) * mesh.indices.size();
+    }
+    if (totalSize == 0) {
+        return;
+    }
 
-            mesh.deviceVerticesOffset = verticesOffset;
-            mesh.deviceIndicesOffset = indicesOffset;
+    Buffer staging(mpDevice, std::min(totalSize, maxStagingSize), VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::byte* pStaging = static_cast<std::byte*>(staging.getHostMap());
+    VkDeviceSize stagingOffset = 0;
 
-            verticesOffset += vertSize;
-            indicesOffset += indxSize;
+    // Regions grouped by the buffer they go to, since meshes may live in different shards
+    std::map<VkBuffer, std::vector<VkBufferCopy>> regions;
+
+    auto flush = [&]() {
+        if (stagingOffset == 0) {
+            return;
+        }
+
+        VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+        for (const auto& [buffer, bufferRegions] : regions) {
+            vkCmdCopyBuffer(cmd, staging.getBuffer(), buffer, count(bufferRegions), bufferRegions.data());
         }
+        Helpers::cmdEnd(mpDevice, cmd);
+
+        regions.clear();
+        stagingOffset = 0;
+    };
+
+    // Copy a range of host memory to the device, split over several flushes if it does not fit in the staging buffer
+    auto stream = [&](const void* pData, VkDeviceSize size, VkBuffer dst, VkDeviceSize dstOffset) {
+        const std::byte* pSrc = static_cast<const std::byte*>(pData);
+        while (size > 0) {
+            if (stagingOffset == staging.getSize()) {
+                flush();
+            }
+
+            VkDeviceSize chunk = std::min(size, staging.getSize() - stagingOffset);
+            std::memcpy(pStaging + stagingOffset, pSrc, chunk);
+            regions[dst].push_back({
+                .srcOffset = stagingOffset,
+                .dstOffset = dstOffset,
+                .size = chunk,
+            });
+
+            stagingOffset += chunk;
+            pSrc += chunk;
+            dstOffset += chunk;
+            size -= chunk;
+        }
+    };
+
+    for (auto meshIndex : meshIndices) {
+        Mesh& mesh = mMeshes[meshIndex];
+
+        stream(mesh.vertices.data(), sizeof(Vertex) * mesh.vertices.size(), getVertexBuffer(mesh.shard)->getBuffer(),
+               mesh.deviceVerticesOffset);
+        stream(mesh.indices.data(), sizeof(uint32_t) * mesh.indices.size(), getIndexBuffer(mesh.shard)->getBuffer(),
+               mesh.deviceIndicesOffset);
+
+        mesh.needsUpload = false;
+        mesh.revision += 1;
     }
 
-    mpVertexBuffer->copyFromHost(vertices.data(), verticesOffset, 0);
-    mpIndexBuffer->copyFromHost(indices.data(), indicesOffset, 0);
+    flush();
+
+    if (!mKeepHostGeometry) {
+        for (auto meshIndex : meshIndices) {
+            Mesh& mesh = mMeshes[meshIndex];
+            std::vector<Vertex>().swap(mesh.vertices);
+            std::vector<uint32_t>().swap(mesh.indices);
+        }
+    }
 }
 
 std::vector<uint32_t> Scene::loadFromOBJ(const std::filesystem::path& path, const std::filesystem::path& materialPath)
@@ -795,13 +1252,13 @@ std::vector<uint32_t> Scene::loadFromOBJ(const std::filesystem::path& path, cons
         mat.params.opacity = material.dissolve;
 
         auto setTexture = [this, &path, &materialPath](std::unordered_map<std::string, ptr<Texture>>& loadedTextures,
-                                                       const std::string& textureName, ptr<Texture> pMissingTexture,
-                                                       std::string& textureKey) {
+                                                       const std::string& textureName, MaterialTextureBit bit,
+                                                       ptr<Texture> pMissingTexture, std::string& textureKey) {
             if (!textureName.empty()) {
                 auto fullPath =
                     std::filesystem::canonical(path.parent_path() / materialPath.relative_path() / textureName);
                 textureKey = fullPath.string();
-                addTexture(textureKey);
+                addTexture(textureKey, bit);
                 return true;
             }
 
@@ -811,19 +1268,24 @@ std::vector<uint32_t> Scene::loadFromOBJ(const std::filesystem::path& path, cons
 
         mat.params.hasTexture = 0;
 
-        if (setTexture(mTextures, material.diffuse_texname, mpMissingTexture, mat.diffuseTexturePath)) {
+        if (setTexture(mTextures, material.diffuse_texname, MaterialTextureBit::Diffuse, mpMissingTexture,
+                       mat.diffuseTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Diffuse);
         }
-        if (setTexture(mTextures, material.specular_texname, mpMissingTexture, mat.specularTexturePath)) {
+        if (setTexture(mTextures, material.specular_texname, MaterialTextureBit::Specular, mpMissingTexture,
+                       mat.specularTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Specular);
         }
-        if (setTexture(mTextures, material.ambient_texname, mpMissingTexture, mat.ambientTexturePath)) {
+        if (setTexture(mTextures, material.ambient_texname, MaterialTextureBit::Ambient, mpMissingTexture,
+                       mat.ambientTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Ambient);
         }
-        if (setTexture(mTextures, material.emissive_texname, mpMissingTexture, mat.emissionTexturePath)) {
+        if (setTexture(mTextures, material.emissive_texname, MaterialTextureBit::Emission, mpMissingTexture,
+                       mat.emissionTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Emission);
         }
-        if (setTexture(mTextures, material.normal_texname, mpMissingTexture, mat.normalTexturePath)) {
+        if (setTexture(mTextures, material.normal_texname, MaterialTextureBit::Normal, mpMissingTexture,
+                       mat.normalTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Normal);
         }
 
@@ -853,6 +1315,20 @@ std::vector<uint32_t> Scene::loadFromGLTF(const std::filesystem::path& path)
     std::string err;
     std::string warn;
 
+    // Keep the encoded images instead of letting TinyGLTF decode them, one after another, only for the pixels to be
+    // thrown away. They are decoded in parallel with the other textures of the file later on.
+    std::vector<std::vector<uint8_t>> encodedImages;
+    loader.SetImageLoader(
+        [&encodedImages](tinygltf::Image*, const int imageIndex, std::string*, std::string*, int, int,
+                         const unsigned char* pBytes, int size, void*) {
+            if (encodedImages.size() <= static_cast<size_t>(imageIndex)) {
+                encodedImages.resize(imageIndex + 1);
+            }
+            encodedImages[imageIndex].assign(pBytes, pBytes + size);
+            return true;
+        },
+        nullptr);
+
     bool ret = false;
     if (path.extension() == ".gltf") {
         ret = loader.LoadASCIIFromFile(&model, &err, &warn, path.string());
@@ -1026,32 +1502,30 @@ std::vector<uint32_t> Scene::loadFromGLTF(const std::filesystem::path& path)
 
         // Captured by reference, the model in particular: copying it would deep copy every buffer in the file, once
         // per material
-        auto setTexture = [this, &path, &model](std::unordered_map<std::string, ptr<Texture>>& loadedTextures,
-                                                int textureIndex, ptr<Texture> pMissingTexture,
-                                                std::string& textureKey) {
+        auto setTexture = [this, &path, &model, &encodedImages](
+                              std::unordered_map<std::string, ptr<Texture>>& loadedTextures, int textureIndex,
+                              MaterialTextureBit bit, ptr<Texture> pMissingTexture, std::string& textureKey) {
             if (textureIndex >= 0) {
-                std::string textureName = model.images[model.textures[textureIndex].source].uri;
-                if (textureName.empty()) {
-                    // Image is stored in buffer view
-                    const auto& bufferView =
-                        model.bufferViews[model.images[model.textures[textureIndex].source].bufferView];
-                    const auto& buffer = model.buffers[bufferView.buffer];
-                    const uint8_t* pFileData = buffer.data.data() + bufferView.byteOffset;
-
-                    textureName = model.images[model.textures[textureIndex].source].name;
-                    if (textureName.empty()) {
-                        // Generate a unique name
-                        static uint32_t unnamedTextureCount = 0;
-                        textureName = "unnamed_texture_" + std::to_string(unnamedTextureCount++);
+                const int imageIndex = model.textures[textureIndex].source;
+                const tinygltf::Image& image = model.images[imageIndex];
+
+                if (image.bufferView >= 0 || image.uri.starts_with("data:")) {
+                    // Image is stored in the file itself. Unnamed ones are told apart by their index, so that every
+                    // material using the same image shares one texture.
+                    textureKey = image.name;
+                    if (textureKey.empty()) {
+                        textureKey = std::format("{}#image{}", path.string(), imageIndex);
                     }
-                    textureKey = textureName;
-                    addTextureFromMemory(pFileData, bufferView.byteLength, textureName);
+                } else {
+                    textureKey = std::filesystem::canonical(path.parent_path() / image.uri).string();
+                }
 
-                    return true;
+                // TinyGLTF has already read external images as well, so the bytes are used whenever they are there
+                if (static_cast<size_t>(imageIndex) < encodedImages.size() && !encodedImages[imageIndex].empty()) {
+                    addTextureFromMemory(std::move(encodedImages[imageIndex]), textureKey, bit);
+                } else {
+                    addTexture(textureKey, bit);
                 }
-                auto fullPath = std::filesystem::canonical(path.parent_path() / textureName);
-                textureKey = fullPath.string();
-                addTexture(textureKey);
                 return true;
             }
             loadedTextures.insert(std::make_pair("", pMissingTexture));
@@ -1060,21 +1534,24 @@ std::vector<uint32_t> Scene::loadFromGLTF(const std::filesystem::path& path)
 
         mat.params.hasTexture = 0;
 
-        if (setTexture(mTextures, material.pbrMetallicRoughness.baseColorTexture.index, mpMissingTexture,
-                       mat.diffuseTexturePath)) {
+        if (setTexture(mTextures, material.pbrMetallicRoughness.baseColorTexture.index, MaterialTextureBit::Diffuse,
+                       mpMissingTexture, mat.diffuseTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Diffuse);
         }
-        if (setTexture(mTextures, material.pbrMetallicRoughness.metallicRoughnessTexture.index, mpMissingTexture,
-                       mat.specularTexturePath)) {
+        if (setTexture(mTextures, material.pbrMetallicRoughness.metallicRoughnessTexture.index,
+                       MaterialTextureBit::Specular, mpMissingTexture, mat.specularTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Specular);
         }
-        if (setTexture(mTextures, material.occlusionTexture.index, mpMissingTexture, mat.ambientTexturePath)) {
+        if (setTexture(mTextures, material.occlusionTexture.index, MaterialTextureBit::Ambient, mpMissingTexture,
+                       mat.ambientTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Ambient);
         }
-        if (setTexture(mTextures, material.emissiveTexture.index, mpMissingTexture, mat.emissionTexturePath)) {
+        if (setTexture(mTextures, material.emissiveTexture.index, MaterialTextureBit::Emission, mpMissingTexture,
+                       mat.emissionTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Emission);
         }
-        if (setTexture(mTextures, material.normalTexture.index, mpMissingTexture, mat.normalTexturePath)) {
+        if (setTexture(mTextures, material.normalTexture.index, MaterialTextureBit::Normal, mpMissingTexture,
+                       mat.normalTexturePath)) {
             mat.params.hasTexture |= static_cast<uint32_t>(MaterialTextureBit::Normal);
         }
 
@@ -1084,7 +1561,13 @@ std::vector<uint32_t> Scene::loadFromGLTF(const std::filesystem::path& path)
     return newMeshIndices;
 }
 
-void Scene::addTexture(std::string texturePath)
+void Scene::setTextureCacheDirectory(const std::filesystem::path& directory)
+{
+    mpTextureCache = make_ptr<TextureCache>(directory);
+    mpTextureLoader->setCache(mpTextureCache);
+}
+
+void Scene::addTexture(std::string texturePath, MaterialTextureBit slot)
 {
     if (texturePath.empty()) {
         return;
@@ -1094,39 +1577,207 @@ void Scene::addTexture(std::string texturePath)
         return;
     }
 
-    bool generateMipmaps = true;
-    auto pTexture =
-        mpDevice->createTextureFromFile(TextureType::Texture2D, VK_FORMAT_R8G8B8A8_UNORM, texturePath, generateMipmaps);
+    // The missing texture stands in until loadTextures() has decoded the image, and stays if that fails
+    mTextures.insert(std::make_pair(texturePath, mpMissingTexture));
 
-    if (pTexture != nullptr) {
-        mTextures.insert(std::make_pair(texturePath, pTexture));
-    } else {
-        mTextures.insert(std::make_pair(texturePath, mpMissingTexture));
-    }
+    const bool generateMipmaps = true;
+    mpTextureLoader->addFile(texturePath, texturePath, VK_FORMAT_R8G8B8A8_UNORM, generateMipmaps,
+                             getTextureCompression(slot), getMipGeneration(slot));
 }
 
-void Scene::addTextureFromMemory(const uint8_t* pFileData, size_t size, const std::string& textureName)
+void Scene::addTextureFromMemory(std::vector<uint8_t> fileData, const std::string& textureName,
+                                 MaterialTextureBit slot)
 {
     if (mTextures.contains(textureName)) {
         return;
     }
 
-    int width;
-    int height;
-    int channels;
-
-    stbi_set_flip_vertically_on_load(1);
-    stbi_uc* pData =
-        stbi_load_from_memory(pFileData, static_cast<int>(size), &width, &height, &channels, STBI_rgb_alpha);
+    mTextures.insert(std::make_pair(textureName, mpMissingTexture));
 
-    const uint32_t bytesPerPixel = 4;
     const bool generateMipmaps = true;
-    auto pTexture = mpDevice->createTextureFromBuffer(TextureType::Texture2D, VK_FORMAT_R8G8B8A8_UNORM, pData, width,
-                                                      height, 1, bytesPerPixel, generateMipmaps);
+    mpTextureLoader->addMemory(textureName, std::move(fileData), VK_FORMAT_R8G8B8A8_UNORM, generateMipmaps,
+                               getTextureCompression(slot), getMipGeneration(slot));
+}
 
-    if (pTexture != nullptr) {
-        mTextures.insert(std::make_pair(textureName, pTexture));
-    } else {
-        mTextures.insert(std::make_pair(textureName, mpMissingTexture));
+TextureCompression Scene::getTextureCompression(MaterialTextureBit slot) const
+{
+    if (!mTextureCompression) {
+        return TextureCompression::None;
+    }
+
+    // Normal maps only need two channels, as the shaders rebuild z, and BC5 spends all its bits on those two
+    return slot == MaterialTextureBit::Normal ? TextureCompression::BC5 : TextureCompression::BC7;
+}
+
+std::optional<MipGenerationDesc> Scene::getMipGeneration(MaterialTextureBit slot) const
+{
+    // Streamed textures are uploaded a few levels at a time, so the device never gets to make them
+    if (!mTextureMipFilter && !mpTextureStreamer) {
+        return std::nullopt;
     }
+
+    // Colours are authored in sRGB even though they are sampled as UNORM, and averaging them without decoding first
+    // darkens the smaller levels. Diffuse alpha is what alpha testing uses, so it keeps its coverage.
+    return MipGenerationDesc{
+        .filter = mTextureMipFilter.value_or(MipFilter::Box),
+        .sRGB = slot == MaterialTextureBit::Diffuse || slot == MaterialTextureBit::Emission,
+        .preserveAlphaCoverage = slot == MaterialTextureBit::Diffuse,
+    };
+}
+
+void Scene::loadTextures()
+{
+    if (mpTextureStreamer) {
+        mpTextureLoader->loadMipChains([this](const std::string& key, std::optional<MipChain> mipChain) {
+            if (mipChain) {
+                mTextures[key] = mpTextureStreamer->add(key, std::move(*mipChain));
+            }
+        });
+        return;
+    }
+
+    mpTextureLoader->load([this](const std::string& key, ptr<Texture> pTexture) {
+        if (pTexture) {
+            mTextures[key] = pTexture;
+        }
+    });
+}
+
+void Scene::setTextureStreaming(std::optional<TextureStreamingDesc> desc)
+{
+    if (mTextures.size() > 1) {
+        Log::Warning("Scene: Texture streaming was changed after textures were loaded, which stay as they are");
+    }
+
+    mpTextureStreamer = desc ? mpDevice->createTextureStreamer(*desc) : nullptr;
+}
+
+void Scene::updateTextureStreaming(VkCommandBuffer cmd, ptr<Camera> pCamera, uint32_t viewportHeight)
+{
+    if (!mpTextureStreamer) {
+        return;
+    }
+
+    requestTexturesFromFeedback();
+    if (pCamera) {
+        requestTexturesFromBounds(pCamera, viewportHeight);
+    }
+
+    std::vector<std::string> changed = mpTextureStreamer->update(cmd);
+    if (!changed.empty()) {
+        updateTextureDescriptors(std::set<std::string>(changed.begin(), changed.end()));
+    }
+}
+
+void Scene::requestTexturesFromFeedback()
+{
+    if (!mpTextureFeedback) {
+        return;
+    }
+
+    // This frame in flight's copy was last written a full round of frames ago, and the device has to be done with
+    // that frame before the copy can be read and cleared for this one
+    const uint64_t frameNumber = mpDevice->getFrameNumber();
+    const uint32_t framesInFlightCount = mpDevice->getFramesInFlightCount();
+    if (frameNumber > framesInFlightCount) {
+        mpDevice->waitForFrame(frameNumber - framesInFlightCount);
+    }
+
+    uint32_t* pLevels = static_cast<uint32_t*>(mpTextureFeedback->at());
+    const uint32_t levelCount = static_cast<uint32_t>(mpTextureFeedback->getElementSize() / sizeof(uint32_t));
+
+    // Slots follow the keys of the last compile, and textures added since then have none until the next one
+    for (uint32_t index = 0; index < std::min(levelCount, count(mTextureKeys)); index++) {
+        // Shaders count levels from the finest one of the texture they sampled, which is the one that was resident
+        if (pLevels[index] != std::numeric_limits<uint32_t>::max()) {
+            const std::string& key = mTextureKeys[index];
+            mpTextureStreamer->request(key, pLevels[index] + mpTextureStreamer->getResidentLevel(key));
+        }
+    }
+
+    std::fill(pLevels, pLevels + levelCount, std::numeric_limits<uint32_t>::max());
+}
+
+void Scene::requestTexturesFromBounds(ptr<Camera> pCamera, uint32_t viewportHeight)
+{
+    const Frustum frustum = pCamera->getFrustum();
+    const glm::vec3 eye = pCamera->getPosition();
+
+    // Pixels that one unit covers at a distance of one unit, from the vertical field of view
+    const float pixelsPerUnit = 0.5f * static_cast<float>(viewportHeight) * pCamera->getProjectionMatrix()[1][1];
+
+    for (auto& node : mNodes) {
+        AABB box = node.getBoundingBox(shared_from_this());
+        if (box.empty()) {
+            continue;
+        }
+
+        box.transform(node.getTransform());
+        if (!frustum.intersects(box)) {
+            continue;
+        }
+
+        // Measured to the closest point of the box, so that a node around the camera counts as right in front of it
+        const float distance = std::max(glm::distance(eye, glm::clamp(eye, box.min, box.max)), 0.01f);
+        const float pixels = std::max(glm::length(box.max - box.min) / distance * pixelsPerUnit, 1.0f);
+
+        for (uint32_t meshIndex : node.getMeshIndices()) {
+            const Material& material = mMaterials[mMeshes[meshIndex].materialIndex];
+            for (const std::string* pPath : {&material.diffuseTexturePath, &material.specularTexturePath,
+                                             &material.ambientTexturePath, &material.emissionTexturePath,
+                                             &material.normalTexturePath}) {
+                const uint32_t levelCount = mpTextureStreamer->getLevelCount(*pPath);
+                if (levelCount == 0) {
+                    continue;
+                }
+
+                // The first level is about 2^(levelCount - 1) texels across, and the level to use is the one whose
+                // texels are as large as the pixels the node is spread over
+                const float level = static_cast<float>(levelCount - 1) - std::log2(pixels);
+                mpTextureStreamer->request(*pPath, level > 0.0f ? static_cast<uint32_t>(level) : 0);
+            }
+        }
+    }
+}
+
+void Scene::updateTextureDescriptors(const std::set<std::string>& keys)
+{
+    for (const auto& key : keys) {
+        mTextures[key] = mpTextureStreamer->getTexture(key);
+    }
+
+    // Setting a resource has the shader allocate a new set the next time it binds, which leaves the set that earlier
+    // frames use alone. The keys stay the same, so every texture keeps its index in the array.
+    std::erase_if(mRayTracingShaders, [](const auto& wpShader) { return wpShader.expired(); });
+    if (!mRayTracingShaders.empty()) {
+        const std::vector<ptr<Texture>> textures = getTextureArray();
+
+        for (const auto& wpShader : mRayTracingShaders) {
+            wpShader.lock()->setResource("textures", textures);
+        }
+    }
+
+    // Material sets are prepared up front, so the ones with a replaced texture are prepared anew and the old ones
+    // kept until the device is done with them
+    for (auto& resources : mShaderResources) {
+        for (uint32_t i = 0; i < count(resources.materialDescriptors); i++) {
+            const Material& material = mMaterials[i];
+            if (!keys.contains(material.diffuseTexturePath) && !keys.contains(material.specularTexturePath) &&
+                !keys.contains(material.ambientTexturePath) && !keys.contains(material.emissionTexturePath) &&
+                !keys.contains(material.normalTexturePath)) {
+                continue;
+            }
+
+            mpTextureStreamer->retire(resources.materialDescriptors[i]);
+            resources.materialDescriptors[i] = createMaterialDescriptor(resources, material);
+        }
+    }
+}
+
+std::vector<ptr<Texture>> Scene::getTextureArray() const
+{
+    std::vector<ptr<Texture>> textures;
+    std::transform(mTextureKeys.begin(), mTextureKeys.end(), std::back_inserter(textures),
+                   [this](const std::string& key) { return mTextures.at(key); });
+    return textures;
 }
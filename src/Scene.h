@@ -4,13 +4,16 @@
 
 #include "AABB.h"
 #include "AccelerationStructure.h"
+#include "BlockCompression.h"
 #include "Camera.h"
 #include "Descriptor.h"
 #include "Device.h"
 #include "DynamicBuffer.h"
 #include "Layout.h"
+#include "MipGenerator.h"
 #include "Swapchain.h"
 #include "Texture.h"
+#include "TextureStreamer.h"
 
 namespace Mandrill
 {
@@ -38,9 +41,22 @@ namespace Mandrill
         std::vector<uint32_t> indices;
         uint32_t materialIndex{};
 
-        // Device offset are set when uploading to device
+        // Counts outlive the host copies above, which the scene can release once they are on the device
+        uint32_t vertexCount{};
+        uint32_t indexCount{};
+
+        // Device offsets are set when the mesh is given its ranges in the geometry heaps
         VkDeviceSize deviceVerticesOffset{};
         VkDeviceSize deviceIndicesOffset{};
+        uint32_t shard{};    // Which pair of geometry heaps the ranges are in
+        bool resident{};     // Has ranges in the geometry heaps
+        bool needsUpload{};  // The ranges do not hold the geometry yet
+        uint32_t revision{}; // Changes whenever the geometry of the mesh is uploaded or removed
+
+        // Mesh whose ranges and BLAS hold the geometry, the mesh itself unless it repeats the geometry of another
+        // mesh. Such a mesh has no ranges of its own and no host copies.
+        uint32_t geometryIndex{};
+        size_t geometryHash{}; // Hash of the vertices and indices, to find meshes with the same geometry
 
         AABB boundingBox{};
     };
@@ -78,13 +94,15 @@ namespace Mandrill
     };
 
     struct InstanceData {
-        uint32_t verticesOffset; // Offset into global vertex buffer
-        uint32_t indicesOffset;  // Offset into global index buffer
+        VkDeviceAddress vertexAddress; // Device address of the first vertex of the instance's mesh
+        VkDeviceAddress indexAddress;  // Device address of the first index of the instance's mesh
     };
 
     class Scene; // Forward declare scene so Node can befriend it
+    class GeometryHeap;
     class Pipeline;
     class Shader;
+    class TextureCache;
 
     /// <summary>
     /// Scene node class for managing a single node in a scene graph. This class can hold meshes and transformations.
@@ -134,6 +152,7 @@ namespace Mandrill
         MANDRILL_API void addMesh(uint32_t meshIndex)
         {
             mMeshIndices.push_back(meshIndex);
+            mRevision++;
         }
 
         /// <summary>
@@ -161,6 +180,7 @@ namespace Mandrill
         MANDRILL_API void setTransform(glm::mat4 transform)
         {
             mTransform = transform;
+            mRevision++;
         }
 
         /// <summary>
@@ -170,6 +190,7 @@ namespace Mandrill
         MANDRILL_API void setVisible(bool visible)
         {
             mVisible = visible;
+            mRevision++;
         }
 
         /// <summary>
@@ -181,6 +202,37 @@ namespace Mandrill
             return mVisible;
         }
 
+        /// <summary>
+        /// Set the mask that ray traced instances of the node's meshes get. A ray only hits the node if the cull mask
+        /// it is traced with shares a bit with the node's mask.
+        /// </summary>
+        /// <param name="mask">Ray mask, 0xff by default</param>
+        MANDRILL_API void setRayMask(uint8_t mask)
+        {
+            mRayMask = mask;
+            mRevision++;
+        }
+
+        /// <summary>
+        /// Get the ray mask of the node.
+        /// </summary>
+        /// <returns>Ray mask</returns>
+        MANDRILL_API uint8_t getRayMask() const
+        {
+            return mRayMask;
+        }
+
+        /// <summary>
+        /// Get the revision of the node. It changes whenever the transform, visibility, ray mask or meshes of the node
+        /// are set, so anything derived from them is out of date when the revision it was made from no longer
+        /// matches. Meshes changed through getMeshIndices() do not change it.
+        /// </summary>
+        /// <returns>Revision of the node</returns>
+        MANDRILL_API uint32_t getRevision() const
+        {
+            return mRevision;
+        }
+
         /// <summary>
         /// Get the mesh indices
         /// </summary>
@@ -203,6 +255,8 @@ namespace Mandrill
         uint32_t mTransformIndex;
 
         bool mVisible;
+        uint8_t mRayMask;
+        uint32_t mRevision;
 
         std::vector<Node*> mChildren;
     };
@@ -262,16 +316,42 @@ namespace Mandrill
 
         /// <summary>
         /// Add a mesh to the scene.
+        ///
+        /// After the scene has been compiled, the mesh is uploaded right away into ranges of the existing geometry
+        /// buffers, without touching the geometry of other meshes. Add it to a node and call syncToDevice() to make
+        /// it part of the instance data, and update any acceleration structure of the scene to build its BLAS.
+        ///
+        /// A mesh with the same vertices and indices as an existing one still gets an index of its own, with its own
+        /// material, but shares the geometry and BLAS of the existing one, see getMeshGeometryIndex().
         /// </summary>
         /// <param name="vertices">List of vertices that make up the mesh</param>
         /// <param name="indices">List of indices that describes how the vertices are connected</param>
         /// <param name="materialIndex">Which material should be used for the mesh</param>
         /// <returns>Mesh index that can be added to a node in the scene</returns>
-        MANDRILL_API uint32_t addMesh(const std::vector<Vertex> vertices, const std::vector<uint32_t> indices,
+        MANDRILL_API uint32_t addMesh(std::vector<Vertex> vertices, std::vector<uint32_t> indices,
                                       uint32_t materialIndex);
 
         /// <summary>
-        /// Add several meshes to a scene by reading them from an OBJ- or GLTF/GLB-file.
+        /// Remove a mesh from the scene. The mesh is taken off every node that uses it and its ranges in the geometry
+        /// buffers are freed, unless other meshes share its geometry, in which case one of them takes the ranges
+        /// over. Mesh indices stay stable, so the index of a removed mesh is simply left empty.
+        ///
+        /// The free space is compacted on the device when it gets too scattered, see compactGeometry().
+        /// </summary>
+        /// <param name="meshIndex">Index of the mesh to remove</param>
+        MANDRILL_API void removeMesh(uint32_t meshIndex);
+
+        /// <summary>
+        /// Move the geometry of all meshes together, so that the space freed by removed meshes forms one block that
+        /// new meshes can use. This happens on the device, so it works without host copies of the geometry, and
+        /// instance data and descriptors are updated to match. Acceleration structures do not need a rebuild, as a
+        /// built BLAS does not refer back to the geometry it was built from.
+        /// </summary>
+        MANDRILL_API void compactGeometry();
+
+        /// <summary>
+        /// Add several meshes to a scene by reading them from an OBJ- or GLTF/GLB-file. Meshes whose geometry is
+        /// already in the scene share it as with addMesh().
         /// </summary>
         /// <param name="path">Path to the file</param>
         /// <param name="materialPath">Path to where the material files are stored (leave to default if the materials
@@ -283,6 +363,9 @@ namespace Mandrill
         /// <summary>
         /// Calculate sizes of buffers and allocate resources. Call this after all nodes have been added. Node
         /// transforms get one copy per frame in flight, as the device is set up for.
+        ///
+        /// Geometry lives in heaps that are only created the first time. Later calls give ranges to the meshes that
+        /// do not have any yet and leave the rest where they are.
         /// </summary>
         MANDRILL_API void compile();
 
@@ -308,7 +391,8 @@ namespace Mandrill
         /// <tr><td> ambientTexture <td> Material ambient texture <td> sampler2D
         /// <tr><td> emissionTexture <td> Material emission texture <td> sampler2D
         /// <tr><td> normalTexture <td> Material normal texture <td> sampler2D
-        /// <tr><td> environmentMap <td> Environment map texture <td> sampler2D, optional
+        /// <tr><td> environmentMap <td> Environment map texture <td> sampler2D, or samplerCube for a cube map,
+        /// optional
         /// </table>
         ///
         /// The camera and the node transforms live in one buffer each that is rebound with a dynamic offset, which is
@@ -333,18 +417,25 @@ namespace Mandrill
         /// <tr><th> Name in shader <th> Contents <th> Declared as <th>
         /// <tr><td> camera <td> Camera matrices (struct CameraMatrices) <td> uniform block named *Dynamic
         /// <tr><td> scene <td> Acceleration structure <td> accelerationStructureEXT
-        /// <tr><td> vertexBuffer <td> Global vertex buffer <td> readonly buffer block
-        /// <tr><td> indexBuffer <td> Global index buffer <td> readonly buffer block
-        /// <tr><td> instanceDataBuffer <td> Vertex and index offsets per instance <td> readonly buffer block
+        /// <tr><td> instanceDataBuffer <td> Vertex and index addresses per instance (struct InstanceData) <td>
+        /// readonly buffer block
         /// <tr><td> materialBuffer <td> Global material buffer <td> readonly buffer block
         /// <tr><td> textures <td> Global texture array <td> sampler2D array
-        /// <tr><td> environmentMap <td> Environment map texture <td> sampler2D, optional
+        /// <tr><td> environmentMap <td> Environment map texture <td> sampler2D, or samplerCube for a cube map,
+        /// optional
+        /// <tr><td> textureFeedback <td> Finest mip level sampled per texture (uint array) <td> buffer block named
+        /// *Dynamic, optional and only attached when textures are streamed
         /// </table>
         ///
         /// A buffer block needs an instance name for the scene to find it, since a block declared without one is only
         /// reachable through its block type name. The texture array has to be sized by a specialization constant that
         /// is set to Scene::getTextureCount().
         ///
+        /// The geometry is reached through the device addresses in the instance data, declared as buffer references,
+        /// since it may be spread over several buffers that together exceed what a descriptor can cover. A shader may
+        /// still declare vertexBuffer and indexBuffer blocks, which are attached as long as all geometry is in a single
+        /// shard.
+        ///
         /// Nothing varies per dispatch the way a node transform varies per draw, so the scene has no bind function of
         /// its own here. Bind everything, the scene's resources and the application's alike, with a single call to
         /// Shader::bindResources(cmd, bindPoint) before tracing.
@@ -364,9 +455,38 @@ namespace Mandrill
         /// Node transforms and material parameters are kept host coherent and can be changed without requiring a
         /// new sync.
         ///
+        /// Only meshes whose geometry is not on the device yet are uploaded. Their geometry is streamed through a
+        /// bounded staging buffer, so the upload needs no more host memory than the meshes already take up. If the
+        /// scene was told not to keep its host geometry, the meshes' vertices and indices are released once they are
+        /// on the device.
+        ///
+        /// The instance data is rewritten as well, so call this after adding meshes to nodes.
         /// </summary>
         MANDRILL_API void syncToDevice();
 
+        /// <summary>
+        /// Set whether meshes keep their vertices and indices on the host after syncToDevice() has uploaded them.
+        ///
+        /// Large scenes can otherwise hold as much geometry on the host as on the device. Without the host copies,
+        /// only the counts, device offsets and bounding boxes of the meshes remain. The device geometry stays valid
+        /// across later calls to compile() and syncToDevice() and the meshes can still be used and removed, but they
+        /// can no longer be read or changed on the host.
+        /// </summary>
+        /// <param name="keep">True to keep the host copies (the default), false to release them after upload</param>
+        MANDRILL_API void setKeepHostGeometry(bool keep)
+        {
+            mKeepHostGeometry = keep;
+        }
+
+        /// <summary>
+        /// Get whether meshes keep their vertices and indices on the host after upload.
+        /// </summary>
+        /// <returns>True if the host copies are kept, otherwise false</returns>
+        MANDRILL_API bool getKeepHostGeometry() const
+        {
+            return mKeepHostGeometry;
+        }
+
         /// <summary>
         /// Get a reference to a node in the scene.
         /// </summary>
@@ -398,7 +518,7 @@ namespace Mandrill
         /// Get the number of vertices in the scene.
         /// </summary>
         /// <returns>Number of vertices</returns>
-        MANDRILL_API uint32_t getVertexCount() const
+        MANDRILL_API uint64_t getVertexCount() const
         {
             return mVertexCount;
         }
@@ -407,11 +527,22 @@ namespace Mandrill
         /// Get the number of indices in the scene.
         /// </summary>
         /// <returns>Number of indices</returns>
-        MANDRILL_API uint32_t getIndexCount() const
+        MANDRILL_API uint64_t getIndexCount() const
         {
             return mIndexCount;
         }
 
+        /// <summary>
+        /// Get the number of shards the geometry is split into. A shard is a vertex and an index buffer that is never
+        /// larger than what the device can allocate at once, and a new one is started whenever the geometry does not
+        /// fit in the existing ones.
+        /// </summary>
+        /// <returns>Number of geometry shards</returns>
+        MANDRILL_API uint32_t getGeometryShardCount() const
+        {
+            return count(mShards);
+        }
+
         /// <summary>
         /// Get the number of meshes in the scene.
         /// </summary>
@@ -446,7 +577,7 @@ namespace Mandrill
         /// <returns>Number of vertices</returns>
         MANDRILL_API uint32_t getMeshVertexCount(uint32_t meshIndex) const
         {
-            return count(mMeshes[meshIndex].vertices);
+            return mMeshes[meshIndex].vertexCount;
         }
 
         /// <summary>
@@ -456,7 +587,7 @@ namespace Mandrill
         /// <returns>Number of indices</returns>
         MANDRILL_API uint32_t getMeshIndexCount(uint32_t meshIndex) const
         {
-            return count(mMeshes[meshIndex].indices);
+            return mMeshes[meshIndex].indexCount;
         }
 
         /// <summary>
@@ -466,7 +597,8 @@ namespace Mandrill
         /// <returns>Device address</returns>
         MANDRILL_API VkDeviceAddress getMeshVertexAddress(uint32_t meshIndex) const
         {
-            return mpVertexBuffer->getDeviceAddress() + mMeshes[meshIndex].deviceVerticesOffset;
+            const Mesh& mesh = mMeshes[mMeshes[meshIndex].geometryIndex];
+            return getVertexBuffer(mesh.shard)->getDeviceAddress() + mesh.deviceVerticesOffset;
         }
 
         /// <summary>
@@ -476,7 +608,8 @@ namespace Mandrill
         /// <returns>Device address</returns>
         MANDRILL_API VkDeviceAddress getMeshIndexAddress(uint32_t meshIndex) const
         {
-            return mpIndexBuffer->getDeviceAddress() + mMeshes[meshIndex].deviceIndicesOffset;
+            const Mesh& mesh = mMeshes[mMeshes[meshIndex].geometryIndex];
+            return getIndexBuffer(mesh.shard)->getDeviceAddress() + mesh.deviceIndicesOffset;
         }
 
         /// <summary>
@@ -490,7 +623,41 @@ namespace Mandrill
         }
 
         /// <summary>
-        /// Set an environment map for the scene.
+        /// Get the revision of a mesh's geometry. It changes whenever the geometry is uploaded or the mesh is removed,
+        /// so anything derived from the geometry, like a BLAS, is out of date when the revision it was built from no
+        /// longer matches.
+        /// </summary>
+        /// <param name="meshIndex">Index of the mesh to look up</param>
+        /// <returns>Revision of the mesh geometry</returns>
+        MANDRILL_API uint32_t getMeshRevision(uint32_t meshIndex) const
+        {
+            return mMeshes[meshIndex].revision;
+        }
+
+        /// <summary>
+        /// Get the mesh that holds the geometry of a mesh. Meshes with the same geometry share the ranges and BLAS of
+        /// the first of them, and keep their own materials.
+        /// </summary>
+        /// <param name="meshIndex">Index of the mesh to look up</param>
+        /// <returns>Index of the mesh with the geometry, meshIndex itself unless the geometry is shared</returns>
+        MANDRILL_API uint32_t getMeshGeometryIndex(uint32_t meshIndex) const
+        {
+            return mMeshes[meshIndex].geometryIndex;
+        }
+
+        /// <summary>
+        /// Get the bounding box of a mesh in its own space.
+        /// </summary>
+        /// <param name="meshIndex">Index of the mesh to look up</param>
+        /// <returns>Axis-aligned bounding box</returns>
+        MANDRILL_API const AABB& getMeshBoundingBox(uint32_t meshIndex) const
+        {
+            return mMeshes[meshIndex].boundingBox;
+        }
+
+        /// <summary>
+        /// Set an environment map for the scene, either a lat-long texture or a cube map. Shaders declare it as a
+        /// sampler2D or a samplerCube to match, where a cube map is sampled with the direction itself.
         /// </summary>
         /// <param name="pTexture">Texture to use as environment map</param>
         MANDRILL_API void setEnvironmentMap(ptr<Texture> pTexture)
@@ -498,9 +665,137 @@ namespace Mandrill
             mpEnvironmentMap = pTexture;
         }
 
+        /// <summary>
+        /// Set whether textures loaded from now on are block compressed, BC5 for normal maps and BC7 for the rest.
+        /// Compressed textures take a quarter of the memory of uncompressed ones, but the first load of each is slower
+        /// as it is encoded on the CPU. Ignored if the device cannot sample block-compressed textures.
+        /// </summary>
+        /// <param name="enable">True to compress textures</param>
+        MANDRILL_API void setTextureCompression(bool enable)
+        {
+            mTextureCompression = enable;
+        }
+
+        /// <summary>
+        /// Get whether textures are block compressed when loaded.
+        /// </summary>
+        /// <returns>True if textures are compressed</returns>
+        MANDRILL_API bool getTextureCompression() const
+        {
+            return mTextureCompression;
+        }
+
+        /// <summary>
+        /// Set how textures loaded from now on get their mip levels. By default the device makes them by blitting,
+        /// which is fast but filters sRGB colours as if they were linear. With a filter set, they are made on the CPU
+        /// instead, in linear space for colours and keeping the alpha-test coverage of diffuse textures, and then
+        /// cached with the compressed textures. Compressed textures always have their levels made on the CPU, with a
+        /// box filter unless another is set.
+        /// </summary>
+        /// <param name="filter">Filter to use, or nothing to let the device make the levels</param>
+        MANDRILL_API void setTextureMipFilter(std::optional<MipFilter> filter)
+        {
+            mTextureMipFilter = filter;
+        }
+
+        /// <summary>
+        /// Set the directory that textures made on the CPU are cached in, so that they are only made on the first run.
+        /// Defaults to a directory named TextureCache next to the executable.
+        /// </summary>
+        /// <param name="directory">Path to directory</param>
+        MANDRILL_API void setTextureCacheDirectory(const std::filesystem::path& directory);
+
+        /// <summary>
+        /// Set whether textures loaded from now on are streamed. Streamed textures keep all their mip levels on the
+        /// host, and only the smallest ones on the device to begin with. The finer levels are uploaded as
+        /// updateTextureStreaming() finds them needed, and dropped again when the memory budget runs out. Their levels
+        /// are always made on the CPU, with a box filter unless another is set.
+        ///
+        /// Set this before adding materials, as textures that were already loaded stay resident in full.
+        /// </summary>
+        /// <param name="desc">How to stream textures, or nothing to load them in full</param>
+        MANDRILL_API void setTextureStreaming(std::optional<TextureStreamingDesc> desc);
+
+        /// <summary>
+        /// Work out which mip levels the streamed textures need, and record the uploads of those that are ready. Call
+        /// once per frame outside of a render pass, before the scene is rendered or traced.
+        ///
+        /// Needs come from two places. Ray-tracing shaders that declare textureFeedback write the finest level they
+        /// sample of each texture into it with atomicMin(), indexed like the texture array. It is read back for the
+        /// frame it was last written in, which the device has finished with by the time the frame in flight comes
+        /// around again. Without feedback, or on top of it, the level is estimated from how large the bounding box of
+        /// each visible node is on screen, as if its textures covered it once.
+        ///
+        /// Textures that were replaced are rebound without waiting for the device. Ray-tracing shaders get the new
+        /// texture array through Shader::setResource(), and the materials of the other shaders are prepared anew.
+        /// </summary>
+        /// <param name="cmd">Command buffer of the frame, which the uploads are recorded into</param>
+        /// <param name="pCamera">Camera to estimate the levels with, or nullptr to only use feedback</param>
+        /// <param name="viewportHeight">Height of the viewport in pixels</param>
+        MANDRILL_API void updateTextureStreaming(VkCommandBuffer cmd, ptr<Camera> pCamera, uint32_t viewportHeight);
+
+        /// <summary>
+        /// Get the texture streamer, if textures are streamed.
+        /// </summary>
+        /// <returns>Texture streamer, or nullptr</returns>
+        MANDRILL_API ptr<TextureStreamer> getTextureStreamer() const
+        {
+            return mpTextureStreamer;
+        }
+
     private:
         friend Node;
 
+        // The texture slots of a material, as bits of MaterialParams::hasTexture
+        enum class MaterialTextureBit : uint32_t {
+            Diffuse = 1 << 0,
+            Specular = 1 << 1,
+            Ambient = 1 << 2,
+            Emission = 1 << 3,
+            Normal = 1 << 4,
+        };
+
+        // A vertex and an index heap that meshes are placed in together. Generations are those last passed on to the
+        // instance data and the ray-tracing shaders.
+        struct GeometryShard {
+            ptr<GeometryHeap> pVertexHeap;
+            ptr<GeometryHeap> pIndexHeap;
+            uint64_t vertexGeneration = 0;
+            uint64_t indexGeneration = 0;
+        };
+
+        // The buffers currently behind the geometry heaps of a shard, which change when a heap grows or is compacted
+        ptr<Buffer> getVertexBuffer(uint32_t shard) const;
+        ptr<Buffer> getIndexBuffer(uint32_t shard) const;
+
+        // Start a new shard with heaps of the given sizes, capped to what the device can allocate and bind
+        void addShard(VkDeviceSize verticesSize, VkDeviceSize indicesSize);
+
+        // Largest buffer a geometry heap may grow to, which shaders can still bind whole as a storage buffer
+        VkDeviceSize getMaxShardSize() const;
+
+        // Let a new mesh use the geometry of an existing mesh with the same vertices and indices, and return whether
+        // it does
+        bool shareGeometry(uint32_t meshIndex);
+
+        // Give a mesh ranges in the first shard with room for it, marking it to be uploaded
+        void allocateMesh(Mesh& mesh);
+
+        // Stream the geometry of the given meshes to their ranges on the device
+        void uploadMeshes(const std::vector<uint32_t>& meshIndices);
+
+        // Rewrite the per-instance geometry addresses, in the order the TLAS lists the instances
+        void updateInstanceData();
+
+        // Point the ray-tracing shaders at the current geometry and instance buffers after they were replaced
+        void updateRayTracingResources();
+
+        // Attach the geometry buffers to a shader that declares them, which only works with a single shard
+        void attachGeometryBuffers(ptr<Shader> pShader) const;
+
+        // Check if a geometry heap has grown or been compacted since last time, and pass that on
+        void handleGeometryRelocation();
+
         // What the scene prepared for one of the shaders its nodes are rendered with. Materials are bound as whole
         // sets rather than through the shader, so they have to be allocated against each shader's own layout.
         struct ShaderResources {
@@ -511,6 +806,7 @@ namespace Mandrill
 
         // Attach the scene's resources to one shader and prepare its materials
         void createDescriptorsForShader(ptr<Shader> pShader, ptr<Camera> pCamera);
+        ptr<Descriptor> createMaterialDescriptor(const ShaderResources& resources, const Material& material);
 
         // What was prepared for a shader, or nullptr if the scene never saw it
         const ShaderResources* findShaderResources(const Shader* pShader) const;
@@ -518,19 +814,41 @@ namespace Mandrill
         std::vector<uint32_t> loadFromOBJ(const std::filesystem::path& path,
                                           const std::filesystem::path& materialPath = "");
         std::vector<uint32_t> loadFromGLTF(const std::filesystem::path& path);
-        void addTexture(std::string texturePath);
-        void addTextureFromMemory(const uint8_t* pData, size_t size, const std::string& textureName);
+        // Textures are queued with a placeholder and only decoded, all at once, by loadTextures()
+        void addTexture(std::string texturePath, MaterialTextureBit slot);
+        void addTextureFromMemory(std::vector<uint8_t> fileData, const std::string& textureName,
+                                  MaterialTextureBit slot);
+        TextureCompression getTextureCompression(MaterialTextureBit slot) const;
+        std::optional<MipGenerationDesc> getMipGeneration(MaterialTextureBit slot) const;
+        void loadTextures();
+
+        // Gather the levels of the streamed textures that shaders reported or that the nodes on screen need
+        void requestTexturesFromFeedback();
+        void requestTexturesFromBounds(ptr<Camera> pCamera, uint32_t viewportHeight);
+
+        // Rebind textures that the streamer replaced
+        void updateTextureDescriptors(const std::set<std::string>& keys);
+
+        // Textures in the order of mTextureKeys, for the texture array
+        std::vector<ptr<Texture>> getTextureArray() const;
 
         ptr<Device> mpDevice;
 
         std::vector<Mesh> mMeshes;
+        std::unordered_multimap<size_t, uint32_t> mMeshesByGeometry; // Meshes with geometry, by geometry hash
         std::vector<Node> mNodes;
         std::vector<Material> mMaterials;
         std::unordered_map<std::string, ptr<Texture>> mTextures;
+        std::vector<std::string> mTextureKeys; // Key of each index in the texture array, as of the last compile
+        ptr<TextureLoader> mpTextureLoader;
+        ptr<TextureCache> mpTextureCache;
+        bool mTextureCompression = false;
+        std::optional<MipFilter> mTextureMipFilter;
+        ptr<TextureStreamer> mpTextureStreamer;
+        ptr<DynamicBuffer> mpTextureFeedback; // One uint per texture and frame in flight
         ptr<Texture> mpEnvironmentMap;
 
-        ptr<Buffer> mpVertexBuffer;
-        ptr<Buffer> mpIndexBuffer;
+        std::vector<GeometryShard> mShards;
         // One transform per node and frame in flight, laid out with the frame index varying fastest
         ptr<DynamicBuffer> mpTransforms;
         ptr<Buffer> mpMaterialParams;
@@ -543,7 +861,12 @@ namespace Mandrill
         ptr<Buffer> mpMaterialBuffer; // Almost same as mpMaterialParams but for ray tracing
         ptr<Buffer> mpInstanceDataBuffer;
 
-        uint32_t mVertexCount;
-        uint32_t mIndexCount;
+        // Shaders given to createRayTracingDescriptors(), which need the buffers again when they are replaced
+        std::vector<std::weak_ptr<Shader>> mRayTracingShaders;
+
+        uint64_t mVertexCount;
+        uint64_t mIndexCount;
+
+        bool mKeepHostGeometry = true;
     };
 }; // namespace Mandrill
@@ -32,9 +32,13 @@ class ShaderIncluder : public shaderc::CompileOptions::IncluderInterface
     shaderc_include_result* GetInclude(const char* requestedSource, shaderc_include_type type,
                                        const char* requestingSource, size_t includeDepth) override
     {
-        // Construct full path of requested include
+        // Construct full path of requested include, falling back to the includes that come with the library like
+        // glslc does with -I
         std::filesystem::path srcPath(requestingSource);
         std::filesystem::path incPath = srcPath.parent_path() / std::filesystem::path(requestedSource);
+        if (!std::filesystem::exists(incPath)) {
+            incPath = std::filesystem::path(MANDRILL_SHADER_INCLUDE_DIR) / std::filesystem::path(requestedSource);
+        }
 
         const std::string name = std::string(requestedSource);
         const std::string contents = ReadFile(incPath.string());
@@ -0,0 +1,334 @@
+#include "SparseVolume.h"
+
+#include "HalfFloat.h"
+#include "Helpers.h"
+#include "Image.h"
+#include "Log.h"
+
+#ifdef MANDRILL_USE_OPENVDB
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#endif
+
+using namespace Mandrill;
+
+namespace
+{
+    // Atlas coordinates of a brick take 10 bits each in the brick table
+    constexpr uint32_t kMaxAtlasBricks = 1024;
+} // namespace
+
+SparseVolume::SparseVolume(ptr<Device> pDevice, const std::filesystem::path& path, const SparseVolumeDesc& desc)
+    : mpDevice(pDevice)
+{
+#ifdef MANDRILL_USE_OPENVDB
+    using LeafT = openvdb::FloatTree::LeafNodeType;
+    static_assert(LeafT::DIM == kBrickSize, "Bricks have to line up with the leaf nodes");
+
+    std::filesystem::path fullPath = path;
+    if (path.is_relative()) {
+        fullPath = GetExecutablePath() / path;
+    }
+
+    Log::Info("Loading sparse volume from {}", path.string());
+
+    if (!std::filesystem::exists(fullPath)) {
+        Log::Error("SparseVolume: {} does not exist", fullPath.string());
+        return;
+    }
+
+    openvdb::io::File file(fullPath.string());
+    file.open();
+    if (!file.hasGrid(desc.grid)) {
+        Log::Error("SparseVolume: Grid {} not found in {}", desc.grid, path.string());
+        return;
+    }
+    openvdb::FloatGrid::Ptr pGrid = openvdb::gridPtrCast<openvdb::FloatGrid>(file.readGrid(desc.grid));
+    file.close();
+
+    if (!pGrid) {
+        Log::Error("SparseVolume: Grid {} is not a float grid", desc.grid);
+        return;
+    }
+
+    VkFormat atlasFormat = desc.atlasFormat;
+    if (atlasFormat != VK_FORMAT_R32_SFLOAT && atlasFormat != VK_FORMAT_R16_SFLOAT) {
+        Log::Warning("SparseVolume: Atlas format {} is not supported, using VK_FORMAT_R32_SFLOAT",
+                     static_cast<int>(atlasFormat));
+        atlasFormat = VK_FORMAT_R32_SFLOAT;
+    }
+
+    const openvdb::CoordBBox bbox = pGrid->evalActiveVoxelBoundingBox();
+    if (bbox.empty()) {
+        Log::Error("SparseVolume: Grid {} has no active voxels", desc.grid);
+        return;
+    }
+
+    // Bricks line up with the leaf nodes, which start at multiples of the brick size
+    const openvdb::Coord brickMin = bbox.min() >> LeafT::LOG2DIM;
+    const openvdb::Coord brickMax = bbox.max() >> LeafT::LOG2DIM;
+    mOrigin = glm::ivec3(brickMin.x(), brickMin.y(), brickMin.z()) * static_cast<int32_t>(kBrickSize);
+    mBrickGridSize = glm::uvec3(brickMax.x() - brickMin.x() + 1, brickMax.y() - brickMin.y() + 1,
+                                brickMax.z() - brickMin.z() + 1);
+
+    const size_t tableSize = static_cast<size_t>(mBrickGridSize.x) * mBrickGridSize.y * mBrickGridSize.z;
+    auto getTableIndex = [&](int32_t x, int32_t y, int32_t z) {
+        return (static_cast<size_t>(z - brickMin.z()) * mBrickGridSize.y + (y - brickMin.y())) * mBrickGridSize.x +
+               (x - brickMin.x());
+    };
+
+    // A brick is kept if it holds anything but zero, and so are its neighbours, whose aprons reach into it. The
+    // background is what the grid holds wherever it stores nothing else, so with a background that is not zero,
+    // every brick holds something.
+    const float background = pGrid->background();
+    std::vector<uint8_t> occupied(tableSize, background != 0.0f ? 1 : 0);
+    auto occupy = [&](const openvdb::Coord& min, const openvdb::Coord& max) {
+        const openvdb::Coord lo = openvdb::Coord::maxComponent((min >> LeafT::LOG2DIM).offsetBy(-1), brickMin);
+        const openvdb::Coord hi = openvdb::Coord::minComponent((max >> LeafT::LOG2DIM).offsetBy(1), brickMax);
+        for (int32_t z = lo.z(); z <= hi.z(); z++) {
+            for (int32_t y = lo.y(); y <= hi.y(); y++) {
+                for (int32_t x = lo.x(); x <= hi.x(); x++) {
+                    occupied[getTableIndex(x, y, z)] = 1;
+                }
+            }
+        }
+    };
+
+    openvdb::tree::LeafManager<const openvdb::FloatTree> leaves(pGrid->tree());
+    std::vector<uint8_t> leafOccupied(leaves.leafCount(), 0);
+    leaves.foreach([&](const LeafT& leaf, size_t index) {
+        for (auto it = leaf.cbeginValueAll(); it; ++it) {
+            if (*it != 0.0f) {
+                leafOccupied[index] = 1;
+                break;
+            }
+        }
+    });
+    for (size_t i = 0; i < leaves.leafCount(); i++) {
+        if (leafOccupied[i]) {
+            const openvdb::Coord origin = leaves.leaf(i).origin();
+            occupy(origin, origin.offsetBy(kBrickSize - 1));
+        }
+    }
+
+    // Inactive tiles hold a value as well, usually the background, which a ray samples as it would any other
+    auto tile = pGrid->tree().cbeginValueAll();
+    tile.setMaxDepth(tile.getLeafDepth() - 1);
+    for (; tile; ++tile) {
+        openvdb::CoordBBox tileBox;
+        tile.getBoundingBox(tileBox);
+        tileBox.intersect(bbox);
+        if (*tile != 0.0f && !tileBox.empty()) {
+            occupy(tileBox.min(), tileBox.max());
+        }
+    }
+
+    std::vector<uint32_t> table(tableSize, kEmptyBrick);
+    std::vector<openvdb::Coord> bricks;
+    for (int32_t z = brickMin.z(); z <= brickMax.z(); z++) {
+        for (int32_t y = brickMin.y(); y <= brickMax.y(); y++) {
+            for (int32_t x = brickMin.x(); x <= brickMax.x(); x++) {
+                const size_t index = getTableIndex(x, y, z);
+                if (occupied[index]) {
+                    table[index] = count(bricks);
+                    bricks.emplace_back(x, y, z);
+                }
+            }
+        }
+    }
+    mBrickCount = count(bricks);
+
+    if (bricks.empty()) {
+        Log::Error("SparseVolume: Grid {} holds nothing but zeros", desc.grid);
+        return;
+    }
+
+    // The buffer is bound as a whole, so it cannot be larger than a storage buffer can be bound with
+    const VkDeviceSize brickVoxels = kPaddedBrickSize * kPaddedBrickSize * kPaddedBrickSize;
+    const VkDeviceSize bufferSize = mBrickCount * brickVoxels * sizeof(float);
+    const VkDeviceSize maxBufferSize = mpDevice->getProperties().physicalDevice.limits.maxStorageBufferRange;
+    if (desc.storage == BrickStorage::Buffer && bufferSize > maxBufferSize) {
+        Log::Error("SparseVolume: {} bricks take {:.1f} MiB, more than the {:.1f} MiB a storage buffer can be bound "
+                   "with, use BrickStorage::Atlas instead",
+                   mBrickCount, static_cast<double>(bufferSize) / (1 << 20),
+                   static_cast<double>(maxBufferSize) / (1 << 20));
+        mBrickCount = 0;
+        return;
+    }
+
+    // The atlas is as close to a cube of bricks as the image size allows
+    glm::uvec3 atlasBricks(0);
+    if (desc.storage == BrickStorage::Atlas) {
+        const uint32_t maxBricks = std::min(
+            mpDevice->getProperties().physicalDevice.limits.maxImageDimension3D / kPaddedBrickSize, kMaxAtlasBricks);
+        atlasBricks.x = std::min(static_cast<uint32_t>(std::ceil(std::cbrt(mBrickCount))), maxBricks);
+        atlasBricks.y = std::min((mBrickCount + atlasBricks.x - 1) / atlasBricks.x, maxBricks);
+        atlasBricks.z = (mBrickCount + atlasBricks.x * atlasBricks.y - 1) / (atlasBricks.x * atlasBricks.y);
+        if (atlasBricks.z > maxBricks) {
+            Log::Error("SparseVolume: {} bricks do not fit in an atlas, use BrickStorage::Buffer instead",
+                       mBrickCount);
+            mBrickCount = 0;
+            return;
+        }
+
+        for (uint32_t& entry : table) {
+            if (entry != kEmptyBrick) {
+                const uint32_t x = entry % atlasBricks.x;
+                const uint32_t y = entry / atlasBricks.x % atlasBricks.y;
+                const uint32_t z = entry / (atlasBricks.x * atlasBricks.y);
+                entry = x | (y << 10) | (z << 20);
+            }
+        }
+    }
+
+    const glm::uvec3 atlasSize = atlasBricks * kPaddedBrickSize;
+    const VkDeviceSize texelSize =
+        desc.storage == BrickStorage::Atlas && atlasFormat == VK_FORMAT_R16_SFLOAT ? sizeof(uint16_t) : sizeof(float);
+    const VkDeviceSize bricksSize = desc.storage == BrickStorage::Atlas
+                                        ? static_cast<VkDeviceSize>(atlasSize.x) * atlasSize.y * atlasSize.z * texelSize
+                                        : bufferSize;
+    const VkDeviceSize tableBytes = sizeof(uint32_t) * tableSize;
+
+    Buffer tableStaging(mpDevice, tableBytes, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    tableStaging.copyFromHost(table.data(), tableBytes);
+
+    // Empty bricks hold nothing but zeros, and so do their majorants. Half floats round to within 2^-11 of the value.
+    const float relativeMargin =
+        desc.storage == BrickStorage::Atlas && atlasFormat == VK_FORMAT_R16_SFLOAT ? 1.0f / 1024.0f : 0.0f;
+    std::vector<glm::vec2> majorants(tableSize, glm::vec2(0.0f));
+
+    // Bricks are read on all cores straight into the staging buffer, each thread with an accessor of its own
+    Buffer bricksStaging(mpDevice, bricksSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                         VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::byte* pBricks = static_cast<std::byte*>(bricksStaging.getHostMap());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, bricks.size()), [&](const tbb::blocked_range<size_t>& range) {
+        auto accessor = pGrid->getConstAccessor();
+        std::array<float, kPaddedBrickSize * kPaddedBrickSize * kPaddedBrickSize> voxels;
+
+        for (size_t i = range.begin(); i != range.end(); i++) {
+            const openvdb::Coord first = (bricks[i] << LeafT::LOG2DIM).offsetBy(-static_cast<int32_t>(kBrickApron));
+            for (uint32_t z = 0; z < kPaddedBrickSize; z++) {
+                for (uint32_t y = 0; y < kPaddedBrickSize; y++) {
+                    for (uint32_t x = 0; x < kPaddedBrickSize; x++) {
+                        voxels[(z * kPaddedBrickSize + y) * kPaddedBrickSize + x] =
+                            accessor.getValue(first.offsetBy(x, y, z));
+                    }
+                }
+            }
+
+            // The apron is the part of the neighbours that filtering reaches into, so it counts as well
+            const auto [min, max] = std::minmax_element(voxels.begin(), voxels.end());
+            majorants[getTableIndex(bricks[i].x(), bricks[i].y(), bricks[i].z())] =
+                glm::vec2(*min - std::abs(*min) * relativeMargin, *max + std::abs(*max) * relativeMargin);
+
+            if (desc.storage == BrickStorage::Buffer) {
+                std::memcpy(pBricks + i * brickVoxels * sizeof(float), voxels.data(), sizeof(voxels));
+                continue;
+            }
+
+            const uint32_t slot = static_cast<uint32_t>(i);
+            const glm::uvec3 atlasFirst = glm::uvec3(slot % atlasBricks.x, slot / atlasBricks.x % atlasBricks.y,
+                                                     slot / (atlasBricks.x * atlasBricks.y)) *
+                                          kPaddedBrickSize;
+            for (uint32_t z = 0; z < kPaddedBrickSize; z++) {
+                for (uint32_t y = 0; y < kPaddedBrickSize; y++) {
+                    const size_t texel =
+                        (static_cast<size_t>(atlasFirst.z + z) * atlasSize.y + atlasFirst.y + y) * atlasSize.x +
+                        atlasFirst.x;
+                    const float* pRow = voxels.data() + (z * kPaddedBrickSize + y) * kPaddedBrickSize;
+                    if (texelSize == sizeof(float)) {
+                        std::memcpy(pBricks + texel * texelSize, pRow, sizeof(float) * kPaddedBrickSize);
+                    } else {
+                        HalfFloat::pack(pRow, reinterpret_cast<uint16_t*>(pBricks + texel * texelSize),
+                                        kPaddedBrickSize);
+                    }
+                }
+            }
+        }
+    });
+
+    ptr<Image> pTableImage = make_ptr<Image>(
+        mpDevice, mBrickGridSize.x, mBrickGridSize.y, mBrickGridSize.z, 1, VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_UINT,
+        VK_IMAGE_TILING_OPTIMAL, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_3D);
+
+    ptr<Image> pAtlasImage;
+    if (desc.storage == BrickStorage::Atlas) {
+        pAtlasImage = make_ptr<Image>(mpDevice, atlasSize.x, atlasSize.y, atlasSize.z, 1, VK_SAMPLE_COUNT_1_BIT,
+                                      atlasFormat, VK_IMAGE_TILING_OPTIMAL,
+                                      VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                      VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_3D);
+    } else {
+        mpBrickBuffer = make_ptr<Buffer>(mpDevice, bricksSize,
+                                         VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                                         VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    }
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+
+    Helpers::imageBarrier(cmd, pTableImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    Helpers::copyBufferToImage(cmd, tableStaging.getBuffer(), pTableImage->getImage(), mBrickGridSize.x,
+                               mBrickGridSize.y, mBrickGridSize.z);
+    Helpers::imageBarrier(cmd, pTableImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+    if (pAtlasImage) {
+        Helpers::imageBarrier(cmd, pAtlasImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                              VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+        Helpers::copyBufferToImage(cmd, bricksStaging.getBuffer(), pAtlasImage->getImage(), atlasSize.x,
+                                   atlasSize.y, atlasSize.z);
+        Helpers::imageBarrier(cmd, pAtlasImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                              VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                              VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    } else {
+        VkBufferCopy region = {.srcOffset = 0, .dstOffset = 0, .size = bricksSize};
+        vkCmdCopyBuffer(cmd, bricksStaging.getBuffer(), mpBrickBuffer->getBuffer(), 1, &region);
+        Helpers::bufferBarrier(cmd, mpBrickBuffer->getBuffer(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                               VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                               VK_ACCESS_2_SHADER_STORAGE_READ_BIT);
+    }
+
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    // The table is only ever fetched, and integer formats cannot be filtered anyway
+    pTableImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+    mpBrickTable = make_ptr<Texture>(mpDevice, pTableImage);
+    mpBrickTable->setMagFilter(VK_FILTER_NEAREST);
+    mpBrickTable->setMinFilter(VK_FILTER_NEAREST);
+    mpBrickTable->setMipmapMode(VK_SAMPLER_MIPMAP_MODE_NEAREST);
+    mpBrickTable->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                 VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+
+    mpMajorants = make_ptr<Texture>(mpDevice, TextureType::Texture3D, VK_FORMAT_R32G32_SFLOAT, majorants.data(),
+                                    mBrickGridSize.x, mBrickGridSize.y, mBrickGridSize.z, sizeof(glm::vec2));
+    mpMajorants->setMagFilter(VK_FILTER_NEAREST);
+    mpMajorants->setMinFilter(VK_FILTER_NEAREST);
+
+    if (pAtlasImage) {
+        pAtlasImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+        mpBrickAtlas = make_ptr<Texture>(mpDevice, pAtlasImage);
+        mpBrickAtlas->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                     VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+    }
+
+    mMemorySize = tableBytes + bricksSize + sizeof(glm::vec2) * tableSize;
+
+    Log::Info("SparseVolume: {} of {} bricks stored, {:.1f} MiB", mBrickCount, tableSize,
+              static_cast<double>(mMemorySize) / (1 << 20));
+#else
+    Log::Error("Trying to load a volume but Mandrill was not compiled with OpenVDB support. OpenVDB can be "
+               "installed using vcpkg:\n\t`vcpkg install openvdb`");
+#endif
+}
+
+SparseVolume::~SparseVolume()
+{
+}
@@ -0,0 +1,171 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "Device.h"
+#include "Texture.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Where the voxels of the bricks of a sparse volume are kept.
+    /// </summary>
+    enum class BrickStorage : uint32_t {
+        Atlas,  // A 3D texture, sampled with hardware trilinear filtering
+        Buffer, // A storage buffer of floats, brick after brick, filtered by the shader, up to maxStorageBufferRange
+    };
+
+    /// <summary>
+    /// Settings for a sparse volume.
+    /// </summary>
+    struct SparseVolumeDesc {
+        // Name of the scalar grid to load
+        std::string grid = "density";
+
+        // Where the voxels of the bricks are kept
+        BrickStorage storage = BrickStorage::Atlas;
+
+        // Format of the atlas, VK_FORMAT_R32_SFLOAT or VK_FORMAT_R16_SFLOAT. The buffer always holds 32-bit floats.
+        VkFormat atlasFormat = VK_FORMAT_R32_SFLOAT;
+    };
+
+    /// <summary>
+    /// Scalar grid of an OpenVDB file kept as bricks of kBrickSize^3 voxels, of which only the ones that hold
+    /// anything but zero are stored. The memory it takes follows the number of voxels that are occupied rather than
+    /// the size of the bounding box, and shaders skip the empty bricks without sampling them. The background of the
+    /// grid counts as a value like any other, so a grid whose background is not zero keeps every brick.
+    ///
+    /// Bricks are aligned to the leaf nodes of the grid and stored with an apron of kBrickApron voxels copied from
+    /// their neighbours on every side, so that trilinear filtering never reads outside a brick. The brick table is an
+    /// R32_UINT 3D texture with one texel per brick, holding kEmptyBrick for empty bricks. For the atlas, other entries
+    /// hold the position of the brick in the atlas in bricks, with bits 0-9 for x, 10-19 for y and 20-29 for z. For
+    /// the buffer, they hold the index of the brick, whose padded voxels start at index * kPaddedBrickSize^3 with x
+    /// fastest, like the flat leaf buffers of NanoVDB.
+    ///
+    /// To sample at a voxel position p, where the volume spans [0, getSize()), fetch the brick table at floor(p /
+    /// kBrickSize) and, if the brick is not empty, sample its padded voxels at p - brick * kBrickSize + kBrickApron.
+    /// A ray can skip to where it leaves an empty brick.
+    ///
+    /// The majorant grid is an R32G32_SFLOAT 3D texture the size of the brick table, holding the smallest and largest
+    /// value of the padded voxels of each brick, and zero for empty bricks.
+    /// </summary>
+    class SparseVolume
+    {
+    public:
+        MANDRILL_NON_COPYABLE(SparseVolume)
+
+        static constexpr uint32_t kBrickSize = 8;
+        static constexpr uint32_t kBrickApron = 1;
+        static constexpr uint32_t kPaddedBrickSize = kBrickSize + 2 * kBrickApron;
+        static constexpr uint32_t kEmptyBrick = std::numeric_limits<uint32_t>::max();
+
+        /// <summary>
+        /// Create a new sparse volume from a file.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="path">Path to OpenVDB file</param>
+        /// <param name="desc">Which grid to load and how to store it</param>
+        MANDRILL_API SparseVolume(ptr<Device> pDevice, const std::filesystem::path& path,
+                                  const SparseVolumeDesc& desc = {});
+
+        /// <summary>
+        /// Destructor for sparse volume.
+        /// </summary>
+        MANDRILL_API ~SparseVolume();
+
+        /// <summary>
+        /// Get the brick table, with one texel per brick.
+        /// </summary>
+        /// <returns>Pointer to texture, or nullptr if the volume could not be loaded</returns>
+        MANDRILL_API ptr<Texture> getBrickTable() const
+        {
+            return mpBrickTable;
+        }
+
+        /// <summary>
+        /// Get the atlas that the bricks are packed into.
+        /// </summary>
+        /// <returns>Pointer to texture, or nullptr if the bricks are kept in a buffer</returns>
+        MANDRILL_API ptr<Texture> getBrickAtlas() const
+        {
+            return mpBrickAtlas;
+        }
+
+        /// <summary>
+        /// Get the buffer that the bricks are stored in.
+        /// </summary>
+        /// <returns>Pointer to buffer, or nullptr if the bricks are kept in an atlas</returns>
+        MANDRILL_API ptr<Buffer> getBrickBuffer() const
+        {
+            return mpBrickBuffer;
+        }
+
+        /// <summary>
+        /// Get the majorant grid, with one texel per brick.
+        /// </summary>
+        /// <returns>Pointer to texture, or nullptr if the volume could not be loaded</returns>
+        MANDRILL_API ptr<Texture> getMajorants() const
+        {
+            return mpMajorants;
+        }
+
+        /// <summary>
+        /// Get the number of voxels along each axis, a multiple of kBrickSize that covers the active voxels.
+        /// </summary>
+        /// <returns>Size in voxels</returns>
+        MANDRILL_API glm::uvec3 getSize() const
+        {
+            return mBrickGridSize * kBrickSize;
+        }
+
+        /// <summary>
+        /// Get the index space coordinates of the first voxel of the volume.
+        /// </summary>
+        /// <returns>Index of the first voxel</returns>
+        MANDRILL_API glm::ivec3 getOrigin() const
+        {
+            return mOrigin;
+        }
+
+        /// <summary>
+        /// Get the number of bricks along each axis, which is the size of the brick table.
+        /// </summary>
+        /// <returns>Size in bricks</returns>
+        MANDRILL_API glm::uvec3 getBrickGridSize() const
+        {
+            return mBrickGridSize;
+        }
+
+        /// <summary>
+        /// Get the number of bricks that are stored.
+        /// </summary>
+        /// <returns>Number of bricks</returns>
+        MANDRILL_API uint32_t getBrickCount() const
+        {
+            return mBrickCount;
+        }
+
+        /// <summary>
+        /// Get the device memory taken up by the bricks, the brick table and the majorant grid.
+        /// </summary>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API VkDeviceSize getMemorySize() const
+        {
+            return mMemorySize;
+        }
+
+    private:
+        ptr<Device> mpDevice;
+
+        ptr<Texture> mpBrickTable;
+        ptr<Texture> mpBrickAtlas;
+        ptr<Buffer> mpBrickBuffer;
+        ptr<Texture> mpMajorants;
+
+        glm::ivec3 mOrigin = glm::ivec3(0);
+        glm::uvec3 mBrickGridSize = glm::uvec3(0);
+        uint32_t mBrickCount = 0;
+        VkDeviceSize mMemorySize = 0;
+    };
+} // namespace Mandrill
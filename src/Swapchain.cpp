@@ -93,7 +93,7 @@ void Swapchain::recreate()
         glfwWaitEvents();
     } while (width == 0 || height == 0);
 
-    uint32_t framesInFlight = count(mInFlightFences);
+    uint32_t framesInFlight = count(mCommandBuffers);
     destroyDescriptor();
     destroySyncObjects();
     destroySwapchain();
@@ -108,14 +108,20 @@ void Swapchain::recreate()
 
 MANDRILL_API void Swapchain::waitForFence()
 {
-    // Wait for the current frame to not be in flight
-    Check::Vk(vkWaitForFences(mpDevice->getDevice(), 1, &mInFlightFences[mInFlightIndex], VK_TRUE, UINT64_MAX));
+    // The frame that last used this frame in flight's resources is at most the frame latency behind, so waiting for
+    // that one frees them and also keeps the host from running further ahead than asked
+    uint64_t frameNumber = mpDevice->getFrameNumber();
+    uint64_t frameLatency = mpDevice->getFrameLatency();
+    if (frameNumber > frameLatency) {
+        mpDevice->waitForFrame(frameNumber - frameLatency);
+    }
 
-    // When the fence is reached, the screenshot has finished the copy
+    // When the frame that blitted the screenshot has completed, the screenshot has finished the copy
     bool waitForScreenshotCopy = false;
     {
         std::lock_guard lock(mScreenshotMutex);
-        if (mScreenshotState == ScreenshotState::QueuedForBlitting && mScreenshotInFlightIndex == mInFlightIndex) {
+        if (mScreenshotState == ScreenshotState::QueuedForBlitting &&
+            mpDevice->getCompletedFrameNumber() >= mScreenshotFrameNumber) {
             mScreenshotState = ScreenshotState::BlittedToStage;
             Log::Debug("Thread render: Blitting done, notify other thread");
             mScreenshotAvailableCV.notify_all();
@@ -140,6 +146,10 @@ VkCommandBuffer Swapchain::acquireNextImage()
     const uint32_t maxAttempts = 8;
     uint32_t attempt = 0;
     for (; attempt < maxAttempts; attempt++) {
+        if (mpDevice->getLowLatency()) {
+            waitForPreviousPresent();
+        }
+
         waitForFence();
 
         VkResult result = vkAcquireNextImageKHR(mpDevice->getDevice(), mSwapchain, UINT64_MAX,
@@ -154,8 +164,6 @@ VkCommandBuffer Swapchain::acquireNextImage()
             Log::Error("Failed to acquire next swapchain image");
         }
 
-        // Reset only once a frame is actually going to be submitted to signal the fence again
-        Check::Vk(vkResetFences(mpDevice->getDevice(), 1, &mInFlightFences[mInFlightIndex]));
         break;
     }
 
@@ -227,7 +235,7 @@ void Swapchain::present(VkCommandBuffer cmd, ptr<Image> pImage)
             vkCmdBlitImage2(cmd, &blitImageInfo);
 
             mScreenshotState = ScreenshotState::QueuedForBlitting;
-            mScreenshotInFlightIndex = mInFlightIndex;
+            mScreenshotFrameNumber = mpDevice->getFrameNumber();
         }
     }
 
@@ -240,21 +248,43 @@ void Swapchain::present(VkCommandBuffer cmd, ptr<Image> pImage)
 
     VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
 
+    // The binary semaphore hands the image over to presentation, the timeline tells everyone else the frame is done.
+    // Binary semaphores ignore their value.
+    const uint64_t frameNumber = mpDevice->getFrameNumber();
+    std::array<VkSemaphore, 2> signalSemaphores = {mRenderFinishedSemaphores[mImageIndex],
+                                                   mpDevice->getFrameTimelineSemaphore()};
+    std::array<uint64_t, 2> signalValues = {0, frameNumber};
+
+    VkTimelineSemaphoreSubmitInfo tsi = {
+        .sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO,
+        .signalSemaphoreValueCount = count(signalValues),
+        .pSignalSemaphoreValues = signalValues.data(),
+    };
+
     VkSubmitInfo si = {
         .sType = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+        .pNext = &tsi,
         .waitSemaphoreCount = 1,
         .pWaitSemaphores = &mPresentFinishedSemaphores[mInFlightIndex],
         .pWaitDstStageMask = &waitStage,
         .commandBufferCount = 1,
         .pCommandBuffers = &cmd,
-        .signalSemaphoreCount = 1,
-        .pSignalSemaphores = &mRenderFinishedSemaphores[mImageIndex],
+        .signalSemaphoreCount = count(signalSemaphores),
+        .pSignalSemaphores = signalSemaphores.data(),
     };
 
-    Check::Vk(vkQueueSubmit(mpDevice->getQueue(), 1, &si, mInFlightFences[mInFlightIndex]));
+    Check::Vk(vkQueueSubmit(mpDevice->getQueue(), 1, &si, nullptr));
+
+    // Tag the present with the frame number so that low-latency mode can wait for it
+    VkPresentIdKHR presentId = {
+        .sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR,
+        .swapchainCount = 1,
+        .pPresentIds = &frameNumber,
+    };
 
     VkPresentInfoKHR pi = {
         .sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR,
+        .pNext = mpDevice->supportsPresentWait() ? &presentId : nullptr,
         .waitSemaphoreCount = 1,
         .pWaitSemaphores = &mRenderFinishedSemaphores[mImageIndex],
         .swapchainCount = 1,
@@ -264,6 +294,10 @@ void Swapchain::present(VkCommandBuffer cmd, ptr<Image> pImage)
 
     VkResult result = vkQueuePresentKHR(mpDevice->getQueue(), &pi);
 
+    if (mpDevice->supportsPresentWait()) {
+        mLastPresentId = frameNumber;
+    }
+
     if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
         recreate();
     } else if (result != VK_SUCCESS) {
@@ -271,12 +305,36 @@ void Swapchain::present(VkCommandBuffer cmd, ptr<Image> pImage)
     }
 
     mPreviousInFlightIndex = mInFlightIndex;
-    mInFlightIndex = (mInFlightIndex + 1) % count(mInFlightFences);
+    mInFlightIndex = (mInFlightIndex + 1) % count(mCommandBuffers);
 
     // Everything that picks a per-frame resource without being told which frame follows the device, so it has to be
     // moved on together with the swapchain. This is the only place the index advances, which is what makes it safe to
     // read at any point during an application's update and render.
     mpDevice->setFrameInFlightIndex(mInFlightIndex);
+    mpDevice->advanceFrameNumber();
+}
+
+void Swapchain::waitForPreviousPresent()
+{
+    // Present ids belong to a swapchain, so there is nothing to wait for until this one has presented something
+    if (mpDevice->supportsPresentWait() && mLastPresentId != 0) {
+        // Bounded, since a present that never reaches the screen (a minimized window, say) would otherwise hang here
+        const uint64_t timeout = 100'000'000; // 100 ms
+        VkResult result = vkWaitForPresentKHR(mpDevice->getDevice(), mSwapchain, mLastPresentId, timeout);
+
+        // An out of date swapchain is recreated by the acquire that follows
+        if (result != VK_SUCCESS && result != VK_TIMEOUT && result != VK_SUBOPTIMAL_KHR &&
+            result != VK_ERROR_OUT_OF_DATE_KHR) {
+            Check::Vk(result);
+        }
+        return;
+    }
+
+    // Without present wait, the closest thing is the previous frame having finished on the device
+    uint64_t frameNumber = mpDevice->getFrameNumber();
+    if (frameNumber > 1) {
+        mpDevice->waitForFrame(frameNumber - 1);
+    }
 }
 
 void Swapchain::requestScreenshot()
@@ -360,6 +418,7 @@ void Swapchain::createSwapchain()
 
     mImageFormat = surfaceFormat.format;
     mExtent = extent;
+    mLastPresentId = 0;
 
     Check::Vk(vkCreateSwapchainKHR(mpDevice->getDevice(), &ci, nullptr, &mSwapchain));
 
@@ -416,24 +475,17 @@ void Swapchain::createSyncObjects(uint32_t framesInFlight)
 
     mRenderFinishedSemaphores.resize(count(mImages));
     mPresentFinishedSemaphores.resize(framesInFlight);
-    mInFlightFences.resize(framesInFlight);
 
     VkSemaphoreCreateInfo sci = {
         .sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO,
     };
 
-    VkFenceCreateInfo fci = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-        .flags = VK_FENCE_CREATE_SIGNALED_BIT,
-    };
-
     for (uint32_t i = 0; i < count(mImages); i++) {
         Check::Vk(vkCreateSemaphore(mpDevice->getDevice(), &sci, nullptr, &mRenderFinishedSemaphores[i]));
     }
 
     for (uint32_t i = 0; i < framesInFlight; i++) {
         Check::Vk(vkCreateSemaphore(mpDevice->getDevice(), &sci, nullptr, &mPresentFinishedSemaphores[i]));
-        Check::Vk(vkCreateFence(mpDevice->getDevice(), &fci, nullptr, &mInFlightFences[i]));
     }
 }
 
@@ -448,9 +500,8 @@ void Swapchain::destroySyncObjects()
         vkDestroySemaphore(mpDevice->getDevice(), mRenderFinishedSemaphores[i], nullptr);
     }
 
-    for (uint32_t i = 0; i < count(mInFlightFences); i++) {
+    for (uint32_t i = 0; i < count(mPresentFinishedSemaphores); i++) {
         vkDestroySemaphore(mpDevice->getDevice(), mPresentFinishedSemaphores[i], nullptr);
-        vkDestroyFence(mpDevice->getDevice(), mInFlightFences[i], nullptr);
     }
 }
 
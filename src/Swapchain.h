@@ -34,8 +34,10 @@ namespace Mandrill
         MANDRILL_API void recreate();
 
         /// <summary>
-        /// Wait for the fence of the current frame in flight to signal. Call this before using resources that are
-        /// shared between host and device. acquireNextImage() will automatically call this.
+        /// Wait for the device to finish the frame that last used the current frame in flight's resources, or an
+        /// even later one if the device's frame latency is lower than the number of frames in flight. Call this
+        /// before using resources that are shared between host and device. acquireNextImage() will automatically
+        /// call this.
         /// </summary>
         MANDRILL_API void waitForFence();
 
@@ -173,7 +175,7 @@ namespace Mandrill
         /// <returns>Number of frames in flight</returns>
         MANDRILL_API uint32_t getFramesInFlightCount() const
         {
-            return static_cast<uint32_t>(mInFlightFences.size());
+            return count(mCommandBuffers);
         }
 
         /// <summary>
@@ -212,6 +214,7 @@ namespace Mandrill
         void createDescriptor();
         void destroyDescriptor();
         void createScreenshotStageImage();
+        void waitForPreviousPresent();
 
         ptr<Device> mpDevice;
 
@@ -232,7 +235,9 @@ namespace Mandrill
 
         std::vector<VkSemaphore> mRenderFinishedSemaphores;
         std::vector<VkSemaphore> mPresentFinishedSemaphores;
-        std::vector<VkFence> mInFlightFences;
+
+        // Present id of the last frame presented to this swapchain, 0 if none or if present wait is unavailable
+        uint64_t mLastPresentId = 0;
 
         uint32_t mInFlightIndex = 0;
         uint32_t mPreviousInFlightIndex = 0;
@@ -256,6 +261,6 @@ namespace Mandrill
         ptr<Image> mScreenshotStageImage;
         std::mutex mScreenshotMutex;
         std::condition_variable mScreenshotAvailableCV;
-        uint32_t mScreenshotInFlightIndex;
+        uint64_t mScreenshotFrameNumber = 0;
     };
 } // namespace Mandrill
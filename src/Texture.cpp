@@ -1,15 +1,33 @@
 #include "Texture.h"
 
 #include "Buffer.h"
+#include "ComputePipeline.h"
+#include "Descriptor.h"
+#include "Downsampler.h"
 #include "Error.h"
+#include "HalfFloat.h"
 #include "Helpers.h"
 #include "Log.h"
+#include "Shader.h"
+#include "TextureLoader.h"
+#include "Volume.h"
 
-#include <glm/gtc/packing.hpp>
 #include <stb_image.h>
 
 using namespace Mandrill;
 
+namespace
+{
+    // Matches the local size of EquirectToCube.comp
+    constexpr uint32_t kCubeMapGroupSize = 8;
+
+    bool isHDRFormat(VkFormat format)
+    {
+        return format == VK_FORMAT_R16G16B16A16_SFLOAT || format == VK_FORMAT_R32G32B32A32_SFLOAT ||
+               format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 || format == VK_FORMAT_BC6H_UFLOAT_BLOCK;
+    }
+} // namespace
+
 Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const std::filesystem::path& path,
                  bool mipmaps)
     : mpDevice(pDevice), mImageInfo{0}
@@ -27,7 +45,7 @@ Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const s
         break;
     }
     case TextureType::Texture2D: {
-        stbi_set_flip_vertically_on_load(1);
+        stbi_set_flip_vertically_on_load_thread(1);
 
         std::string pathStr = fullPath.string();
         int width, height, channels;
@@ -37,7 +55,15 @@ Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const s
         const bool halfFloat = format == VK_FORMAT_R16G16B16A16_SFLOAT;
         const bool fullFloat = format == VK_FORMAT_R32G32B32A32_SFLOAT;
 
-        if (halfFloat || fullFloat) {
+        // Compact HDR formats, which the device cannot make mip levels for, so they are made here
+        if (format == VK_FORMAT_BC6H_UFLOAT_BLOCK && !mpDevice->supportsTextureCompressionBC()) {
+            Log::Warning("Device does not support BC6H, loading {} as VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 instead",
+                         path.string());
+            format = VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+        }
+        const bool packedFloat = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 || format == VK_FORMAT_BC6H_UFLOAT_BLOCK;
+
+        if (halfFloat || fullFloat || packedFloat) {
             float* pData = stbi_loadf(pathStr.c_str(), &width, &height, &channels, STBI_rgb_alpha);
             channels = STBI_rgb_alpha;
 
@@ -47,13 +73,11 @@ Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const s
             }
 
             if (halfFloat) {
-                // Bright pixels such as suns can exceed the half-float range, and the resulting infinities would
-                // propagate through any renderer that accumulates them
                 std::vector<uint16_t> halfData(static_cast<size_t>(width) * height * channels);
-                for (size_t i = 0; i < halfData.size(); i++) {
-                    halfData[i] = glm::packHalf1x16(std::min(pData[i], 65504.0f));
-                }
+                HalfFloat::pack(pData, halfData.data(), halfData.size());
                 create(type, format, halfData.data(), width, height, 1, sizeof(uint16_t) * channels, mipmaps);
+            } else if (packedFloat) {
+                create(TextureLoader::createHDRMipChain(pData, width, height, format, mipmaps));
             } else {
                 create(type, format, pData, width, height, 1, sizeof(float) * channels, mipmaps);
             }
@@ -81,58 +105,40 @@ Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const s
         break;
     }
     case TextureType::Texture3D: {
-#ifdef MANDRILL_USE_OPENVDB
-        openvdb::io::File file(path.string());
-        file.open();
-
-        Log::Debug("Grids in volume:");
-        for (auto iter = file.beginName(); iter != file.endName(); ++iter) {
-            Log::Debug("\t{}", *iter);
-        }
-
-        auto found = std::find_if(file.beginName(), file.endName(), [](const auto& grid) { return grid == "density"; });
-        if (found == file.endName()) {
-            Log::Error("Density grid not found in volume");
-        }
-
-        auto baseGrid = file.readGrid("density");
-        auto floatGrid = openvdb::gridPtrCast<openvdb::FloatGrid>(baseGrid);
-
-        openvdb::CoordBBox bbox = floatGrid->evalActiveVoxelBoundingBox();
-        int32_t sizeX = bbox.dim().x();
-        int32_t sizeY = bbox.dim().y();
-        int32_t sizeZ = bbox.dim().z();
-
-        std::vector<float> volumeData(sizeX * sizeY * sizeZ);
-
-        auto accessor = floatGrid->getAccessor();
-        for (int z = bbox.min().z(); z <= bbox.max().z(); ++z) {
-            for (int y = bbox.min().y(); y <= bbox.max().y(); ++y) {
-                for (int x = bbox.min().x(); x <= bbox.max().x(); ++x) {
-                    openvdb::Coord ijk(x, y, z);
-                    float density = accessor.getValue(ijk);
-                    int32_t localX = x - bbox.min().x();
-                    int32_t localY = y - bbox.min().y();
-                    int32_t localZ = z - bbox.min().z();
-                    int32_t idx = (localZ * sizeY + localY) * sizeX + localX;
-                    volumeData[idx] = density;
-                }
+        // The density grid, read on all cores, and the majorant grid that Volume builds along with it. Quantized
+        // formats need the scale and offset of the grid to be undone, which only Volume keeps.
+        Volume volume(mpDevice, fullPath, {{.name = "density", .format = format}});
+        if (const VolumeGrid* pDensity = volume.getGrid("density")) {
+            if (pDensity->scale != 1.0f || pDensity->offset != 0.0f) {
+                Log::Warning("Density of {} is quantized, use Volume to get the scale and offset to undo it",
+                             path.string());
             }
-        }
 
-        create(type, format, volumeData.data(), sizeX, sizeY, sizeZ, sizeof(float), false);
-#else
-        Log::Error("Trying to load a Texture3D but Mandrill was not compiled with OpenVDB support. OpenVDB can be "
-                   "installed using vcpkg:\n\t`vcpkg install openvdb`");
-#endif
+            mpImage = pDensity->pTexture->getImage();
+            mpMajorants = pDensity->pMajorants;
+            mImageInfo = {
+                .sampler = nullptr,
+                .imageView = mpImage->getImageView(),
+                .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+            };
+        }
         break;
     }
     case TextureType::CubeMap: {
-        Log::Error("Not implemented");
+        // The lat-long image only lives for the conversion, so HDR targets read it at full precision and the
+        // conversion rounds once, to the format of the cube map
+        auto pLatLong = make_ptr<Texture>(mpDevice, TextureType::Texture2D,
+                                          isHDRFormat(format) ? VK_FORMAT_R32G32B32A32_SFLOAT : format, path);
+        if (pLatLong->getImage()) {
+            // Filtering must not wrap from one pole to the other
+            pLatLong->setAddressMode(VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                                     VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+            createCubeMap(pLatLong, std::max(pLatLong->getImage()->getWidth() / 4, 1u), format, mipmaps);
+        }
         break;
     }
     }
-    createSampler();
+    updateSampler();
 }
 
 Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const void* pData, uint32_t width,
@@ -140,7 +146,88 @@ Texture::Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const v
     : mpDevice(pDevice), mImageInfo{0}
 {
     create(type, format, pData, width, height, depth, bytesPerPixel, mipmaps);
-    createSampler();
+    updateSampler();
+}
+
+Texture::Texture(ptr<Device> pDevice, const MipChain& mipChain) : mpDevice(pDevice), mImageInfo{0}
+{
+    create(mipChain);
+    updateSampler();
+}
+
+Texture::Texture(ptr<Device> pDevice, VkFormat format, const std::array<std::filesystem::path, 6>& faces, bool mipmaps)
+    : mpDevice(pDevice), mImageInfo{0}
+{
+    // Same choice of loader as for 2D textures, where the compact HDR formats would need their levels made on the CPU
+    if (format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 || format == VK_FORMAT_BC6H_UFLOAT_BLOCK) {
+        Log::Warning("Cube map faces cannot be loaded as format {}, using VK_FORMAT_R16G16B16A16_SFLOAT instead",
+                     static_cast<uint32_t>(format));
+        format = VK_FORMAT_R16G16B16A16_SFLOAT;
+    }
+    const bool halfFloat = format == VK_FORMAT_R16G16B16A16_SFLOAT;
+    const bool fullFloat = format == VK_FORMAT_R32G32B32A32_SFLOAT;
+    const uint32_t bytesPerPixel = halfFloat ? 8 : (fullFloat ? 16 : 4);
+
+    // Faces are stored one after the other, as create() uploads them
+    std::vector<std::byte> data;
+    int size = 0;
+
+    stbi_set_flip_vertically_on_load_thread(0);
+
+    for (uint32_t face = 0; face < 6; face++) {
+        std::filesystem::path fullPath = faces[face];
+        if (fullPath.is_relative()) {
+            fullPath = GetExecutablePath() / fullPath;
+        }
+        std::string pathStr = fullPath.string();
+
+        Log::Info("Loading cube map face from {}", faces[face].string());
+
+        int width, height, channels;
+        void* pPixels = nullptr;
+        if (halfFloat || fullFloat) {
+            pPixels = stbi_loadf(pathStr.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        } else {
+            pPixels = stbi_load(pathStr.c_str(), &width, &height, &channels, STBI_rgb_alpha);
+        }
+
+        if (!pPixels) {
+            Log::Error("Failed to load cube map face {}", faces[face].string());
+            return;
+        }
+
+        if (width != height || (face > 0 && width != size)) {
+            Log::Error("Cube map face {} is {} x {}, but faces have to be square and of the same size",
+                       faces[face].string(), width, height);
+            stbi_image_free(pPixels);
+            return;
+        }
+
+        size = width;
+        const size_t texelCount = static_cast<size_t>(size) * size;
+        if (face == 0) {
+            data.resize(texelCount * bytesPerPixel * 6);
+        }
+
+        std::byte* pFace = data.data() + texelCount * bytesPerPixel * face;
+        if (halfFloat) {
+            HalfFloat::pack(static_cast<const float*>(pPixels), reinterpret_cast<uint16_t*>(pFace), texelCount * 4);
+        } else {
+            std::memcpy(pFace, pPixels, texelCount * bytesPerPixel);
+        }
+
+        stbi_image_free(pPixels);
+    }
+
+    create(TextureType::CubeMap, format, data.data(), size, size, 1, bytesPerPixel, mipmaps);
+    updateSampler();
+}
+
+Texture::Texture(ptr<Device> pDevice, ptr<Texture> pLatLong, uint32_t size, VkFormat format, bool mipmaps)
+    : mpDevice(pDevice), mImageInfo{0}
+{
+    createCubeMap(pLatLong, size, format, mipmaps);
+    updateSampler();
 }
 
 Texture::Texture(ptr<Device> pDevice, ptr<Image> pImage, bool mipmaps)
@@ -153,18 +240,30 @@ Texture::Texture(ptr<Device> pDevice, ptr<Image> pImage, bool mipmaps)
     };
 
     if (mipmaps) {
+        // The device's downsampler is shared by all textures, so that its pipeline is only made once
         VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
-        generateMipmaps(cmd);
+        if (Downsampler::supports(mpDevice, mpImage)) {
+            downsampleMipmaps(cmd, *mpDevice->getDownsampler(DownsampleReduction::Average));
+        } else {
+            generateMipmaps(cmd);
+        }
         Helpers::cmdEnd(mpDevice, cmd);
     }
-    createSampler();
+    updateSampler();
 }
 
 Texture::~Texture()
 {
-    vkDeviceWaitIdle(mpDevice->getDevice());
+}
 
-    vkDestroySampler(mpDevice->getDevice(), mSampler, nullptr);
+VkSampler Texture::getSampler() const
+{
+    const SamplerQuality quality = mpDevice->getSamplerQuality();
+    if (quality.maxAnisotropy != mSamplerQuality.maxAnisotropy || quality.lodBias != mSamplerQuality.lodBias) {
+        updateSampler();
+    }
+
+    return mSampler;
 }
 
 void Texture::create(TextureType type, VkFormat format, const void* pData, uint32_t width, uint32_t height,
@@ -184,13 +283,29 @@ void Texture::create(TextureType type, VkFormat format, const void* pData, uint3
         imageType = VK_IMAGE_TYPE_3D;
     }
 
+    // Cube maps are six layers of a 2D image, one per face
+    const bool cubeMap = type == TextureType::CubeMap;
+    if (cubeMap && (width != height || depth != 1)) {
+        Log::Error("Cube map faces have to be square, with a depth of 1, but are {} x {} x {}", width, height, depth);
+        return;
+    }
+    const uint32_t layers = cubeMap ? 6 : 1;
+
     mpImage = make_ptr<Image>(
         mpDevice, width, height, depth, mipLevels, VK_SAMPLE_COUNT_1_BIT, format, VK_IMAGE_TILING_OPTIMAL,
         VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, imageType);
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, imageType, layers, cubeMap ? VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT : 0);
+
+    if (cubeMap) {
+        // Seamless filtering across the edges of the faces is what cube maps are sampled with, and clamping keeps the
+        // coordinates of a face within it
+        mAddressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        mAddressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+        mAddressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    }
 
     if (pData) {
-        VkDeviceSize size = width * height * depth * bytesPerPixel;
+        VkDeviceSize size = static_cast<VkDeviceSize>(width) * height * depth * layers * bytesPerPixel;
 
         Buffer staging(mpDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
                        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
@@ -202,7 +317,7 @@ void Texture::create(TextureType type, VkFormat format, const void* pData, uint3
             .baseMipLevel = 0,
             .levelCount = mipLevels,
             .baseArrayLayer = 0,
-            .layerCount = 1,
+            .layerCount = layers,
         };
 
         VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
@@ -211,7 +326,24 @@ void Texture::create(TextureType type, VkFormat format, const void* pData, uint3
                               VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
                               VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &subresourceRange);
 
-        Helpers::copyBufferToImage(cmd, staging.getBuffer(), mpImage->getImage(), width, height, depth);
+        if (cubeMap) {
+            // The faces follow each other in the buffer, which is how a copy to several layers reads them
+            VkBufferImageCopy region = {
+                .bufferOffset = 0,
+                .imageSubresource =
+                    {
+                        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                        .mipLevel = 0,
+                        .baseArrayLayer = 0,
+                        .layerCount = layers,
+                    },
+                .imageExtent = {width, height, 1},
+            };
+            vkCmdCopyBufferToImage(cmd, staging.getBuffer(), mpImage->getImage(),
+                                   VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+        } else {
+            Helpers::copyBufferToImage(cmd, staging.getBuffer(), mpImage->getImage(), width, height, depth);
+        }
 
         if (mipmaps) {
             generateMipmaps(cmd);
@@ -234,6 +366,193 @@ void Texture::create(TextureType type, VkFormat format, const void* pData, uint3
     };
 }
 
+void Texture::create(const MipChain& mipChain)
+{
+    const uint32_t mipLevels = count(mipChain.levels);
+
+    mpImage = make_ptr<Image>(mpDevice, mipChain.width, mipChain.height, 1, mipLevels, VK_SAMPLE_COUNT_1_BIT,
+                              mipChain.format, VK_IMAGE_TILING_OPTIMAL,
+                              VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+
+    VkDeviceSize size = 0;
+    for (const auto& level : mipChain.levels) {
+        size += level.size();
+    }
+
+    Buffer staging(mpDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                   VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    // The levels follow each other in the staging buffer, with one region each so that a single copy takes them all
+    std::byte* pStaging = static_cast<std::byte*>(staging.getHostMap());
+    std::vector<VkBufferImageCopy> regions;
+    VkDeviceSize offset = 0;
+    for (uint32_t i = 0; i < mipLevels; i++) {
+        std::memcpy(pStaging + offset, mipChain.levels[i].data(), mipChain.levels[i].size());
+
+        regions.push_back({
+            .bufferOffset = offset,
+            .imageSubresource =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = i,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+            .imageExtent = {std::max(mipChain.width >> i, 1u), std::max(mipChain.height >> i, 1u), 1},
+        });
+
+        offset += mipChain.levels[i].size();
+    }
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = mipLevels,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+
+    Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &subresourceRange);
+
+    vkCmdCopyBufferToImage(cmd, staging.getBuffer(), mpImage->getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           count(regions), regions.data());
+
+    Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT, VK_ACCESS_2_SHADER_READ_BIT,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                          &subresourceRange);
+
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    mpImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+    mImageInfo = {
+        .sampler = nullptr,
+        .imageView = mpImage->getImageView(),
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+}
+
+void Texture::createCubeMap(ptr<Texture> pLatLong, uint32_t size, VkFormat format, bool mipmaps)
+{
+    if (!mpDevice->supportsStorageImageWithoutFormat()) {
+        Log::Error("The device cannot use storage images without a format, which the cube map conversion needs");
+        return;
+    }
+
+    VkFormatProperties props;
+    vkGetPhysicalDeviceFormatProperties(mpDevice->getPhysicalDevice(), format, &props);
+    if (!(props.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT)) {
+        Log::Warning("Format {} cannot be a storage image, converting to a cube map of VK_FORMAT_R16G16B16A16_SFLOAT",
+                     static_cast<uint32_t>(format));
+        format = VK_FORMAT_R16G16B16A16_SFLOAT;
+    }
+
+    uint32_t mipLevels = 1;
+    if (mipmaps) {
+        mipLevels = static_cast<uint32_t>(std::floor(log2(size)) + 1);
+    }
+
+    mpImage = make_ptr<Image>(mpDevice, size, size, 1, mipLevels, VK_SAMPLE_COUNT_1_BIT, format,
+                              VK_IMAGE_TILING_OPTIMAL,
+                              VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT |
+                                  VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_STORAGE_BIT,
+                              VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D, 6,
+                              VK_IMAGE_CREATE_CUBE_COMPATIBLE_BIT);
+
+    mAddressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    mAddressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+    mAddressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+
+    // The shader writes the faces as the layers of an array view of the first level, since cube views cannot be
+    // storage images
+    VkImageViewCreateInfo ci = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+        .image = mpImage->getImage(),
+        .viewType = VK_IMAGE_VIEW_TYPE_2D_ARRAY,
+        .format = format,
+        .subresourceRange =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .baseMipLevel = 0,
+                .levelCount = 1,
+                .baseArrayLayer = 0,
+                .layerCount = 6,
+            },
+    };
+
+    VkImageView faceView;
+    Check::Vk(vkCreateImageView(mpDevice->getDevice(), &ci, nullptr, &faceView));
+
+    std::vector<ShaderDesc> shaderDesc;
+    shaderDesc.emplace_back("Mandrill/EquirectToCube.comp", "main", VK_SHADER_STAGE_COMPUTE_BIT);
+    auto pShader = make_ptr<Shader>(mpDevice, shaderDesc);
+    auto pPipeline = make_ptr<ComputePipeline>(mpDevice, pShader);
+
+    std::vector<DescriptorDesc> desc;
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, pLatLong);
+    desc.emplace_back(VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, mpImage);
+    desc.back().imageView = faceView;
+    desc.back().imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    auto pDescriptor = make_ptr<Descriptor>(mpDevice, desc, pShader->getDescriptorSetLayout(0));
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = mipLevels,
+        .baseArrayLayer = 0,
+        .layerCount = 6,
+    };
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+
+    Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT, VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_GENERAL, &subresourceRange);
+
+    pPipeline->bind(cmd);
+    pDescriptor->bind(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, pPipeline->getLayout(), 0);
+
+    int32_t faceSize = static_cast<int32_t>(size);
+    vkCmdPushConstants(cmd, pPipeline->getLayout(), VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(faceSize), &faceSize);
+
+    const uint32_t groupCount = (size + kCubeMapGroupSize - 1) / kCubeMapGroupSize;
+    pPipeline->dispatchGroups(cmd, groupCount, groupCount, 6);
+
+    if (mipmaps) {
+        // The levels below are made from the first one by blitting, as for textures loaded from files
+        Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                              VK_ACCESS_2_TRANSFER_READ_BIT | VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                              VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &subresourceRange);
+        generateMipmaps(cmd);
+    } else {
+        Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                              VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, &subresourceRange);
+    }
+
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    // The descriptor waits for the device to be idle before it goes, after which the view is no longer in use
+    pDescriptor = nullptr;
+    vkDestroyImageView(mpDevice->getDevice(), faceView, nullptr);
+
+    mpImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+    mImageInfo = {
+        .sampler = nullptr,
+        .imageView = mpImage->getImageView(),
+        .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+    };
+}
+
 void Texture::generateMipmaps(VkCommandBuffer cmd)
 {
     VkFormatProperties props;
@@ -243,11 +562,14 @@ void Texture::generateMipmaps(VkCommandBuffer cmd)
         Log::Error("Texture image format does not support linear blitting");
     }
 
+    // Every layer is blitted at once, which is how the faces of a cube map get their levels
+    const uint32_t layers = mpImage->getArrayLayers();
+
     VkImageSubresourceRange subresourceRange = {
         .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
         .levelCount = 1,
         .baseArrayLayer = 0,
-        .layerCount = 1,
+        .layerCount = layers,
     };
 
     int32_t mipWidth = mpImage->getWidth();
@@ -266,12 +588,12 @@ void Texture::generateMipmaps(VkCommandBuffer cmd)
             .srcSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                                .mipLevel = i - 1,
                                .baseArrayLayer = 0,
-                               .layerCount = 1},
+                               .layerCount = layers},
             .srcOffsets = {{0, 0, 0}, {mipWidth, mipHeight, 1}},
             .dstSubresource = {.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
                                .mipLevel = i,
                                .baseArrayLayer = 0,
-                               .layerCount = 1},
+                               .layerCount = layers},
             .dstOffsets = {{0, 0, 0}, {mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1}},
         };
 
@@ -309,13 +631,32 @@ void Texture::generateMipmaps(VkCommandBuffer cmd)
                           VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, &subresourceRange);
 }
 
-void Texture::createSampler()
+void Texture::downsampleMipmaps(VkCommandBuffer cmd, Downsampler& downsampler)
 {
-    if (mSampler != VK_NULL_HANDLE) {
-        vkDeviceWaitIdle(mpDevice->getDevice());
-        vkDestroySampler(mpDevice->getDevice(), mSampler, nullptr);
-    }
+    // Like generateMipmaps(), this expects every level to be in the layout the first one was copied in with
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = mpImage->getMipLevels(),
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_GENERAL, &subresourceRange);
+
+    downsampler.downsample(cmd, mpImage);
 
+    Helpers::imageBarrier(cmd, mpImage->getImage(), VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT, VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_GENERAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, &subresourceRange);
+}
+
+void Texture::updateSampler() const
+{
     VkSamplerCreateInfo ci = {
         .sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
         .magFilter = mMagFilter,
@@ -335,7 +676,9 @@ void Texture::createSampler()
         .unnormalizedCoordinates = VK_FALSE,
     };
 
-    Check::Vk(vkCreateSampler(mpDevice->getDevice(), &ci, nullptr, &mSampler));
+    // Samplers in use stay alive in the cache, so frames in flight that still refer to the old one are unaffected
+    mSampler = mpDevice->getSampler(ci);
+    mSamplerQuality = mpDevice->getSamplerQuality();
 
     mImageInfo.sampler = mSampler;
 }
\ No newline at end of file
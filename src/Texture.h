@@ -14,6 +14,17 @@ namespace Mandrill
         CubeMap,
     };
 
+    /// <summary>
+    /// Every mip level of a 2D texture, laid out as it is uploaded. Block-compressed levels hold whole blocks, row by
+    /// row.
+    /// </summary>
+    struct MipChain {
+        VkFormat format = VK_FORMAT_UNDEFINED;
+        uint32_t width = 0;  // Width of the first level
+        uint32_t height = 0; // Height of the first level
+        std::vector<std::vector<std::byte>> levels; // Largest level first
+    };
+
     /// <summary>
     /// Texture class for managing textures in Vulkan.
     /// </summary>
@@ -27,7 +38,12 @@ namespace Mandrill
         /// </summary>
         /// <param name="pDevice">Device to use</param>
         /// <param name="type">Type of texture</param>
-        /// <param name="format">Format to use</param>
+        /// <param name="format">Format to use. HDR files keep their dynamic range in VK_FORMAT_R16G16B16A16_SFLOAT,
+        /// VK_FORMAT_R32G32B32A32_SFLOAT, VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 or VK_FORMAT_BC6H_UFLOAT_BLOCK, where the
+        /// last two drop alpha and negative values and are encoded on the CPU. Texture3D reads the density grid of an
+        /// OpenVDB file, in any format that Volume supports for scalar grids, along with its majorant grid, see
+        /// getMajorants(). CubeMap reads an equirectangular image and converts it on the device, see the constructor
+        /// that takes a lat-long texture.</param>
         /// <param name="path">Path to texture file</param>
         /// <param name="mipmaps">Whether to use mipmaps or not</param>
         MANDRILL_API Texture(ptr<Device> pDevice, TextureType type, VkFormat format, const std::filesystem::path& path,
@@ -39,7 +55,8 @@ namespace Mandrill
         /// <param name="pDevice">Device to use</param>
         /// <param name="type">Type of texture</param>
         /// <param name="format">Format to use</param>
-        /// <param name="pData">Pointer to texture data</param>
+        /// <param name="pData">Pointer to texture data. A CubeMap takes six square faces of width x height, one
+        /// after the other in the order +X, -X, +Y, -Y, +Z, -Z, with a depth of 1.</param>
         /// <param name="width">Width of texture</param>
         /// <param name="height">Height of texture</param>
         /// <param name="depth">Depth of texture</param>
@@ -49,7 +66,48 @@ namespace Mandrill
                              uint32_t height, uint32_t depth, uint32_t bytesPerPixel, bool mipmaps = false);
 
         /// <summary>
-        /// Create a texture from an existing image.
+        /// Create a new 2D texture from mip levels prepared on the host, such as block-compressed ones. All levels
+        /// are uploaded in one copy.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="mipChain">Levels to upload</param>
+        MANDRILL_API Texture(ptr<Device> pDevice, const MipChain& mipChain);
+
+        /// <summary>
+        /// Create a cube map from six image files, one per face in the order +X, -X, +Y, -Y, +Z, -Z. The faces have to
+        /// be square and of the same size, and are read as they are, without flipping.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="format">Format to use. VK_FORMAT_R16G16B16A16_SFLOAT and VK_FORMAT_R32G32B32A32_SFLOAT keep
+        /// the dynamic range of HDR files, other formats take 8 bits per channel.</param>
+        /// <param name="faces">Paths to the face files</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        MANDRILL_API Texture(ptr<Device> pDevice, VkFormat format, const std::array<std::filesystem::path, 6>& faces,
+                             bool mipmaps = false);
+
+        /// <summary>
+        /// Create a cube map from a lat-long texture, in a single compute dispatch that samples it once per texel of
+        /// the faces. Directions map to the lat-long texture like worldToLatlongMap() in the shaders, with u following
+        /// atan(-z, x) and v following acos(-y), so a cube map can take the place of the texture by sampling it with
+        /// the direction itself.
+        ///
+        /// The faces are written as storage images, so the device has to support storage images without a format.
+        /// Formats that cannot be storage images, such as sRGB and the compact HDR formats, are replaced by
+        /// VK_FORMAT_R16G16B16A16_SFLOAT.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="pLatLong">Lat-long texture to convert</param>
+        /// <param name="size">Width and height of each face. A quarter of the width of the lat-long texture keeps the
+        /// resolution at the horizon.</param>
+        /// <param name="format">Format to use</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        MANDRILL_API Texture(ptr<Device> pDevice, ptr<Texture> pLatLong, uint32_t size, VkFormat format,
+                             bool mipmaps = false);
+
+        /// <summary>
+        /// Create a texture from an existing image. Mipmaps are made from the first level, which is expected in
+        /// VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL along with the others. They are made in a single compute dispatch
+        /// when the Downsampler supports the image, and by blitting one level at a time otherwise.
         /// </summary>
         /// <param name="pDevice">Device to use</param>
         /// <param name="pImage">Image to use</param>
@@ -62,13 +120,11 @@ namespace Mandrill
         MANDRILL_API ~Texture();
 
         /// <summary>
-        /// Get the sampler handle currently in use by the texture.
+        /// Get the sampler handle currently in use by the texture. Samplers are shared through the device's sampler
+        /// cache, and a new one is looked up here if the device's sampler quality has changed.
         /// </summary>
         /// <returns>Sampler in use</returns>
-        MANDRILL_API VkSampler getSampler() const
-        {
-            return mSampler;
-        }
+        MANDRILL_API VkSampler getSampler() const;
 
         /// <summary>
         /// Get the image of the texture.
@@ -79,6 +135,15 @@ namespace Mandrill
             return mpImage;
         }
 
+        /// <summary>
+        /// Get the majorant grid of a Texture3D read from an OpenVDB file, laid out like VolumeGrid::pMajorants.
+        /// </summary>
+        /// <returns>Majorant grid, or nullptr for other textures</returns>
+        MANDRILL_API ptr<Texture> getMajorants() const
+        {
+            return mpMajorants;
+        }
+
         /// <summary>
         /// Get the image view handle.
         /// </summary>
@@ -95,6 +160,8 @@ namespace Mandrill
         /// <returns>Write descriptor set</returns>
         MANDRILL_API VkWriteDescriptorSet getWriteDescriptor(uint32_t binding) const
         {
+            getSampler();
+
             VkWriteDescriptorSet descriptor = {
                 .sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
                 .dstBinding = binding,
@@ -108,13 +175,14 @@ namespace Mandrill
         }
 
         /// <summary>
-        /// Set the magnification filter.
+        /// Set the magnification filter. Like the other sampler settings, this only swaps which shared sampler the
+        /// texture uses, so it does not wait for the device, and descriptors have to be recreated to see it.
         /// </summary>
         /// <param name="filter">Magnification filter</param>
         MANDRILL_API void setMagFilter(VkFilter filter)
         {
             mMagFilter = filter;
-            createSampler();
+            updateSampler();
         }
 
         /// <summary>
@@ -124,7 +192,7 @@ namespace Mandrill
         MANDRILL_API void setMinFilter(VkFilter filter)
         {
             mMinFilter = filter;
-            createSampler();
+            updateSampler();
         }
 
         /// <summary>
@@ -134,7 +202,7 @@ namespace Mandrill
         MANDRILL_API void setMipmapMode(VkSamplerMipmapMode mode)
         {
             mMipmapMode = mode;
-            createSampler();
+            updateSampler();
         }
 
         /// <summary>
@@ -149,21 +217,27 @@ namespace Mandrill
             mAddressModeU = modeU;
             mAddressModeV = modeV;
             mAddressModeW = modeW;
-            createSampler();
+            updateSampler();
         }
 
     private:
         void create(TextureType type, VkFormat format, const void* pData, uint32_t width, uint32_t height,
                     uint32_t depth, uint32_t bytesPerPixel, bool mipmaps);
+        void create(const MipChain& mipChain);
+        void createCubeMap(ptr<Texture> pLatLong, uint32_t size, VkFormat format, bool mipmaps);
         void generateMipmaps(VkCommandBuffer cmd);
-        void createSampler();
+        void downsampleMipmaps(VkCommandBuffer cmd, Downsampler& downsampler);
+        void updateSampler() const;
 
         ptr<Device> mpDevice;
 
         ptr<Image> mpImage;
-        VkDescriptorImageInfo mImageInfo;
+        mutable VkDescriptorImageInfo mImageInfo;
+        ptr<Texture> mpMajorants; // Only for Texture3D read from a file
 
-        VkSampler mSampler = VK_NULL_HANDLE;
+        // Owned by the device's sampler cache, and looked up again when the quality it was made with changes
+        mutable VkSampler mSampler = VK_NULL_HANDLE;
+        mutable SamplerQuality mSamplerQuality;
         VkFilter mMagFilter = VK_FILTER_LINEAR;
         VkFilter mMinFilter = VK_FILTER_LINEAR;
         VkSamplerMipmapMode mMipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
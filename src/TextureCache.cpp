@@ -0,0 +1,372 @@
+#include "TextureCache.h"
+
+#include "Log.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    const uint8_t kIdentifier[12] = {0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'};
+
+    // Fixed part of a KTX2 file after the identifier. Packed, because the 64-bit fields that end it are only four-byte
+    // aligned within the struct.
+#pragma pack(push, 4)
+    struct Header {
+        uint32_t vkFormat;
+        uint32_t typeSize;
+        uint32_t pixelWidth;
+        uint32_t pixelHeight;
+        uint32_t pixelDepth;
+        uint32_t layerCount;
+        uint32_t faceCount;
+        uint32_t levelCount;
+        uint32_t supercompressionScheme;
+        uint32_t dfdByteOffset;
+        uint32_t dfdByteLength;
+        uint32_t kvdByteOffset;
+        uint32_t kvdByteLength;
+        uint64_t sgdByteOffset;
+        uint64_t sgdByteLength;
+    };
+#pragma pack(pop)
+
+    struct LevelIndex {
+        uint64_t byteOffset;
+        uint64_t byteLength;
+        uint64_t uncompressedByteLength;
+    };
+
+    // One sample of a data format descriptor, which says where a channel lives in a texel block
+    struct Sample {
+        uint32_t bitOffset;
+        uint32_t bitLength;
+        uint32_t channelType;
+        uint32_t lower;
+        uint32_t upper;
+    };
+
+    // What a KTX2 file needs to know about a format: its data format descriptor and the size of its texel blocks
+    struct FormatInfo {
+        VkFormat format;
+        uint32_t colorModel;
+        uint32_t blockWidth;
+        uint32_t blockHeight;
+        uint32_t blockSize; // Bytes per texel block
+        uint32_t typeSize;
+        std::vector<Sample> samples;
+    };
+
+    // Colour models and channels from the Khronos data format specification
+    constexpr uint32_t kModelRGBSDA = 1;
+    constexpr uint32_t kModelBC1A = 128;
+    constexpr uint32_t kModelBC3 = 130;
+    constexpr uint32_t kModelBC5 = 132;
+    constexpr uint32_t kModelBC6H = 133;
+    constexpr uint32_t kModelBC7 = 134;
+    constexpr uint32_t kChannelAlpha = 15;
+    constexpr uint32_t kQualifierFloat = 0x80; // Combined with the channel in the sample's channel type
+    constexpr uint32_t kQualifierSigned = 0x40;
+    constexpr uint32_t kFloatOne = 0x3f800000;
+    constexpr uint32_t kFloatMinusOne = 0xbf800000;
+    constexpr uint32_t kSignedFloat = kQualifierFloat | kQualifierSigned;
+
+    const std::vector<FormatInfo>& getFormats()
+    {
+        static const std::vector<FormatInfo> formats = {
+            {
+                .format = VK_FORMAT_R8G8B8A8_UNORM,
+                .colorModel = kModelRGBSDA,
+                .blockWidth = 1,
+                .blockHeight = 1,
+                .blockSize = 4,
+                .typeSize = 1,
+                .samples = {{0, 8, 0, 0, 255}, {8, 8, 1, 0, 255}, {16, 8, 2, 0, 255}, {24, 8, kChannelAlpha, 0, 255}},
+            },
+            {
+                .format = VK_FORMAT_R16G16_SFLOAT,
+                .colorModel = kModelRGBSDA,
+                .blockWidth = 1,
+                .blockHeight = 1,
+                .blockSize = 4,
+                .typeSize = 2,
+                .samples = {{0, 16, kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {16, 16, 1 | kSignedFloat, kFloatMinusOne, kFloatOne}},
+            },
+            {
+                .format = VK_FORMAT_R16G16B16A16_SFLOAT,
+                .colorModel = kModelRGBSDA,
+                .blockWidth = 1,
+                .blockHeight = 1,
+                .blockSize = 8,
+                .typeSize = 2,
+                .samples = {{0, 16, kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {16, 16, 1 | kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {32, 16, 2 | kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {48, 16, kChannelAlpha | kSignedFloat, kFloatMinusOne, kFloatOne}},
+            },
+            {
+                .format = VK_FORMAT_R32G32B32A32_SFLOAT,
+                .colorModel = kModelRGBSDA,
+                .blockWidth = 1,
+                .blockHeight = 1,
+                .blockSize = 16,
+                .typeSize = 4,
+                .samples = {{0, 32, kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {32, 32, 1 | kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {64, 32, 2 | kSignedFloat, kFloatMinusOne, kFloatOne},
+                            {96, 32, kChannelAlpha | kSignedFloat, kFloatMinusOne, kFloatOne}},
+            },
+            {
+                .format = VK_FORMAT_BC1_RGB_UNORM_BLOCK,
+                .colorModel = kModelBC1A,
+                .blockWidth = 4,
+                .blockHeight = 4,
+                .blockSize = 8,
+                .typeSize = 1,
+                .samples = {{0, 64, 0, 0, 0xffffffff}},
+            },
+            {
+                .format = VK_FORMAT_BC3_UNORM_BLOCK,
+                .colorModel = kModelBC3,
+                .blockWidth = 4,
+                .blockHeight = 4,
+                .blockSize = 16,
+                .typeSize = 1,
+                .samples = {{0, 64, kChannelAlpha, 0, 0xffffffff}, {64, 64, 0, 0, 0xffffffff}},
+            },
+            {
+                .format = VK_FORMAT_BC5_UNORM_BLOCK,
+                .colorModel = kModelBC5,
+                .blockWidth = 4,
+                .blockHeight = 4,
+                .blockSize = 16,
+                .typeSize = 1,
+                .samples = {{0, 64, 0, 0, 0xffffffff}, {64, 64, 1, 0, 0xffffffff}},
+            },
+            {
+                .format = VK_FORMAT_BC6H_UFLOAT_BLOCK,
+                .colorModel = kModelBC6H,
+                .blockWidth = 4,
+                .blockHeight = 4,
+                .blockSize = 16,
+                .typeSize = 1,
+                .samples = {{0, 128, kQualifierFloat, 0, kFloatOne}},
+            },
+            {
+                .format = VK_FORMAT_BC7_UNORM_BLOCK,
+                .colorModel = kModelBC7,
+                .blockWidth = 4,
+                .blockHeight = 4,
+                .blockSize = 16,
+                .typeSize = 1,
+                .samples = {{0, 128, 0, 0, 0xffffffff}},
+            },
+        };
+        return formats;
+    }
+
+    const FormatInfo* findFormat(VkFormat format)
+    {
+        for (const auto& info : getFormats()) {
+            if (info.format == format) {
+                return &info;
+            }
+        }
+        return nullptr;
+    }
+
+    size_t getLevelSize(const FormatInfo& info, uint32_t width, uint32_t height)
+    {
+        size_t blocksX = (width + info.blockWidth - 1) / info.blockWidth;
+        size_t blocksY = (height + info.blockHeight - 1) / info.blockHeight;
+        return blocksX * blocksY * info.blockSize;
+    }
+
+    // The basic data format descriptor block, preceded by the total size of the descriptor
+    std::vector<uint32_t> createDescriptor(const FormatInfo& info)
+    {
+        const uint32_t blockSize = 24 + 16 * count(info.samples);
+
+        std::vector<uint32_t> words;
+        words.push_back(4 + blockSize);
+        words.push_back(0);                                      // Khronos vendor, basic descriptor type
+        words.push_back(2 | (blockSize << 16));                  // Version 1.3 of the specification
+        words.push_back(info.colorModel | (1 << 8) | (1 << 16)); // BT.709 primaries, linear transfer, straight alpha
+        words.push_back((info.blockWidth - 1) | ((info.blockHeight - 1) << 8));
+        words.push_back(info.blockSize); // Bytes in plane 0
+        words.push_back(0);
+
+        for (const auto& sample : info.samples) {
+            words.push_back(sample.bitOffset | ((sample.bitLength - 1) << 16) | (sample.channelType << 24));
+            words.push_back(0); // Sample position
+            words.push_back(sample.lower);
+            words.push_back(sample.upper);
+        }
+
+        return words;
+    }
+
+    uint64_t alignUp(uint64_t value, uint64_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+} // namespace
+
+TextureCache::TextureCache(const std::filesystem::path& directory) : mDirectory(directory)
+{
+}
+
+TextureCache::~TextureCache()
+{
+}
+
+std::optional<MipChain> TextureCache::load(uint64_t key) const
+{
+    std::ifstream is(getPath(key), std::ios::binary | std::ios::ate);
+    if (!is.good()) {
+        return std::nullopt;
+    }
+
+    std::vector<uint8_t> file(static_cast<size_t>(is.tellg()));
+    is.seekg(0);
+    is.read(reinterpret_cast<char*>(file.data()), file.size());
+    if (!is.good() || file.size() < sizeof(kIdentifier) + sizeof(Header)) {
+        return std::nullopt;
+    }
+
+    if (std::memcmp(file.data(), kIdentifier, sizeof(kIdentifier)) != 0) {
+        return std::nullopt;
+    }
+
+    Header header;
+    std::memcpy(&header, file.data() + sizeof(kIdentifier), sizeof(Header));
+
+    // Only what store() writes is read back, anything else is treated as a miss
+    const FormatInfo* pInfo = findFormat(static_cast<VkFormat>(header.vkFormat));
+    if (!pInfo || header.supercompressionScheme != 0 || header.pixelDepth != 0 || header.layerCount != 0 ||
+        header.faceCount != 1 || header.levelCount == 0) {
+        return std::nullopt;
+    }
+
+    const size_t levelIndexOffset = sizeof(kIdentifier) + sizeof(Header);
+    if (file.size() < levelIndexOffset + sizeof(LevelIndex) * header.levelCount) {
+        return std::nullopt;
+    }
+
+    MipChain mipChain = {
+        .format = pInfo->format,
+        .width = header.pixelWidth,
+        .height = header.pixelHeight,
+    };
+
+    for (uint32_t i = 0; i < header.levelCount; i++) {
+        LevelIndex level;
+        std::memcpy(&level, file.data() + levelIndexOffset + sizeof(LevelIndex) * i, sizeof(LevelIndex));
+
+        size_t expectedSize =
+            getLevelSize(*pInfo, std::max(header.pixelWidth >> i, 1u), std::max(header.pixelHeight >> i, 1u));
+        if (level.byteLength != expectedSize || level.byteOffset + level.byteLength > file.size()) {
+            Log::Warning("TextureCache: Ignoring damaged entry {}", getPath(key).string());
+            return std::nullopt;
+        }
+
+        const std::byte* pLevel = reinterpret_cast<const std::byte*>(file.data() + level.byteOffset);
+        mipChain.levels.emplace_back(pLevel, pLevel + level.byteLength);
+    }
+
+    return mipChain;
+}
+
+bool TextureCache::store(uint64_t key, const MipChain& mipChain) const
+{
+    const FormatInfo* pInfo = findFormat(mipChain.format);
+    if (!pInfo) {
+        Log::Error("TextureCache: Format {} cannot be stored", static_cast<uint32_t>(mipChain.format));
+        return false;
+    }
+
+    const uint32_t levelCount = count(mipChain.levels);
+    const std::vector<uint32_t> descriptor = createDescriptor(*pInfo);
+
+    Header header = {
+        .vkFormat = static_cast<uint32_t>(mipChain.format),
+        .typeSize = pInfo->typeSize,
+        .pixelWidth = mipChain.width,
+        .pixelHeight = mipChain.height,
+        .pixelDepth = 0,
+        .layerCount = 0,
+        .faceCount = 1,
+        .levelCount = levelCount,
+        .supercompressionScheme = 0,
+    };
+
+    header.dfdByteOffset =
+        static_cast<uint32_t>(sizeof(kIdentifier) + sizeof(Header) + sizeof(LevelIndex) * levelCount);
+    header.dfdByteLength = static_cast<uint32_t>(sizeof(uint32_t) * descriptor.size());
+
+    // KTX2 stores the smallest level first, each aligned to the texel block size and to four bytes
+    const uint64_t alignment = std::lcm(uint64_t(pInfo->blockSize), uint64_t(4));
+    std::vector<LevelIndex> levels(levelCount);
+    uint64_t offset = header.dfdByteOffset + header.dfdByteLength;
+    for (uint32_t i = levelCount; i-- > 0;) {
+        offset = alignUp(offset, alignment);
+        levels[i] = {
+            .byteOffset = offset,
+            .byteLength = mipChain.levels[i].size(),
+            .uncompressedByteLength = mipChain.levels[i].size(),
+        };
+        offset += mipChain.levels[i].size();
+    }
+
+    std::vector<uint8_t> file(offset);
+    std::memcpy(file.data(), kIdentifier, sizeof(kIdentifier));
+    std::memcpy(file.data() + sizeof(kIdentifier), &header, sizeof(Header));
+    std::memcpy(file.data() + sizeof(kIdentifier) + sizeof(Header), levels.data(), sizeof(LevelIndex) * levelCount);
+    std::memcpy(file.data() + header.dfdByteOffset, descriptor.data(), header.dfdByteLength);
+    for (uint32_t i = 0; i < levelCount; i++) {
+        std::memcpy(file.data() + levels[i].byteOffset, mipChain.levels[i].data(), mipChain.levels[i].size());
+    }
+
+    std::error_code error;
+    std::filesystem::create_directories(mDirectory, error);
+
+    // Written under a temporary name first, so that a run that stops halfway never leaves a truncated entry behind
+    const std::filesystem::path path = getPath(key);
+    std::filesystem::path tempPath = path;
+    tempPath += std::format(".{}.tmp", std::hash<std::thread::id>()(std::this_thread::get_id()));
+
+    {
+        std::ofstream os(tempPath, std::ios::binary);
+        os.write(reinterpret_cast<const char*>(file.data()), file.size());
+        if (!os.good()) {
+            Log::Warning("TextureCache: Failed to write {}", tempPath.string());
+            return false;
+        }
+    }
+
+    std::filesystem::rename(tempPath, path, error);
+    if (error) {
+        Log::Warning("TextureCache: Failed to write {}: {}", path.string(), error.message());
+        std::filesystem::remove(tempPath, error);
+        return false;
+    }
+
+    return true;
+}
+
+uint64_t TextureCache::hash(const void* pData, size_t size, uint64_t seed)
+{
+    // 64-bit FNV-1a
+    const uint8_t* pBytes = static_cast<const uint8_t*>(pData);
+    uint64_t h = seed;
+    for (size_t i = 0; i < size; i++) {
+        h ^= pBytes[i];
+        h *= 0x100000001b3;
+    }
+    return h;
+}
+
+std::filesystem::path TextureCache::getPath(uint64_t key) const
+{
+    return mDirectory / std::format("{:016x}.ktx2", key);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Texture.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// On-disk cache of prepared textures, with every mip level stored as it is uploaded. Each entry is a KTX2 file
+    /// named after a key, which should be a hash of the source image and of every setting that went into preparing
+    /// it, so that changing either misses the cache instead of returning stale data.
+    ///
+    /// Entries can be loaded and stored from several threads at once, as long as they use different keys.
+    /// </summary>
+    class TextureCache
+    {
+    public:
+        MANDRILL_NON_COPYABLE(TextureCache)
+
+        /// <summary>
+        /// Create a new texture cache.
+        /// </summary>
+        /// <param name="directory">Directory to keep the entries in, which is created when the first one is
+        /// stored</param>
+        MANDRILL_API TextureCache(const std::filesystem::path& directory);
+
+        /// <summary>
+        /// Destructor for texture cache.
+        /// </summary>
+        MANDRILL_API ~TextureCache();
+
+        /// <summary>
+        /// Load an entry.
+        /// </summary>
+        /// <param name="key">Key of the entry</param>
+        /// <returns>The mip chain, or nothing if there is no valid entry for the key</returns>
+        MANDRILL_API std::optional<MipChain> load(uint64_t key) const;
+
+        /// <summary>
+        /// Store an entry, replacing any there was for the key.
+        /// </summary>
+        /// <param name="key">Key of the entry</param>
+        /// <param name="mipChain">Mip chain to store</param>
+        /// <returns>True if the entry was written</returns>
+        MANDRILL_API bool store(uint64_t key, const MipChain& mipChain) const;
+
+        /// <summary>
+        /// Get the directory the entries are kept in.
+        /// </summary>
+        /// <returns>Path to directory</returns>
+        MANDRILL_API const std::filesystem::path& getDirectory() const
+        {
+            return mDirectory;
+        }
+
+        /// <summary>
+        /// Hash data into a key, continuing from an earlier hash so that several pieces can make up one key. The
+        /// hash is the same on every platform and run, unlike std::hash.
+        /// </summary>
+        /// <param name="pData">Data to hash</param>
+        /// <param name="size">Size of data in bytes</param>
+        /// <param name="seed">Hash to continue from</param>
+        /// <returns>Hash value</returns>
+        MANDRILL_API static uint64_t hash(const void* pData, size_t size, uint64_t seed = 0xcbf29ce484222325);
+
+    private:
+        std::filesystem::path getPath(uint64_t key) const;
+
+        std::filesystem::path mDirectory;
+    };
+} // namespace Mandrill
@@ -0,0 +1,386 @@
+#include "TextureLoader.h"
+
+#include "HalfFloat.h"
+#include "Log.h"
+
+#include <glm/gtc/packing.hpp>
+#include <stb_image.h>
+
+using namespace Mandrill;
+
+// Bumped whenever the prepared textures change for the same source and settings, so that old cache entries are missed
+static constexpr uint32_t kPreparationVersion = 2;
+
+static bool readFile(const std::filesystem::path& path, std::vector<uint8_t>& data)
+{
+    std::ifstream is(path, std::ios::binary | std::ios::ate);
+    if (!is.good()) {
+        return false;
+    }
+
+    data.resize(static_cast<size_t>(is.tellg()));
+    is.seekg(0);
+    is.read(reinterpret_cast<char*>(data.data()), data.size());
+
+    return is.good();
+}
+
+// Pack texels with four float channels into the shared-exponent format, which has no alpha and no negative values
+static std::vector<std::byte> packSharedExponent(const float* pRGBA, size_t texelCount)
+{
+    std::vector<std::byte> packed(texelCount * sizeof(uint32_t));
+    uint32_t* pPacked = reinterpret_cast<uint32_t*>(packed.data());
+    for (size_t i = 0; i < texelCount; i++) {
+        const float* pTexel = pRGBA + i * 4;
+        pPacked[i] = glm::packF3x9_E1x5(glm::max(glm::vec3(pTexel[0], pTexel[1], pTexel[2]), 0.0f));
+    }
+    return packed;
+}
+
+TextureLoader::TextureLoader(ptr<Device> pDevice, uint32_t threadCount) : mpDevice(pDevice), mThreadCount(threadCount)
+{
+    if (mThreadCount == 0) {
+        mThreadCount = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+}
+
+TextureLoader::~TextureLoader()
+{
+}
+
+void TextureLoader::addFile(const std::string& key, const std::filesystem::path& path, VkFormat format, bool mipmaps,
+                            TextureCompression compression, std::optional<MipGenerationDesc> mipGeneration)
+{
+    if (!mQueuedKeys.insert(key).second) {
+        return;
+    }
+
+    std::filesystem::path fullPath = path;
+    if (path.is_relative()) {
+        fullPath = GetExecutablePath() / path;
+    }
+
+    mJobs.push_back({
+        .key = key,
+        .path = fullPath,
+        .format = format,
+        .mipmaps = mipmaps,
+        .compression = compression,
+        .mipGeneration = mipGeneration,
+    });
+}
+
+void TextureLoader::addMemory(const std::string& key, std::vector<uint8_t> fileData, VkFormat format, bool mipmaps,
+                              TextureCompression compression, std::optional<MipGenerationDesc> mipGeneration)
+{
+    if (!mQueuedKeys.insert(key).second) {
+        return;
+    }
+
+    mJobs.push_back({
+        .key = key,
+        .fileData = std::move(fileData),
+        .format = format,
+        .mipmaps = mipmaps,
+        .compression = compression,
+        .mipGeneration = mipGeneration,
+    });
+}
+
+void TextureLoader::load(const std::function<void(const std::string& key, ptr<Texture> pTexture)>& onLoaded)
+{
+    run([&](const Job& job, std::optional<MipChain> mipChain) {
+        ptr<Texture> pTexture;
+        if (mipChain && preparesMipChain(job)) {
+            pTexture = mpDevice->createTextureFromMipChain(*mipChain);
+        } else if (mipChain) {
+            const uint32_t bytesPerPixel = static_cast<uint32_t>(
+                mipChain->levels[0].size() / (static_cast<size_t>(mipChain->width) * mipChain->height));
+            pTexture = mpDevice->createTextureFromBuffer(TextureType::Texture2D, job.format, mipChain->levels[0].data(),
+                                                         mipChain->width, mipChain->height, 1, bytesPerPixel,
+                                                         job.mipmaps);
+        } else {
+            Log::Error("Failed to load texture {}", job.key);
+        }
+
+        onLoaded(job.key, pTexture);
+    });
+}
+
+void TextureLoader::loadMipChains(
+    const std::function<void(const std::string& key, std::optional<MipChain> mipChain)>& onLoaded)
+{
+    // 8-bit textures that would have had their levels made by the device get them made on the host instead
+    for (auto& job : mJobs) {
+        if (job.mipmaps && !job.mipGeneration) {
+            job.mipGeneration = MipGenerationDesc{};
+        }
+    }
+
+    run([&](const Job& job, std::optional<MipChain> mipChain) {
+        if (!mipChain) {
+            Log::Error("Failed to load texture {}", job.key);
+        } else if (job.mipmaps && !preparesMipChain(job)) {
+            Log::Error("Texture {} in format {} cannot have its mip levels made on the host", job.key,
+                       static_cast<uint32_t>(job.format));
+        }
+
+        onLoaded(job.key, std::move(mipChain));
+    });
+}
+
+void TextureLoader::run(const std::function<void(const Job& job, std::optional<MipChain> mipChain)>& onPrepared)
+{
+    if (mJobs.empty()) {
+        return;
+    }
+
+    const uint32_t workerCount = std::min(mThreadCount, count(mJobs));
+    Log::Info("Loading {} textures on {} threads", mJobs.size(), workerCount);
+
+    // The encoders can split an image over threads of their own, which only pays off when there are fewer images
+    // than cores to spread over
+    const uint32_t encodeThreadCount = std::max(mThreadCount / count(mJobs), 1u);
+
+    // Compression is only for 8-bit sources, and only if the device can sample the result. HDR textures fall back
+    // to the shared-exponent format, which is as small as BC6H gets without compression.
+    for (auto& job : mJobs) {
+        if (job.compression != TextureCompression::None &&
+            (job.format != VK_FORMAT_R8G8B8A8_UNORM || !mpDevice->supportsTextureCompressionBC())) {
+            job.compression = TextureCompression::None;
+        }
+        if (job.format == VK_FORMAT_BC6H_UFLOAT_BLOCK && !mpDevice->supportsTextureCompressionBC()) {
+            job.format = VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+        }
+    }
+
+    std::atomic<uint32_t> nextJob = 0;
+    std::mutex mutex;
+    std::condition_variable resultReady;
+    std::vector<Result> results;
+
+    // Workers only decode. Everything that touches the device stays on this thread, which uploads each image while
+    // the workers carry on with the next ones.
+    auto work = [&]() {
+        for (uint32_t i = nextJob++; i < count(mJobs); i = nextJob++) {
+            Job& job = mJobs[i];
+
+            Result result = {.jobIndex = i};
+            if (job.fileData.empty() && !readFile(job.path, job.fileData)) {
+                job.fileData.clear();
+            }
+            if (!job.fileData.empty()) {
+                result.mipChain = prepare(job, encodeThreadCount);
+            }
+
+            // The encoded file is not needed anymore, and a large batch would otherwise keep all of them in memory
+            std::vector<uint8_t>().swap(job.fileData);
+
+            {
+                std::lock_guard lock(mutex);
+                results.push_back(std::move(result));
+            }
+            resultReady.notify_one();
+        }
+    };
+
+    std::vector<std::thread> workers;
+    for (uint32_t i = 0; i < workerCount; i++) {
+        workers.emplace_back(work);
+    }
+
+    for (uint32_t completed = 0; completed < count(mJobs);) {
+        std::vector<Result> ready;
+        {
+            std::unique_lock lock(mutex);
+            resultReady.wait(lock, [&]() { return !results.empty(); });
+            std::swap(ready, results);
+        }
+
+        for (auto& result : ready) {
+            onPrepared(mJobs[result.jobIndex], std::move(result.mipChain));
+            completed += 1;
+        }
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+
+    mJobs.clear();
+    mQueuedKeys.clear();
+}
+
+std::optional<MipChain> TextureLoader::prepare(Job& job, uint32_t encodeThreadCount) const
+{
+    if (!preparesMipChain(job)) {
+        std::optional<DecodedImage> image = decode(job.fileData.data(), job.fileData.size(), job.format);
+        if (!image) {
+            return std::nullopt;
+        }
+
+        MipChain mipChain = {.format = job.format, .width = image->width, .height = image->height};
+        mipChain.levels.push_back(std::move(image->data));
+        return mipChain;
+    }
+
+    // Textures that have to be made on the host are filtered as asked, or with a box if nothing was asked for
+    MipGenerationDesc mipGeneration = job.mipGeneration.value_or(MipGenerationDesc{});
+    mipGeneration.threadCount = encodeThreadCount;
+
+    // Everything but the shared-exponent format is worth caching, since packing it is as fast as reading it back
+    const bool cached = job.format != VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+
+    // The key covers the source itself and everything that decides what is made from it
+    const uint32_t settings[] = {
+        kPreparationVersion,
+        static_cast<uint32_t>(job.compression),
+        job.mipmaps,
+        static_cast<uint32_t>(job.format),
+        static_cast<uint32_t>(mipGeneration.filter),
+        mipGeneration.sRGB,
+        mipGeneration.preserveAlphaCoverage,
+        static_cast<uint32_t>(mipGeneration.alphaReference * 65535.0f),
+    };
+    uint64_t key = TextureCache::hash(job.fileData.data(), job.fileData.size());
+    key = TextureCache::hash(settings, sizeof(settings), key);
+
+    if (cached && mpCache) {
+        if (auto mipChain = mpCache->load(key)) {
+            return mipChain;
+        }
+    }
+
+    std::optional<MipChain> mipChain;
+    if (job.format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 || job.format == VK_FORMAT_BC6H_UFLOAT_BLOCK) {
+        std::optional<DecodedImage> image =
+            decode(job.fileData.data(), job.fileData.size(), VK_FORMAT_R32G32B32A32_SFLOAT);
+        if (!image) {
+            return std::nullopt;
+        }
+
+        mipChain = createHDRMipChain(reinterpret_cast<const float*>(image->data.data()), image->width, image->height,
+                                     job.format, job.mipmaps, mipGeneration);
+    } else {
+        std::optional<DecodedImage> image = decode(job.fileData.data(), job.fileData.size(), job.format);
+        if (!image) {
+            return std::nullopt;
+        }
+
+        mipChain = {.format = job.format, .width = image->width, .height = image->height};
+        if (job.mipmaps) {
+            const uint8_t* pPixels = reinterpret_cast<const uint8_t*>(image->data.data());
+            mipChain->levels = MipGenerator::generate(pPixels, image->width, image->height, mipGeneration);
+        } else {
+            mipChain->levels.push_back(std::move(image->data));
+        }
+
+        // The device cannot blit into compressed images, which is why their levels are made here before encoding
+        if (job.compression != TextureCompression::None) {
+            mipChain->format = BlockCompression::getFormat(job.compression);
+            for (uint32_t i = 0; i < count(mipChain->levels); i++) {
+                const uint8_t* pLevel = reinterpret_cast<const uint8_t*>(mipChain->levels[i].data());
+                mipChain->levels[i] =
+                    BlockCompression::encode(job.compression, pLevel, std::max(image->width >> i, 1u),
+                                             std::max(image->height >> i, 1u), encodeThreadCount);
+            }
+        }
+    }
+
+    if (cached && mpCache) {
+        mpCache->store(key, *mipChain);
+    }
+
+    return mipChain;
+}
+
+bool TextureLoader::preparesMipChain(const Job& job)
+{
+    if (job.compression != TextureCompression::None || job.format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 ||
+        job.format == VK_FORMAT_BC6H_UFLOAT_BLOCK) {
+        return true;
+    }
+    return job.mipmaps && job.mipGeneration && job.format == VK_FORMAT_R8G8B8A8_UNORM;
+}
+
+MipChain TextureLoader::createHDRMipChain(const float* pRGBA, uint32_t width, uint32_t height, VkFormat format,
+                                          bool mipmaps, const MipGenerationDesc& mipGeneration)
+{
+    std::vector<std::vector<float>> levels;
+    if (mipmaps) {
+        levels = MipGenerator::generate(pRGBA, width, height, mipGeneration);
+    } else {
+        levels.emplace_back(pRGBA, pRGBA + static_cast<size_t>(width) * height * 4);
+    }
+
+    MipChain mipChain = {.format = format, .width = width, .height = height};
+    for (uint32_t i = 0; i < count(levels); i++) {
+        const uint32_t levelWidth = std::max(width >> i, 1u);
+        const uint32_t levelHeight = std::max(height >> i, 1u);
+        if (format == VK_FORMAT_BC6H_UFLOAT_BLOCK) {
+            mipChain.levels.push_back(
+                BlockCompression::encodeBC6H(levels[i].data(), levelWidth, levelHeight, mipGeneration.threadCount));
+        } else {
+            mipChain.levels.push_back(
+                packSharedExponent(levels[i].data(), static_cast<size_t>(levelWidth) * levelHeight));
+        }
+    }
+
+    return mipChain;
+}
+
+std::optional<DecodedImage> TextureLoader::decode(const uint8_t* pFileData, size_t size, VkFormat format)
+{
+    // The thread-local setting, so that decoding on several threads does not depend on a shared flag
+    stbi_set_flip_vertically_on_load_thread(1);
+
+    int width, height, channels;
+    DecodedImage image;
+
+    // A floating-point target format selects the floating-point loader, which preserves the full dynamic range of
+    // HDR files and converts LDR files from sRGB to linear
+    const bool halfFloat = format == VK_FORMAT_R16G16B16A16_SFLOAT;
+    const bool fullFloat = format == VK_FORMAT_R32G32B32A32_SFLOAT;
+    const bool sharedExponent = format == VK_FORMAT_E5B9G9R9_UFLOAT_PACK32;
+
+    if (halfFloat || fullFloat || sharedExponent) {
+        float* pData = stbi_loadf_from_memory(pFileData, static_cast<int>(size), &width, &height, &channels,
+                                              STBI_rgb_alpha);
+        if (!pData) {
+            return std::nullopt;
+        }
+
+        const size_t valueCount = static_cast<size_t>(width) * height * STBI_rgb_alpha;
+        if (halfFloat) {
+            image.bytesPerPixel = sizeof(uint16_t) * STBI_rgb_alpha;
+            image.data.resize(sizeof(uint16_t) * valueCount);
+            HalfFloat::pack(pData, reinterpret_cast<uint16_t*>(image.data.data()), valueCount);
+        } else if (sharedExponent) {
+            image.bytesPerPixel = sizeof(uint32_t);
+            image.data = packSharedExponent(pData, valueCount / STBI_rgb_alpha);
+        } else {
+            image.bytesPerPixel = sizeof(float) * STBI_rgb_alpha;
+            image.data.resize(sizeof(float) * valueCount);
+            std::memcpy(image.data.data(), pData, image.data.size());
+        }
+
+        stbi_image_free(pData);
+    } else {
+        stbi_uc* pData =
+            stbi_load_from_memory(pFileData, static_cast<int>(size), &width, &height, &channels, STBI_rgb_alpha);
+        if (!pData) {
+            return std::nullopt;
+        }
+
+        image.bytesPerPixel = sizeof(stbi_uc) * STBI_rgb_alpha;
+        image.data.resize(static_cast<size_t>(width) * height * image.bytesPerPixel);
+        std::memcpy(image.data.data(), pData, image.data.size());
+
+        stbi_image_free(pData);
+    }
+
+    image.width = width;
+    image.height = height;
+
+    return image;
+}
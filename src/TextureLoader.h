@@ -0,0 +1,188 @@
+#pragma once
+
+#include "Common.h"
+
+#include "BlockCompression.h"
+#include "Device.h"
+#include "MipGenerator.h"
+#include "Texture.h"
+#include "TextureCache.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Pixels of a decoded image, laid out row by row with the first row at the bottom as Vulkan expects.
+    /// </summary>
+    struct DecodedImage {
+        std::vector<std::byte> data;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t bytesPerPixel = 0;
+    };
+
+    /// <summary>
+    /// Loads many 2D textures at once. Images are decoded on a pool of worker threads, while the thread that called
+    /// load() uploads each one to the device as soon as it has been decoded. A batch of textures therefore takes
+    /// roughly the total decode time divided by the number of cores, plus the uploads.
+    ///
+    /// Textures are queued with addFile() or addMemory(), each under a key that is passed back once the texture is
+    /// ready. Queueing the same key twice decodes it once.
+    ///
+    /// Textures can be block compressed on the way, which needs every mip level to be made on the CPU since the
+    /// device cannot blit into compressed images. Uncompressed textures can have their levels made there too, with a
+    /// better filter than the device's blits. With a cache set, levels made on the CPU are stored after the first
+    /// load and later loads upload them directly without decoding the source at all.
+    /// </summary>
+    class TextureLoader
+    {
+    public:
+        MANDRILL_NON_COPYABLE(TextureLoader)
+
+        /// <summary>
+        /// Create a new texture loader.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="threadCount">Number of worker threads, 0 to use one per core</param>
+        MANDRILL_API TextureLoader(ptr<Device> pDevice, uint32_t threadCount = 0);
+
+        /// <summary>
+        /// Destructor for texture loader.
+        /// </summary>
+        MANDRILL_API ~TextureLoader();
+
+        /// <summary>
+        /// Queue a texture to be read from a file.
+        /// </summary>
+        /// <param name="key">Key to report the texture under</param>
+        /// <param name="path">Path to texture file</param>
+        /// <param name="format">Format to use, where a floating-point format keeps the dynamic range of HDR
+        /// files. VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 and VK_FORMAT_BC6H_UFLOAT_BLOCK keep it at a quarter and a sixteenth
+        /// of the size of VK_FORMAT_R32G32B32A32_SFLOAT.</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        /// <param name="compression">Block compression to encode 8-bit textures with</param>
+        /// <param name="mipGeneration">How to make mip levels on the host, or nothing to have the device make them.
+        /// Levels made on the host are stored in the cache. Only 8-bit textures can choose, others are made where
+        /// they have to be.</param>
+        MANDRILL_API void addFile(const std::string& key, const std::filesystem::path& path, VkFormat format,
+                                  bool mipmaps = false, TextureCompression compression = TextureCompression::None,
+                                  std::optional<MipGenerationDesc> mipGeneration = std::nullopt);
+
+        /// <summary>
+        /// Queue a texture to be decoded from an encoded image in memory, such as one embedded in a glTF file.
+        /// </summary>
+        /// <param name="key">Key to report the texture under</param>
+        /// <param name="fileData">Contents of the image file, which the loader takes over</param>
+        /// <param name="format">Format to use, where a floating-point format keeps the dynamic range of HDR
+        /// files. VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 and VK_FORMAT_BC6H_UFLOAT_BLOCK keep it at a quarter and a sixteenth
+        /// of the size of VK_FORMAT_R32G32B32A32_SFLOAT.</param>
+        /// <param name="mipmaps">Whether to use mipmaps or not</param>
+        /// <param name="compression">Block compression to encode 8-bit textures with</param>
+        /// <param name="mipGeneration">How to make mip levels on the host, or nothing to have the device make them.
+        /// Levels made on the host are stored in the cache. Only 8-bit textures can choose, others are made where
+        /// they have to be.</param>
+        MANDRILL_API void addMemory(const std::string& key, std::vector<uint8_t> fileData, VkFormat format,
+                                    bool mipmaps = false, TextureCompression compression = TextureCompression::None,
+                                    std::optional<MipGenerationDesc> mipGeneration = std::nullopt);
+
+        /// <summary>
+        /// Decode and upload all queued textures, and empty the queue. Returns once every texture is on the device.
+        /// </summary>
+        /// <param name="onLoaded">Called on the calling thread for each texture as it completes, in the order they
+        /// finish decoding. The texture is nullptr if the image could not be decoded.</param>
+        MANDRILL_API void load(const std::function<void(const std::string& key, ptr<Texture> pTexture)>& onLoaded);
+
+        /// <summary>
+        /// Decode all queued textures into mip chains on the host without uploading them, and empty the queue. Used
+        /// by the TextureStreamer, which keeps the chains and uploads levels as they are needed. Levels that the
+        /// device would otherwise make are made on the host, with a box filter unless another was asked for.
+        /// </summary>
+        /// <param name="onLoaded">Called on the calling thread for each texture as it completes, in the order they
+        /// finish decoding. The mip chain is empty if the image could not be decoded.</param>
+        MANDRILL_API void loadMipChains(
+            const std::function<void(const std::string& key, std::optional<MipChain> mipChain)>& onLoaded);
+
+        /// <summary>
+        /// Set the cache to keep compressed textures in between runs.
+        /// </summary>
+        /// <param name="pCache">Cache to use, or nullptr to compress every time</param>
+        MANDRILL_API void setCache(ptr<TextureCache> pCache)
+        {
+            mpCache = pCache;
+        }
+
+        /// <summary>
+        /// Check whether a key has been queued and not loaded yet.
+        /// </summary>
+        /// <param name="key">Key to look for</param>
+        /// <returns>True if the key is queued</returns>
+        MANDRILL_API bool isQueued(const std::string& key) const
+        {
+            return mQueuedKeys.contains(key);
+        }
+
+        /// <summary>
+        /// Get the number of queued textures.
+        /// </summary>
+        /// <returns>Number of textures</returns>
+        MANDRILL_API uint32_t getQueuedCount() const
+        {
+            return count(mJobs);
+        }
+
+        /// <summary>
+        /// Decode an image file into pixels with four channels. Safe to call from several threads at once.
+        /// </summary>
+        /// <param name="pFileData">Contents of the image file</param>
+        /// <param name="size">Size of the contents in bytes</param>
+        /// <param name="format">Format the pixels are meant for, which decides between 8-bit, half-float, float and
+        /// shared-exponent texels</param>
+        /// <returns>The decoded image, or nothing if the data could not be decoded</returns>
+        MANDRILL_API static std::optional<DecodedImage> decode(const uint8_t* pFileData, size_t size, VkFormat format);
+
+        /// <summary>
+        /// Make the mip levels of an HDR image in a format that the device cannot make them for by blitting.
+        /// </summary>
+        /// <param name="pRGBA">Texels of the first level, four floats each and row by row</param>
+        /// <param name="width">Width of the image in texels</param>
+        /// <param name="height">Height of the image in texels</param>
+        /// <param name="format">Either VK_FORMAT_E5B9G9R9_UFLOAT_PACK32 or VK_FORMAT_BC6H_UFLOAT_BLOCK</param>
+        /// <param name="mipmaps">Whether to make every mip level or only the first</param>
+        /// <param name="mipGeneration">How to make the levels, whose thread count BC6H is also encoded with</param>
+        /// <returns>The mip chain</returns>
+        MANDRILL_API static MipChain createHDRMipChain(const float* pRGBA, uint32_t width, uint32_t height,
+                                                       VkFormat format, bool mipmaps,
+                                                       const MipGenerationDesc& mipGeneration = {});
+
+    private:
+        struct Job {
+            std::string key;
+            std::filesystem::path path; // Read by the worker if there is no file data
+            std::vector<uint8_t> fileData;
+            VkFormat format;
+            bool mipmaps;
+            TextureCompression compression;
+            std::optional<MipGenerationDesc> mipGeneration;
+        };
+
+        // Either the first level only, for the device to make the other mip levels from, or all of them
+        struct Result {
+            uint32_t jobIndex;
+            std::optional<MipChain> mipChain;
+        };
+
+        // Prepare every queued job on the worker threads, and hand each result to the calling thread
+        void run(const std::function<void(const Job& job, std::optional<MipChain> mipChain)>& onPrepared);
+
+        std::optional<MipChain> prepare(Job& job, uint32_t encodeThreadCount) const;
+
+        // Whether the job makes all mip levels itself, for formats that the device cannot blit into
+        static bool preparesMipChain(const Job& job);
+
+        ptr<Device> mpDevice;
+        ptr<TextureCache> mpCache;
+        uint32_t mThreadCount;
+
+        std::vector<Job> mJobs;
+        std::set<std::string> mQueuedKeys;
+    };
+} // namespace Mandrill
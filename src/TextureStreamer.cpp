@@ -0,0 +1,372 @@
+#include "TextureStreamer.h"
+
+#include "Helpers.h"
+#include "Image.h"
+#include "Log.h"
+
+using namespace Mandrill;
+
+namespace
+{
+    // Levels are placed on 16-byte boundaries in the staging buffers, which is a whole number of texels or blocks in
+    // every format the loader makes
+    constexpr VkDeviceSize kLevelAlignment = 16;
+
+    // Replaced textures and descriptors are let go this many at a time, to only walk the retirees now and then
+    constexpr size_t kRetireeBatchSize = 32;
+} // namespace
+
+TextureStreamer::TextureStreamer(ptr<Device> pDevice, const TextureStreamingDesc& desc)
+    : mpDevice(pDevice), mDesc(desc)
+{
+    mDesc.maxUploadsPerFrame = std::max(mDesc.maxUploadsPerFrame, 1u);
+
+    for (uint32_t i = 0; i < std::max(mDesc.threadCount, 1u); i++) {
+        mWorkers.emplace_back(&TextureStreamer::work, this);
+    }
+}
+
+TextureStreamer::~TextureStreamer()
+{
+    {
+        std::lock_guard lock(mMutex);
+        mStopping = true;
+    }
+    mJobReady.notify_all();
+
+    for (auto& worker : mWorkers) {
+        worker.join();
+    }
+}
+
+ptr<Texture> TextureStreamer::add(const std::string& key, MipChain mipChain)
+{
+    if (mipChain.levels.empty()) {
+        Log::Error("TextureStreamer: Texture {} has no levels", key);
+        return nullptr;
+    }
+
+    auto it = mEntries.find(key);
+    if (it != mEntries.end()) {
+        return it->second.pTexture;
+    }
+
+    Entry entry;
+    const uint32_t levelCount = count(mipChain.levels);
+    while (entry.tailLevel + 1 < levelCount &&
+           std::max(mipChain.width >> entry.tailLevel, mipChain.height >> entry.tailLevel) > mDesc.tailSize) {
+        entry.tailLevel += 1;
+    }
+
+    MipChain tail = {
+        .format = mipChain.format,
+        .width = std::max(mipChain.width >> entry.tailLevel, 1u),
+        .height = std::max(mipChain.height >> entry.tailLevel, 1u),
+    };
+    tail.levels.assign(mipChain.levels.begin() + entry.tailLevel, mipChain.levels.end());
+
+    entry.mipChain = std::move(mipChain);
+    entry.pTail = mpDevice->createTextureFromMipChain(tail);
+    entry.pTexture = entry.pTail;
+    entry.residentLevel = entry.tailLevel;
+    entry.requestedLevel = entry.tailLevel;
+
+    return mEntries.emplace(key, std::move(entry)).first->second.pTexture;
+}
+
+void TextureStreamer::request(const std::string& key, uint32_t level)
+{
+    auto it = mEntries.find(key);
+    if (it == mEntries.end()) {
+        return;
+    }
+
+    Entry& entry = it->second;
+    entry.requestedLevel = std::min(entry.requestedLevel, level);
+    entry.lastRequestedFrame = mpDevice->getFrameNumber();
+}
+
+std::vector<std::string> TextureStreamer::update(VkCommandBuffer cmd)
+{
+    std::vector<std::string> changed;
+
+    // Textures that are furthest from what was asked for are staged first
+    std::vector<std::pair<const std::string*, Entry*>> wanted;
+    for (auto& [key, entry] : mEntries) {
+        if (!entry.staging && entry.requestedLevel < entry.residentLevel) {
+            wanted.emplace_back(&key, &entry);
+        }
+    }
+    std::sort(wanted.begin(), wanted.end(), [](const auto& a, const auto& b) {
+        return a.second->residentLevel - a.second->requestedLevel > b.second->residentLevel - b.second->requestedLevel;
+    });
+
+    // Staging runs at most two frames of uploads ahead, so that the requests it works from stay recent
+    bool queued = false;
+    for (auto& [pKey, pEntry] : wanted) {
+        if (mStagingCount >= 2 * mDesc.maxUploadsPerFrame) {
+            break;
+        }
+
+        // A texture gets at most half the budget, so that it can replace the one it had while that is still in use
+        uint32_t level = pEntry->requestedLevel;
+        while (level < pEntry->tailLevel && getStreamedSize(*pEntry, level) > mDesc.memoryBudget / 2) {
+            level += 1;
+        }
+        if (level >= pEntry->residentLevel) {
+            continue;
+        }
+
+        pEntry->staging = true;
+        mStagingCount += 1;
+        queued = true;
+
+        std::lock_guard lock(mMutex);
+        mJobs.push_back({.key = *pKey, .pMipChain = &pEntry->mipChain, .firstLevel = level});
+    }
+    if (queued) {
+        mJobReady.notify_all();
+    }
+
+    for (uint32_t uploads = 0; uploads < mDesc.maxUploadsPerFrame;) {
+        StagingJob job;
+        {
+            std::lock_guard lock(mMutex);
+            if (mStaged.empty()) {
+                break;
+            }
+            job = std::move(mStaged.front());
+            mStaged.pop_front();
+        }
+
+        Entry& entry = mEntries.at(job.key);
+        if (job.firstLevel < entry.residentLevel) {
+            // Memory given back by evictions only becomes free once the device has finished with it, so a texture
+            // that does not fit yet waits for a later frame
+            if (!makeRoom(getStreamedSize(entry, job.firstLevel), entry, changed)) {
+                std::lock_guard lock(mMutex);
+                mStaged.push_front(std::move(job));
+                break;
+            }
+
+            install(cmd, entry, job);
+            changed.push_back(job.key);
+            uploads += 1;
+        }
+
+        entry.staging = false;
+        mStagingCount -= 1;
+    }
+
+    // Requests only hold for the frame they were made in
+    for (auto& [key, entry] : mEntries) {
+        entry.requestedLevel = entry.tailLevel;
+    }
+
+    if (mRetirees.size() >= kRetireeBatchSize) {
+        releaseRetirees();
+    }
+
+    return changed;
+}
+
+void TextureStreamer::retire(ptr<Descriptor> pDescriptor)
+{
+    // Whoever drops the last reference, it is dropped no earlier than when the retiree is released
+    pDescriptor->setWaitOnDestroy(false);
+    mRetirees.push_back({.frameNumber = mpDevice->getFrameNumber(), .pObject = std::move(pDescriptor), .size = 0});
+}
+
+void TextureStreamer::retire(ptr<Buffer> pBuffer)
+{
+    pBuffer->setWaitOnDestroy(false);
+    mRetirees.push_back({.frameNumber = mpDevice->getFrameNumber(), .pObject = std::move(pBuffer), .size = 0});
+}
+
+ptr<Texture> TextureStreamer::getTexture(const std::string& key) const
+{
+    auto it = mEntries.find(key);
+    return it != mEntries.end() ? it->second.pTexture : nullptr;
+}
+
+uint32_t TextureStreamer::getResidentLevel(const std::string& key) const
+{
+    auto it = mEntries.find(key);
+    return it != mEntries.end() ? it->second.residentLevel : 0;
+}
+
+uint32_t TextureStreamer::getLevelCount(const std::string& key) const
+{
+    auto it = mEntries.find(key);
+    return it != mEntries.end() ? count(it->second.mipChain.levels) : 0;
+}
+
+void TextureStreamer::work()
+{
+    while (true) {
+        StagingJob job;
+        {
+            std::unique_lock lock(mMutex);
+            mJobReady.wait(lock, [this]() { return mStopping || !mJobs.empty(); });
+            if (mStopping) {
+                return;
+            }
+            job = std::move(mJobs.front());
+            mJobs.pop_front();
+        }
+
+        stage(job);
+
+        std::lock_guard lock(mMutex);
+        mStaged.push_back(std::move(job));
+    }
+}
+
+void TextureStreamer::stage(StagingJob& job) const
+{
+    const MipChain& mipChain = *job.pMipChain;
+    const uint32_t levelCount = count(mipChain.levels);
+
+    VkDeviceSize size = 0;
+    for (uint32_t i = job.firstLevel; i < levelCount; i++) {
+        size = Helpers::alignTo(size, kLevelAlignment) + mipChain.levels[i].size();
+    }
+
+    // Creating and filling a buffer needs no queue, so the workers can do it while the main thread records
+    job.pStaging = make_ptr<Buffer>(mpDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+    std::byte* pStaging = static_cast<std::byte*>(job.pStaging->getHostMap());
+    VkDeviceSize offset = 0;
+    for (uint32_t i = job.firstLevel; i < levelCount; i++) {
+        offset = Helpers::alignTo(offset, kLevelAlignment);
+        std::memcpy(pStaging + offset, mipChain.levels[i].data(), mipChain.levels[i].size());
+
+        job.regions.push_back({
+            .bufferOffset = offset,
+            .imageSubresource =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = i - job.firstLevel,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+            .imageExtent = {std::max(mipChain.width >> i, 1u), std::max(mipChain.height >> i, 1u), 1},
+        });
+
+        offset += mipChain.levels[i].size();
+    }
+}
+
+void TextureStreamer::install(VkCommandBuffer cmd, Entry& entry, StagingJob& job)
+{
+    const MipChain& mipChain = entry.mipChain;
+    const uint32_t levelCount = count(mipChain.levels) - job.firstLevel;
+
+    ptr<Image> pImage = make_ptr<Image>(
+        mpDevice, std::max(mipChain.width >> job.firstLevel, 1u), std::max(mipChain.height >> job.firstLevel, 1u), 1,
+        levelCount, VK_SAMPLE_COUNT_1_BIT, mipChain.format, VK_IMAGE_TILING_OPTIMAL,
+        VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        VK_IMAGE_TYPE_2D);
+
+    VkImageSubresourceRange subresourceRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = levelCount,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &subresourceRange);
+
+    vkCmdCopyBufferToImage(cmd, job.pStaging->getBuffer(), pImage->getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           count(job.regions), job.regions.data());
+
+    // Streamed textures are sampled by rasterization and ray-tracing shaders alike
+    Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_SHADER_READ_BIT,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                          &subresourceRange);
+
+    pImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+    // The texture it had may still be in use by earlier frames, and the staging buffer is read by this one
+    if (entry.pTexture != entry.pTail) {
+        evict(entry);
+    }
+    retire(job.pStaging);
+
+    entry.pTexture = make_ptr<Texture>(mpDevice, pImage);
+    entry.residentLevel = job.firstLevel;
+    mResidentSize += getStreamedSize(entry, job.firstLevel);
+}
+
+void TextureStreamer::evict(Entry& entry)
+{
+    const VkDeviceSize size = getStreamedSize(entry, entry.residentLevel);
+    mResidentSize -= size;
+    mRetiredSize += size;
+
+    // The streamer made the image, so no one else keeps it alive past the retiree
+    entry.pTexture->getImage()->setWaitOnDestroy(false);
+    mRetirees.push_back({.frameNumber = mpDevice->getFrameNumber(), .pObject = entry.pTexture, .size = size});
+
+    entry.pTexture = entry.pTail;
+    entry.residentLevel = entry.tailLevel;
+}
+
+bool TextureStreamer::makeRoom(VkDeviceSize size, const Entry& keep, std::vector<std::string>& changed)
+{
+    const uint64_t frameNumber = mpDevice->getFrameNumber();
+
+    // Textures that were asked for this frame are in use and stay, the others go back to their tails in the order
+    // they were last asked for
+    while (mResidentSize + size > mDesc.memoryBudget) {
+        auto victim = mEntries.end();
+        for (auto it = mEntries.begin(); it != mEntries.end(); it++) {
+            const Entry& entry = it->second;
+            if (&entry == &keep || entry.pTexture == entry.pTail || entry.lastRequestedFrame >= frameNumber) {
+                continue;
+            }
+            if (victim == mEntries.end() || entry.lastRequestedFrame < victim->second.lastRequestedFrame) {
+                victim = it;
+            }
+        }
+
+        if (victim == mEntries.end()) {
+            return false;
+        }
+
+        evict(victim->second);
+        changed.push_back(victim->first);
+    }
+
+    // Only retirees of frames the device has already finished are reclaimed, so this never waits
+    if (mResidentSize + mRetiredSize + size > mDesc.memoryBudget) {
+        releaseRetirees();
+    }
+
+    return mResidentSize + mRetiredSize + size <= mDesc.memoryBudget;
+}
+
+void TextureStreamer::releaseRetirees()
+{
+    // Retirees are kept in the order they were retired, so the ones the device has finished with are at the front.
+    // They were told not to wait for the device to be idle when they are destroyed, so releasing them never stalls.
+    const uint64_t completedFrameNumber = mpDevice->getCompletedFrameNumber();
+    while (!mRetirees.empty() && mRetirees.front().frameNumber <= completedFrameNumber) {
+        mRetiredSize -= mRetirees.front().size;
+        mRetirees.pop_front();
+    }
+}
+
+VkDeviceSize TextureStreamer::getStreamedSize(const Entry& entry, uint32_t firstLevel)
+{
+    VkDeviceSize size = 0;
+    for (uint32_t i = firstLevel; i < entry.tailLevel; i++) {
+        size += entry.mipChain.levels[i].size();
+    }
+    return size;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "Descriptor.h"
+#include "Device.h"
+#include "Texture.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Settings for streaming textures.
+    /// </summary>
+    struct TextureStreamingDesc {
+        // Device memory that the streamed levels of all textures may take up together, not counting their tails
+        VkDeviceSize memoryBudget = 512ull << 20;
+
+        // Levels this many texels on a side or smaller make up the tail of a texture, which is uploaded when the
+        // texture is added and is never evicted
+        uint32_t tailSize = 64;
+
+        // Most textures to swap for ones with more levels per frame, which bounds the upload traffic of a frame
+        uint32_t maxUploadsPerFrame = 4;
+
+        // Number of worker threads that copy levels into staging buffers
+        uint32_t threadCount = 2;
+    };
+
+    /// <summary>
+    /// Keeps the mip chains of many textures on the host and only the levels that are asked for on the device, within
+    /// a memory budget.
+    ///
+    /// Every texture starts out with its tail, the smallest levels, which stays resident. Levels are asked for with
+    /// request(), and update() then stages the finer levels on worker threads and records their upload into the
+    /// frame's command buffer. A texture with more levels is a new texture that replaces the old one, so the caller
+    /// rebinds the textures that update() reports, typically through the descriptors the shaders allocate anew for
+    /// every change. Nothing waits for the device to do this.
+    ///
+    /// When the budget would be exceeded, the textures that have gone unrequested for the longest fall back to their
+    /// tails. Replaced textures are kept until the device has finished the frame that last used them, and are then
+    /// released in batches.
+    /// </summary>
+    class TextureStreamer
+    {
+    public:
+        MANDRILL_NON_COPYABLE(TextureStreamer)
+
+        /// <summary>
+        /// Create a new texture streamer.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="desc">How to stream the textures</param>
+        MANDRILL_API TextureStreamer(ptr<Device> pDevice, const TextureStreamingDesc& desc = {});
+
+        /// <summary>
+        /// Destructor for texture streamer.
+        /// </summary>
+        MANDRILL_API ~TextureStreamer();
+
+        /// <summary>
+        /// Add a texture and upload its tail.
+        /// </summary>
+        /// <param name="key">Key to request the texture by</param>
+        /// <param name="mipChain">Every level of the texture, which the streamer keeps on the host</param>
+        /// <returns>Texture to bind until update() reports a new one</returns>
+        MANDRILL_API ptr<Texture> add(const std::string& key, MipChain mipChain);
+
+        /// <summary>
+        /// Ask for a texture to have its levels from a given one resident. Requests are gathered until the next
+        /// update(), where the finest one counts. Unknown keys are ignored.
+        /// </summary>
+        /// <param name="key">Key of the texture</param>
+        /// <param name="level">Finest level needed</param>
+        MANDRILL_API void request(const std::string& key, uint32_t level);
+
+        /// <summary>
+        /// Stage and upload the levels that were requested, and evict textures to stay within the budget. Call once
+        /// per frame outside of a render pass, before the textures are bound.
+        /// </summary>
+        /// <param name="cmd">Command buffer of the frame, which the uploads are recorded into</param>
+        /// <returns>Keys of the textures that were replaced, whose new texture getTexture() returns</returns>
+        MANDRILL_API std::vector<std::string> update(VkCommandBuffer cmd);
+
+        /// <summary>
+        /// Keep a descriptor that still refers to a replaced texture alive until the device has finished the current
+        /// frame. It must not be bound again, since it is destroyed without waiting for the device to be idle.
+        /// </summary>
+        /// <param name="pDescriptor">Descriptor to keep</param>
+        MANDRILL_API void retire(ptr<Descriptor> pDescriptor);
+
+        /// <summary>
+        /// Keep a buffer that the current frame reads alive until the device has finished it. It must not be used
+        /// again, since it is destroyed without waiting for the device to be idle.
+        /// </summary>
+        /// <param name="pBuffer">Buffer to keep</param>
+        MANDRILL_API void retire(ptr<Buffer> pBuffer);
+
+        /// <summary>
+        /// Get the texture currently bound for a key.
+        /// </summary>
+        /// <param name="key">Key of the texture</param>
+        /// <returns>Texture, or nullptr if the key is unknown</returns>
+        MANDRILL_API ptr<Texture> getTexture(const std::string& key) const;
+
+        /// <summary>
+        /// Get the finest level of a texture that is resident.
+        /// </summary>
+        /// <param name="key">Key of the texture</param>
+        /// <returns>Level, or 0 if the key is unknown</returns>
+        MANDRILL_API uint32_t getResidentLevel(const std::string& key) const;
+
+        /// <summary>
+        /// Get the number of levels in the full mip chain of a texture.
+        /// </summary>
+        /// <param name="key">Key of the texture</param>
+        /// <returns>Number of levels, or 0 if the key is unknown</returns>
+        MANDRILL_API uint32_t getLevelCount(const std::string& key) const;
+
+        /// <summary>
+        /// Get the device memory taken up by streamed levels, including textures waiting to be released.
+        /// </summary>
+        /// <returns>Size in bytes</returns>
+        MANDRILL_API VkDeviceSize getResidentSize() const
+        {
+            return mResidentSize + mRetiredSize;
+        }
+
+        /// <summary>
+        /// Get the settings the streamer was created with.
+        /// </summary>
+        /// <returns>Streaming settings</returns>
+        MANDRILL_API const TextureStreamingDesc& getDesc() const
+        {
+            return mDesc;
+        }
+
+    private:
+        struct Entry {
+            MipChain mipChain;
+            uint32_t tailLevel = 0;
+            ptr<Texture> pTail;
+            ptr<Texture> pTexture;      // The tail, or a texture that starts at residentLevel
+            uint32_t residentLevel = 0; // First level of pTexture
+            uint32_t requestedLevel = 0;
+            uint64_t lastRequestedFrame = 0;
+            bool staging = false;
+        };
+
+        // Levels from firstLevel of a texture, copied to a staging buffer by a worker
+        struct StagingJob {
+            std::string key;
+            const MipChain* pMipChain = nullptr;
+            uint32_t firstLevel = 0;
+            ptr<Buffer> pStaging;
+            std::vector<VkBufferImageCopy> regions;
+        };
+
+        struct Retiree {
+            uint64_t frameNumber;
+            std::shared_ptr<void> pObject;
+            VkDeviceSize size; // Streamed levels the object holds
+        };
+
+        void work();
+        void stage(StagingJob& job) const;
+        void install(VkCommandBuffer cmd, Entry& entry, StagingJob& job);
+        void evict(Entry& entry);
+
+        // Evict and release until a texture of the given size fits, and report whether it does
+        bool makeRoom(VkDeviceSize size, const Entry& keep, std::vector<std::string>& changed);
+        void releaseRetirees();
+
+        // Device memory of the levels from firstLevel down to the tail
+        static VkDeviceSize getStreamedSize(const Entry& entry, uint32_t firstLevel);
+
+        ptr<Device> mpDevice;
+        TextureStreamingDesc mDesc;
+
+        std::unordered_map<std::string, Entry> mEntries;
+        VkDeviceSize mResidentSize = 0;
+
+        std::deque<Retiree> mRetirees;
+        VkDeviceSize mRetiredSize = 0;
+
+        std::vector<std::thread> mWorkers;
+        std::mutex mMutex;
+        std::condition_variable mJobReady;
+        std::deque<StagingJob> mJobs;   // Waiting for a worker
+        std::deque<StagingJob> mStaged; // Waiting to be uploaded
+        uint32_t mStagingCount = 0;     // Jobs handed out and not uploaded yet
+        bool mStopping = false;
+    };
+} // namespace Mandrill
@@ -0,0 +1,584 @@
+#include "VirtualTexture.h"
+
+#include "Helpers.h"
+#include "Log.h"
+#include "TextureLoader.h"
+
+#include <bit>
+
+using namespace Mandrill;
+
+namespace
+{
+    // The tile file starts with this header, after which the tiles follow level after level and row by row within a
+    // level. Every tile has the same size, so where one starts follows from its index.
+    struct TileFileHeader {
+        char magic[4];
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t tileSize;
+        uint32_t border;
+        uint32_t levelCount;
+        uint32_t format;
+    };
+
+    constexpr char kMagic[4] = {'M', 'V', 'T', 'X'};
+    constexpr uint32_t kVersion = 1;
+
+    // Tiles have four 8-bit channels, so that filtering across their borders stays exact
+    constexpr VkFormat kFormat = VK_FORMAT_R8G8B8A8_UNORM;
+    constexpr uint32_t kBytesPerTexel = 4;
+
+    // Staging ranges start on a boundary that suits both the tiles and the page table
+    constexpr VkDeviceSize kStagingAlignment = 16;
+
+    // Pages of a level that the texture actually covers, as opposed to the page table, which is rounded up
+    uint32_t getPageCount(uint32_t size, uint32_t level, uint32_t tileSize)
+    {
+        return (std::max(size >> level, 1u) + tileSize - 1) / tileSize;
+    }
+
+    // Levels down to and including the first one that fits in a single tile
+    uint32_t getLevelCount(uint32_t width, uint32_t height, uint32_t tileSize)
+    {
+        uint32_t level = 0;
+        while (std::max(width >> level, 1u) > tileSize || std::max(height >> level, 1u) > tileSize) {
+            level += 1;
+        }
+        return level + 1;
+    }
+
+    uint32_t encodeEntry(uint32_t column, uint32_t row, uint32_t level)
+    {
+        return column | (row << 12) | (level << 24);
+    }
+} // namespace
+
+VirtualTexture::VirtualTexture(ptr<Device> pDevice, const std::filesystem::path& path, const VirtualTextureDesc& desc)
+    : mpDevice(pDevice), mDesc(desc), mPath(path)
+{
+    if (mPath.is_relative()) {
+        mPath = GetExecutablePath() / mPath;
+    }
+
+    std::ifstream file(mPath, std::ios::binary);
+    TileFileHeader header = {};
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file.good() || std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 || header.version != kVersion ||
+        header.format != kFormat || header.tileSize == 0 ||
+        header.levelCount != getLevelCount(header.width, header.height, header.tileSize)) {
+        Log::Error("VirtualTexture: {} is not a tile file made by VirtualTexture::createTileFile()", mPath.string());
+        return;
+    }
+
+    mDataOffset = sizeof(header);
+    mDesc.maxUploadsPerFrame = std::max(mDesc.maxUploadsPerFrame, 1u);
+
+    const uint32_t paddedTileSize = header.tileSize + 2 * header.border;
+    mTileBytes = static_cast<VkDeviceSize>(paddedTileSize) * paddedTileSize * kBytesPerTexel;
+
+    // The page table is rounded up to a power of two, so that each of its mip levels has room for the pages of the
+    // same level of the texture
+    mInfo = {
+        .size = glm::uvec2(header.width, header.height),
+        .pageTableSize = glm::uvec2(std::bit_ceil(getPageCount(header.width, 0, header.tileSize)),
+                                    std::bit_ceil(getPageCount(header.height, 0, header.tileSize))),
+        .tileSize = header.tileSize,
+        .border = header.border,
+        .levelCount = header.levelCount,
+    };
+
+    uint32_t pageCount = 0;
+    uint32_t tileCount = 0;
+    for (uint32_t level = 0; level < mInfo.levelCount; level++) {
+        mLevelOffsets.push_back(pageCount);
+        mFileOffsets.push_back(tileCount);
+        pageCount += std::max(mInfo.pageTableSize.x >> level, 1u) * std::max(mInfo.pageTableSize.y >> level, 1u);
+        tileCount +=
+            getPageCount(mInfo.size.x, level, mInfo.tileSize) * getPageCount(mInfo.size.y, level, mInfo.tileSize);
+    }
+    mPageTable.assign(pageCount, 0);
+
+    // The cache is a grid of tiles in a single image, which has to stay within what an image can be
+    const uint32_t maxImageSize = mpDevice->getProperties().physicalDevice.limits.maxImageDimension2D;
+    mCacheTiles = std::clamp(mDesc.cacheSize, 1u, maxImageSize / paddedTileSize);
+    mInfo.cacheSize = glm::uvec2(mCacheTiles * paddedTileSize);
+    mSlots.resize(mCacheTiles * mCacheTiles);
+
+    mpCacheImage = make_ptr<Image>(mpDevice, mInfo.cacheSize.x, mInfo.cacheSize.y, 1, 1, VK_SAMPLE_COUNT_1_BIT,
+                                   kFormat, VK_IMAGE_TILING_OPTIMAL,
+                                   VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                   VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+    mpCacheImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+    mpCache = make_ptr<Texture>(mpDevice, mpCacheImage);
+    mpCache->setAddressMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+                            VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+
+    mpPageTableImage = make_ptr<Image>(mpDevice, mInfo.pageTableSize.x, mInfo.pageTableSize.y, 1, mInfo.levelCount,
+                                       VK_SAMPLE_COUNT_1_BIT, VK_FORMAT_R32_UINT, VK_IMAGE_TILING_OPTIMAL,
+                                       VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                       VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_2D);
+    mpPageTableImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+    mpPageTable = make_ptr<Texture>(mpDevice, mpPageTableImage);
+    mpPageTable->setMagFilter(VK_FILTER_NEAREST);
+    mpPageTable->setMinFilter(VK_FILTER_NEAREST);
+    mpPageTable->setMipmapMode(VK_SAMPLER_MIPMAP_MODE_NEAREST);
+
+    mpInfo = mpDevice->createBuffer(sizeof(VirtualTextureInfo), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                                    VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    std::memcpy(mpInfo->getHostMap(), &mInfo, sizeof(VirtualTextureInfo));
+
+    const uint32_t framesInFlightCount = mpDevice->getFramesInFlightCount();
+    mpFeedback = mpDevice->createPerFrameBuffer(sizeof(uint32_t) * pageCount, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT);
+    for (uint32_t i = 0; i < framesInFlightCount; i++) {
+        std::memset(mpFeedback->at(i), 0, sizeof(uint32_t) * pageCount);
+    }
+
+    // A frame copies at most its tiles and the whole page table
+    mpStaging = mpDevice->createFrameAllocator(
+        (mTileBytes + kStagingAlignment) * mDesc.maxUploadsPerFrame + sizeof(uint32_t) * pageCount + kStagingAlignment,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT);
+
+    // The last level is the fallback for every page, so it is loaded right away and never leaves the cache
+    Tile root = {.page = getPage(mInfo.levelCount - 1, 0, 0)};
+    if (!readTile(file, root.page, root.data)) {
+        Log::Error("VirtualTexture: Failed to read the last level of {}", mPath.string());
+    }
+    mSlots[0] = {.page = root.page, .lastRequestedFrame = std::numeric_limits<uint64_t>::max()};
+    mResidentPages[root.page] = 0;
+    updatePageTable();
+
+    VkImageSubresourceRange pageTableRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = mInfo.levelCount,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    VkCommandBuffer cmd = Helpers::cmdBegin(mpDevice);
+
+    Helpers::imageBarrier(cmd, mpCacheImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    Helpers::imageBarrier(cmd, mpPageTableImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_IMAGE_LAYOUT_UNDEFINED,
+                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &pageTableRange);
+
+    if (!root.data.empty()) {
+        copyTile(cmd, root, 0);
+    }
+    copyPageTable(cmd);
+
+    Helpers::imageBarrier(cmd, mpCacheImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    Helpers::imageBarrier(cmd, mpPageTableImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, &pageTableRange);
+
+    Helpers::cmdEnd(mpDevice, cmd);
+
+    for (uint32_t i = 0; i < std::max(mDesc.threadCount, 1u); i++) {
+        mWorkers.emplace_back(&VirtualTexture::work, this);
+    }
+}
+
+VirtualTexture::~VirtualTexture()
+{
+    {
+        std::lock_guard lock(mMutex);
+        mStopping = true;
+    }
+    mTileWanted.notify_all();
+
+    for (auto& worker : mWorkers) {
+        worker.join();
+    }
+}
+
+bool VirtualTexture::createTileFile(const std::filesystem::path& source, const std::filesystem::path& destination,
+                                    uint32_t tileSize, uint32_t border, const MipGenerationDesc& mipGeneration)
+{
+    if (tileSize == 0) {
+        Log::Error("VirtualTexture: Tiles have to be at least one texel in size");
+        return false;
+    }
+
+    std::vector<uint8_t> fileData;
+    {
+        std::ifstream is(source, std::ios::binary | std::ios::ate);
+        if (!is.good()) {
+            Log::Error("VirtualTexture: Failed to open {}", source.string());
+            return false;
+        }
+        fileData.resize(static_cast<size_t>(is.tellg()));
+        is.seekg(0);
+        is.read(reinterpret_cast<char*>(fileData.data()), fileData.size());
+    }
+
+    std::optional<DecodedImage> image = TextureLoader::decode(fileData.data(), fileData.size(), kFormat);
+    if (!image) {
+        Log::Error("VirtualTexture: Failed to decode {}", source.string());
+        return false;
+    }
+    std::vector<uint8_t>().swap(fileData);
+
+    const uint32_t width = image->width;
+    const uint32_t height = image->height;
+    const uint32_t levelCount = getLevelCount(width, height, tileSize);
+
+    // The full chain goes down to 1 x 1, of which only the levels that take more than one tile, and the first that
+    // does not, are kept
+    std::vector<std::vector<std::byte>> levels =
+        MipGenerator::generate(reinterpret_cast<const uint8_t*>(image->data.data()), width, height, mipGeneration);
+    levels.resize(levelCount);
+    image.reset();
+
+    std::ofstream os(destination, std::ios::binary);
+    if (!os.good()) {
+        Log::Error("VirtualTexture: Failed to create {}", destination.string());
+        return false;
+    }
+
+    TileFileHeader header = {
+        .version = kVersion,
+        .width = width,
+        .height = height,
+        .tileSize = tileSize,
+        .border = border,
+        .levelCount = levelCount,
+        .format = kFormat,
+    };
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    // Texels past the edge of a level repeat the edge, like a sampler that clamps
+    const uint32_t paddedTileSize = tileSize + 2 * border;
+    std::vector<std::byte> tile(static_cast<size_t>(paddedTileSize) * paddedTileSize * kBytesPerTexel);
+    for (uint32_t level = 0; level < levelCount; level++) {
+        const int32_t levelWidth = static_cast<int32_t>(std::max(width >> level, 1u));
+        const int32_t levelHeight = static_cast<int32_t>(std::max(height >> level, 1u));
+        const std::byte* pLevel = levels[level].data();
+
+        for (uint32_t pageY = 0; pageY < getPageCount(height, level, tileSize); pageY++) {
+            for (uint32_t pageX = 0; pageX < getPageCount(width, level, tileSize); pageX++) {
+                for (uint32_t y = 0; y < paddedTileSize; y++) {
+                    const int32_t sy =
+                        std::clamp(static_cast<int32_t>(pageY * tileSize + y - border), 0, levelHeight - 1);
+                    for (uint32_t x = 0; x < paddedTileSize; x++) {
+                        const int32_t sx =
+                            std::clamp(static_cast<int32_t>(pageX * tileSize + x - border), 0, levelWidth - 1);
+                        std::memcpy(&tile[(static_cast<size_t>(y) * paddedTileSize + x) * kBytesPerTexel],
+                                    pLevel + (static_cast<size_t>(sy) * levelWidth + sx) * kBytesPerTexel,
+                                    kBytesPerTexel);
+                    }
+                }
+                os.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+            }
+        }
+    }
+
+    if (!os.good()) {
+        Log::Error("VirtualTexture: Failed to write {}", destination.string());
+        return false;
+    }
+
+    return true;
+}
+
+void VirtualTexture::attach(ptr<Shader> pShader) const
+{
+    if (!mpCache) {
+        return;
+    }
+
+    pShader->setResource("virtualTextureInfo", mpInfo);
+    pShader->setResource("virtualPageTable", mpPageTable);
+    pShader->setResource("virtualCache", mpCache);
+    pShader->setResource("virtualFeedback", mpFeedback);
+}
+
+void VirtualTexture::update(VkCommandBuffer cmd)
+{
+    if (!mpCache) {
+        return;
+    }
+
+    // This frame in flight's copy of the feedback was last written a full round of frames ago, and the device has
+    // to be done with that frame before the copy can be read and cleared for this one
+    const uint64_t frameNumber = mpDevice->getFrameNumber();
+    const uint32_t framesInFlightCount = mpDevice->getFramesInFlightCount();
+    if (frameNumber > framesInFlightCount) {
+        mpDevice->waitForFrame(frameNumber - framesInFlightCount);
+    }
+
+    uint32_t* pFeedback = static_cast<uint32_t*>(mpFeedback->at());
+    std::set<uint32_t> wanted;
+    for (uint32_t page = 0; page < count(mPageTable); page++) {
+        if (pFeedback[page] == 0) {
+            continue;
+        }
+
+        uint32_t level, x, y;
+        getPageLocation(page, level, x, y);
+        if (x >= getPageCount(mInfo.size.x, level, mInfo.tileSize) ||
+            y >= getPageCount(mInfo.size.y, level, mInfo.tileSize)) {
+            continue; // Outside the texture, in the part of the page table that was only there for rounding
+        }
+
+        // The coarser pages are wanted too, so that a page that is far from the cache sharpens a level at a time
+        for (; level < mInfo.levelCount; level++, x /= 2, y /= 2) {
+            const uint32_t coarser = getPage(level, x, y);
+            auto it = mResidentPages.find(coarser);
+            if (it != mResidentPages.end()) {
+                Slot& slot = mSlots[it->second];
+                slot.lastRequestedFrame = std::max(slot.lastRequestedFrame, frameNumber);
+            } else {
+                wanted.insert(coarser);
+            }
+        }
+    }
+    std::memset(pFeedback, 0, sizeof(uint32_t) * mPageTable.size());
+
+    // Coarser levels come later in the page order, and are loaded first. Only a few frames of tiles are queued, so
+    // that the queue follows the camera.
+    {
+        std::lock_guard lock(mMutex);
+        for (auto it = wanted.rbegin(); it != wanted.rend(); it++) {
+            if (mLoadingPages.size() >= 4 * mDesc.maxUploadsPerFrame) {
+                break;
+            }
+            if (mLoadingPages.insert(*it).second) {
+                mWantedPages.push_back(*it);
+            }
+        }
+    }
+    mTileWanted.notify_all();
+
+    std::vector<std::pair<uint32_t, Tile>> copies;
+    while (copies.size() < mDesc.maxUploadsPerFrame) {
+        Tile tile;
+        {
+            std::lock_guard lock(mMutex);
+            if (mLoadedTiles.empty()) {
+                break;
+            }
+            tile = std::move(mLoadedTiles.front());
+            mLoadedTiles.pop_front();
+        }
+
+        mLoadingPages.erase(tile.page);
+        if (tile.data.empty() || mResidentPages.contains(tile.page)) {
+            continue;
+        }
+
+        // With every slot wanted this frame the tile is dropped, and asked for again once there is room
+        const uint32_t slot = findSlot();
+        if (slot == UINT32_MAX) {
+            break;
+        }
+
+        if (mSlots[slot].page != UINT32_MAX) {
+            mResidentPages.erase(mSlots[slot].page);
+        }
+        mSlots[slot] = {.page = tile.page, .lastRequestedFrame = frameNumber};
+        mResidentPages[tile.page] = slot;
+
+        copies.emplace_back(slot, std::move(tile));
+    }
+
+    if (copies.empty()) {
+        return;
+    }
+
+    updatePageTable();
+
+    VkImageSubresourceRange pageTableRange = {
+        .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+        .baseMipLevel = 0,
+        .levelCount = mInfo.levelCount,
+        .baseArrayLayer = 0,
+        .layerCount = 1,
+    };
+
+    // Earlier frames may still be sampling, and the copies wait for them rather than the host waiting for the device
+    Helpers::imageBarrier(cmd, mpCacheImage->getImage(), VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    Helpers::imageBarrier(cmd, mpPageTableImage->getImage(), VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT, VK_ACCESS_2_NONE,
+                          VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          &pageTableRange);
+
+    for (const auto& [slot, tile] : copies) {
+        copyTile(cmd, tile, slot);
+    }
+    copyPageTable(cmd);
+
+    Helpers::imageBarrier(cmd, mpCacheImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    Helpers::imageBarrier(cmd, mpPageTableImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                          VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                          VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, &pageTableRange);
+}
+
+void VirtualTexture::work()
+{
+    std::ifstream file(mPath, std::ios::binary);
+
+    while (true) {
+        Tile tile;
+        {
+            std::unique_lock lock(mMutex);
+            mTileWanted.wait(lock, [this]() { return mStopping || !mWantedPages.empty(); });
+            if (mStopping) {
+                return;
+            }
+            tile.page = mWantedPages.front();
+            mWantedPages.pop_front();
+        }
+
+        if (!readTile(file, tile.page, tile.data)) {
+            Log::Error("VirtualTexture: Failed to read page {} of {}", tile.page, mPath.string());
+            tile.data.clear();
+            file.clear();
+        }
+
+        std::lock_guard lock(mMutex);
+        mLoadedTiles.push_back(std::move(tile));
+    }
+}
+
+bool VirtualTexture::readTile(std::ifstream& file, uint32_t page, std::vector<std::byte>& data) const
+{
+    uint32_t level, x, y;
+    getPageLocation(page, level, x, y);
+
+    const uint64_t tileIndex = mFileOffsets[level] + y * getPageCount(mInfo.size.x, level, mInfo.tileSize) + x;
+    file.seekg(static_cast<std::streamoff>(mDataOffset + tileIndex * mTileBytes));
+
+    data.resize(mTileBytes);
+    file.read(reinterpret_cast<char*>(data.data()), data.size());
+
+    return file.good();
+}
+
+uint32_t VirtualTexture::getPage(uint32_t level, uint32_t x, uint32_t y) const
+{
+    return mLevelOffsets[level] + y * std::max(mInfo.pageTableSize.x >> level, 1u) + x;
+}
+
+void VirtualTexture::getPageLocation(uint32_t page, uint32_t& level, uint32_t& x, uint32_t& y) const
+{
+    level = static_cast<uint32_t>(std::upper_bound(mLevelOffsets.begin(), mLevelOffsets.end(), page) -
+                                  mLevelOffsets.begin()) -
+            1;
+
+    const uint32_t rowLength = std::max(mInfo.pageTableSize.x >> level, 1u);
+    x = (page - mLevelOffsets[level]) % rowLength;
+    y = (page - mLevelOffsets[level]) / rowLength;
+}
+
+uint32_t VirtualTexture::findSlot()
+{
+    const uint64_t frameNumber = mpDevice->getFrameNumber();
+
+    uint32_t best = UINT32_MAX;
+    for (uint32_t i = 0; i < count(mSlots); i++) {
+        if (mSlots[i].page == UINT32_MAX) {
+            return i;
+        }
+        if (mSlots[i].lastRequestedFrame < frameNumber &&
+            (best == UINT32_MAX || mSlots[i].lastRequestedFrame < mSlots[best].lastRequestedFrame)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+void VirtualTexture::copyTile(VkCommandBuffer cmd, const Tile& tile, uint32_t slot)
+{
+    TransientAllocation staging = mpStaging->copyFromHost(tile.data.data(), tile.data.size(), kStagingAlignment);
+    if (!staging.pData) {
+        return;
+    }
+
+    const uint32_t paddedTileSize = mInfo.tileSize + 2 * mInfo.border;
+    VkBufferImageCopy region = {
+        .bufferOffset = staging.offset,
+        .imageSubresource =
+            {
+                .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                .mipLevel = 0,
+                .baseArrayLayer = 0,
+                .layerCount = 1,
+            },
+        .imageOffset = {static_cast<int32_t>(slot % mCacheTiles * paddedTileSize),
+                        static_cast<int32_t>(slot / mCacheTiles * paddedTileSize), 0},
+        .imageExtent = {paddedTileSize, paddedTileSize, 1},
+    };
+
+    vkCmdCopyBufferToImage(cmd, staging.buffer, mpCacheImage->getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1,
+                           &region);
+}
+
+void VirtualTexture::copyPageTable(VkCommandBuffer cmd)
+{
+    TransientAllocation staging =
+        mpStaging->copyFromHost(mPageTable.data(), sizeof(uint32_t) * mPageTable.size(), kStagingAlignment);
+    if (!staging.pData) {
+        return;
+    }
+
+    std::vector<VkBufferImageCopy> regions;
+    for (uint32_t level = 0; level < mInfo.levelCount; level++) {
+        regions.push_back({
+            .bufferOffset = staging.offset + sizeof(uint32_t) * mLevelOffsets[level],
+            .imageSubresource =
+                {
+                    .aspectMask = VK_IMAGE_ASPECT_COLOR_BIT,
+                    .mipLevel = level,
+                    .baseArrayLayer = 0,
+                    .layerCount = 1,
+                },
+            .imageExtent = {std::max(mInfo.pageTableSize.x >> level, 1u), std::max(mInfo.pageTableSize.y >> level, 1u),
+                            1},
+        });
+    }
+
+    vkCmdCopyBufferToImage(cmd, staging.buffer, mpPageTableImage->getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                           count(regions), regions.data());
+}
+
+void VirtualTexture::updatePageTable()
+{
+    const uint32_t lastLevel = mInfo.levelCount - 1;
+    const uint32_t rootEntry = encodeEntry(0, 0, lastLevel);
+
+    // From the coarsest level down, so that every page can take over the entry of the page it falls back to
+    for (uint32_t level = lastLevel + 1; level-- > 0;) {
+        const uint32_t rowLength = std::max(mInfo.pageTableSize.x >> level, 1u);
+        const uint32_t rowCount = std::max(mInfo.pageTableSize.y >> level, 1u);
+
+        for (uint32_t y = 0; y < rowCount; y++) {
+            for (uint32_t x = 0; x < rowLength; x++) {
+                const uint32_t page = getPage(level, x, y);
+                auto it = mResidentPages.find(page);
+                if (it != mResidentPages.end()) {
+                    mPageTable[page] = encodeEntry(it->second % mCacheTiles, it->second / mCacheTiles, level);
+                } else if (level < lastLevel) {
+                    mPageTable[page] = mPageTable[getPage(level + 1, x / 2, y / 2)];
+                } else {
+                    mPageTable[page] = rootEntry;
+                }
+            }
+        }
+    }
+}
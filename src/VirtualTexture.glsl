@@ -0,0 +1,92 @@
+// Sampling of a VirtualTexture. Define VIRTUAL_TEXTURE_SET and VIRTUAL_TEXTURE_BINDING before including this file,
+// which declares four resources at consecutive bindings from there, and attach them with VirtualTexture::attach().
+// Define VIRTUAL_TEXTURE_NO_DERIVATIVES as well in stages other than fragment shaders.
+//
+// A fragment shader calls sampleVirtualTexture(), which picks the level from the derivatives of the coordinates.
+// Other stages pick a level of their own and call sampleVirtualTextureLevel(). Both ask for the page they need
+// through the feedback buffer, and sample the finest level of it that is in the cache meanwhile.
+
+// Must match VirtualTextureInfo in VirtualTexture.h
+layout(std140, set = VIRTUAL_TEXTURE_SET, binding = VIRTUAL_TEXTURE_BINDING + 0) uniform VirtualTextureInfo {
+    uvec2 size;          // Size of the first level in texels
+    uvec2 cacheSize;     // Size of the physical cache in texels
+    uvec2 pageTableSize; // Size of the first level of the page table in pages
+    uint tileSize;       // Texels per side of a tile, not counting its border
+    uint border;         // Texels repeated from the neighbouring tiles on every side
+    uint levelCount;
+} virtualTextureInfo;
+
+// Cache tile column in bits 0-11, row in bits 12-23 and level in bits 24-31, per page and level
+layout(set = VIRTUAL_TEXTURE_SET, binding = VIRTUAL_TEXTURE_BINDING + 1) uniform usampler2D virtualPageTable;
+layout(set = VIRTUAL_TEXTURE_SET, binding = VIRTUAL_TEXTURE_BINDING + 2) uniform sampler2D virtualCache;
+
+// One entry per page, level after level, with one copy per frame in flight
+layout(std430, set = VIRTUAL_TEXTURE_SET, binding = VIRTUAL_TEXTURE_BINDING + 3) buffer VirtualFeedbackDynamic {
+    uint pages[];
+} virtualFeedback;
+
+uvec2 virtualTextureLevelSize(uint level)
+{
+    return max(virtualTextureInfo.size >> level, uvec2(1u));
+}
+
+// Page that covers the coordinates at a level, in the layout of that level of the page table
+uvec2 virtualTexturePageAt(vec2 uv, uint level)
+{
+    uvec2 levelSize = virtualTextureLevelSize(level);
+    uvec2 pageCount = (levelSize + virtualTextureInfo.tileSize - 1u) / virtualTextureInfo.tileSize;
+    return min(uvec2(uv * vec2(levelSize)) / virtualTextureInfo.tileSize, pageCount - 1u);
+}
+
+// Index of a page in the feedback buffer, where the pages of a level follow those of all levels before it
+uint virtualTextureFeedbackIndex(uvec2 page, uint level)
+{
+    uint offset = 0u;
+    for (uint l = 0u; l < level; l++) {
+        uvec2 rows = max(virtualTextureInfo.pageTableSize >> l, uvec2(1u));
+        offset += rows.x * rows.y;
+    }
+    return offset + page.y * max(virtualTextureInfo.pageTableSize.x >> level, 1u) + page.x;
+}
+
+#ifndef VIRTUAL_TEXTURE_NO_DERIVATIVES
+// Level that a fragment would sample with trilinear filtering, rounded, since tiles are only filtered within a level
+uint virtualTextureLevel(vec2 uv)
+{
+    vec2 texels = uv * vec2(virtualTextureInfo.size);
+    vec2 dx = dFdx(texels);
+    vec2 dy = dFdy(texels);
+    float lod = 0.5 * log2(max(max(dot(dx, dx), dot(dy, dy)), 1e-8));
+    return uint(clamp(round(lod), 0.0, float(virtualTextureInfo.levelCount - 1u)));
+}
+#endif
+
+vec4 sampleVirtualTextureLevel(vec2 uv, uint level)
+{
+    uv = clamp(uv, vec2(0.0), vec2(1.0));
+    level = min(level, virtualTextureInfo.levelCount - 1u);
+
+    uvec2 page = virtualTexturePageAt(uv, level);
+    virtualFeedback.pages[virtualTextureFeedbackIndex(page, level)] = 1u;
+
+    // A page that is not in the cache points at the closest coarser page that is
+    uint entry = texelFetch(virtualPageTable, ivec2(page), int(level)).r;
+    uvec2 tile = uvec2(entry & 0xfffu, (entry >> 12) & 0xfffu);
+    uint entryLevel = entry >> 24;
+
+    // The same coordinates in the level of the entry, relative to its page and within the border of its tile
+    vec2 texel = uv * vec2(virtualTextureLevelSize(entryLevel));
+    vec2 offset = texel - vec2(virtualTexturePageAt(uv, entryLevel) * virtualTextureInfo.tileSize);
+    offset = clamp(offset, vec2(0.0), vec2(virtualTextureInfo.tileSize));
+
+    float paddedTileSize = float(virtualTextureInfo.tileSize + 2u * virtualTextureInfo.border);
+    vec2 cacheTexel = vec2(tile) * paddedTileSize + float(virtualTextureInfo.border) + offset;
+    return textureLod(virtualCache, cacheTexel / vec2(virtualTextureInfo.cacheSize), 0.0);
+}
+
+#ifndef VIRTUAL_TEXTURE_NO_DERIVATIVES
+vec4 sampleVirtualTexture(vec2 uv)
+{
+    return sampleVirtualTextureLevel(uv, virtualTextureLevel(uv));
+}
+#endif
@@ -0,0 +1,205 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Buffer.h"
+#include "Device.h"
+#include "DynamicBuffer.h"
+#include "FrameAllocator.h"
+#include "Image.h"
+#include "MipGenerator.h"
+#include "Shader.h"
+#include "Texture.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Settings for a virtual texture.
+    /// </summary>
+    struct VirtualTextureDesc {
+        // Tiles per side of the physical cache, lowered if the cache would be larger than an image can be
+        uint32_t cacheSize = 32;
+
+        // Most tiles to copy into the cache per frame
+        uint32_t maxUploadsPerFrame = 16;
+
+        // Number of worker threads that read tiles from the file
+        uint32_t threadCount = 2;
+    };
+
+    /// <summary>
+    /// Parameters that shaders need to look up a virtual texture, laid out for a uniform block.
+    /// </summary>
+    struct VirtualTextureInfo {
+        glm::uvec2 size;          // Size of the first level in texels
+        glm::uvec2 cacheSize;     // Size of the physical cache in texels
+        glm::uvec2 pageTableSize; // Size of the first level of the page table in pages
+        uint32_t tileSize;        // Texels per side of a tile, not counting its border
+        uint32_t border;          // Texels repeated from the neighbouring tiles on every side
+        uint32_t levelCount;      // Number of levels, the last of which fits in a single tile
+    };
+
+    /// <summary>
+    /// Texture that can be far larger than an image can be, or than the device has memory for. It is split into
+    /// tiles at every mip level, and only the tiles that shaders ask for are kept in a physical cache texture. A page
+    /// table texture with one texel per tile, and one mip level per level of the virtual texture, tells shaders where
+    /// in the cache each tile is. Tiles that are not in the cache point to the closest coarser tile that is, and the
+    /// last level is always there. Everything is done with ordinary images, so it needs no sparse binding support.
+    ///
+    /// Tiles are read from a file made by createTileFile(), on worker threads. Shaders write the tiles they want into
+    /// a feedback buffer, which update() reads back one round of frames later, when the device is done with it.
+    ///
+    /// Attach the resources to a shader with attach(), where they are matched by name:
+    /// <table>
+    /// <caption> Resources the virtual texture expects to find in the shader </caption>
+    /// <tr><th> Name in shader <th> Contents <th> Declared as <th>
+    /// <tr><td> virtualTextureInfo <td> Lookup parameters (struct VirtualTextureInfo) <td> uniform block
+    /// <tr><td> virtualPageTable <td> Cache tile and level per page, bits 0-11 and 12-23 for the tile column and row
+    /// and 24-31 for the level <td> usampler2D
+    /// <tr><td> virtualCache <td> Physical cache <td> sampler2D
+    /// <tr><td> virtualFeedback <td> One uint per page, level after level, set to non-zero for the pages that are
+    /// wanted <td> buffer block named *Dynamic
+    /// </table>
+    ///
+    /// Shaders include VirtualTexture.glsl, which declares these and samples with sampleVirtualTexture(). To sample at
+    /// a level L, it finds the page that covers the coordinates at that level, which is floor(uv * max(size >> L, 1) /
+    /// tileSize), and sets its entry in the feedback buffer. Pages of level L in the feedback buffer start after all
+    /// pages of the levels before it, each level being max(pageTableSize >> L, 1) pages in size. Then it fetches the
+    /// page table at that page and level, and finds the same coordinates in the level the entry names. Their offset
+    /// within its page, plus the border, is the offset within the cache tile. Tiles are sampled bilinearly within a
+    /// level, so L is picked from the derivatives and rounded.
+    ///
+    /// The cache and the page table are updated in place, after a barrier that waits for earlier frames to finish
+    /// reading them, so update() never waits for the device.
+    /// </summary>
+    class VirtualTexture
+    {
+    public:
+        MANDRILL_NON_COPYABLE(VirtualTexture)
+
+        /// <summary>
+        /// Create a new virtual texture and load its last level.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="path">Path to a file made by createTileFile()</param>
+        /// <param name="desc">How large the cache is and how tiles are loaded</param>
+        MANDRILL_API VirtualTexture(ptr<Device> pDevice, const std::filesystem::path& path,
+                                    const VirtualTextureDesc& desc = {});
+
+        /// <summary>
+        /// Destructor for virtual texture.
+        /// </summary>
+        MANDRILL_API ~VirtualTexture();
+
+        /// <summary>
+        /// Split an image into the tiles of a virtual texture and write them to a file. Every mip level is made on the
+        /// CPU, down to the first that fits in one tile. The whole image is decoded at once, so it has to fit in host
+        /// memory, even though it may not fit on the device.
+        /// </summary>
+        /// <param name="source">Path to an image file with 8-bit channels</param>
+        /// <param name="destination">Path to the tile file to write</param>
+        /// <param name="tileSize">Texels per side of a tile, not counting its border</param>
+        /// <param name="border">Texels to repeat from the neighbouring tiles on every side, so that filtering within a
+        /// tile never reads outside it</param>
+        /// <param name="mipGeneration">How to make the mip levels</param>
+        /// <returns>True if the file was written, otherwise false</returns>
+        MANDRILL_API static bool createTileFile(const std::filesystem::path& source,
+                                                const std::filesystem::path& destination, uint32_t tileSize = 128,
+                                                uint32_t border = 4, const MipGenerationDesc& mipGeneration = {});
+
+        /// <summary>
+        /// Attach the page table, the cache, the lookup parameters and the feedback buffer to a shader. The cache and
+        /// the page table are updated in place, so this only has to be done once per shader.
+        /// </summary>
+        /// <param name="pShader">Shader that samples the virtual texture</param>
+        MANDRILL_API void attach(ptr<Shader> pShader) const;
+
+        /// <summary>
+        /// Read the pages that shaders asked for, load the ones that are missing, and record the copies of the tiles
+        /// that are ready into the cache along with the page table. Call once per frame outside of a render pass,
+        /// before the virtual texture is sampled.
+        /// </summary>
+        /// <param name="cmd">Command buffer of the frame</param>
+        MANDRILL_API void update(VkCommandBuffer cmd);
+
+        /// <summary>
+        /// Get the parameters shaders look up the virtual texture with.
+        /// </summary>
+        /// <returns>Lookup parameters</returns>
+        MANDRILL_API const VirtualTextureInfo& getInfo() const
+        {
+            return mInfo;
+        }
+
+        /// <summary>
+        /// Get the number of pages that are in the cache.
+        /// </summary>
+        /// <returns>Number of pages</returns>
+        MANDRILL_API uint32_t getResidentPageCount() const
+        {
+            return count(mResidentPages);
+        }
+
+    private:
+        struct Slot {
+            uint32_t page = UINT32_MAX;
+            uint64_t lastRequestedFrame = 0;
+        };
+
+        struct Tile {
+            uint32_t page;
+            std::vector<std::byte> data;
+        };
+
+        void work();
+
+        // Read a tile from the file, which is opened by each thread of its own
+        bool readTile(std::ifstream& file, uint32_t page, std::vector<std::byte>& data) const;
+
+        // Pages are numbered level after level, in the layout of the page table
+        uint32_t getPage(uint32_t level, uint32_t x, uint32_t y) const;
+        void getPageLocation(uint32_t page, uint32_t& level, uint32_t& x, uint32_t& y) const;
+
+        // Find a slot for a tile, taking the one that has gone unrequested for the longest, or UINT32_MAX if every
+        // slot was requested this frame
+        uint32_t findSlot();
+
+        void copyTile(VkCommandBuffer cmd, const Tile& tile, uint32_t slot);
+        void copyPageTable(VkCommandBuffer cmd);
+
+        // Point every page at itself if it is in the cache, and at the closest coarser page that is otherwise
+        void updatePageTable();
+
+        ptr<Device> mpDevice;
+        VirtualTextureDesc mDesc;
+        std::filesystem::path mPath;
+
+        VirtualTextureInfo mInfo{};
+        uint64_t mDataOffset = 0;             // Where the tiles start in the file
+        std::vector<uint32_t> mLevelOffsets;  // First page of each level, in the page table layout
+        std::vector<uint32_t> mFileOffsets;   // First tile of each level in the file
+        uint32_t mCacheTiles = 0;             // Tiles per side of the cache
+        VkDeviceSize mTileBytes = 0;          // Size of a tile with its border
+
+        ptr<Image> mpCacheImage;
+        ptr<Texture> mpCache;
+        ptr<Image> mpPageTableImage;
+        ptr<Texture> mpPageTable;
+        ptr<Buffer> mpInfo;
+        ptr<DynamicBuffer> mpFeedback;
+        ptr<FrameAllocator> mpStaging;
+
+        std::vector<uint32_t> mPageTable; // Host copy, in the page table layout
+
+        std::vector<Slot> mSlots;
+        std::unordered_map<uint32_t, uint32_t> mResidentPages; // Page to slot
+        std::set<uint32_t> mLoadingPages;
+
+        std::vector<std::thread> mWorkers;
+        std::mutex mMutex;
+        std::condition_variable mTileWanted;
+        std::deque<uint32_t> mWantedPages; // Waiting for a worker
+        std::deque<Tile> mLoadedTiles;     // Waiting to be copied into the cache
+        bool mStopping = false;
+    };
+} // namespace Mandrill
@@ -0,0 +1,439 @@
+#include "Volume.h"
+
+#include "Buffer.h"
+#include "HalfFloat.h"
+#include "Helpers.h"
+#include "Image.h"
+#include "Log.h"
+
+#ifdef MANDRILL_USE_OPENVDB
+#include <openvdb/tree/LeafManager.h>
+#include <tbb/blocked_range.h>
+#include <tbb/parallel_for.h>
+#endif
+
+using namespace Mandrill;
+
+namespace
+{
+    enum class ComponentType {
+        Float32,
+        Float16,
+        Unorm16,
+        Unorm8,
+    };
+
+    struct TexelFormat {
+        ComponentType type;
+        uint32_t componentCount;
+    };
+
+    std::optional<TexelFormat> getTexelFormat(VkFormat format)
+    {
+        switch (format) {
+        case VK_FORMAT_R32_SFLOAT:
+            return TexelFormat{ComponentType::Float32, 1};
+        case VK_FORMAT_R32G32B32A32_SFLOAT:
+            return TexelFormat{ComponentType::Float32, 4};
+        case VK_FORMAT_R16_SFLOAT:
+            return TexelFormat{ComponentType::Float16, 1};
+        case VK_FORMAT_R16G16B16A16_SFLOAT:
+            return TexelFormat{ComponentType::Float16, 4};
+        case VK_FORMAT_R16_UNORM:
+            return TexelFormat{ComponentType::Unorm16, 1};
+        case VK_FORMAT_R16G16B16A16_UNORM:
+            return TexelFormat{ComponentType::Unorm16, 4};
+        case VK_FORMAT_R8_UNORM:
+            return TexelFormat{ComponentType::Unorm8, 1};
+        case VK_FORMAT_R8G8B8A8_UNORM:
+            return TexelFormat{ComponentType::Unorm8, 4};
+        default:
+            return std::nullopt;
+        }
+    }
+
+    uint32_t getComponentSize(ComponentType type)
+    {
+        switch (type) {
+        case ComponentType::Float32:
+            return 4;
+        case ComponentType::Float16:
+        case ComponentType::Unorm16:
+            return 2;
+        case ComponentType::Unorm8:
+            return 1;
+        }
+        return 0;
+    }
+
+    // Turns the values of a voxel into a texel, mapping [offset, offset + scale] to [0, 1] for the quantized formats
+    struct TexelEncoder {
+        TexelFormat format;
+        uint32_t channelCount;
+        float scale = 1.0f;
+        float offset = 0.0f;
+
+        uint32_t getTexelSize() const
+        {
+            return getComponentSize(format.type) * format.componentCount;
+        }
+
+        void encode(const float* pValues, std::byte* pDst) const
+        {
+            // Channels beyond those of the grid hold zero, encoded like any other value so that they decode to it
+            float texel[4];
+            for (uint32_t c = 0; c < 4; c++) {
+                texel[c] = ((c < channelCount ? pValues[c] : 0.0f) - offset) / scale;
+            }
+
+            switch (format.type) {
+            case ComponentType::Float32:
+                std::memcpy(pDst, texel, sizeof(float) * format.componentCount);
+                break;
+            case ComponentType::Float16:
+                HalfFloat::pack(texel, reinterpret_cast<uint16_t*>(pDst), format.componentCount);
+                break;
+            case ComponentType::Unorm16:
+                for (uint32_t c = 0; c < format.componentCount; c++) {
+                    const uint16_t q = static_cast<uint16_t>(std::lround(std::clamp(texel[c], 0.0f, 1.0f) * 65535.0f));
+                    std::memcpy(pDst + sizeof(uint16_t) * c, &q, sizeof(uint16_t));
+                }
+                break;
+            case ComponentType::Unorm8:
+                for (uint32_t c = 0; c < format.componentCount; c++) {
+                    pDst[c] = static_cast<std::byte>(std::lround(std::clamp(texel[c], 0.0f, 1.0f) * 255.0f));
+                }
+                break;
+            }
+        }
+    };
+
+#ifdef MANDRILL_USE_OPENVDB
+    void getValues(float value, float* pValues)
+    {
+        pValues[0] = value;
+    }
+
+    void getValues(const openvdb::Vec3s& value, float* pValues)
+    {
+        pValues[0] = value.x();
+        pValues[1] = value.y();
+        pValues[2] = value.z();
+    }
+
+    // Smallest and largest component of the values a grid can be sampled at, which are those of its leaves, its
+    // active tiles and its background
+    template <typename GridT> std::pair<float, float> getRange(const GridT& grid, uint32_t channelCount)
+    {
+        using TreeT = typename GridT::TreeType;
+
+        openvdb::tree::LeafManager<const TreeT> leaves(grid.tree());
+        std::vector<std::pair<float, float>> leafRanges(leaves.leafCount());
+        leaves.foreach([&](const typename TreeT::LeafNodeType& leaf, size_t index) {
+            auto range = std::make_pair(std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest());
+            float values[3];
+            for (auto it = leaf.cbeginValueAll(); it; ++it) {
+                getValues(*it, values);
+                for (uint32_t c = 0; c < channelCount; c++) {
+                    range.first = std::min(range.first, values[c]);
+                    range.second = std::max(range.second, values[c]);
+                }
+            }
+            leafRanges[index] = range;
+        });
+
+        float values[3];
+        getValues(grid.background(), values);
+        auto range = std::make_pair(*std::min_element(values, values + channelCount),
+                                    *std::max_element(values, values + channelCount));
+
+        auto tile = grid.tree().cbeginValueOn();
+        tile.setMaxDepth(tile.getLeafDepth() - 1);
+        for (; tile; ++tile) {
+            getValues(*tile, values);
+            for (uint32_t c = 0; c < channelCount; c++) {
+                range.first = std::min(range.first, values[c]);
+                range.second = std::max(range.second, values[c]);
+            }
+        }
+
+        for (const auto& leafRange : leafRanges) {
+            range.first = std::min(range.first, leafRange.first);
+            range.second = std::max(range.second, leafRange.second);
+        }
+
+        return range;
+    }
+
+    // Write every voxel of the bounding box into a dense array, x fastest. Voxels outside the leaves and active tiles
+    // take the background value.
+    template <typename GridT>
+    void writeDense(const GridT& grid, const openvdb::CoordBBox& bbox, const TexelEncoder& encoder, std::byte* pDst)
+    {
+        using TreeT = typename GridT::TreeType;
+
+        const openvdb::Coord min = bbox.min();
+        const openvdb::Coord dim = bbox.dim();
+        const size_t texelSize = encoder.getTexelSize();
+        auto getTexel = [&](const openvdb::Coord& ijk) {
+            const size_t index = (static_cast<size_t>(ijk.z() - min.z()) * dim.y() + (ijk.y() - min.y())) * dim.x() +
+                                 (ijk.x() - min.x());
+            return pDst + index * texelSize;
+        };
+
+        float values[3];
+        std::vector<std::byte> background(texelSize);
+        getValues(grid.background(), values);
+        encoder.encode(values, background.data());
+
+        tbb::parallel_for(tbb::blocked_range<int32_t>(min.z(), min.z() + dim.z()),
+                          [&](const tbb::blocked_range<int32_t>& slices) {
+                              for (int32_t z = slices.begin(); z != slices.end(); z++) {
+                                  std::byte* pSlice = getTexel(openvdb::Coord(min.x(), min.y(), z));
+                                  for (size_t i = 0; i < static_cast<size_t>(dim.x()) * dim.y(); i++) {
+                                      std::memcpy(pSlice + i * texelSize, background.data(), texelSize);
+                                  }
+                              }
+                          });
+
+        // Active tiles cover whole nodes with one value, which is rare enough in volumes to fill on one thread
+        auto tile = grid.tree().cbeginValueOn();
+        tile.setMaxDepth(tile.getLeafDepth() - 1);
+        for (; tile; ++tile) {
+            openvdb::CoordBBox tileBox;
+            tile.getBoundingBox(tileBox);
+            tileBox.intersect(bbox);
+            if (tileBox.empty()) {
+                continue;
+            }
+
+            std::vector<std::byte> texel(texelSize);
+            getValues(*tile, values);
+            encoder.encode(values, texel.data());
+            for (auto ijk = tileBox.begin(); ijk; ++ijk) {
+                std::memcpy(getTexel(*ijk), texel.data(), texelSize);
+            }
+        }
+
+        // Leaves never overlap, so each writes its own voxels without synchronization
+        openvdb::tree::LeafManager<const TreeT> leaves(grid.tree());
+        leaves.foreach([&](const typename TreeT::LeafNodeType& leaf, size_t) {
+            float leafValues[3];
+            for (auto it = leaf.cbeginValueAll(); it; ++it) {
+                const openvdb::Coord ijk = it.getCoord();
+                if (bbox.isInside(ijk)) {
+                    getValues(*it, leafValues);
+                    encoder.encode(leafValues, getTexel(ijk));
+                }
+            }
+        });
+    }
+
+    // Smallest and largest value that trilinear filtering can return within each cell, which is the range of the
+    // voxels of the cell and the voxel around it. The bounds are widened by the rounding of the format, so that the
+    // largest value is a true majorant of what shaders sample.
+    ptr<Texture> createMajorants(ptr<Device> pDevice, const openvdb::FloatGrid& grid, const openvdb::CoordBBox& bbox,
+                                 const TexelEncoder& encoder)
+    {
+        const openvdb::Coord dim = bbox.dim();
+        const int32_t cellSize = static_cast<int32_t>(Volume::kMajorantCellSize);
+        const glm::uvec3 cells = (glm::uvec3(dim.x(), dim.y(), dim.z()) + Volume::kMajorantCellSize - 1u) /
+                                 Volume::kMajorantCellSize;
+
+        float margin = 0.0f;
+        float relativeMargin = 0.0f;
+        if (encoder.format.type == ComponentType::Unorm16) {
+            margin = 0.5f * encoder.scale / 65535.0f;
+        } else if (encoder.format.type == ComponentType::Unorm8) {
+            margin = 0.5f * encoder.scale / 255.0f;
+        } else if (encoder.format.type == ComponentType::Float16) {
+            relativeMargin = 1.0f / 1024.0f;
+        }
+
+        std::vector<glm::vec2> majorants(static_cast<size_t>(cells.x) * cells.y * cells.z);
+        const size_t sliceSize = static_cast<size_t>(cells.x) * cells.y;
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, majorants.size()), [&](const tbb::blocked_range<size_t>& r) {
+            auto accessor = grid.getConstAccessor();
+            for (size_t i = r.begin(); i != r.end(); i++) {
+                const openvdb::Coord cell(static_cast<int32_t>(i % cells.x),
+                                          static_cast<int32_t>(i % sliceSize / cells.x),
+                                          static_cast<int32_t>(i / sliceSize));
+                const openvdb::Coord first = bbox.min() + cell * cellSize - openvdb::Coord(1);
+                const openvdb::Coord last = first + openvdb::Coord(cellSize + 1);
+
+                float min = std::numeric_limits<float>::max();
+                float max = std::numeric_limits<float>::lowest();
+                for (auto ijk = openvdb::CoordBBox(first, last).begin(); ijk; ++ijk) {
+                    const float value = accessor.getValue(*ijk);
+                    min = std::min(min, value);
+                    max = std::max(max, value);
+                }
+
+                majorants[i] = glm::vec2(min - margin - std::abs(min) * relativeMargin,
+                                         max + margin + std::abs(max) * relativeMargin);
+            }
+        });
+
+        ptr<Texture> pMajorants = make_ptr<Texture>(pDevice, TextureType::Texture3D, VK_FORMAT_R32G32_SFLOAT,
+                                                    majorants.data(), cells.x, cells.y, cells.z, sizeof(glm::vec2));
+        pMajorants->setMagFilter(VK_FILTER_NEAREST);
+        pMajorants->setMinFilter(VK_FILTER_NEAREST);
+        return pMajorants;
+    }
+
+    template <typename GridT>
+    VolumeGrid loadGrid(ptr<Device> pDevice, const GridT& grid, const openvdb::CoordBBox& bbox, VkFormat format,
+                        uint32_t channelCount)
+    {
+        TexelEncoder encoder = {
+            .format = *getTexelFormat(format),
+            .channelCount = channelCount,
+        };
+        if (encoder.format.type == ComponentType::Unorm16 || encoder.format.type == ComponentType::Unorm8) {
+            auto [min, max] = getRange(grid, channelCount);
+            if (channelCount > 1) {
+                // The zero of the unused channel has to be in range for it to decode to zero
+                min = std::min(min, 0.0f);
+                max = std::max(max, 0.0f);
+            }
+            encoder.offset = min;
+            encoder.scale = max > min ? max - min : 1.0f;
+        }
+
+        const openvdb::Coord dim = bbox.dim();
+        const VkDeviceSize size = static_cast<VkDeviceSize>(dim.x()) * dim.y() * dim.z() * encoder.getTexelSize();
+
+        Buffer staging(pDevice, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                       VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        writeDense(grid, bbox, encoder, static_cast<std::byte*>(staging.getHostMap()));
+
+        ptr<Image> pImage = make_ptr<Image>(pDevice, dim.x(), dim.y(), dim.z(), 1, VK_SAMPLE_COUNT_1_BIT, format,
+                                            VK_IMAGE_TILING_OPTIMAL,
+                                            VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                                            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, VK_IMAGE_TYPE_3D);
+
+        VkCommandBuffer cmd = Helpers::cmdBegin(pDevice);
+
+        Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_NONE, VK_ACCESS_2_NONE,
+                              VK_PIPELINE_STAGE_2_TRANSFER_BIT, VK_ACCESS_2_TRANSFER_WRITE_BIT,
+                              VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+
+        Helpers::copyBufferToImage(cmd, staging.getBuffer(), pImage->getImage(), dim.x(), dim.y(), dim.z());
+
+        Helpers::imageBarrier(cmd, pImage->getImage(), VK_PIPELINE_STAGE_2_TRANSFER_BIT,
+                              VK_ACCESS_2_TRANSFER_WRITE_BIT, VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT,
+                              VK_ACCESS_2_SHADER_READ_BIT, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+                              VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+
+        Helpers::cmdEnd(pDevice, cmd);
+
+        pImage->createImageView(VK_IMAGE_ASPECT_COLOR_BIT);
+
+        VolumeGrid volumeGrid = {
+            .pTexture = make_ptr<Texture>(pDevice, pImage),
+            .channelCount = channelCount,
+            .scale = encoder.scale,
+            .offset = encoder.offset,
+        };
+        if constexpr (std::is_same_v<GridT, openvdb::FloatGrid>) {
+            volumeGrid.pMajorants = createMajorants(pDevice, grid, bbox, encoder);
+        }
+        return volumeGrid;
+    }
+#endif
+} // namespace
+
+Volume::Volume(ptr<Device> pDevice, const std::filesystem::path& path, const std::vector<VolumeGridDesc>& grids)
+    : mpDevice(pDevice)
+{
+#ifdef MANDRILL_USE_OPENVDB
+    std::filesystem::path fullPath = path;
+    if (path.is_relative()) {
+        fullPath = GetExecutablePath() / path;
+    }
+
+    Log::Info("Loading volume from {}", path.string());
+
+    if (!std::filesystem::exists(fullPath)) {
+        Log::Error("Volume: {} does not exist", fullPath.string());
+        return;
+    }
+
+    openvdb::io::File file(fullPath.string());
+    file.open();
+
+    Log::Debug("Grids in volume:");
+    for (auto iter = file.beginName(); iter != file.endName(); ++iter) {
+        Log::Debug("\t{}", *iter);
+    }
+
+    // Every grid is read before any is uploaded, since they all cover the union of their bounding boxes
+    std::vector<std::pair<VolumeGridDesc, openvdb::GridBase::Ptr>> found;
+    openvdb::CoordBBox bbox;
+    for (const auto& desc : grids) {
+        if (!file.hasGrid(desc.name)) {
+            Log::Error("Volume: Grid {} not found in {}", desc.name, path.string());
+            continue;
+        }
+
+        openvdb::GridBase::Ptr pGrid = file.readGrid(desc.name);
+        const uint32_t channelCount = pGrid->isType<openvdb::Vec3SGrid>() ? 3 : 1;
+        if (!pGrid->isType<openvdb::FloatGrid>() && !pGrid->isType<openvdb::Vec3SGrid>()) {
+            Log::Error("Volume: Grid {} is of type {}, which is not supported", desc.name, pGrid->type());
+            continue;
+        }
+        if (!supports(desc.format, channelCount)) {
+            Log::Error("Volume: Grid {} cannot be stored in format {}", desc.name, static_cast<int>(desc.format));
+            continue;
+        }
+        if (!found.empty() && pGrid->transform() != found.front().second->transform()) {
+            Log::Warning("Volume: Grid {} has another transform than {}, and will not line up with it", desc.name,
+                         found.front().first.name);
+        }
+
+        bbox.expand(pGrid->evalActiveVoxelBoundingBox());
+        found.emplace_back(desc, pGrid);
+    }
+
+    file.close();
+
+    if (found.empty() || bbox.empty()) {
+        Log::Error("Volume: Nothing to load from {}", path.string());
+        return;
+    }
+
+    mOrigin = glm::ivec3(bbox.min().x(), bbox.min().y(), bbox.min().z());
+    mSize = glm::uvec3(bbox.dim().x(), bbox.dim().y(), bbox.dim().z());
+
+    for (const auto& [desc, pGrid] : found) {
+        if (auto pFloatGrid = openvdb::gridPtrCast<openvdb::FloatGrid>(pGrid)) {
+            mGrids[desc.name] = loadGrid(mpDevice, *pFloatGrid, bbox, desc.format, 1);
+        } else if (auto pVectorGrid = openvdb::gridPtrCast<openvdb::Vec3SGrid>(pGrid)) {
+            mGrids[desc.name] = loadGrid(mpDevice, *pVectorGrid, bbox, desc.format, 3);
+        }
+    }
+#else
+    Log::Error("Trying to load a volume but Mandrill was not compiled with OpenVDB support. OpenVDB can be "
+               "installed using vcpkg:\n\t`vcpkg install openvdb`");
+#endif
+}
+
+Volume::~Volume()
+{
+}
+
+const VolumeGrid* Volume::getGrid(const std::string& name) const
+{
+    auto it = mGrids.find(name);
+    return it != mGrids.end() ? &it->second : nullptr;
+}
+
+bool Volume::supports(VkFormat format, uint32_t channelCount)
+{
+    std::optional<TexelFormat> texelFormat = getTexelFormat(format);
+    if (!texelFormat) {
+        return false;
+    }
+
+    return channelCount == 1 ? texelFormat->componentCount == 1 : texelFormat->componentCount == 4;
+}
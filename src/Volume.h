@@ -0,0 +1,121 @@
+#pragma once
+
+#include "Common.h"
+
+#include "Device.h"
+#include "Texture.h"
+
+namespace Mandrill
+{
+    /// <summary>
+    /// Grid to load from a volume file.
+    /// </summary>
+    struct VolumeGridDesc {
+        // Name of the grid in the file, such as density, temperature or velocity
+        std::string name = "density";
+
+        // Format of the 3D texture. Scalar grids go in one channel and vector grids in four, with the last one zero.
+        // VK_FORMAT_R32_SFLOAT and VK_FORMAT_R16_SFLOAT, and their four-channel counterparts, keep the values as they
+        // are. VK_FORMAT_R16_UNORM and VK_FORMAT_R8_UNORM, and their four-channel counterparts, quantize them to the
+        // range of the grid, widened to hold zero for vector grids, which is undone with the scale and offset of
+        // VolumeGrid. The last channel then decodes to zero to within the precision of the format.
+        VkFormat format = VK_FORMAT_R32_SFLOAT;
+    };
+
+    /// <summary>
+    /// Grid of a volume as a 3D texture. Shaders get the value of the grid back as texel * scale + offset.
+    ///
+    /// Scalar grids also come with a majorant grid, an R32G32_SFLOAT 3D texture with one texel per
+    /// Volume::kMajorantCellSize^3 voxels. It holds the smallest and largest value that filtering can return anywhere
+    /// in the cell, as values of the grid rather than of the texture, which is what delta and ratio tracking need.
+    /// </summary>
+    struct VolumeGrid {
+        ptr<Texture> pTexture;
+        ptr<Texture> pMajorants; // Only for scalar grids
+        uint32_t channelCount = 1; // 1 for scalar grids and 3 for vector grids
+        float scale = 1.0f;
+        float offset = 0.0f;
+    };
+
+    /// <summary>
+    /// Volume read from an OpenVDB file, with each of its grids as a dense 3D texture. All grids cover the same
+    /// voxels, the union of their active bounding boxes, so that they can be sampled with the same coordinates.
+    ///
+    /// Grids are read a leaf node at a time on all cores, straight into the staging buffer of the upload, so that the
+    /// only dense copy of a grid on the host is the one that is uploaded. Quantized formats take a half or a quarter
+    /// of the memory of VK_FORMAT_R32_SFLOAT, and lose at most half a step of the range of the grid.
+    /// </summary>
+    class Volume
+    {
+    public:
+        MANDRILL_NON_COPYABLE(Volume)
+
+        static constexpr uint32_t kMajorantCellSize = 8;
+
+        /// <summary>
+        /// Create a new volume from a file. Grids that are missing or that are neither float nor vector grids are
+        /// reported and left out.
+        /// </summary>
+        /// <param name="pDevice">Device to use</param>
+        /// <param name="path">Path to OpenVDB file</param>
+        /// <param name="grids">Grids to load</param>
+        MANDRILL_API Volume(ptr<Device> pDevice, const std::filesystem::path& path,
+                            const std::vector<VolumeGridDesc>& grids = {{}});
+
+        /// <summary>
+        /// Destructor for volume.
+        /// </summary>
+        MANDRILL_API ~Volume();
+
+        /// <summary>
+        /// Get a grid of the volume.
+        /// </summary>
+        /// <param name="name">Name of the grid</param>
+        /// <returns>Pointer to grid, or nullptr if it was not loaded</returns>
+        MANDRILL_API const VolumeGrid* getGrid(const std::string& name) const;
+
+        /// <summary>
+        /// Get the texture of a grid of the volume.
+        /// </summary>
+        /// <param name="name">Name of the grid</param>
+        /// <returns>Pointer to texture, or nullptr if the grid was not loaded</returns>
+        MANDRILL_API ptr<Texture> getTexture(const std::string& name = "density") const
+        {
+            const VolumeGrid* pGrid = getGrid(name);
+            return pGrid ? pGrid->pTexture : nullptr;
+        }
+
+        /// <summary>
+        /// Get the number of voxels along each axis, which is the size of every texture of the volume.
+        /// </summary>
+        /// <returns>Size in voxels</returns>
+        MANDRILL_API glm::uvec3 getSize() const
+        {
+            return mSize;
+        }
+
+        /// <summary>
+        /// Get the index space coordinates of the first voxel of the textures.
+        /// </summary>
+        /// <returns>Index of the first voxel</returns>
+        MANDRILL_API glm::ivec3 getOrigin() const
+        {
+            return mOrigin;
+        }
+
+        /// <summary>
+        /// Check if a format can hold a grid.
+        /// </summary>
+        /// <param name="format">Format to check</param>
+        /// <param name="channelCount">Number of channels of the grid, 1 or 3</param>
+        /// <returns>True if the format is supported, otherwise false</returns>
+        MANDRILL_API static bool supports(VkFormat format, uint32_t channelCount);
+
+    private:
+        ptr<Device> mpDevice;
+
+        std::unordered_map<std::string, VolumeGrid> mGrids;
+        glm::uvec3 mSize = glm::uvec3(0);
+        glm::ivec3 mOrigin = glm::ivec3(0);
+    };
+} // namespace Mandrill